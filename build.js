@@ -1,7 +1,14 @@
 #!/usr/bin/node
 const { exec } = require("child_process");
+const fs = require("fs");
 const buildType = process.argv[2]
 
+// LZ4 is not part of the repository, see speed_test/README.md. Without it, the
+// compression VFS is built as a stub whose registration fails.
+const withLz4 = fs.existsSync('libs/lz4/lz4.c') && fs.existsSync('libs/lz4/lz4.h')
+const zvfsFlags = withLz4 ? '-Ilibs/lz4' : '-DPTHREADFS_ZVFS_LZ4=0'
+const lz4Object = withLz4 ? ' out/libs/lz4.o' : ''
+
 process.on('unhandledRejection', error => {
   console.log('\n\n')
   console.error(error)
@@ -38,7 +45,27 @@ async function buildLibraries () {
     await runShellCommand(
       `emcc -O2 -Wall -pthread -I.. -c libs/pthreadfs.cpp -o out/libs/pthreadfs.o`
     )
+    await runShellCommand(
+      `emcc -O2 -Wall -pthread -Ilibs -I.. -c libs/pthreadfs_vfs.cpp -o out/libs/pthreadfs_vfs.o`
+    )
+    await runShellCommand(
+      `emcc -O2 -Wall -pthread -Ilibs ${zvfsFlags} -I.. -c libs/pthreadfs_zvfs.cpp -o out/libs/pthreadfs_zvfs.o`
+    )
+    await runShellCommand(
+      `emcc -O2 -Wall -pthread -Ilibs -c libs/sqlite_arena.cpp -o out/libs/sqlite_arena.o`
+    )
+    await buildLz4()
+  }
+}
+
+async function buildLz4 () {
+  if (!withLz4) {
+    console.log('libs/lz4 not found, building without the compression VFS')
+    return
   }
+  await runShellCommand(
+    `emcc -O3 -Wall -pthread -c libs/lz4/lz4.c -o out/libs/lz4.o`
+  )
 }
 
 async function script (buildType) {
@@ -52,20 +79,65 @@ async function script (buildType) {
       `emcc -O2 -Wall -pthread -c -Ilibs src/speedtest1.c -o out/speedtest/speedtest1.o`
     )
     await runShellCommand(
-      `emcc -pthread -s PROXY_TO_PTHREAD -O2 -s INITIAL_MEMORY=134217728 -gsource-map --source-map-base http://localhost:8992/out/speedtest/ --js-library=libs/library_pthreadfs.js --pre-js=libs/sqlite-prejs.js out/speedtest/speedtest1.o out/libs/pthreadfs.o out/libs/sqlite3.o -o out/speedtest/index.html`
+      `emcc -pthread -s PROXY_TO_PTHREAD -O2 -s INITIAL_MEMORY=134217728 -gsource-map --source-map-base http://localhost:8992/out/speedtest/ --js-library=libs/library_pthreadfs.js --pre-js=libs/sqlite-prejs.js out/speedtest/speedtest1.o out/libs/pthreadfs.o out/libs/pthreadfs_vfs.o out/libs/pthreadfs_zvfs.o out/libs/sqlite_arena.o${lz4Object} out/libs/sqlite3.o -o out/speedtest/index.html`
+    )
+  } else if (buildType === 'speedtest-threads') {
+    // speedtest1 on the sqlite-wrapper's SQLite, which has the multi-threaded sorter (PRAGMA threads).
+    await runShellCommand('mkdir -p out/speedtest-threads')
+    if (!process.env.SKIP_LIBRARY_BUILD) {
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_THREADSAFE=2 -DSQLITE_MAX_WORKER_THREADS=4 -c libs/sqlite_js/sqlite3.c -o out/speedtest-threads/sqlite3.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -I.. -c libs/pthreadfs.cpp -o out/libs/pthreadfs.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js -I.. -c libs/pthreadfs_vfs.cpp -o out/speedtest-threads/pthreadfs_vfs.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js ${zvfsFlags} -I.. -c libs/pthreadfs_zvfs.cpp -o out/speedtest-threads/pthreadfs_zvfs.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js -c libs/sqlite_arena.cpp -o out/speedtest-threads/sqlite_arena.o`
+      )
+      await buildLz4()
+    }
+    await runShellCommand(
+      `emcc -O2 -Wall -pthread -c -Ilibs/sqlite_js -Ilibs src/speedtest1.c -o out/speedtest-threads/speedtest1.o`
+    )
+    await runShellCommand(
+      `emcc -pthread -s PROXY_TO_PTHREAD -O2 -s INITIAL_MEMORY=268435456 -s PTHREAD_POOL_SIZE=6 --js-library=libs/library_pthreadfs.js --pre-js=libs/sqlite-prejs.js out/speedtest-threads/speedtest1.o out/libs/pthreadfs.o out/speedtest-threads/pthreadfs_vfs.o out/speedtest-threads/pthreadfs_zvfs.o out/speedtest-threads/sqlite_arena.o${lz4Object} out/speedtest-threads/sqlite3.o -o out/speedtest-threads/index.html`
     )
   } else if (buildType === 'sqlite-wrapper') {
     await runShellCommand('mkdir -p out/sqlite-wrapper')
 
     if (!process.env.SKIP_LIBRARY_BUILD) {
-      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=0 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/sqlite3.c -o out/sqlite-wrapper/sqlite3.bc')
-      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=0 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/extension-functions.c -o out/sqlite-wrapper/extension-functions.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -DSQLITE_MAX_MMAP_SIZE=268435456 -DSQLITE_ENABLE_BATCH_ATOMIC_WRITE -DSQLITE_MAX_WORKER_THREADS=4 -DSQLITE_DEFAULT_WORKER_THREADS=2 -DSQLITE_ENABLE_MEMSYS5 -c libs/sqlite_js/sqlite3.c -o out/sqlite-wrapper/sqlite3.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/extension-functions.c -o out/sqlite-wrapper/extension-functions.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/connection_pool.c -o out/sqlite-wrapper/connection_pool.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/memory_budget.c -o out/sqlite-wrapper/memory_budget.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/columnar.c -o out/sqlite-wrapper/columnar.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/row_packer.c -o out/sqlite-wrapper/row_packer.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/blob_io.c -o out/sqlite-wrapper/blob_io.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/bulk_insert.c -o out/sqlite-wrapper/bulk_insert.bc')
+      await runShellCommand('emcc -pthread -O2 -DSQLITE_OMIT_LOAD_EXTENSION -DSQLITE_DISABLE_LFS -DSQLITE_ENABLE_FTS3 -DSQLITE_ENABLE_FTS3_PARENTHESIS -DSQLITE_ENABLE_JSON1 -DSQLITE_THREADSAFE=2 -DSQLITE_ENABLE_NORMALIZE -c libs/sqlite_js/serialize.c -o out/sqlite-wrapper/serialize.bc')
       await runShellCommand(
         `emcc -O2 -Wall -pthread -I.. -c libs/pthreadfs.cpp -o out/libs/pthreadfs.o`
       )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js -I.. -c libs/pthreadfs_vfs.cpp -o out/sqlite-wrapper/pthreadfs_vfs.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js ${zvfsFlags} -I.. -c libs/pthreadfs_zvfs.cpp -o out/sqlite-wrapper/pthreadfs_zvfs.o`
+      )
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -Ilibs/sqlite_js -c libs/sqlite_arena.cpp -o out/sqlite-wrapper/sqlite_arena.o`
+      )
+      await buildLz4()
     }
 
-    await runShellCommand('emcc -pthread --memory-init-file 0 -s RESERVED_FUNCTION_POINTERS=64 -s ALLOW_TABLE_GROWTH=1 -s EXPORTED_FUNCTIONS=@libs/sqlite_js/exported_functions.json -s EXPORTED_RUNTIME_METHODS=@libs/sqlite_js/exported_runtime_methods.json -s SINGLE_FILE=0 -s NODEJS_CATCH_EXIT=0 -s NODEJS_CATCH_REJECTION=0 -s INLINING_LIMIT=50 -O3 -flto --closure 1 -s WASM=1 -s ALLOW_MEMORY_GROWTH=1 --js-library=libs/library_pthreadfs.js out/sqlite-wrapper/sqlite3.bc out/sqlite-wrapper/extension-functions.bc out/libs/pthreadfs.o --pre-js src/sqlite_wrapper/wrapper.js -o out/sqlite-wrapper/sql-wasm.js')
+    // The pool has room for the PThreadFS helper, the readers and two sorter worker threads.
+    await runShellCommand(`emcc -pthread --memory-init-file 0 -s RESERVED_FUNCTION_POINTERS=64 -s ALLOW_TABLE_GROWTH=1 -s EXPORTED_FUNCTIONS=@libs/sqlite_js/exported_functions.json -s EXPORTED_RUNTIME_METHODS=@libs/sqlite_js/exported_runtime_methods.json -s SINGLE_FILE=0 -s NODEJS_CATCH_EXIT=0 -s NODEJS_CATCH_REJECTION=0 -s INLINING_LIMIT=50 -O3 -flto --closure 1 -s WASM=1 -s ALLOW_MEMORY_GROWTH=1 -s PTHREAD_POOL_SIZE=7 --js-library=libs/library_pthreadfs.js out/sqlite-wrapper/sqlite3.bc out/sqlite-wrapper/extension-functions.bc out/sqlite-wrapper/connection_pool.bc out/sqlite-wrapper/memory_budget.bc out/sqlite-wrapper/columnar.bc out/sqlite-wrapper/row_packer.bc out/sqlite-wrapper/blob_io.bc out/sqlite-wrapper/bulk_insert.bc out/sqlite-wrapper/serialize.bc out/libs/pthreadfs.o out/sqlite-wrapper/pthreadfs_vfs.o out/sqlite-wrapper/pthreadfs_zvfs.o out/sqlite-wrapper/sqlite_arena.o${lz4Object} --pre-js src/sqlite_wrapper/wrapper.js -o out/sqlite-wrapper/sql-wasm.js`)
     await runShellCommand('mv out/sqlite-wrapper/sql-wasm.js out/tmp-raw.js')
     await runShellCommand('cat libs/sqlite_js/shell-pre.js out/tmp-raw.js libs/sqlite_js/shell-post.js > out/sqlite-wrapper/sql-wasm.js')
     await runShellCommand('rm out/tmp-raw.js')
@@ -77,6 +149,16 @@ async function script (buildType) {
     }
     await runShellCommand('mkdir -p out/simple-example')
     await runShellCommand('emcc -pthread -sEXPORTED_FUNCTIONS=_lstat_test,_lstat_test_with_thread -s ALLOW_BLOCKING_ON_MAIN_THREAD=0 -sEXPORTED_RUNTIME_METHODS=ccall,cwrap -sPTHREAD_POOL_SIZE=2 --js-library=libs/library_pthreadfs.js src/simple_example/simple_file.c out/libs/pthreadfs.o -o out/simple-example/simple_file.js')
+  } else if (buildType === 'readdir-bench') {
+    if (!process.env.SKIP_LIBRARY_BUILD) {
+      await runShellCommand(
+        `emcc -O2 -Wall -pthread -I.. -c libs/pthreadfs.cpp -o out/libs/pthreadfs.o`
+      )
+    }
+    await runShellCommand('mkdir -p out/readdir-bench')
+    await runShellCommand(
+      `emcc -pthread -s PROXY_TO_PTHREAD -O2 -s INITIAL_MEMORY=134217728 --js-library=libs/library_pthreadfs.js src/readdir_bench/readdir_bench.c out/libs/pthreadfs.o -o out/readdir-bench/index.html`
+    )
   } else {
     throw new Error(`Invalid build type ${buildType}`)
   }
@@ -34,6 +34,9 @@ let SyscallsFunctions = [
   {'name': 'statfs64', 'args': ['path', 'size', 'buf']},
   {'name': 'fstatfs64', 'args': ['fd', 'size', 'buf']},
   {'name': 'fallocate', 'args': ['fd', 'mode', 'off_low', 'off_high', 'len_low', 'len_high']},
+  {'name': 'openat', 'args': ['dirfd', 'path', 'flags', 'varargs']},
+  {'name': 'unlinkat', 'args': ['dirfd', 'path', 'flags']},
+  {'name': 'faccessat', 'args': ['dirfd', 'path', 'amode', 'flags']},
 ]
 
 let WasiFunctions = [
@@ -58,7 +61,7 @@ function createWasiWrapper(name, args, wrappers) {
   wrapper += 'wasmTable.get(resume)(res);});}'
   wrappers[`__fd_${name}_async`] = eval('(' + wrapper + ')');
   // Additional backends must register a dependency here.
-  wrappers[`__fd_${name}_async__deps`] = [`fd_${name}_async`, '$ASYNCSYSCALLS', '$FSAFS'];
+  wrappers[`__fd_${name}_async__deps`] = [`fd_${name}_async`, '$ASYNCSYSCALLS', '$FSAFS', '$IDB_ASYNC'];
 }
 
 function createSyscallWrapper(name, args, wrappers) {
@@ -73,7 +76,7 @@ function createSyscallWrapper(name, args, wrappers) {
   wrapper += 'wasmTable.get(resume)(res);});}'
   wrappers[`__sys_${name}_async`] = eval('(' + wrapper + ')');
   // Additional backends must register a dependency here.
-  wrappers[`__sys_${name}_async__deps`] = [`${name}_async`, '$ASYNCSYSCALLS', '$FSAFS'];
+  wrappers[`__sys_${name}_async__deps`] = [`${name}_async`, '$ASYNCSYSCALLS', '$FSAFS', '$IDB_ASYNC'];
 }
 
 for (x of WasiFunctions) {
@@ -142,7 +145,480 @@ SyscallWrappers['pthreadfs_init'] =
   });
 }
 
+// Flushes `count` file descriptors in a single pass and stores one
+// __wasi_errno_t per descriptor in `results`. Descriptors whose streams share a
+// node also share its access handle, so each node is flushed only once.
+SyscallWrappers['pthreadfs_fsync_many__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_fsync_many'] = function(fds, count, results, resume) {
+  (async () => {
+    let flushed = new Map();
+    for (let i = 0; i < count; i++) {
+      let fd = {{{ makeGetValue('fds', 'i*4', 'i32') }}};
+      let res;
+      try {
+        let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+        if (flushed.has(stream.node)) {
+          res = flushed.get(stream.node);
+        } else {
+          res = 0;
+          let delay = PThreadFS.relaxedDelay(stream.path);
+          if (delay >= 0) {
+            PThreadFS.deferFsync(stream, delay);
+          } else if (stream.stream_ops && stream.stream_ops.fsync) {
+            res = -(await stream.stream_ops.fsync(stream));
+            PThreadFS.stats.fsyncFlushes++;
+          }
+          flushed.set(stream.node, res);
+        }
+      } catch (e) {
+        if (!(e instanceof PThreadFS.ErrnoError)) throw e;
+        res = e.errno;
+      }
+      {{{ makeSetValue('results', 'i*2', 'res', 'i16') }}};
+    }
+    PThreadFS.stats.fsyncRequests += count;
+    PThreadFS.stats.fsyncPasses++;
+    wasmTable.get(resume)();
+  })();
+}
+
+// Relaxed durability, see pthreadfs_set_relaxed_durability in pthreadfs.h.
+SyscallWrappers['pthreadfs_durability_set__deps'] = ['$PThreadFS'];
+SyscallWrappers['pthreadfs_durability_set'] = function(path, delay, resume) {
+  PThreadFS.setRelaxedDurability(UTF8ToString(path), delay);
+  wasmTable.get(resume)();
+}
+
+// Stores the current and the durable epoch in `epochs`. When nothing is waiting
+// for a flush, the current epoch is already durable and a new one begins.
+SyscallWrappers['pthreadfs_durability_epochs__deps'] = ['$PThreadFS'];
+SyscallWrappers['pthreadfs_durability_epochs'] = function(epochs, resume) {
+  let durability = PThreadFS.durability;
+  if (durability.pending.size === 0 && durability.pass === null) {
+    durability.durableEpoch = durability.currentEpoch++;
+  }
+  {{{ makeSetValue('epochs', 0, 'PThreadFS.durability.currentEpoch', 'double') }}};
+  {{{ makeSetValue('epochs', 8, 'PThreadFS.durability.durableEpoch', 'double') }}};
+  wasmTable.get(resume)();
+}
+
+SyscallWrappers['pthreadfs_durability_wait__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_durability_wait'] = function(epoch, resume) {
+  ASYNCSYSCALLS.resumeWith(() => PThreadFS.waitDurable(epoch), resume);
+}
+
+// Direct file access for the SQLite VFS in libs/pthreadfs_vfs.cpp. Each of
+// these is a single bridge call on an open PThreadFS descriptor that passes its
+// result, or a negative errno, to `resume`. Offsets and sizes are doubles.
+SyscallWrappers['pthreadfs_vfs_read__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_read'] = function(fd, buf, amount, offset, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    return await PThreadFS.read(stream, HEAP8, buf, amount, offset);
+  }, resume);
+}
+
+SyscallWrappers['pthreadfs_vfs_write__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_write'] = function(fd, buf, amount, offset, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    if (stream.node.batchLog) await ASYNCSYSCALLS.batchSettle(stream);
+    return await PThreadFS.write(stream, HEAP8, buf, amount, offset);
+  }, resume);
+}
+
+SyscallWrappers['pthreadfs_vfs_truncate__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_truncate'] = function(fd, size, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    if (stream.node.batchLog) await ASYNCSYSCALLS.batchSettle(stream);
+    await PThreadFS.ftruncate(fd, size);
+    return 0;
+  }, resume);
+}
+
+SyscallWrappers['pthreadfs_vfs_size__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_size'] = function(fd, size, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    let attr = await stream.node.node_ops.getattr(stream.node);
+    {{{ makeSetValue('size', 0, 'attr.size', 'double') }}};
+    return 0;
+  }, resume);
+}
+
+// Implements xAccess. `flags` is one of SQLITE_ACCESS_EXISTS (0),
+// SQLITE_ACCESS_READWRITE (1) or SQLITE_ACCESS_READ (2); passes 1 to `resume`
+// if the check succeeds. Like the unix VFS, empty files do not exist.
+SyscallWrappers['pthreadfs_vfs_access__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_access'] = function(path, flags, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let node;
+    try {
+      node = (await PThreadFS.lookupPath(UTF8ToString(path), { follow: true })).node;
+    } catch (e) {
+      if (!(e instanceof PThreadFS.ErrnoError)) throw e;
+      return 0;
+    }
+    if (flags === 0) {
+      if (!PThreadFS.isFile(node.mode)) return 1;
+      let attr = await node.node_ops.getattr(node);
+      return attr.size > 0 ? 1 : 0;
+    }
+    let amode = flags === 1 ? {{{ cDefine('R_OK') }}} | {{{ cDefine('W_OK') }}} : {{{ cDefine('R_OK') }}};
+    return (await ASYNCSYSCALLS.doAccessNode(node, amode)) === 0 ? 1 : 0;
+  }, resume);
+}
+
+// Commits a batch-atomic transaction of the database `fd`. `records` points to
+// `size` bytes of staged writes, each an 8-byte double offset, a 4-byte length
+// and the data; a negative length truncates the file to the offset. The records
+// are appended to the log in the -batch file `batchFd` and flushed before they
+// are applied to the database, so pthreadfs_vfs_batch_recover can finish an
+// interrupted commit. Once the applied pages are flushed, the log is emptied.
+// That takes two flushes, where a rollback journal needs three and the creation
+// and deletion of the journal file. With relaxed durability, only the log is
+// flushed: the database is flushed by the next background pass, and the log
+// keeps growing until a pass has made its entries durable.
+SyscallWrappers['pthreadfs_vfs_batch_commit__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_batch_commit'] = function(fd, batchFd, records, size, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    let batch = await ASYNCSYSCALLS.getStreamFromFD(batchFd);
+    let log = ASYNCSYSCALLS.batchLog(stream.node, batch);
+    let durability = PThreadFS.durability;
+    if (log.end > 0 && durability.durableEpoch >= log.epoch) {
+      // The entries are durable in the database, so the log starts over.
+      log.end = 0;
+    }
+    let data = HEAPU8.subarray(records, records + size);
+    await ASYNCSYSCALLS.batchAppend(batch, log, data);
+    // Flushed even for relaxed paths: the pages must not reach the database
+    // before the entry that can repair them.
+    await ASYNCSYSCALLS.batchFlush(batch);
+    await ASYNCSYSCALLS.batchApply(stream, data);
+    let delay = PThreadFS.relaxedDelay(stream.path);
+    if (delay >= 0) {
+      PThreadFS.deferFsync(stream, delay);
+      // The pass that flushes the pages makes this epoch durable.
+      log.epoch = durability.currentEpoch;
+      return 0;
+    }
+    await ASYNCSYSCALLS.batchFlush(stream);
+    // Replaying the entry again would be harmless, so the truncation is only
+    // flushed before the database is next written outside a batch, see
+    // batchSettle.
+    await PThreadFS.truncate(batch.node, 0);
+    log.end = 0;
+    log.truncated = true;
+    return 0;
+  }, resume);
+}
+
+// Replays the complete entries of the log in the -batch file `batchFd` onto the
+// database `fd`, in order, and empties the log once they are flushed. Entries
+// only hold the new contents of pages, so replaying one that was already
+// applied changes nothing, and the database is not inspected. Passes 1 to
+// `resume` if an entry was replayed.
+SyscallWrappers['pthreadfs_vfs_batch_recover__deps'] = ['$PThreadFS', '$ASYNCSYSCALLS'];
+SyscallWrappers['pthreadfs_vfs_batch_recover'] = function(fd, batchFd, resume) {
+  ASYNCSYSCALLS.resumeWith(async () => {
+    let stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+    let batch = await ASYNCSYSCALLS.getStreamFromFD(batchFd);
+    let log = ASYNCSYSCALLS.batchLog(stream.node, batch);
+    let attr = await batch.node.node_ops.getattr(batch.node);
+    if (attr.size === 0) {
+      return 0;
+    }
+    let data = new Uint8Array(attr.size);
+    let length = await PThreadFS.read(batch, data, 0, attr.size, 0);
+    let view = new DataView(data.buffer);
+    let headerSize = ASYNCSYSCALLS.batchHeaderSize;
+    let pos = 0;
+    let replayed = 0;
+    // The log ends at the first entry that is incomplete, or whose sequence
+    // number does not follow the previous one: left over from before the log
+    // was restarted at offset 0.
+    while (pos + headerSize <= length) {
+      let size = view.getUint32(pos + 4, true);
+      let seq = view.getUint32(pos + 8, true);
+      if (view.getUint32(pos, true) !== ASYNCSYSCALLS.batchMagic ||
+          pos + headerSize + size > length ||
+          (replayed > 0 && seq !== ((log.seq + 1) >>> 0))) {
+        break;
+      }
+      let entry = data.subarray(pos + headerSize, pos + headerSize + size);
+      if (view.getUint32(pos + 12, true) !== ASYNCSYSCALLS.batchChecksum(entry, seq)) {
+        break;
+      }
+      await ASYNCSYSCALLS.batchApply(stream, entry);
+      log.seq = seq;
+      replayed++;
+      pos += headerSize + size;
+    }
+    if (replayed > 0) {
+      await ASYNCSYSCALLS.batchFlush(stream);
+    }
+    await PThreadFS.truncate(batch.node, 0);
+    await ASYNCSYSCALLS.batchFlush(batch);
+    return replayed > 0 ? 1 : 0;
+  }, resume);
+}
+
 mergeInto(LibraryManager.library, SyscallWrappers);
+
+// Advisory byte-range locks (fcntl F_GETLK, F_SETLK and F_SETLKW) on PThreadFS
+// files. All pthreads of a module reach PThreadFS through the same helper
+// thread and share the lock table of each node. As with POSIX locks, they are
+// one process: their locks never conflict with each other, a lock replaces the
+// module's previous lock on the same bytes, and closing any descriptor of a file
+// releases all locks on it.
+//
+// Conflicts with other module instances (tabs, workers) are detected through
+// the Web Locks API, which also releases the locks of a context that goes away.
+// Ranges of up to `maxByteUnits` bytes take one Web Lock per byte; longer ones
+// take a single Web Lock for the exact range, so a long range only conflicts
+// with the same range in another context. SQLite's lock ranges (the pending and
+// reserved bytes, the shared range and the WAL locks) never overlap partially,
+// so they are fully covered. Without Web Locks, locks are only local.
+mergeInto(LibraryManager.library, {
+  $RANGELOCKS__deps: ['$PThreadFS'],
+  $RANGELOCKS: {
+    maxByteUnits: 64,
+
+    // Reads the range of the struct flock at `arg` as [start, end).
+    readRange: async function(stream, arg) {
+      var whence = {{{ makeGetValue('arg', C_STRUCTS.flock.l_whence, 'i16') }}};
+      var start = RANGELOCKS.getOffset(arg, {{{ C_STRUCTS.flock.l_start }}});
+      var len = RANGELOCKS.getOffset(arg, {{{ C_STRUCTS.flock.l_len }}});
+      if (whence === {{{ cDefine('SEEK_CUR') }}}) {
+        start += stream.position;
+      } else if (whence === {{{ cDefine('SEEK_END') }}}) {
+        start += (await stream.node.node_ops.getattr(stream.node)).size;
+      } else if (whence !== {{{ cDefine('SEEK_SET') }}}) {
+        throw new PThreadFS.ErrnoError({{{ cDefine('EINVAL') }}});
+      }
+      var end = len === 0 ? Infinity : start + len;
+      if (len < 0) {
+        end = start;
+        start += len;
+      }
+      if (start < 0) {
+        throw new PThreadFS.ErrnoError({{{ cDefine('EINVAL') }}});
+      }
+      return { start: start, end: end };
+    },
+    getOffset: function(arg, offset) {
+      var low = {{{ makeGetValue('arg', 'offset', 'i32') }}};
+      var high = {{{ makeGetValue('arg', 'offset + 4', 'i32') }}};
+      return high * 4294967296 + (low >>> 0);
+    },
+    setOffset: function(arg, offset, value) {
+      {{{ makeSetValue('arg', 'offset', 'value', 'i64') }}};
+    },
+
+    // The Web Lock names covering [start, end).
+    units: function(start, end) {
+      var units = [];
+      if (end - start > RANGELOCKS.maxByteUnits) {
+        units.push({ key: start + '-' + end, start: start, end: end });
+      } else {
+        for (var i = start; i < end; i++) {
+          units.push({ key: String(i), start: i, end: i + 1 });
+        }
+      }
+      return units;
+    },
+
+    // Returns `ranges`, a sorted list of locked ranges, with [start, end) set to
+    // `type`.
+    setRange: function(ranges, start, end, type) {
+      var result = [];
+      for (var r of ranges) {
+        if (r.end <= start || r.start >= end) {
+          result.push(r);
+          continue;
+        }
+        if (r.start < start) result.push({ start: r.start, end: start, type: r.type });
+        if (r.end > end) result.push({ start: end, end: r.end, type: r.type });
+      }
+      if (type !== {{{ cDefine('F_UNLCK') }}}) {
+        result.push({ start: start, end: end, type: type });
+      }
+      result.sort((a, b) => a.start - b.start);
+      // Merge adjacent ranges of the same type.
+      var merged = [];
+      for (var r of result) {
+        var last = merged[merged.length - 1];
+        if (last && last.end === r.start && last.type === r.type) {
+          last.end = r.end;
+        } else {
+          merged.push(Object.assign({}, r));
+        }
+      }
+      return merged;
+    },
+
+    // The Web Lock mode needed for [start, end) given the locked `ranges`.
+    mode: function(ranges, start, end) {
+      var mode = null;
+      for (var r of ranges) {
+        if (r.end <= start || r.start >= end) continue;
+        if (r.type === {{{ cDefine('F_WRLCK') }}}) return 'exclusive';
+        mode = 'shared';
+      }
+      return mode;
+    },
+
+    // Takes the Web Lock `name` if it is available. Resolves to an async
+    // function that releases it, or null.
+    request: function(name, mode) {
+      if (typeof navigator === 'undefined' || !navigator.locks) {
+        return Promise.resolve(async () => {});
+      }
+      return new Promise((resolve) => {
+        var done = navigator.locks.request(name, { mode: mode, ifAvailable: true }, (lock) => {
+          if (!lock) {
+            resolve(null);
+            return;
+          }
+          return new Promise((release) => resolve(async () => {
+            release();
+            await done;
+          }));
+        });
+      });
+    },
+
+    // Moves the Web Lock of `unit` to `mode`, or releases it if `mode` is null.
+    // Web Locks cannot be converted, so the previous lock is released first and
+    // taken again if the new mode is not available. SQLite only converts the
+    // shared range while it holds the pending byte, which keeps other contexts
+    // from taking it in between.
+    transition: async function(table, unit, mode) {
+      var held = table.held.get(unit.key);
+      if (held) {
+        table.held.delete(unit.key);
+        await held.release();
+      }
+      if (!mode) return true;
+      var release = await RANGELOCKS.request(table.name + unit.key, mode);
+      if (!release) {
+        if (held) {
+          release = await RANGELOCKS.request(table.name + unit.key, held.mode);
+          if (release) table.held.set(unit.key, Object.assign({}, held, { release: release }));
+        }
+        return false;
+      }
+      table.held.set(unit.key, { key: unit.key, start: unit.start, end: unit.end, mode: mode, release: release });
+      return true;
+    },
+
+    // Implements F_SETLK. Returns 0 or -EAGAIN if another context holds a
+    // conflicting lock, in which case the module's locks are unchanged.
+    setlk: async function(stream, arg) {
+      var type = {{{ makeGetValue('arg', C_STRUCTS.flock.l_type, 'i16') }}};
+      if ((type === {{{ cDefine('F_RDLCK') }}} && !stream.isRead) ||
+          (type === {{{ cDefine('F_WRLCK') }}} && !stream.isWrite)) {
+        return -{{{ cDefine('EBADF') }}};
+      }
+      if (type !== {{{ cDefine('F_RDLCK') }}} && type !== {{{ cDefine('F_WRLCK') }}} &&
+          type !== {{{ cDefine('F_UNLCK') }}}) {
+        return -{{{ cDefine('EINVAL') }}};
+      }
+      var range = await RANGELOCKS.readRange(stream, arg);
+      var node = stream.node;
+      var table = node.rangeLocks;
+      if (!table) {
+        if (type === {{{ cDefine('F_UNLCK') }}}) return 0;
+        table = node.rangeLocks = { name: 'pthreadfs:' + stream.path + ':', ranges: [], held: new Map() };
+      }
+      var ranges = RANGELOCKS.setRange(table.ranges, range.start, range.end, type);
+      var units = new Map();
+      if (type !== {{{ cDefine('F_UNLCK') }}}) {
+        for (var unit of RANGELOCKS.units(range.start, range.end)) units.set(unit.key, unit);
+      }
+      for (var held of table.held.values()) {
+        if (held.start < range.end && held.end > range.start) units.set(held.key, held);
+      }
+      var stronger = [], weaker = [];
+      for (var unit of units.values()) {
+        var held = table.held.get(unit.key);
+        var from = held ? held.mode : null;
+        var to = RANGELOCKS.mode(ranges, unit.start, unit.end);
+        if (from === to) continue;
+        (to === 'exclusive' || from === null ? stronger : weaker).push({ unit: unit, from: from, to: to });
+      }
+      // Everything that can fail is done first, and undone if it does.
+      for (var i = 0; i < stronger.length; i++) {
+        if (!await RANGELOCKS.transition(table, stronger[i].unit, stronger[i].to)) {
+          while (--i >= 0) {
+            await RANGELOCKS.transition(table, stronger[i].unit, stronger[i].from);
+          }
+          PThreadFS.stats.rangeLockConflicts++;
+          return -{{{ cDefine('EAGAIN') }}};
+        }
+      }
+      for (var change of weaker) {
+        await RANGELOCKS.transition(table, change.unit, change.to);
+      }
+      table.ranges = ranges;
+      if (ranges.length === 0 && table.held.size === 0) {
+        node.rangeLocks = null;
+      }
+      PThreadFS.stats.rangeLocks++;
+      return 0;
+    },
+
+    // Implements F_GETLK. Only locks of other contexts can conflict; they are
+    // found with navigator.locks.query(), which does not tell which process holds
+    // them, so l_pid is set to 0.
+    getlk: async function(stream, arg) {
+      var type = {{{ makeGetValue('arg', C_STRUCTS.flock.l_type, 'i16') }}};
+      if (type !== {{{ cDefine('F_RDLCK') }}} && type !== {{{ cDefine('F_WRLCK') }}}) {
+        return -{{{ cDefine('EINVAL') }}};
+      }
+      var range = await RANGELOCKS.readRange(stream, arg);
+      var conflict = null;
+      if (typeof navigator !== 'undefined' && navigator.locks) {
+        var table = stream.node.rangeLocks;
+        var name = 'pthreadfs:' + stream.path + ':';
+        var snapshot = await navigator.locks.query();
+        for (var unit of RANGELOCKS.units(range.start, range.end)) {
+          var holders = snapshot.held.filter((lock) => lock.name === name + unit.key);
+          var own = table && table.held.has(unit.key) ? 1 : 0;
+          if (holders.length <= own) continue;
+          var exclusive = holders.some((lock) => lock.mode === 'exclusive');
+          if (exclusive || type === {{{ cDefine('F_WRLCK') }}}) {
+            conflict = { unit: unit, type: exclusive ? {{{ cDefine('F_WRLCK') }}} : {{{ cDefine('F_RDLCK') }}} };
+            break;
+          }
+        }
+      }
+      if (!conflict) {
+        {{{ makeSetValue('arg', C_STRUCTS.flock.l_type, cDefine('F_UNLCK'), 'i16') }}};
+        return 0;
+      }
+      var unit = conflict.unit;
+      {{{ makeSetValue('arg', C_STRUCTS.flock.l_type, 'conflict.type', 'i16') }}};
+      {{{ makeSetValue('arg', C_STRUCTS.flock.l_whence, cDefine('SEEK_SET'), 'i16') }}};
+      RANGELOCKS.setOffset(arg, {{{ C_STRUCTS.flock.l_start }}}, unit.start);
+      RANGELOCKS.setOffset(arg, {{{ C_STRUCTS.flock.l_len }}}, unit.end === Infinity ? 0 : unit.end - unit.start);
+      {{{ makeSetValue('arg', C_STRUCTS.flock.l_pid, '0', 'i32') }}};
+      return 0;
+    },
+
+    // Releases all locks of the module on the file of `stream`.
+    releaseAll: async function(stream) {
+      var table = stream.node.rangeLocks;
+      if (!table) return;
+      stream.node.rangeLocks = null;
+      for (var held of table.held.values()) {
+        await held.release();
+      }
+    },
+  },
+});
 /**
  * @license
  * Copyright 2013 The Emscripten Authors
@@ -197,7 +673,7 @@ List of implemented syscalls:
 */
 
 var SyscallsLibrary = {
-  $ASYNCSYSCALLS__deps: ['$PThreadFS'],
+  $ASYNCSYSCALLS__deps: ['$PThreadFS', '$RANGELOCKS'],
   $ASYNCSYSCALLS: {
     mappings: {},
     // global constants
@@ -225,6 +701,21 @@ var SyscallsLibrary = {
       }
       return PATH.join2(dir, path);
     },
+    // If `path` is a single name relative to the directory stream `dirfd`,
+    // returns the directory node and the name, so that callers can look the
+    // name up directly instead of resolving a full path. Returns null for
+    // anything else.
+    lookupAt: async function(dirfd, path) {
+      if (dirfd === {{{ cDefine('AT_FDCWD') }}} || path.length == 0 || path === '.' || path === '..' ||
+          path.indexOf('/') !== -1) {
+        return null;
+      }
+      var dirstream = await ASYNCSYSCALLS.getStreamFromFD(dirfd);
+      if (!PThreadFS.isDir(dirstream.node.mode)) {
+        throw new PThreadFS.ErrnoError({{{ cDefine('ENOTDIR') }}});
+      }
+      return { parent: dirstream.node, name: path };
+    },
 
     doStat: async function(func, path, buf) {
       try {
@@ -299,7 +790,13 @@ var SyscallsLibrary = {
         return -{{{ cDefine('EINVAL') }}};
       }
       var lookup = await PThreadFS.lookupPath(path, { follow: true });
-      var node = lookup.node;
+      return await ASYNCSYSCALLS.doAccessNode(lookup.node, amode);
+    },
+    doAccessNode: async function(node, amode) {
+      if (amode & ~{{{ cDefine('S_IRWXO') }}}) {
+        // need a valid mode
+        return -{{{ cDefine('EINVAL') }}};
+      }
       if (!node) {
         return -{{{ cDefine('ENOENT') }}};
       }
@@ -359,6 +856,105 @@ var SyscallsLibrary = {
 #endif
       return ret;
     },
+    // Runs the async function `fn` and passes its result to the C callback
+    // `resume`, or the negated errno if it throws an ErrnoError.
+    resumeWith: function(fn, resume) {
+      fn().catch((e) => {
+        if (!(e instanceof PThreadFS.ErrnoError)) throw e;
+        return -e.errno;
+      }).then((res) => {
+        wasmTable.get(resume)(res);
+      });
+    },
+    // A -batch file is a log of batch-atomic commits. Each entry is a header of
+    // four little-endian 32-bit integers, followed by the records of the commit:
+    // a magic number, the length of the records, the sequence number of the
+    // commit and a checksum of both.
+    batchMagic: 0x48425450,
+    batchHeaderSize: 16,
+    batchChecksum: function(data, seq) {
+      // FNV-1a, seeded with the sequence number
+      var hash = 0x811c9dc5 ^ seq;
+      for (var i = 0; i < data.length; i++) {
+        hash = Math.imul(hash ^ data[i], 0x01000193);
+      }
+      return hash >>> 0;
+    },
+    // Returns the log state of the database `node`: the end of its entries in
+    // the -batch file, the last sequence number, the epoch that makes the
+    // entries durable in the database, and whether the log was emptied without
+    // a flush. `batch` is the stream the log was last used through.
+    batchLog: function(node, batch) {
+      if (!node.batchLog) {
+        node.batchLog = { stream: batch, path: batch.path, end: 0, seq: 0, epoch: 0, truncated: false };
+      }
+      node.batchLog.stream = batch;
+      return node.batchLog;
+    },
+    batchAppend: async function(batch, log, data) {
+      var seq = (log.seq + 1) >>> 0;
+      var header = new Uint8Array(ASYNCSYSCALLS.batchHeaderSize);
+      var view = new DataView(header.buffer);
+      view.setUint32(0, ASYNCSYSCALLS.batchMagic, true);
+      view.setUint32(4, data.length, true);
+      view.setUint32(8, seq, true);
+      view.setUint32(12, ASYNCSYSCALLS.batchChecksum(data, seq), true);
+      await PThreadFS.write(batch, data, 0, data.length, log.end + header.length);
+      await PThreadFS.write(batch, header, 0, header.length, log.end);
+      log.seq = seq;
+      log.end += header.length + data.length;
+    },
+    // Empties the log of the database `stream` for good before the database is
+    // written outside a batch, since a stale entry replayed over such a write
+    // would undo it. Entries of relaxed commits are flushed to the database
+    // first.
+    batchSettle: async function(stream) {
+      var log = stream.node.batchLog;
+      if (log.end === 0 && !log.truncated) return;
+      var batch = log.stream;
+      if (PThreadFS.isClosed(batch)) {
+        try {
+          batch = await PThreadFS.open(log.path, {{{ cDefine('O_RDWR') }}});
+        } catch (e) {
+          if (!(e instanceof PThreadFS.ErrnoError) || e.errno !== {{{ cDefine('ENOENT') }}}) throw e;
+          log.end = 0;
+          log.truncated = false;
+          return;
+        }
+      }
+      try {
+        if (log.end > 0) {
+          await ASYNCSYSCALLS.batchFlush(stream);
+          await PThreadFS.truncate(batch.node, 0);
+          log.end = 0;
+        }
+        await ASYNCSYSCALLS.batchFlush(batch);
+      } finally {
+        if (batch !== log.stream) await PThreadFS.close(batch);
+      }
+      log.truncated = false;
+    },
+    batchApply: async function(stream, records) {
+      var view = new DataView(records.buffer, records.byteOffset, records.byteLength);
+      var pos = 0;
+      while (pos < records.length) {
+        var offset = view.getFloat64(pos, true);
+        var length = view.getInt32(pos + 8, true);
+        pos += 12;
+        if (length < 0) {
+          await PThreadFS.truncate(stream.node, offset);
+          continue;
+        }
+        await PThreadFS.write(stream, records, pos, length, offset);
+        pos += length;
+      }
+    },
+    // Flushes `stream` at once, also on relaxed paths.
+    batchFlush: async function(stream) {
+      if (stream.stream_ops.fsync) {
+        await stream.stream_ops.fsync(stream);
+      }
+    },
     getStreamFromFD: async function(fd) {
       var stream = await PThreadFS.getStream(fd);
       if (!stream) throw new PThreadFS.ErrnoError({{{ cDefine('EBADF') }}});
@@ -391,6 +987,7 @@ var SyscallsLibrary = {
     },
     fd_close_async: async function(fd, iov, iovcnt, pnum) {
       var stream = await ASYNCSYSCALLS.getStreamFromFD(fd);
+      await RANGELOCKS.releaseAll(stream);
       await PThreadFS.close(stream);
       return 0;
     },
@@ -713,6 +1310,8 @@ var SyscallsLibrary = {
     getdents64_async: async function(fd, dirp, count) {
       var stream = await ASYNCSYSCALLS.getStreamFromFD(fd)
       if (!stream.getdents) {
+        // The listing is taken once per open directory stream and then served
+        // from the stream position, so paging through it stays linear.
         stream.getdents = await PThreadFS.readdir(stream.path);
       }
 
@@ -731,12 +1330,18 @@ var SyscallsLibrary = {
           type = 4; // DT_DIR
         }
         else if (name === '..') {
-          var lookup = await PThreadFS.lookupPath(stream.path, { parent: true });
-          id = lookup.node.id;
+          if (!PThreadFS.isRoot(stream.node)) {
+            id = stream.node.parent.id;
+          } else {
+            // The root of a mount is its own parent; use the mountpoint's.
+            var lookup = await PThreadFS.lookupPath(stream.path, { parent: true });
+            id = lookup.node.id;
+          }
           type = 4; // DT_DIR
         }
         else {
-          var child = await PThreadFS.lookupNode(stream.node, name);
+          var child = PThreadFS.lookupNodeCached(stream.node, name) ||
+                      await PThreadFS.lookupNode(stream.node, name);
           id = child.id;
           type = PThreadFS.isChrdev(child.mode) ? 2 :  // DT_CHR, character device.
                  PThreadFS.isDir(child.mode) ? 4 :     // DT_DIR, directory.
@@ -784,10 +1389,7 @@ var SyscallsLibrary = {
         /* case {{{ cDefine('F_GETLK64') }}}: Currently in musl F_GETLK64 has same value as F_GETLK, so omitted to avoid duplicate case blocks. If that changes, uncomment this */ {
           {{{ assert(cDefine('F_GETLK') === cDefine('F_GETLK64')), '' }}}
           var arg = ASYNCSYSCALLS.get();
-          var offset = {{{ C_STRUCTS.flock.l_type }}};
-          // We're always unlocked.
-          {{{ makeSetValue('arg', 'offset', cDefine('F_UNLCK'), 'i16') }}};
-          return 0;
+          return await RANGELOCKS.getlk(stream, arg);
         }
         case {{{ cDefine('F_SETLK') }}}:
         case {{{ cDefine('F_SETLKW') }}}:
@@ -795,7 +1397,8 @@ var SyscallsLibrary = {
         /* case {{{ cDefine('F_SETLKW64') }}}: Currently in musl F_SETLKW64 has same value as F_SETLKW, so omitted to avoid duplicate case blocks. If that changes, uncomment this */
           {{{ assert(cDefine('F_SETLK64') === cDefine('F_SETLK')), '' }}}
           {{{ assert(cDefine('F_SETLKW64') === cDefine('F_SETLKW')), '' }}}
-          return 0; // Pretend that the locking is successful.
+          // pthreadfs.cpp implements F_SETLKW by retrying F_SETLK.
+          return await RANGELOCKS.setlk(stream, ASYNCSYSCALLS.get());
         case {{{ cDefine('F_GETOWN_EX') }}}:
         case {{{ cDefine('F_SETOWN') }}}:
           return -{{{ cDefine('EINVAL') }}}; // These are for sockets. We don't have them fully implemented yet.
@@ -830,24 +1433,38 @@ var SyscallsLibrary = {
     },
     openat_async: async function(dirfd, path, flags, varargs) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
       var mode = varargs ? ASYNCSYSCALLS.get() : 0;
+      var at = await ASYNCSYSCALLS.lookupAt(dirfd, path);
+      if (at) {
+        var node = null;
+        try {
+          node = await PThreadFS.lookupNode(at.parent, at.name);
+        } catch (e) {
+          if (!(e instanceof PThreadFS.ErrnoError)) throw e;
+        }
+        // Links and names that still need to be created take the path below.
+        if (node && !PThreadFS.isLink(node.mode)) {
+          let stream = await PThreadFS.open(node, flags, mode);
+          return stream.fd;
+        }
+      }
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       let stream = await PThreadFS.open(path, flags, mode);
       return stream.fd;
     },
     mkdirat_async: async function(dirfd, path, mode) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       return ASYNCSYSCALLS.doMkdir(path, mode);
     },
     mknodat_async: async function(dirfd, path, mode, dev) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       return ASYNCSYSCALLS.doMknod(path, mode, dev);
     },
     fchownat_async: async function(dirfd, path, owner, group, flags) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       await PThreadFS.chown(path, owner, group);
       return 0;
     },
@@ -856,12 +1473,17 @@ var SyscallsLibrary = {
       var nofollow = flags & {{{ cDefine('AT_SYMLINK_NOFOLLOW') }}};
       var allowEmpty = flags & {{{ cDefine('AT_EMPTY_PATH') }}};
       flags = flags & (~{{{ cDefine('AT_SYMLINK_NOFOLLOW') | cDefine('AT_EMPTY_PATH') }}});
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path, allowEmpty);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path, allowEmpty);
       return await ASYNCSYSCALLS.doStat(nofollow ? PThreadFS.lstat : PThreadFS.stat, path, buf);
     },
     unlinkat_async: async function(dirfd, path, flags) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      var at = flags === 0 ? await ASYNCSYSCALLS.lookupAt(dirfd, path) : null;
+      if (at) {
+        await PThreadFS.unlinkNode(at.parent, at.name, PATH.join2(PThreadFS.getPath(at.parent), at.name));
+        return 0;
+      }
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       if (flags === 0) {
         await PThreadFS.unlink(path);
       } else if (flags === {{{ cDefine('AT_REMOVEDIR') }}}) {
@@ -872,29 +1494,37 @@ var SyscallsLibrary = {
       return 0;
     },
     symlinkat_async: async function(target, newdirfd, linkpath) {
-      linkpath = ASYNCSYSCALLS.calculateAt(newdirfd, linkpath);
+      linkpath = await ASYNCSYSCALLS.calculateAt(newdirfd, linkpath);
       await PThreadFS.symlink(target, linkpath);
       return 0;
     },
     readlinkat_async: async function(dirfd, path, buf, bufsize) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       return await ASYNCSYSCALLS.doReadlink(path, buf, bufsize);
     },
     fchmodat_async: async function(dirfd, path, mode, varargs) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       await PThreadFS.chmod(path, mode);
       return 0;
     },
     faccessat_async: async function(dirfd, path, amode, flags) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path);
+      var at = await ASYNCSYSCALLS.lookupAt(dirfd, path);
+      if (at) {
+        var node = await PThreadFS.lookupNode(at.parent, at.name);
+        // Links take the path below, which follows them.
+        if (!PThreadFS.isLink(node.mode)) {
+          return await ASYNCSYSCALLS.doAccessNode(node, amode);
+        }
+      }
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path);
       return await ASYNCSYSCALLS.doAccess(path, amode);
     },
     utimensat_async: async function(dirfd, path, times, flags) {
       path = ASYNCSYSCALLS.getStr(path);
-      path = ASYNCSYSCALLS.calculateAt(dirfd, path, true);
+      path = await ASYNCSYSCALLS.calculateAt(dirfd, path, true);
       var seconds = {{{ makeGetValue('times', C_STRUCTS.timespec.tv_sec, 'i32') }}};
       var nanoseconds = {{{ makeGetValue('times', C_STRUCTS.timespec.tv_nsec, 'i32') }}};
       var atime = (seconds*1000) + (nanoseconds/(1000*1000));
@@ -988,6 +1618,7 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
     streams: [],
     nextInode: 1,
     nameTable: null,
+    nameTableCount: 0, // number of nodes in nameTable, used to grow it
     currentPath: '/',
     initialized: false,
     // Whether we are currently ignoring permissions. Useful when preparing the
@@ -1006,6 +1637,18 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
     genericErrors: {},
     filesystems: null,
     syncFSRequests: 0, // we warn if there are multiple in flight at once
+    // Counters reported by PThreadFS.printStats().
+    stats: null, // set during init
+    // Relaxed durability state, see PThreadFS.setRelaxedDurability().
+    durability: null, // set during init
+    // Sequential read-ahead. Filesystems opt in by setting `readahead: true`.
+    // The window starts at `minBlocks` blocks and doubles on every sequential
+    // read that misses the buffer, up to `maxBlocks`.
+    readahead: {
+      blockSize: 4096,
+      minBlocks: 4,
+      maxBlocks: 64
+    },
 
     //
     // paths
@@ -1104,30 +1747,49 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       return ((parentid + hash) >>> 0) % PThreadFS.nameTable.length;
     },
     hashAddNode: function(node) {
+      // Keep chains short when large directories are listed.
+      if (PThreadFS.nameTableCount >= PThreadFS.nameTable.length * 2) {
+        PThreadFS.hashResize(PThreadFS.nameTable.length * 2);
+      }
       var hash = PThreadFS.hashName(node.parent.id, node.name);
       node.name_next = PThreadFS.nameTable[hash];
       PThreadFS.nameTable[hash] = node;
+      PThreadFS.nameTableCount++;
     },
     hashRemoveNode: function(node) {
       var hash = PThreadFS.hashName(node.parent.id, node.name);
       if (PThreadFS.nameTable[hash] === node) {
         PThreadFS.nameTable[hash] = node.name_next;
+        PThreadFS.nameTableCount--;
       } else {
         var current = PThreadFS.nameTable[hash];
         while (current) {
           if (current.name_next === node) {
             current.name_next = node.name_next;
+            PThreadFS.nameTableCount--;
             break;
           }
           current = current.name_next;
         }
       }
     },
-    lookupNode: async function(parent, name) {
-      var errCode = PThreadFS.mayLookup(parent);
-      if (errCode) {
-        throw new PThreadFS.ErrnoError(errCode, parent);
+    hashResize: function(size) {
+      var old = PThreadFS.nameTable;
+      PThreadFS.nameTable = new Array(size);
+      for (var i = 0; i < old.length; i++) {
+        var node = old[i];
+        while (node) {
+          var next = node.name_next;
+          var hash = PThreadFS.hashName(node.parent.id, node.name);
+          node.name_next = PThreadFS.nameTable[hash];
+          PThreadFS.nameTable[hash] = node;
+          node = next;
+        }
       }
+    },
+    // Returns the node for `name` in `parent` if it is cached, without calling
+    // into the filesystem.
+    lookupNodeCached: function(parent, name) {
       var hash = PThreadFS.hashName(parent.id, name);
 #if CASE_INSENSITIVE_FS
       name = name.toLowerCase();
@@ -1141,6 +1803,17 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
           return node;
         }
       }
+      return null;
+    },
+    lookupNode: async function(parent, name) {
+      var errCode = PThreadFS.mayLookup(parent);
+      if (errCode) {
+        throw new PThreadFS.ErrnoError(errCode, parent);
+      }
+      var node = PThreadFS.lookupNodeCached(parent, name);
+      if (node) {
+        return node;
+      }
       // if we failed to find it in the cache, call into the VFS
       return await PThreadFS.lookup(parent, name);
     },
@@ -1739,7 +2412,11 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       if (!parent) {
         throw new PThreadFS.ErrnoError({{{ cDefine('ENOENT') }}});
       }
-      var name = PATH.basename(path);
+      await PThreadFS.unlinkNode(parent, PATH.basename(path), path);
+    },
+    // Removes `name` from the directory node `parent`. `path` is only used for
+    // the tracking delegate.
+    unlinkNode: async function(parent, name, path) {
       var node = await PThreadFS.lookupNode(parent, name);
       var errCode = await PThreadFS.mayDelete(parent, name, false);
       if (errCode) {
@@ -1872,6 +2549,7 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       if (errCode) {
         throw new PThreadFS.ErrnoError(errCode);
       }
+      PThreadFS.invalidateReadahead(node);
       await node.node_ops.setattr(node, {
         size: len,
         timestamp: Date.now()
@@ -2004,6 +2682,7 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
         throw new PThreadFS.ErrnoError({{{ cDefine('EBADF') }}});
       }
       if (stream.getdents) stream.getdents = null; // free readdir state
+      await PThreadFS.flushDeferred(stream);
       try {
         if (stream.stream_ops.close) {
           await stream.stream_ops.close(stream);
@@ -2057,10 +2736,64 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       } else if (!stream.seekable) {
         throw new PThreadFS.ErrnoError({{{ cDefine('ESPIPE') }}});
       }
-      var bytesRead = await stream.stream_ops.read(stream, buffer, offset, length, position);
+      var bytesRead;
+      if (stream.node.mount.type.readahead && PThreadFS.isFile(stream.node.mode)) {
+        bytesRead = await PThreadFS.readWithReadahead(stream, buffer, offset, length, position);
+      } else {
+        bytesRead = await stream.stream_ops.read(stream, buffer, offset, length, position);
+      }
+      PThreadFS.stats.reads++;
+      PThreadFS.stats.readBytes += bytesRead;
       if (!seeking) stream.position += bytesRead;
       return bytesRead;
     },
+    // Serves reads from a per-stream buffer once a stream is detected to read
+    // sequentially. Any write or truncate of the node bumps `node.version`,
+    // which invalidates the buffers of all streams on that node.
+    readWithReadahead: async function(stream, buffer, offset, length, position) {
+      var node = stream.node;
+      var ra = stream.readahead;
+      if (!ra) {
+        ra = stream.readahead = { next: -1, blocks: 0, data: null, start: 0, eof: false, version: 0 };
+      }
+      var stats = PThreadFS.stats;
+      if (ra.data && ra.version === (node.version || 0) && position >= ra.start) {
+        var end = ra.start + ra.data.length;
+        if (position + length <= end || (ra.eof && position <= end)) {
+          var count = Math.min(length, end - position);
+          buffer.set(ra.data.subarray(position - ra.start, position - ra.start + count), offset);
+          ra.next = position + count;
+          stats.readaheadHits++;
+          return count;
+        }
+      }
+      var sequential = position === ra.next;
+      ra.next = position + length;
+      if (!sequential) {
+        ra.blocks = 0;
+        ra.data = null;
+        return await stream.stream_ops.read(stream, buffer, offset, length, position);
+      }
+      stats.readaheadMisses++;
+      var config = PThreadFS.readahead;
+      ra.blocks = ra.blocks ? Math.min(ra.blocks * 2, config.maxBlocks) : config.minBlocks;
+      var size = Math.max(length, ra.blocks * config.blockSize);
+      var data = new Uint8Array(size);
+      var fetched = await stream.stream_ops.read(stream, data, 0, size, position);
+      stats.readaheadFetches++;
+      stats.readaheadBytes += fetched;
+      ra.data = data.subarray(0, fetched);
+      ra.start = position;
+      ra.eof = fetched < size;
+      ra.version = node.version || 0;
+      var count = Math.min(length, fetched);
+      buffer.set(ra.data.subarray(0, count), offset);
+      ra.next = position + count;
+      return count;
+    },
+    invalidateReadahead: function(node) {
+      node.version = (node.version || 0) + 1;
+    },
     write: async function(stream, buffer, offset, length, position, canOwn) {
 #if CAN_ADDRESS_2GB
       offset >>>= 0;
@@ -2090,7 +2823,10 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       } else if (!stream.seekable) {
         throw new PThreadFS.ErrnoError({{{ cDefine('ESPIPE') }}});
       }
+      PThreadFS.invalidateReadahead(stream.node);
       var bytesWritten = await stream.stream_ops.write(stream, buffer, offset, length, position, canOwn);
+      PThreadFS.stats.writes++;
+      PThreadFS.stats.writeBytes += bytesWritten;
       if (!seeking) stream.position += bytesWritten;
       try {
         if (stream.path && PThreadFS.trackingDelegate['onWriteToFile']) PThreadFS.trackingDelegate['onWriteToFile'](stream.path);
@@ -2115,6 +2851,7 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       if (!stream.stream_ops.allocate) {
         throw new PThreadFS.ErrnoError({{{ cDefine('EOPNOTSUPP') }}});
       }
+      PThreadFS.invalidateReadahead(stream.node);
       await stream.stream_ops.allocate(stream, offset, length);
    },
     ioctl: async function(stream, cmd, arg) {
@@ -2272,8 +3009,21 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
     },
     staticInit: async function() {
       PThreadFS.ensureErrnoError();
+      PThreadFS.resetStats();
+      PThreadFS.durability = {
+        // Flush delay in milliseconds by path.
+        relaxed: new Map(),
+        // Streams whose fsync was deferred, by node.
+        pending: new Map(),
+        // The epoch made durable by the next flush pass, and the last one that was.
+        currentEpoch: 1,
+        durableEpoch: 0,
+        timer: null,
+        pass: null
+      };
 
       PThreadFS.nameTable = new Array(4096);
+      PThreadFS.nameTableCount = 0;
 
       await PThreadFS.mount(MEMFS_ASYNC, {}, '/');
 
@@ -2295,6 +3045,158 @@ mergeInto(LibraryManager.library, SyscallsLibrary);
       }
     },
 
+    resetStats: function() {
+      PThreadFS.stats = {
+        reads: 0,
+        readBytes: 0,
+        writes: 0,
+        writeBytes: 0,
+        readaheadHits: 0,
+        readaheadMisses: 0,
+        readaheadFetches: 0,
+        readaheadBytes: 0,
+        fsyncRequests: 0,
+        fsyncPasses: 0,
+        fsyncFlushes: 0,
+        fsyncDeferred: 0,
+        durablePasses: 0,
+        idbTransactions: 0,
+        idbBlockReads: 0,
+        idbBlockWrites: 0,
+        idbCacheHits: 0,
+        rangeLocks: 0,
+        rangeLockConflicts: 0
+      };
+    },
+    printStats: function() {
+      var stats = PThreadFS.stats;
+      var lookups = stats.readaheadHits + stats.readaheadMisses;
+      var hitRate = lookups ? (100 * stats.readaheadHits / lookups).toFixed(1) : '0.0';
+      out('-- PThreadFS reads:            ' + stats.reads + ' (' + stats.readBytes + ' bytes)');
+      out('-- PThreadFS writes:           ' + stats.writes + ' (' + stats.writeBytes + ' bytes)');
+      out('-- PThreadFS read-ahead hits:  ' + stats.readaheadHits + ' of ' + lookups +
+          ' sequential reads (' + hitRate + '%)');
+      out('-- PThreadFS read-ahead fetch: ' + stats.readaheadFetches + ' (' + stats.readaheadBytes + ' bytes)');
+      out('-- PThreadFS fsync requests:   ' + stats.fsyncRequests + ' in ' + stats.fsyncPasses +
+          ' passes (' + stats.fsyncFlushes + ' handle flushes)');
+      if (stats.fsyncDeferred) {
+        out('-- PThreadFS deferred fsyncs:  ' + stats.fsyncDeferred + ' in ' + stats.durablePasses +
+            ' background passes (durable epoch ' + PThreadFS.durability.durableEpoch + ')');
+      }
+      if (stats.idbTransactions) {
+        out('-- PThreadFS IndexedDB:        ' + stats.idbTransactions + ' transactions, ' +
+            stats.idbBlockReads + ' blocks read, ' + stats.idbBlockWrites + ' blocks written, ' +
+            stats.idbCacheHits + ' block cache hits');
+      }
+      if (stats.rangeLocks || stats.rangeLockConflicts) {
+        out('-- PThreadFS range locks:      ' + stats.rangeLocks + ' set, ' +
+            stats.rangeLockConflicts + ' conflicts with other contexts');
+      }
+    },
+
+    // Relaxed durability. fsync of a file at or below a relaxed path returns at
+    // once, and the file is flushed by a background pass at most `delay`
+    // milliseconds later. Each pass makes the epoch it started in durable, that
+    // is all fsync calls made up to then. A tab crash loses nothing that was
+    // written, but an OS crash or power loss can lose the commits of the
+    // epochs that are not durable yet and, as with PRAGMA synchronous=OFF,
+    // corrupt databases in rollback journal mode. Batch-atomic commits still
+    // flush their -batch log, so they can only be lost, see
+    // pthreadfs_vfs_batch_commit.
+    setRelaxedDurability: function(path, delay) {
+      path = PATH_FS.resolve(PThreadFS.cwd(), path);
+      if (delay < 0) {
+        PThreadFS.durability.relaxed.delete(path);
+      } else {
+        PThreadFS.durability.relaxed.set(path, delay);
+      }
+    },
+    // Returns the flush delay for `path`, or -1 if fsync must flush. A relaxed
+    // path covers the files below it and, for databases, SQLite's -journal,
+    // -wal and -batch files.
+    relaxedDelay: function(path) {
+      var relaxed = PThreadFS.durability.relaxed;
+      if (relaxed.size === 0 || !path) return -1;
+      for (var [prefix, delay] of relaxed) {
+        if (path === prefix || path.startsWith(prefix + '/') || path.startsWith(prefix + '-')) {
+          return delay;
+        }
+      }
+      return -1;
+    },
+    deferFsync: function(stream, delay) {
+      var durability = PThreadFS.durability;
+      durability.pending.set(stream.node, stream);
+      PThreadFS.stats.fsyncDeferred++;
+      if (durability.timer === null) {
+        durability.timer = setTimeout(() => {
+          durability.timer = null;
+          PThreadFS.flushEpoch();
+        }, delay);
+      }
+    },
+    // Starts a flush pass once the running one, if any, is done. Resolves to 0
+    // or a negative errno; files that failed to flush are retried by the next
+    // pass, and the epoch only becomes durable once all are flushed.
+    flushEpoch: function() {
+      var durability = PThreadFS.durability;
+      var pass = (durability.pass || Promise.resolve(0)).then(async () => {
+        if (durability.timer !== null) {
+          clearTimeout(durability.timer);
+          durability.timer = null;
+        }
+        var epoch = durability.currentEpoch++;
+        var pending = durability.pending;
+        durability.pending = new Map();
+        var res = 0;
+        for (var [node, stream] of pending) {
+          try {
+            if (!PThreadFS.isClosed(stream) && stream.stream_ops.fsync) {
+              await stream.stream_ops.fsync(stream);
+              PThreadFS.stats.fsyncFlushes++;
+            }
+          } catch (e) {
+            if (!(e instanceof PThreadFS.ErrnoError)) throw e;
+            res = -e.errno;
+            if (!durability.pending.has(node)) durability.pending.set(node, stream);
+          }
+        }
+        PThreadFS.stats.durablePasses++;
+        if (res === 0) {
+          durability.durableEpoch = epoch;
+        }
+        return res;
+      });
+      durability.pass = pass;
+      pass.then(() => {
+        if (durability.pass === pass) durability.pass = null;
+      });
+      return pass;
+    },
+    // Resolves to 0 once `epoch` is durable, running flush passes as needed, or
+    // to the negative errno of a failed pass.
+    waitDurable: async function(epoch) {
+      var durability = PThreadFS.durability;
+      epoch = Math.min(epoch, durability.currentEpoch);
+      while (durability.durableEpoch < epoch) {
+        var res = await PThreadFS.flushEpoch();
+        if (res !== 0) return res;
+      }
+      return 0;
+    },
+    // Flushes a deferred fsync of `stream` before it is closed, since the pass
+    // would skip the closed stream.
+    flushDeferred: async function(stream) {
+      var pending = PThreadFS.durability.pending;
+      if (pending.get(stream.node) === stream) {
+        pending.delete(stream.node);
+        if (stream.stream_ops.fsync) {
+          await stream.stream_ops.fsync(stream);
+          PThreadFS.stats.fsyncFlushes++;
+        }
+      }
+    },
+
     //
     // old v1 compatibility functions
     //
@@ -2562,6 +3464,9 @@ postMessage(present);
       if (has_access_handles) {
         await PThreadFS.mount(FSAFS, {root : '.'}, folderpath);
         console.log('Initialized PThreadFS with OPFS Access Handles');
+      } else if (typeof indexedDB !== 'undefined') {
+        await PThreadFS.mount(IDB_ASYNC, {name : folder}, folderpath);
+        console.log('Initialized PThreadFS with IndexedDB');
       // } else if (has_storage_foundation) {
       //   await PThreadFS.mount(SFAFS, {root : '.'}, folderpath);
 
@@ -2974,6 +3879,9 @@ mergeInto(LibraryManager.library, {
 mergeInto(LibraryManager.library, {
   $FSAFS__deps: ['$PThreadFS'],
   $FSAFS: {
+    // Access handle reads are comparatively expensive, so sequential reads are
+    // served from a read-ahead buffer (see PThreadFS.readWithReadahead).
+    readahead: true,
 
     /* Helper functions */
 
@@ -2987,6 +3895,35 @@ mergeInto(LibraryManager.library, {
       return await node.localReference.createSyncAccessHandle({mode: "in-place"});
     },
 
+    // Creates the node for an existing OPFS entry.
+    nodeFromHandle: function(parent, name, handle) {
+      let mode = handle.kind === 'directory' ?
+        {{{ cDefine('S_IFDIR') }}} | 511 /* 0777 */ : {{{ cDefine('S_IFREG') }}} | 511 /* 0777 */;
+      var node = PThreadFS.createNode(parent, name, mode);
+      node.node_ops = FSAFS.node_ops;
+      node.stream_ops = FSAFS.stream_ops;
+      node.localReference = handle;
+      if (handle.kind === 'directory') {
+        node.contents = {};
+      }
+      return node;
+    },
+
+    // Directory listings are cached on the node as a Map from name to entry
+    // kind. They are kept up to date by the operations of this instance, but
+    // do not see entries created or removed by other tabs or workers.
+    listingSet: function(parent, name, kind) {
+      if (parent.listing) {
+        parent.listing.set(name, kind);
+      }
+    },
+
+    listingDelete: function(parent, name) {
+      if (parent.listing) {
+        parent.listing.delete(name);
+      }
+    },
+
     /* Filesystem implementation (public interface) */
 
     createNode: function (parent, name, mode, dev) {
@@ -3113,27 +4050,20 @@ mergeInto(LibraryManager.library, {
       },
 
       lookup: async function (parent, name) {
+        if (parent.listing && !parent.listing.has(name)) {
+          throw PThreadFS.genericErrors[{{{ cDefine('ENOENT') }}}];
+        }
         let childLocalReference = null;
-        let mode = null;
         try {
           childLocalReference = await parent.localReference.getDirectoryHandle(name, {create: false});
-          mode = {{{ cDefine('S_IFDIR') }}} | 511 /* 0777 */
         } catch (e) {
           try {
             childLocalReference = await parent.localReference.getFileHandle(name, {create: false});
-            mode = {{{ cDefine('S_IFREG') }}} | 511 /* 0777 */
           } catch (e) {
             throw PThreadFS.genericErrors[{{{ cDefine('ENOENT') }}}];
           }
         }
-        var node = PThreadFS.createNode(parent, name, mode);
-        node.node_ops = FSAFS.node_ops;
-        node.stream_ops = FSAFS.stream_ops;
-        node.localReference = childLocalReference;
-        if (childLocalReference.kind === 'directory') {
-          node.contents = {};
-        }
-        return node;
+        return FSAFS.nodeFromHandle(parent, name, childLocalReference);
       },
 
       mknod: async function (parent, name, mode, dev) {
@@ -3151,6 +4081,7 @@ mergeInto(LibraryManager.library, {
 
         node.handle = null;
         node.refcount = 0;
+        FSAFS.listingSet(parent, name, node.localReference.kind);
         return node;
       },
 
@@ -3179,6 +4110,8 @@ mergeInto(LibraryManager.library, {
           throw new PThreadFS.ErrnoError({{{ cDefine('EXDEV') }}});
         }
         // Update the internal directory cache.
+        FSAFS.listingDelete(oldNode.parent, oldNode.name);
+        FSAFS.listingSet(newParentNode, newName, oldNode.localReference.kind);
         delete oldNode.parent.contents[oldNode.name];
         oldNode.parent.timestamp = Date.now()
         oldNode.name = newName;
@@ -3189,6 +4122,7 @@ mergeInto(LibraryManager.library, {
 
       unlink: async function(parent, name) {
         let res = await parent.localReference.removeEntry(name);
+        FSAFS.listingDelete(parent, name);
 
         if ('contents' in parent) {
           delete parent.contents[name];
@@ -3210,6 +4144,7 @@ mergeInto(LibraryManager.library, {
           }
           throw new PThreadFS.ErrnoError({{{ cDefine('EINVAL') }}});
         }
+        FSAFS.listingDelete(parent, name);
         if ('contents' in parent) {
           delete parent.contents[name];
         }
@@ -3218,18 +4153,27 @@ mergeInto(LibraryManager.library, {
       },
 
       readdir: async function(node) {
-        let entries = ['.', '..'];
-        // Do not use `for await` yet, since it's not supported by Emscripten's minifier.
-        // for await (let [name, handle] of node.localReference) {
-        //   entries.push(name);
-        // }
-        let it = node.localReference.values();
-        let curr = await it.next();
-        while (!curr.done) {
-          entries.push(curr.value.name);
-          curr = await it.next();
+        if (!node.listing) {
+          let listing = new Map();
+          // Do not use `for await` yet, since it's not supported by Emscripten's minifier.
+          // for await (let [name, handle] of node.localReference) {
+          //   entries.push(name);
+          // }
+          let it = node.localReference.values();
+          let curr = await it.next();
+          while (!curr.done) {
+            let handle = curr.value;
+            listing.set(handle.name, handle.kind);
+            // Create nodes from the iterator's handles, so that looking up the
+            // listed names does not go back to OPFS one entry at a time.
+            if (!PThreadFS.lookupNodeCached(node, handle.name)) {
+              FSAFS.nodeFromHandle(node, handle.name, handle);
+            }
+            curr = await it.next();
+          }
+          node.listing = listing;
         }
-        return entries;
+        return ['.', '..'].concat(Array.from(node.listing.keys()));
       },
 
       // No readlink support: Since PThreadFS does not support links, there is
@@ -3364,3 +4308,547 @@ mergeInto(LibraryManager.library, {
     }
   }
 });
+/**
+ * @license
+ * Copyright 2021 The Emscripten Authors
+ * SPDX-License-Identifier: MIT
+ */
+
+mergeInto(LibraryManager.library, {
+  $IDB_ASYNC__deps: ['$PThreadFS'],
+  $IDB_ASYNC: {
+    DB_VERSION: 1,
+    ENTRY_STORE: 'entries',
+    BLOCK_STORE: 'blocks',
+    // Files are stored as blocks of this size, keyed by [file id, block index].
+    // It matches SQLite's default page size, so writing a page rewrites a
+    // single block.
+    blockSize: 4096,
+    // Number of blocks kept in the LRU read cache.
+    cacheBlocks: 1024,
+    // Dirty blocks of a single file that are written out without waiting for
+    // an fsync, to bound memory use.
+    maxDirtyBlocks: 4096,
+    cache: null, // set during mount
+    // Sequential reads fetch a window of blocks in one transaction.
+    readahead: true,
+
+    /* Helper functions */
+
+    ioError: function(e) {
+      console.log('IDB_ASYNC error: ' + e);
+      return new PThreadFS.ErrnoError({{{ cDefine('EIO') }}});
+    },
+
+    request: function(req) {
+      return new Promise((resolve, reject) => {
+        req.onsuccess = () => resolve(req.result);
+        req.onerror = () => reject(IDB_ASYNC.ioError(req.error));
+      });
+    },
+
+    transactionDone: function(tx) {
+      return new Promise((resolve, reject) => {
+        tx.oncomplete = () => resolve();
+        tx.onerror = () => reject(IDB_ASYNC.ioError(tx.error));
+        tx.onabort = () => reject(IDB_ASYNC.ioError(tx.error));
+      });
+    },
+
+    openDatabase: function(name) {
+      return new Promise((resolve, reject) => {
+        let req = indexedDB.open(name, IDB_ASYNC.DB_VERSION);
+        req.onupgradeneeded = () => {
+          let db = req.result;
+          if (!db.objectStoreNames.contains(IDB_ASYNC.ENTRY_STORE)) {
+            db.createObjectStore(IDB_ASYNC.ENTRY_STORE);
+          }
+          if (!db.objectStoreNames.contains(IDB_ASYNC.BLOCK_STORE)) {
+            db.createObjectStore(IDB_ASYNC.BLOCK_STORE);
+          }
+        };
+        req.onsuccess = () => resolve(req.result);
+        req.onerror = () => reject(IDB_ASYNC.ioError(req.error));
+      });
+    },
+
+    // The path of `node` relative to its mount, which keys its entry.
+    storePath: function(node) {
+      let parts = [];
+      while (node !== node.mount.root) {
+        parts.unshift(node.name);
+        node = node.parent;
+      }
+      return '/' + parts.join('/');
+    },
+
+    childPath: function(parent, name) {
+      let path = IDB_ASYNC.storePath(parent);
+      return path === '/' ? path + name : path + '/' + name;
+    },
+
+    // Key range of all entries below the directory at `path`.
+    descendantRange: function(path) {
+      let prefix = path === '/' ? '/' : path + '/';
+      return IDBKeyRange.bound(prefix, prefix + '\uffff');
+    },
+
+    // Key range of the blocks of file `id` starting at block `from`.
+    blockRange: function(id, from) {
+      return IDBKeyRange.bound([id, from], [id, Infinity]);
+    },
+
+    // Blocks are keyed by a random id rather than by path, so that renames
+    // only move the entry.
+    newFileId: function() {
+      return Math.floor(Math.random() * Number.MAX_SAFE_INTEGER);
+    },
+
+    entryOf: function(node) {
+      return {
+        'id': node.fileId || 0,
+        'mode': node.mode,
+        'size': node.usedBytes || 0,
+        'timestamp': node.timestamp
+      };
+    },
+
+    putEntry: async function(node) {
+      let tx = node.mount.db.transaction(IDB_ASYNC.ENTRY_STORE, 'readwrite');
+      tx.objectStore(IDB_ASYNC.ENTRY_STORE).put(IDB_ASYNC.entryOf(node), IDB_ASYNC.storePath(node));
+      PThreadFS.stats.idbTransactions++;
+      await IDB_ASYNC.transactionDone(tx);
+    },
+
+    cacheGet: function(node, index) {
+      let key = node.fileId + ':' + index;
+      let block = IDB_ASYNC.cache.get(key);
+      if (block) {
+        // Move the block to the most recently used end.
+        IDB_ASYNC.cache.delete(key);
+        IDB_ASYNC.cache.set(key, block);
+      }
+      return block;
+    },
+
+    cachePut: function(node, index, block) {
+      let key = node.fileId + ':' + index;
+      IDB_ASYNC.cache.delete(key);
+      IDB_ASYNC.cache.set(key, block);
+      if (IDB_ASYNC.cache.size > IDB_ASYNC.cacheBlocks) {
+        IDB_ASYNC.cache.delete(IDB_ASYNC.cache.keys().next().value);
+      }
+    },
+
+    // Drops the cached blocks of `node` starting at block `from`.
+    cacheDrop: function(node, from) {
+      let prefix = node.fileId + ':';
+      let stale = [];
+      IDB_ASYNC.cache.forEach((block, key) => {
+        if (key.startsWith(prefix) && Number(key.substring(prefix.length)) >= from) {
+          stale.push(key);
+        }
+      });
+      stale.forEach((key) => IDB_ASYNC.cache.delete(key));
+    },
+
+    // Returns blocks `first` to `last` of a file. Dirty and cached blocks are
+    // served from memory, the others are fetched in a single transaction.
+    // Blocks that were never written, or that lie beyond a pending truncation,
+    // read as zeros.
+    getBlocks: async function(node, first, last) {
+      let blocks = new Array(last - first + 1);
+      let missing = [];
+      for (let i = first; i <= last; i++) {
+        let block = node.dirtyBlocks.get(i) || IDB_ASYNC.cacheGet(node, i);
+        if (!block && node.truncatedBlocks >= 0 && i >= node.truncatedBlocks) {
+          block = new Uint8Array(IDB_ASYNC.blockSize);
+        }
+        if (block) {
+          blocks[i - first] = block;
+        } else {
+          missing.push(i);
+        }
+      }
+      PThreadFS.stats.idbCacheHits += blocks.length - missing.length;
+      if (missing.length > 0) {
+        let tx = node.mount.db.transaction(IDB_ASYNC.BLOCK_STORE, 'readonly');
+        let store = tx.objectStore(IDB_ASYNC.BLOCK_STORE);
+        let results = await Promise.all(missing.map(
+          (i) => IDB_ASYNC.request(store.get([node.fileId, i]))));
+        PThreadFS.stats.idbTransactions++;
+        PThreadFS.stats.idbBlockReads += missing.length;
+        for (let k = 0; k < missing.length; k++) {
+          let block = results[k] ? new Uint8Array(results[k]) : new Uint8Array(IDB_ASYNC.blockSize);
+          IDB_ASYNC.cachePut(node, missing[k], block);
+          blocks[missing[k] - first] = block;
+        }
+      }
+      return blocks;
+    },
+
+    // Writes all pending changes of a file in one transaction: the deletion of
+    // truncated blocks, every dirty block and the file's entry. Changes made
+    // while the transaction runs are left for the next flush; blocks are
+    // cloned when they are put, so later writes to them are not lost.
+    flush: async function(node) {
+      if (node.unlinked || (!node.metaDirty && node.dirtyBlocks.size === 0 && node.truncatedBlocks < 0)) {
+        return;
+      }
+      let dirtyBlocks = node.dirtyBlocks;
+      let truncatedBlocks = node.truncatedBlocks;
+      node.dirtyBlocks = new Map();
+      node.truncatedBlocks = -1;
+      node.metaDirty = false;
+      let tx = node.mount.db.transaction([IDB_ASYNC.ENTRY_STORE, IDB_ASYNC.BLOCK_STORE], 'readwrite');
+      let blockStore = tx.objectStore(IDB_ASYNC.BLOCK_STORE);
+      if (truncatedBlocks >= 0) {
+        blockStore.delete(IDB_ASYNC.blockRange(node.fileId, truncatedBlocks));
+      }
+      dirtyBlocks.forEach((block, index) => {
+        blockStore.put(block, [node.fileId, index]);
+      });
+      tx.objectStore(IDB_ASYNC.ENTRY_STORE).put(IDB_ASYNC.entryOf(node), IDB_ASYNC.storePath(node));
+      try {
+        await IDB_ASYNC.transactionDone(tx);
+      } catch (e) {
+        // Keep the changes for the next flush, behind any newer ones.
+        dirtyBlocks.forEach((block, index) => {
+          if (!node.dirtyBlocks.has(index) && (node.truncatedBlocks < 0 || index < node.truncatedBlocks)) {
+            node.dirtyBlocks.set(index, block);
+          }
+        });
+        if (truncatedBlocks >= 0 && (node.truncatedBlocks < 0 || truncatedBlocks < node.truncatedBlocks)) {
+          node.truncatedBlocks = truncatedBlocks;
+        }
+        node.metaDirty = true;
+        throw e;
+      }
+      PThreadFS.stats.idbTransactions++;
+      PThreadFS.stats.idbBlockWrites += dirtyBlocks.size;
+    },
+
+    resize: async function(node, size) {
+      let bs = IDB_ASYNC.blockSize;
+      if (size < node.usedBytes) {
+        let keep = Math.ceil(size / bs);
+        node.dirtyBlocks.forEach((block, index) => {
+          if (index >= keep) node.dirtyBlocks.delete(index);
+        });
+        IDB_ASYNC.cacheDrop(node, keep);
+        if (node.truncatedBlocks < 0 || keep < node.truncatedBlocks) {
+          node.truncatedBlocks = keep;
+        }
+        if (size % bs) {
+          // Zero the tail of the last block, so that growing the file again
+          // reads zeros.
+          let block = (await IDB_ASYNC.getBlocks(node, keep - 1, keep - 1))[0];
+          block.fill(0, size % bs);
+          node.dirtyBlocks.set(keep - 1, block);
+        }
+      }
+      node.usedBytes = size;
+      node.metaDirty = true;
+    },
+
+    /* Filesystem implementation (public interface) */
+
+    createNode: function(parent, name, mode, entry) {
+      if (!PThreadFS.isDir(mode) && !PThreadFS.isFile(mode)) {
+        throw new PThreadFS.ErrnoError({{{ cDefine('EINVAL') }}});
+      }
+      var node = PThreadFS.createNode(parent, name, mode);
+      node.node_ops = IDB_ASYNC.node_ops;
+      node.stream_ops = IDB_ASYNC.stream_ops;
+      node.timestamp = entry ? entry['timestamp'] : Date.now();
+      if (PThreadFS.isFile(mode)) {
+        node.fileId = entry ? entry['id'] : IDB_ASYNC.newFileId();
+        node.usedBytes = entry ? entry['size'] : 0;
+        node.dirtyBlocks = new Map();
+        // First block to delete on the next flush, or -1.
+        node.truncatedBlocks = -1;
+        node.metaDirty = false;
+        node.openCount = 0;
+      }
+      return node;
+    },
+
+    mount: async function(mount) {
+      if (!IDB_ASYNC.cache) {
+        IDB_ASYNC.cache = new Map();
+      }
+      mount.db = await IDB_ASYNC.openDatabase('PThreadFS-' + (mount.opts.name || 'default'));
+      return IDB_ASYNC.createNode(null, '/', {{{ cDefine('S_IFDIR') }}} | 511 /* 0777 */, null);
+    },
+
+    /* Operations on the nodes of the filesystem tree */
+
+    node_ops: {
+      getattr: async function(node) {
+        var attr = {};
+        attr.dev = 1;
+        attr.ino = node.id;
+        attr.mode = node.mode;
+        attr.nlink = 1;
+        attr.uid = 0;
+        attr.gid = 0;
+        attr.rdev = node.rdev;
+        attr.size = PThreadFS.isDir(node.mode) ? 4096 : node.usedBytes;
+        attr.atime = new Date(node.timestamp);
+        attr.mtime = new Date(node.timestamp);
+        attr.ctime = new Date(node.timestamp);
+        attr.blksize = IDB_ASYNC.blockSize;
+        attr.blocks = Math.ceil(attr.size / attr.blksize);
+        return attr;
+      },
+
+      setattr: async function(node, attr) {
+        if (attr.mode !== undefined) {
+          node.mode = attr.mode;
+        }
+        if (attr.timestamp !== undefined) {
+          node.timestamp = attr.timestamp;
+        }
+        if (PThreadFS.isDir(node.mode)) {
+          await IDB_ASYNC.putEntry(node);
+          return;
+        }
+        node.metaDirty = true;
+        if (attr.size !== undefined) {
+          await IDB_ASYNC.resize(node, attr.size);
+        }
+        // Open files are written out on fsync or close.
+        if (node.openCount === 0) {
+          await IDB_ASYNC.flush(node);
+        }
+      },
+
+      lookup: async function(parent, name) {
+        let tx = parent.mount.db.transaction(IDB_ASYNC.ENTRY_STORE, 'readonly');
+        let entry = await IDB_ASYNC.request(
+          tx.objectStore(IDB_ASYNC.ENTRY_STORE).get(IDB_ASYNC.childPath(parent, name)));
+        if (!entry) {
+          throw PThreadFS.genericErrors[{{{ cDefine('ENOENT') }}}];
+        }
+        return IDB_ASYNC.createNode(parent, name, entry['mode'], entry);
+      },
+
+      mknod: async function(parent, name, mode, dev) {
+        let node = IDB_ASYNC.createNode(parent, name, mode, null);
+        await IDB_ASYNC.putEntry(node);
+        parent.timestamp = node.timestamp;
+        return node;
+      },
+
+      rename: async function(oldNode, newDir, newName) {
+        let db = oldNode.mount.db;
+        let oldPath = IDB_ASYNC.storePath(oldNode);
+        let newPath = IDB_ASYNC.childPath(newDir, newName);
+        let target = null;
+        try {
+          target = await PThreadFS.lookupNode(newDir, newName);
+        } catch (e) {
+        }
+        if (target === oldNode) {
+          return;
+        }
+
+        // Collect the stored entry and, for directories, all entries below it.
+        let readTx = db.transaction(IDB_ASYNC.ENTRY_STORE, 'readonly');
+        let entryStore = readTx.objectStore(IDB_ASYNC.ENTRY_STORE);
+        let requests = [IDB_ASYNC.request(entryStore.get(oldPath))];
+        if (PThreadFS.isDir(oldNode.mode)) {
+          requests.push(IDB_ASYNC.request(entryStore.getAllKeys(IDB_ASYNC.descendantRange(oldPath))));
+          requests.push(IDB_ASYNC.request(entryStore.getAll(IDB_ASYNC.descendantRange(oldPath))));
+        }
+        if (target && PThreadFS.isDir(target.mode)) {
+          requests.push(IDB_ASYNC.request(entryStore.count(IDB_ASYNC.descendantRange(newPath))));
+        }
+        let results = await Promise.all(requests);
+        if (target && PThreadFS.isDir(target.mode) && results[results.length - 1] > 0) {
+          throw new PThreadFS.ErrnoError({{{ cDefine('ENOTEMPTY') }}});
+        }
+
+        let tx = db.transaction([IDB_ASYNC.ENTRY_STORE, IDB_ASYNC.BLOCK_STORE], 'readwrite');
+        let entries = tx.objectStore(IDB_ASYNC.ENTRY_STORE);
+        if (target && PThreadFS.isFile(target.mode)) {
+          tx.objectStore(IDB_ASYNC.BLOCK_STORE).delete(IDB_ASYNC.blockRange(target.fileId, 0));
+        }
+        entries.delete(oldPath);
+        entries.put(results[0] || IDB_ASYNC.entryOf(oldNode), newPath);
+        if (PThreadFS.isDir(oldNode.mode)) {
+          let keys = results[1];
+          let values = results[2];
+          for (let i = 0; i < keys.length; i++) {
+            entries.delete(keys[i]);
+            entries.put(values[i], newPath + keys[i].substring(oldPath.length));
+          }
+        }
+        await IDB_ASYNC.transactionDone(tx);
+        PThreadFS.stats.idbTransactions++;
+
+        if (target) {
+          if (PThreadFS.isFile(target.mode)) {
+            IDB_ASYNC.cacheDrop(target, 0);
+            target.dirtyBlocks = new Map();
+            target.unlinked = true;
+          }
+          PThreadFS.hashRemoveNode(target);
+        }
+        oldNode.parent.timestamp = Date.now();
+        oldNode.name = newName;
+        newDir.timestamp = oldNode.parent.timestamp;
+        oldNode.parent = newDir;
+      },
+
+      unlink: async function(parent, name) {
+        let node = await PThreadFS.lookupNode(parent, name);
+        let tx = parent.mount.db.transaction([IDB_ASYNC.ENTRY_STORE, IDB_ASYNC.BLOCK_STORE], 'readwrite');
+        tx.objectStore(IDB_ASYNC.ENTRY_STORE).delete(IDB_ASYNC.childPath(parent, name));
+        tx.objectStore(IDB_ASYNC.BLOCK_STORE).delete(IDB_ASYNC.blockRange(node.fileId, 0));
+        await IDB_ASYNC.transactionDone(tx);
+        PThreadFS.stats.idbTransactions++;
+        IDB_ASYNC.cacheDrop(node, 0);
+        // Streams that are still open keep working on the in-memory state,
+        // but nothing is written back.
+        node.dirtyBlocks = new Map();
+        node.unlinked = true;
+        parent.timestamp = Date.now();
+      },
+
+      rmdir: async function(parent, name) {
+        let path = IDB_ASYNC.childPath(parent, name);
+        let db = parent.mount.db;
+        let readTx = db.transaction(IDB_ASYNC.ENTRY_STORE, 'readonly');
+        let children = await IDB_ASYNC.request(
+          readTx.objectStore(IDB_ASYNC.ENTRY_STORE).count(IDB_ASYNC.descendantRange(path)));
+        if (children > 0) {
+          throw new PThreadFS.ErrnoError({{{ cDefine('ENOTEMPTY') }}});
+        }
+        let tx = db.transaction(IDB_ASYNC.ENTRY_STORE, 'readwrite');
+        tx.objectStore(IDB_ASYNC.ENTRY_STORE).delete(path);
+        await IDB_ASYNC.transactionDone(tx);
+        PThreadFS.stats.idbTransactions++;
+        parent.timestamp = Date.now();
+      },
+
+      readdir: async function(node) {
+        let path = IDB_ASYNC.storePath(node);
+        let prefix = path === '/' ? '/' : path + '/';
+        let tx = node.mount.db.transaction(IDB_ASYNC.ENTRY_STORE, 'readonly');
+        let keys = await IDB_ASYNC.request(
+          tx.objectStore(IDB_ASYNC.ENTRY_STORE).getAllKeys(IDB_ASYNC.descendantRange(path)));
+        let entries = ['.', '..'];
+        for (let key of keys) {
+          let name = key.substring(prefix.length);
+          // Skip deeper descendants, and the root's own entry.
+          if (name && name.indexOf('/') === -1) {
+            entries.push(name);
+          }
+        }
+        return entries;
+      },
+
+      symlink: function(parent, newName, oldPath) {
+        console.log('IDB_ASYNC error: symlink is not implemented');
+        throw new PThreadFS.ErrnoError({{{ cDefine('EXDEV') }}});
+      },
+    },
+
+    /* Operations on file streams (i.e., file handles) */
+
+    stream_ops: {
+      open: async function(stream) {
+        if (PThreadFS.isFile(stream.node.mode)) {
+          stream.node.openCount++;
+        }
+      },
+
+      close: async function(stream) {
+        if (PThreadFS.isFile(stream.node.mode)) {
+          stream.node.openCount--;
+          await IDB_ASYNC.flush(stream.node);
+        }
+      },
+
+      fsync: async function(stream) {
+        await IDB_ASYNC.flush(stream.node);
+        return 0;
+      },
+
+      read: async function(stream, buffer, offset, length, position) {
+        let node = stream.node;
+        if (position >= node.usedBytes || length === 0) {
+          return 0;
+        }
+        let size = Math.min(node.usedBytes - position, length);
+        let bs = IDB_ASYNC.blockSize;
+        let first = Math.floor(position / bs);
+        let blocks = await IDB_ASYNC.getBlocks(node, first, Math.floor((position + size - 1) / bs));
+        let done = 0;
+        while (done < size) {
+          let pos = position + done;
+          let start = pos % bs;
+          let count = Math.min(bs - start, size - done);
+          buffer.set(blocks[Math.floor(pos / bs) - first].subarray(start, start + count), offset + done);
+          done += count;
+        }
+        return size;
+      },
+
+      write: async function(stream, buffer, offset, length, position) {
+        if (length === 0) {
+          return 0;
+        }
+        let node = stream.node;
+        let bs = IDB_ASYNC.blockSize;
+        let last = Math.floor((position + length - 1) / bs);
+        for (let i = Math.floor(position / bs); i <= last; i++) {
+          let start = Math.max(position, i * bs) - i * bs;
+          let end = Math.min(position + length, (i + 1) * bs) - i * bs;
+          let block = node.dirtyBlocks.get(i);
+          if (!block) {
+            // Only partially overwritten blocks need their previous contents.
+            if ((start === 0 && end === bs) || i * bs >= node.usedBytes) {
+              block = new Uint8Array(bs);
+            } else {
+              block = (await IDB_ASYNC.getBlocks(node, i, i))[0];
+            }
+          }
+          let src = offset + i * bs + start - position;
+          block.set(buffer.subarray(src, src + end - start), start);
+          node.dirtyBlocks.set(i, block);
+          IDB_ASYNC.cachePut(node, i, block);
+        }
+        node.usedBytes = Math.max(node.usedBytes, position + length);
+        node.timestamp = Date.now();
+        node.metaDirty = true;
+        if (node.dirtyBlocks.size > IDB_ASYNC.maxDirtyBlocks) {
+          await IDB_ASYNC.flush(node);
+        }
+        return length;
+      },
+
+      allocate: async function(stream, offset, length) {
+        if (offset + length > stream.node.usedBytes) {
+          await IDB_ASYNC.resize(stream.node, offset + length);
+        }
+      },
+
+      llseek: async function(stream, offset, whence) {
+        var position = offset;
+        if (whence === {{{ cDefine('SEEK_CUR') }}}) {
+          position += stream.position;
+        } else if (whence === {{{ cDefine('SEEK_END') }}}) {
+          if (PThreadFS.isFile(stream.node.mode)) {
+            position += stream.node.usedBytes;
+          }
+        }
+        if (position < 0) {
+          throw new PThreadFS.ErrnoError({{{ cDefine('EINVAL') }}});
+        }
+        return position;
+      },
+    }
+  }
+});
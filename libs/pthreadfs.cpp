@@ -2,10 +2,14 @@
 
 #include <assert.h>
 #include <emscripten.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <wasi/api.h>
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -111,13 +115,58 @@ void sync_to_async::threadIter(void* arg) {
   work(parent->resume.get());
 }
 
-bool is_pthreadfs_file(std::string path) {
-  auto const regex = std::regex("/*" PTHREADFS_FOLDER_NAME "(/*$|/+.*)");
+__wasi_errno_t fsync_scheduler::sync(__wasi_fd_t fd) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!pending) {
+    pending = std::make_shared<batch>();
+  }
+  std::shared_ptr<batch> own = pending;
+  size_t index = own->fds.size();
+  own->fds.push_back(fd);
+
+  // Either a leader flushes our batch while we wait, or the previous flush
+  // finishes and we take over as the leader of our batch.
+  condition.wait(lock, [&]() { return own->done || !flushing; });
+  if (own->done) {
+    return own->results[index];
+  }
+  flushing = true;
+  if (gatherWindow > 0) {
+    lock.unlock();
+    std::this_thread::sleep_for(std::chrono::microseconds(gatherWindow));
+    lock.lock();
+  }
+  // Close the batch. Requests arriving from now on start the next one.
+  pending = nullptr;
+  std::vector<__wasi_fd_t> fds = own->fds;
+  lock.unlock();
+
+  std::vector<__wasi_errno_t> results(fds.size(), __WASI_ERRNO_SUCCESS);
+  g_sync_to_async_helper.invoke([&fds, &results](sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_fsync_many(fds.data(), fds.size(), results.data(), &resumeWrapper_v);
+  });
+
+  lock.lock();
+  own->results = std::move(results);
+  own->done = true;
+  flushing = false;
+  condition.notify_all();
+  return own->results[index];
+}
+
+void fsync_scheduler::set_gather_window(int microseconds) {
+  std::lock_guard<std::mutex> lock(mutex);
+  gatherWindow = microseconds > 0 ? microseconds : 0;
+}
+
+bool is_pthreadfs_file(const std::string& path) {
+  static const std::regex regex("/*" PTHREADFS_FOLDER_NAME "(/*$|/+.*)");
   return std::regex_match(path, regex);
 }
 
-bool is_pthreadfs_fd_link(std::string path) {
-  auto const regex = std::regex("^/*proc/+self/+fd/+([0-9]+)$");
+bool is_pthreadfs_fd_link(const std::string& path) {
+  static const std::regex regex("^/*proc/+self/+fd/+([0-9]+)$");
   std::smatch match;
   if (regex_match(path, match, regex)){
     char* p;
@@ -149,6 +198,7 @@ void resumeWrapper_wasi(__wasi_errno_t retVal) {
 
 // File System Access collection
 std::set<long> fsa_file_descriptors;
+std::recursive_mutex g_bridge_mutex;
 std::set<std::string> mounted_directories;
 
 // Wasi definitions
@@ -173,19 +223,33 @@ WASI_CAPI_DEF(
 }
 WASI_CAPI_DEF(fdstat_get, __wasi_fdstat_t* stat) { WASI_SYNC_TO_ASYNC(fdstat_get, stat); }
 WASI_CAPI_NOARGS_DEF(close) {
-  if (fsa_file_descriptors.count(fd) > 0) {
-    g_sync_to_async_helper.invoke([fd](emscripten::sync_to_async::Callback resume) {
-      g_resumeFct = [resume]() { (*resume)(); };
-      __fd_close_async(fd, &resumeWrapper_wasi);
-    });
-    if (resume_result_wasi == __WASI_ERRNO_SUCCESS) {
-      fsa_file_descriptors.erase(fd);
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (fsa_file_descriptors.count(fd) > 0) {
+      g_sync_to_async_helper.invoke([fd](emscripten::sync_to_async::Callback resume) {
+        g_resumeFct = [resume]() { (*resume)(); };
+        __fd_close_async(fd, &resumeWrapper_wasi);
+      });
+      if (resume_result_wasi == __WASI_ERRNO_SUCCESS) {
+        fsa_file_descriptors.erase(fd);
+      }
+      return resume_result_wasi;
     }
-    return resume_result_wasi;
   }
   return fd_close(fd);
 }
-WASI_CAPI_NOARGS_DEF(sync) { WASI_SYNC_TO_ASYNC_NOARGS(sync); }
+// fsync is routed through the scheduler so that concurrent flushes are merged.
+WASI_CAPI_NOARGS_DEF(sync) {
+  bool is_pthreadfs_fd;
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    is_pthreadfs_fd = fsa_file_descriptors.count(fd) > 0;
+  }
+  if (is_pthreadfs_fd) {
+    return g_fsync_scheduler.sync(fd);
+  }
+  return fd_sync(fd);
+}
 
 // Syscall definitions
 SYS_CAPI_DEF(open, 5, long path_ref, long flags, ...) {
@@ -196,6 +260,7 @@ SYS_CAPI_DEF(open, 5, long path_ref, long flags, ...) {
     va_start(vl, flags);
     mode_t mode = va_arg(vl, mode_t);
     va_end(vl);
+    PTHREADFS_BRIDGE_LOCK;
     SYS_SYNC_TO_ASYNC_NORETURN(open, path_ref, flags, mode);
     fsa_file_descriptors.insert(resume_result_long);
     return resume_result_long;
@@ -225,6 +290,7 @@ SYS_CAPI_DEF(rename, 38, long old_path_ref, long new_path_ref) {
 
   if (emscripten::is_pthreadfs_file(old_path)) {
     if (emscripten::is_pthreadfs_file(new_path)) {
+      PTHREADFS_BRIDGE_LOCK;
       SYS_SYNC_TO_ASYNC_NORETURN(rename, old_path_ref, new_path_ref);
       return resume_result_long;
     }
@@ -256,6 +322,7 @@ SYS_CAPI_DEF(ioctl, 54, long fd, long request, ...) {
 SYS_CAPI_DEF(readlink, 85, long path, long buf, long bufsize) {
   std::string pathname((char*)path);
   if (emscripten::is_pthreadfs_file(pathname) || emscripten::is_pthreadfs_fd_link(pathname)) {
+    PTHREADFS_BRIDGE_LOCK;
     SYS_SYNC_TO_ASYNC_NORETURN(readlink, path, buf, bufsize);
     return resume_result_long;
   }
@@ -266,7 +333,17 @@ SYS_CAPI_DEF(fchmod, 94, long fd, long mode) { SYS_SYNC_TO_ASYNC_FD(fchmod, fd,
 
 SYS_CAPI_DEF(fchdir, 133, long fd) { SYS_SYNC_TO_ASYNC_FD(fchdir, fd); }
 
-SYS_CAPI_DEF(fdatasync, 148, long fd) { SYS_SYNC_TO_ASYNC_FD(fdatasync, fd); }
+SYS_CAPI_DEF(fdatasync, 148, long fd) {
+  bool is_pthreadfs_fd;
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    is_pthreadfs_fd = fsa_file_descriptors.count(fd) > 0;
+  }
+  if (is_pthreadfs_fd) {
+    return -(long)g_fsync_scheduler.sync(fd);
+  }
+  return SYNC_JS_SYSCALL(fdatasync)(fd);
+}
 
 #if __EMSCRIPTEN_major__ > 2 || (__EMSCRIPTEN_major__==2 && __EMSCRIPTEN_tiny__ > 31)
 SYS_CAPI_DEF(truncate64, 193, long path, long low, long high) {
@@ -280,6 +357,7 @@ SYS_CAPI_DEF(ftruncate64, 194, long fd, long low, long high) {
 SYS_CAPI_DEF(truncate64, 193, long path, long zero, long low, long high) {
   std::string pathname((char*)path);
   if (emscripten::is_pthreadfs_file(pathname)) {
+    PTHREADFS_BRIDGE_LOCK;
     g_sync_to_async_helper.invoke([path, low, high](emscripten::sync_to_async::Callback resume) {
       g_resumeFct = [resume]() { (*resume)(); };
       __sys_truncate64_async(path, low, high, &resumeWrapper_l);
@@ -290,13 +368,16 @@ SYS_CAPI_DEF(truncate64, 193, long path, long zero, long low, long high) {
 }
 
 SYS_CAPI_DEF(ftruncate64, 194, long fd, long zero, long low, long high) {
-  if (fsa_file_descriptors.count(fd) > 0) {
-    g_sync_to_async_helper.invoke(
-      [fd, low, high](emscripten::sync_to_async::Callback resume) {
-        g_resumeFct = [resume]() { (*resume)(); };
-        __sys_ftruncate64_async(fd, low, high, &resumeWrapper_l);
-      });
-    return resume_result_long;
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (fsa_file_descriptors.count(fd) > 0) {
+      g_sync_to_async_helper.invoke(
+        [fd, low, high](emscripten::sync_to_async::Callback resume) {
+          g_resumeFct = [resume]() { (*resume)(); };
+          __sys_ftruncate64_async(fd, low, high, &resumeWrapper_l);
+        });
+      return resume_result_long;
+    }
   }
   return SYNC_JS_SYSCALL(ftruncate64)(fd, zero, low, high);
 }
@@ -305,6 +386,7 @@ SYS_CAPI_DEF(ftruncate64, 194, long fd, long zero, long low, long high) {
 SYS_CAPI_DEF(stat64, 195, long path, long buf) {
   std::string pathname((char*)path);
   if (emscripten::is_pthreadfs_file(pathname)) {
+    PTHREADFS_BRIDGE_LOCK;
     g_sync_to_async_helper.invoke([path, buf](emscripten::sync_to_async::Callback resume) {
       g_resumeFct = [resume]() { (*resume)(); };
       __sys_stat64_async(path, buf, &resumeWrapper_l);
@@ -318,6 +400,7 @@ SYS_CAPI_DEF(lstat64, 196, long path, long buf) {
   printf("cpp lstat64\n");
   std::string pathname((char*)path);
   if (emscripten::is_pthreadfs_file(pathname)) {
+    PTHREADFS_BRIDGE_LOCK;
     g_sync_to_async_helper.invoke([path, buf](emscripten::sync_to_async::Callback resume) {
       g_resumeFct = [resume]() { (*resume)(); };
       __sys_lstat64_async(path, buf, &resumeWrapper_l);
@@ -328,12 +411,15 @@ SYS_CAPI_DEF(lstat64, 196, long path, long buf) {
 }
 
 SYS_CAPI_DEF(fstat64, 197, long fd, long buf) {
-  if (fsa_file_descriptors.count(fd) > 0) {
-    g_sync_to_async_helper.invoke([fd, buf](emscripten::sync_to_async::Callback resume) {
-      g_resumeFct = [resume]() { (*resume)(); };
-      __sys_fstat64_async(fd, buf, &resumeWrapper_l);
-    });
-    return resume_result_long;
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (fsa_file_descriptors.count(fd) > 0) {
+      g_sync_to_async_helper.invoke([fd, buf](emscripten::sync_to_async::Callback resume) {
+        g_resumeFct = [resume]() { (*resume)(); };
+        __sys_fstat64_async(fd, buf, &resumeWrapper_l);
+      });
+      return resume_result_long;
+    }
   }
   return SYNC_JS_SYSCALL(fstat64)(fd, buf);
 }
@@ -355,21 +441,36 @@ SYS_CAPI_DEF(getdents64, 220, long fd, long dirp, long count) {
 }
 
 SYS_CAPI_DEF(fcntl64, 221, long fd, long cmd, ...) {
-
-  if (fsa_file_descriptors.count(fd) > 0) {
-    // varargs are currently unused by __sys_fcntl64_async.
-    va_list vl;
-    va_start(vl, cmd);
-    int varargs = va_arg(vl, int);
-    va_end(vl);
-    g_sync_to_async_helper.invoke([fd, cmd, varargs](emscripten::sync_to_async::Callback resume) {
-      g_resumeFct = [resume]() { (*resume)(); };
-      __sys_fcntl64_async(fd, cmd, varargs, &resumeWrapper_l);
-    });
-    return resume_result_long;
-  }
+  // fcntl64_async reads its argument through the varargs pointer. The argument is
+  // an int, or a pointer such as the struct flock of the locking commands.
   va_list vl;
   va_start(vl, cmd);
+  int arg = va_arg(vl, int);
+  va_end(vl);
+  int varargs = (int)(intptr_t)&arg;
+  // F_SETLKW retries F_SETLK without holding the bridge, so that other threads
+  // can use PThreadFS while a lock held by another context is awaited.
+  long async_cmd = cmd == F_SETLKW ? F_SETLK : cmd;
+  int backoff = 1;
+  while (true) {
+    {
+      PTHREADFS_BRIDGE_LOCK;
+      if (fsa_file_descriptors.count(fd) == 0) {
+        break;
+      }
+      g_sync_to_async_helper.invoke(
+        [fd, async_cmd, varargs](emscripten::sync_to_async::Callback resume) {
+          g_resumeFct = [resume]() { (*resume)(); };
+          __sys_fcntl64_async(fd, async_cmd, varargs, &resumeWrapper_l);
+        });
+      if (cmd != F_SETLKW || resume_result_long != -EAGAIN) {
+        return resume_result_long;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+    backoff = std::min(backoff * 2, 64);
+  }
+  va_start(vl, cmd);
   long res = SYNC_JS_SYSCALL(fcntl64)(fd, cmd, (int)vl);
   va_end(vl);
   return res;
@@ -388,9 +489,68 @@ SYS_CAPI_DEF(
   SYS_SYNC_TO_ASYNC_FD(fallocate, fd, mode, off_low, off_high, len_low, len_high);
 }
 
+// Must be called with the bridge lock held.
+static bool is_pthreadfs_at(long dirfd, long path_ref) {
+  const char* path = (const char*)path_ref;
+  if (path[0] == '/') {
+    return emscripten::is_pthreadfs_file(path);
+  }
+  return fsa_file_descriptors.count(dirfd) > 0;
+}
+
+SYS_CAPI_DEF(openat, 295, long dirfd, long path, long flags, ...) {
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (is_pthreadfs_at(dirfd, path)) {
+      // openat_async reads the mode through the varargs pointer.
+      int mode = 0;
+      if (flags & O_CREAT) {
+        va_list vl;
+        va_start(vl, flags);
+        mode = va_arg(vl, int);
+        va_end(vl);
+      }
+      int varargs = (int)(intptr_t)&mode;
+      SYS_SYNC_TO_ASYNC_NORETURN(openat, dirfd, path, flags, varargs);
+      if (resume_result_long >= 0) {
+        fsa_file_descriptors.insert(resume_result_long);
+      }
+      return resume_result_long;
+    }
+  }
+  va_list vl;
+  va_start(vl, flags);
+  long res = SYNC_JS_SYSCALL(openat)(dirfd, path, flags, (int)vl);
+  va_end(vl);
+  return res;
+}
+
+SYS_CAPI_DEF(unlinkat, 301, long dirfd, long path, long flags) {
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (is_pthreadfs_at(dirfd, path)) {
+      SYS_SYNC_TO_ASYNC_NORETURN(unlinkat, dirfd, path, flags);
+      return resume_result_long;
+    }
+  }
+  return SYNC_JS_SYSCALL(unlinkat)(dirfd, path, flags);
+}
+
+SYS_CAPI_DEF(faccessat, 307, long dirfd, long path, long amode, long flags) {
+  {
+    PTHREADFS_BRIDGE_LOCK;
+    if (is_pthreadfs_at(dirfd, path)) {
+      SYS_SYNC_TO_ASYNC_NORETURN(faccessat, dirfd, path, amode, flags);
+      return resume_result_long;
+    }
+  }
+  return SYNC_JS_SYSCALL(faccessat)(dirfd, path, amode, flags);
+}
+
 long utime(long path_ref, long times) {
   std::string path((char*)path_ref);
   if (emscripten::is_pthreadfs_file(path)) {
+    PTHREADFS_BRIDGE_LOCK;
     g_sync_to_async_helper.invoke(
       [path_ref, times](emscripten::sync_to_async::Callback resume) {
         g_resumeFct = [resume]() { (*resume)(); };
@@ -404,6 +564,7 @@ long utime(long path_ref, long times) {
 // Define global variables to be populated by resume;
 std::function<void()> g_resumeFct;
 emscripten::sync_to_async g_sync_to_async_helper __attribute__((init_priority(102)));
+emscripten::fsync_scheduler g_fsync_scheduler;
 
 // Other helper code
 
@@ -427,3 +588,54 @@ void pthreadfs_load_package(const char* package_path) {
     // clang-format on
   });
 }
+
+void pthreadfs_print_stats() {
+  g_sync_to_async_helper.invoke([](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    // clang-format off
+    EM_ASM({
+      PThreadFS.printStats();
+      wasmTable.get($0)();
+    }, &resumeWrapper_v);
+    // clang-format on
+  });
+}
+
+void pthreadfs_set_fsync_gather_window(int microseconds) {
+  g_fsync_scheduler.set_gather_window(microseconds);
+}
+
+void pthreadfs_set_relaxed_durability(const char* path, int delay_ms) {
+  g_sync_to_async_helper.invoke([path, delay_ms](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_durability_set(path, delay_ms, &resumeWrapper_v);
+  });
+}
+
+static void get_epochs(double* epochs) {
+  g_sync_to_async_helper.invoke([epochs](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_durability_epochs(epochs, &resumeWrapper_v);
+  });
+}
+
+double pthreadfs_current_epoch() {
+  double epochs[2];
+  get_epochs(epochs);
+  return epochs[0];
+}
+
+double pthreadfs_durable_epoch() {
+  double epochs[2];
+  get_epochs(epochs);
+  return epochs[1];
+}
+
+long pthreadfs_wait_durable(double epoch) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke([epoch](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_durability_wait(epoch, &resumeWrapper_l);
+  });
+  return resume_result_long;
+}
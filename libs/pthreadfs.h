@@ -6,10 +6,14 @@
 #include <emscripten/threading.h>
 #include <pthread.h>
 
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <thread>
 #include <utility>
+#include <vector>
 #include <wasi/api.h>
 
 // The following macros convert the PTHREADFS_FOLDER to a string that can be used by C++
@@ -45,6 +49,13 @@ EM_IMPORT(__syscall_##name)  long SYNC_JS_SYSCALL(name)(__VA_ARGS__);
   });
 // clang-format on
 
+// Results of invoke() are passed back through the resume_result_* globals, and
+// the set of PThreadFS file descriptors is shared by all threads. The bridge
+// lock is held from the descriptor check until the result has been read, so
+// that concurrent callers cannot observe each other's results.
+#define PTHREADFS_BRIDGE_LOCK                                                                      \
+  std::lock_guard<std::recursive_mutex> bridgeLock(g_bridge_mutex)
+
 #define WASI_JSAPI_DEF(name, ...)                                                                  \
   extern void __fd_##name##_async(__wasi_fd_t fd, __VA_ARGS__, void (*fun)(__wasi_errno_t));       \
   __attribute__((__import_module__("wasi_snapshot_preview1"), __import_name__(QUOTE(fd_##name))))  \
@@ -58,21 +69,28 @@ EM_IMPORT(__syscall_##name)  long SYNC_JS_SYSCALL(name)(__VA_ARGS__);
 #define WASI_CAPI_NOARGS_DEF(name) __wasi_errno_t __wasi_fd_##name(__wasi_fd_t fd)
 
 #define WASI_SYNC_TO_ASYNC(name, ...)                                                              \
-  if (fsa_file_descriptors.count(fd) > 0) {                                                        \
-    g_sync_to_async_helper.invoke([fd, __VA_ARGS__](emscripten::sync_to_async::Callback resume) {  \
-      g_resumeFct = [resume]() { (*resume)(); };                                                   \
-      __fd_##name##_async(fd, __VA_ARGS__, &resumeWrapper_wasi);                                   \
-    });                                                                                            \
-    return resume_result_wasi;                                                                     \
+  {                                                                                                \
+    PTHREADFS_BRIDGE_LOCK;                                                                         \
+    if (fsa_file_descriptors.count(fd) > 0) {                                                      \
+      g_sync_to_async_helper.invoke(                                                               \
+        [fd, __VA_ARGS__](emscripten::sync_to_async::Callback resume) {                            \
+          g_resumeFct = [resume]() { (*resume)(); };                                               \
+          __fd_##name##_async(fd, __VA_ARGS__, &resumeWrapper_wasi);                               \
+        });                                                                                        \
+      return resume_result_wasi;                                                                   \
+    }                                                                                              \
   }                                                                                                \
   return fd_##name(fd, __VA_ARGS__);
 #define WASI_SYNC_TO_ASYNC_NOARGS(name)                                                            \
-  if (fsa_file_descriptors.count(fd) > 0) {                                                        \
-    g_sync_to_async_helper.invoke([fd](emscripten::sync_to_async::Callback resume) {               \
-      g_resumeFct = [resume]() { (*resume)(); };                                                   \
-      __fd_##name##_async(fd, &resumeWrapper_wasi);                                                \
-    });                                                                                            \
-    return resume_result_wasi;                                                                     \
+  {                                                                                                \
+    PTHREADFS_BRIDGE_LOCK;                                                                         \
+    if (fsa_file_descriptors.count(fd) > 0) {                                                      \
+      g_sync_to_async_helper.invoke([fd](emscripten::sync_to_async::Callback resume) {             \
+        g_resumeFct = [resume]() { (*resume)(); };                                                 \
+        __fd_##name##_async(fd, &resumeWrapper_wasi);                                              \
+      });                                                                                          \
+      return resume_result_wasi;                                                                   \
+    }                                                                                              \
   }                                                                                                \
   return fd_##name(fd);
 
@@ -96,17 +114,21 @@ EM_IMPORT(__syscall_##name)  long SYNC_JS_SYSCALL(name)(__VA_ARGS__);
     SYS_JSAPI(name, __VA_ARGS__, &resumeWrapper_l);                                                \
   });
 #define SYS_SYNC_TO_ASYNC_FD(name, ...)                                                            \
-  if (fsa_file_descriptors.count(fd) > 0) {                                                        \
-    g_sync_to_async_helper.invoke([__VA_ARGS__](emscripten::sync_to_async::Callback resume) {      \
-      g_resumeFct = [resume]() { (*resume)(); };                                                   \
-      __sys_##name##_async(__VA_ARGS__, &resumeWrapper_l);                                         \
-    });                                                                                            \
-    return resume_result_long;                                                                     \
+  {                                                                                                \
+    PTHREADFS_BRIDGE_LOCK;                                                                         \
+    if (fsa_file_descriptors.count(fd) > 0) {                                                      \
+      g_sync_to_async_helper.invoke([__VA_ARGS__](emscripten::sync_to_async::Callback resume) {    \
+        g_resumeFct = [resume]() { (*resume)(); };                                                 \
+        __sys_##name##_async(__VA_ARGS__, &resumeWrapper_l);                                       \
+      });                                                                                          \
+      return resume_result_long;                                                                   \
+    }                                                                                              \
   }                                                                                                \
   return SYNC_JS_SYSCALL(name)(__VA_ARGS__);
 #define SYS_SYNC_TO_ASYNC_PATH(name, ...)                                                          \
   std::string pathname((char*)path);                                                               \
   if (emscripten::is_pthreadfs_file(pathname)) {                                                   \
+    PTHREADFS_BRIDGE_LOCK;                                                                         \
     g_sync_to_async_helper.invoke([__VA_ARGS__](emscripten::sync_to_async::Callback resume) {      \
       g_resumeFct = [resume]() { (*resume)(); };                                                   \
       __sys_##name##_async(__VA_ARGS__, &resumeWrapper_l);                                         \
@@ -119,8 +141,47 @@ extern "C" {
 // Helpers
 extern void pthreadfs_init(const char* folder, void (*fun)(void));
 void pthreadfs_load_package(const char* path_to_package);
+void pthreadfs_print_stats();
+// Sets how long (in microseconds) the first of several concurrent fsync calls
+// waits for others to join its flush pass. The default of 0 only merges
+// requests that arrive while a previous flush is still running.
+void pthreadfs_set_fsync_gather_window(int microseconds);
+// Relaxed durability: fsync() of files at or below `path` (a directory, such as
+// PTHREADFS_FOLDER, or a database file, which includes its -journal and -wal
+// files) returns without flushing, and the files are flushed by a background
+// pass at most `delay_ms` milliseconds later. A negative delay restores flushing
+// fsync() for `path`. Batch-atomic commits of the PThreadFS VFS still flush their
+// -batch log before they write the database, so a crash cannot tear it.
+void pthreadfs_set_relaxed_durability(const char* path, int delay_ms);
+// Each background pass makes one epoch durable: all fsync() calls made before it
+// started. Returns the epoch that covers the fsync() calls made so far.
+double pthreadfs_current_epoch();
+// Returns the newest durable epoch.
+double pthreadfs_durable_epoch();
+// Blocks until `epoch` is durable, starting a flush pass right away if needed.
+// Returns 0, or a negative errno if a file could not be flushed.
+long pthreadfs_wait_durable(double epoch);
+extern void pthreadfs_durability_set(const char* path, long delay, void (*fun)(void));
+extern void pthreadfs_durability_epochs(double* epochs, void (*fun)(void));
+extern void pthreadfs_durability_wait(double epoch, void (*fun)(long));
+extern void pthreadfs_fsync_many(
+  const __wasi_fd_t* fds, size_t count, __wasi_errno_t* results, void (*fun)(void));
 void emscripten_init_pthreadfs();
 
+// Direct file access used by the SQLite VFS in pthreadfs_vfs.cpp. Each call is a
+// single bridge crossing; results are passed to `fun`, negative values being
+// errno codes. Offsets and sizes are passed as doubles.
+extern void pthreadfs_vfs_read(long fd, void* buf, long amount, double offset, void (*fun)(long));
+extern void pthreadfs_vfs_write(
+  long fd, const void* buf, long amount, double offset, void (*fun)(long));
+extern void pthreadfs_vfs_truncate(long fd, double size, void (*fun)(long));
+extern void pthreadfs_vfs_size(long fd, double* size, void (*fun)(long));
+extern void pthreadfs_vfs_access(const char* path, long flags, void (*fun)(long));
+// Batch-atomic commits: see the descriptions in library_pthreadfs.js.
+extern void pthreadfs_vfs_batch_commit(
+  long fd, long batchFd, const void* records, long size, void (*fun)(long));
+extern void pthreadfs_vfs_batch_recover(long fd, long batchFd, void (*fun)(long));
+
 // WASI
 WASI_JSAPI_DEF(write, const __wasi_ciovec_t* iovs, size_t iovs_len, __wasi_size_t* nwritten)
 WASI_JSAPI_DEF(read, const __wasi_iovec_t* iovs, size_t iovs_len, __wasi_size_t* nread)
@@ -233,6 +294,19 @@ SYS_CAPI_DEF(
 SYS_JSAPI_DEF(
   fallocate, long fd, long mode, long off_low, long off_high, long len_low, long len_high)
 
+// The *at syscalls go to PThreadFS if `dirfd` is an open PThreadFS directory or
+// if `path` is an absolute path inside PTHREADFS_FOLDER. Opening a directory
+// once and passing single names relative to it avoids resolving the full path
+// on every call.
+SYS_CAPI_DEF(openat, 295, long dirfd, long path, long flags, ...);
+SYS_JSAPI_DEF(openat, long dirfd, long path, long flags, int varargs)
+
+SYS_CAPI_DEF(unlinkat, 301, long dirfd, long path, long flags);
+SYS_JSAPI_DEF(unlinkat, long dirfd, long path, long flags)
+
+SYS_CAPI_DEF(faccessat, 307, long dirfd, long path, long amode, long flags);
+SYS_JSAPI_DEF(faccessat, long dirfd, long path, long amode, long flags)
+
 // Emscripten implements utime directly through library.js. We copy that code 
 // to utime_sync in order to avoid name confusion. utime_async proxies the
 // calls to the IO thread.
@@ -311,17 +385,55 @@ private:
   static void threadIter(void* arg);
 };
 
+// Merges fsync requests that are issued concurrently by several threads into a
+// single flush pass on the sync_to_async helper thread. A caller that finds no
+// flush running becomes the leader of the pending batch: it waits for the
+// gather window, closes the batch and flushes every descriptor in it, flushing
+// descriptors that share an access handle only once. Callers arriving while a
+// flush runs join the next batch and are all released when it completes.
+class fsync_scheduler {
+public:
+  // Flushes `fd`. Blocks until a flush pass that started after this call has
+  // completed, and returns that pass's result for `fd`.
+  __wasi_errno_t sync(__wasi_fd_t fd);
+
+  void set_gather_window(int microseconds);
+
+private:
+  struct batch {
+    std::vector<__wasi_fd_t> fds;
+    std::vector<__wasi_errno_t> results;
+    bool done = false;
+  };
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  // The batch that new requests join. Reset by its leader once flushing starts.
+  std::shared_ptr<batch> pending;
+  bool flushing = false;
+  int gatherWindow = 0;
+};
+
 // Determines if `path` is a file in the special folder PTHREADFS_FOLDER.
-bool is_pthreadfs_file(std::string path);
+bool is_pthreadfs_file(const std::string& path);
 // Determines is `path` is a symlink in self/proc/fd/ that corresponds to a file in
 // PTHREADFS_FOLDER.
-bool is_pthreadfs_fd_link(std::string path);
+bool is_pthreadfs_fd_link(const std::string& path);
 
 } // namespace emscripten
 
 // Declare global variables to be populated by resume;
 extern std::function<void()> g_resumeFct;
 extern emscripten::sync_to_async g_sync_to_async_helper;
+extern emscripten::fsync_scheduler g_fsync_scheduler;
+extern std::recursive_mutex g_bridge_mutex;
+
+// File descriptors that belong to PThreadFS. Guarded by g_bridge_mutex.
+extern std::set<long> fsa_file_descriptors;
+
+// Return values set by the resume wrappers below. Guarded by g_bridge_mutex.
+extern long resume_result_long;
+extern __wasi_errno_t resume_result_wasi;
 
 // Static functions calling resumFct and setting corresponding the return value.
 void resumeWrapper_v();
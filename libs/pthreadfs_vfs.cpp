@@ -0,0 +1,1216 @@
+#include "pthreadfs_vfs.h"
+
+#include "pthreadfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Built against either libs/sqlite3.h or libs/sqlite_js/sqlite3.h, depending on
+// the include path.
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// xFetch and xUnfetch are part of version 3 of sqlite3_io_methods.
+#if SQLITE_VERSION_NUMBER >= 3007017
+#define PTHREADFS_VFS_MMAP 1
+#else
+#define PTHREADFS_VFS_MMAP 0
+#endif
+
+// SQLITE_IOCAP_BATCH_ATOMIC and the *_ATOMIC_WRITE file controls were added in
+// SQLite 3.21.0. SQLite only uses them when built with
+// SQLITE_ENABLE_BATCH_ATOMIC_WRITE.
+#if SQLITE_VERSION_NUMBER >= 3021000
+#define PTHREADFS_VFS_BATCH 1
+#else
+#define PTHREADFS_VFS_BATCH 0
+#endif
+
+// SQLite's unix VFS reaches PThreadFS through libc, which adds lseek, fstat and
+// fcntl calls and a path check to every read and write. The VFS below keeps the
+// PThreadFS descriptor of each database file and maps xRead, xWrite, xSync,
+// xFileSize and xTruncate onto single bridge calls. xFetch is served from a
+// mirror of the file in wasm memory, and the WAL index lives in wasm memory as
+// well. Main database files support batch-atomic writes, so SQLite can commit a
+// transaction without a rollback journal. Temporary files never reach PThreadFS
+// unless they outgrow their memory budget. Opening, closing and deleting files still go through libc, so
+// descriptors remain visible to the rest of pthreadfs.cpp.
+
+namespace {
+
+// State shared by all connections that have the same file open. Lock state
+// follows the unix VFS: `level` and `readers` arbitrate between the connections
+// of the module, and the module as a whole holds fcntl() locks on SQLite's lock
+// bytes, which PThreadFS makes visible to other instances of the module through
+// Web Locks. As with POSIX locks, closing any descriptor of the file would drop
+// them, so descriptors closed while the module holds a lock wait in `closeFds`.
+//
+// With `PRAGMA mmap_size`, xFetch hands out pointers into `mirror`, a copy of
+// the first `mirrorSize` bytes of the file in (shared) wasm memory. Writes and
+// truncations through this VFS update the mirror, so all connections of the
+// module see the same pages. The mirror is only reallocated while no fetched
+// page is outstanding.
+//
+// In WAL mode, the wal-index regions are allocated here instead of in a -shm
+// file, and every pthread of the module maps the same memory. Each of the
+// SQLITE_SHM_NLOCK shm locks is an atomic counter: the number of shared
+// holders, or -1 while held exclusively. Like the byte-range locks of the unix
+// VFS, they never block. The regions are freed once the last connection has
+// unmapped them, and SQLite rebuilds the index from the WAL on the next open.
+// Other instances of the module cannot see the index, so while it is mapped the
+// module holds a write lock on a dead-man switch byte of the database file, as
+// unixShmMap() does on the -shm file, and other instances fail to map theirs.
+struct vfs_shared {
+  int refs = 0;
+  int readers = 0;
+  int level = SQLITE_LOCK_NONE;
+  std::vector<long> closeFds;
+  char* mirror = nullptr;
+  sqlite3_int64 mirrorSize = 0;
+  int fetchRefs = 0;
+  std::vector<char*> shmRegions;
+  int shmRefs = 0;
+  std::atomic<int> shmLocks[SQLITE_SHM_NLOCK] = {};
+};
+
+// Writes staged between SQLITE_FCNTL_BEGIN_ATOMIC_WRITE and
+// SQLITE_FCNTL_COMMIT_ATOMIC_WRITE, encoded as they are stored in the -batch
+// file: an 8-byte double offset, a 4-byte length and the data. A negative length
+// truncates the file to the offset.
+struct vfs_batch {
+  struct staged {
+    sqlite3_int64 offset;
+    int amount;
+    // Position of the data in `records`, or -1 for a truncation.
+    long pos;
+  };
+  std::vector<staged> writes;
+  std::vector<char> records;
+
+  void add(sqlite3_int64 offset, const void* data, int amount) {
+    double header = (double)offset;
+    size_t pos = records.size();
+    records.resize(pos + 12 + std::max(amount, 0));
+    memcpy(&records[pos], &header, 8);
+    memcpy(&records[pos + 8], &amount, 4);
+    if (amount > 0) {
+      memcpy(&records[pos + 12], data, amount);
+    }
+    writes.push_back({offset, amount, amount < 0 ? -1 : (long)pos + 12});
+  }
+};
+
+struct vfs_file {
+  sqlite3_file base;
+  long fd;
+  int level;
+  int deleteOnClose;
+  // Valid until xClose, as guaranteed by SQLite.
+  const char* path;
+  // Points into g_vfs_files, whose nodes are stable.
+  vfs_shared* shared;
+  // Limit set through SQLITE_FCNTL_MMAP_SIZE. 0 disables xFetch.
+  sqlite3_int64 mmapSizeMax;
+  // Whether this connection has mapped the wal-index, and which shm locks it
+  // holds, one bit per lock.
+  int shmMapped;
+  unsigned shmShared;
+  unsigned shmExclusive;
+  // Whether this is a main database file opened for writing, the descriptor of
+  // its -batch file or -1, and the open batch-atomic transaction, if any.
+  int batchAtomic;
+  long batchFd;
+  vfs_batch* batch;
+};
+
+void shm_free_regions(vfs_shared* shared) {
+  for (char* region : shared->shmRegions) {
+    free(region);
+  }
+  shared->shmRegions.clear();
+}
+
+// Guards g_vfs_files and the vfs_shared entries.
+std::mutex g_vfs_mutex;
+std::map<std::string, vfs_shared> g_vfs_files;
+
+sqlite3_vfs* g_base_vfs = nullptr;
+sqlite3_vfs g_vfs;
+
+long bridge_read(long fd, void* buf, int amount, sqlite3_int64 offset) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke(
+    [fd, buf, amount, offset](emscripten::sync_to_async::Callback resume) {
+      g_resumeFct = [resume]() { (*resume)(); };
+      pthreadfs_vfs_read(fd, buf, amount, (double)offset, &resumeWrapper_l);
+    });
+  return resume_result_long;
+}
+
+long bridge_write(long fd, const void* buf, int amount, sqlite3_int64 offset) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke(
+    [fd, buf, amount, offset](emscripten::sync_to_async::Callback resume) {
+      g_resumeFct = [resume]() { (*resume)(); };
+      pthreadfs_vfs_write(fd, buf, amount, (double)offset, &resumeWrapper_l);
+    });
+  return resume_result_long;
+}
+
+long bridge_truncate(long fd, sqlite3_int64 size) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke([fd, size](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_vfs_truncate(fd, (double)size, &resumeWrapper_l);
+  });
+  return resume_result_long;
+}
+
+long bridge_size(long fd, double* size) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke([fd, size](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_vfs_size(fd, size, &resumeWrapper_l);
+  });
+  return resume_result_long;
+}
+
+long bridge_batch_commit(long fd, long batchFd, const void* records, long size) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke(
+    [fd, batchFd, records, size](emscripten::sync_to_async::Callback resume) {
+      g_resumeFct = [resume]() { (*resume)(); };
+      pthreadfs_vfs_batch_commit(fd, batchFd, records, size, &resumeWrapper_l);
+    });
+  return resume_result_long;
+}
+
+long bridge_batch_recover(long fd, long batchFd) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke([fd, batchFd](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_vfs_batch_recover(fd, batchFd, &resumeWrapper_l);
+  });
+  return resume_result_long;
+}
+
+long bridge_access(const char* path, int flags) {
+  PTHREADFS_BRIDGE_LOCK;
+  g_sync_to_async_helper.invoke([path, flags](emscripten::sync_to_async::Callback resume) {
+    g_resumeFct = [resume]() { (*resume)(); };
+    pthreadfs_vfs_access(path, flags, &resumeWrapper_l);
+  });
+  return resume_result_long;
+}
+
+int vfs_unlock(sqlite3_file* pFile, int eLock);
+
+int vfs_close(sqlite3_file* pFile) {
+  vfs_file* p = (vfs_file*)pFile;
+  vfs_unlock(pFile, SQLITE_LOCK_NONE);
+  std::vector<long> closeFds;
+  {
+    std::lock_guard<std::mutex> lock(g_vfs_mutex);
+    if (--p->shared->refs == 0) {
+      closeFds.swap(p->shared->closeFds);
+      free(p->shared->mirror);
+      shm_free_regions(p->shared);
+      g_vfs_files.erase(p->path);
+    } else if (p->shared->level != SQLITE_LOCK_NONE || p->shared->shmRefs > 0) {
+      // Closed by close_deferred_fds() once the module's locks are released.
+      p->shared->closeFds.push_back(p->fd);
+      p->fd = -1;
+    }
+  }
+  for (long fd : closeFds) {
+    close(fd);
+  }
+  delete p->batch;
+  if (p->batchFd >= 0) {
+    close(p->batchFd);
+  }
+  int rc = p->fd < 0 || close(p->fd) == 0 ? SQLITE_OK : SQLITE_IOERR_CLOSE;
+  // Access handles keep OPFS files from being removed while they are open, so
+  // temporary files are deleted after closing rather than right after opening.
+  if (p->deleteOnClose) {
+    unlink(p->path);
+  }
+  return rc;
+}
+
+int vfs_read(sqlite3_file* pFile, void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  vfs_file* p = (vfs_file*)pFile;
+  long res = bridge_read(p->fd, zBuf, iAmt, iOfst);
+  if (res < 0) {
+    return SQLITE_IOERR_READ;
+  }
+  if (p->batch != nullptr) {
+    // SQLite does not read during a batch, but staged writes are visible anyway.
+    for (const vfs_batch::staged& w : p->batch->writes) {
+      sqlite3_int64 start = std::max(iOfst, w.offset);
+      sqlite3_int64 end = std::min(iOfst + iAmt, w.offset + w.amount);
+      if (start < end) {
+        memcpy((char*)zBuf + (start - iOfst), &p->batch->records[w.pos + (start - w.offset)],
+          end - start);
+        res = std::max<long>(res, end - iOfst);
+      }
+    }
+  }
+  if (res < iAmt) {
+    // SQLite requires the unread part of the buffer to be zeroed.
+    memset((char*)zBuf + res, 0, iAmt - res);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+int vfs_write(sqlite3_file* pFile, const void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  vfs_file* p = (vfs_file*)pFile;
+  if (p->batch != nullptr) {
+    p->batch->add(iOfst, zBuf, iAmt);
+    return SQLITE_OK;
+  }
+  long res = bridge_write(p->fd, zBuf, iAmt, iOfst);
+  if (res == -ENOSPC) {
+    return SQLITE_FULL;
+  }
+  if (res != iAmt) {
+    return SQLITE_IOERR_WRITE;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* shared = p->shared;
+  if (iOfst < shared->mirrorSize) {
+    sqlite3_int64 n = std::min<sqlite3_int64>(iAmt, shared->mirrorSize - iOfst);
+    memcpy(shared->mirror + iOfst, zBuf, n);
+  }
+  return SQLITE_OK;
+}
+
+int vfs_truncate(sqlite3_file* pFile, sqlite3_int64 size) {
+  vfs_file* p = (vfs_file*)pFile;
+  if (p->batch != nullptr) {
+    p->batch->add(size, nullptr, -1);
+    return SQLITE_OK;
+  }
+  if (bridge_truncate(p->fd, size) != 0) {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  if (p->shared->mirrorSize > size) {
+    p->shared->mirrorSize = size;
+  }
+  return SQLITE_OK;
+}
+
+int vfs_sync(sqlite3_file* pFile, int flags) {
+  vfs_file* p = (vfs_file*)pFile;
+  // Goes through the scheduler so that syncs of concurrent connections share a
+  // flush pass.
+  return g_fsync_scheduler.sync(p->fd) == __WASI_ERRNO_SUCCESS ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+}
+
+int vfs_file_size(sqlite3_file* pFile, sqlite3_int64* pSize) {
+  vfs_file* p = (vfs_file*)pFile;
+  double size = 0;
+  if (bridge_size(p->fd, &size) != 0) {
+    return SQLITE_IOERR_FSTAT;
+  }
+  *pSize = (sqlite3_int64)size;
+  if (p->batch != nullptr) {
+    for (const vfs_batch::staged& w : p->batch->writes) {
+      *pSize = w.amount < 0 ? w.offset : std::max(*pSize, w.offset + w.amount);
+    }
+  }
+  return SQLITE_OK;
+}
+
+// SQLite's lock bytes, as in os.c. The pending byte is only moved by tests.
+constexpr off_t kPendingByte = 0x40000000;
+constexpr off_t kReservedByte = kPendingByte + 1;
+constexpr off_t kSharedFirst = kPendingByte + 2;
+constexpr off_t kSharedSize = 510;
+// Held while the module has the wal-index mapped. Not one of SQLite's lock
+// bytes, which only matters to other users of this VFS.
+constexpr off_t kShmDmsByte = kSharedFirst + kSharedSize;
+
+// Sets the fcntl() lock `type` on `len` bytes at `start` of the file of `p`.
+// Returns SQLITE_BUSY if another instance of the module holds a conflicting
+// lock, or `ioerr`.
+int range_lock(vfs_file* p, short type, off_t start, off_t len, int ioerr) {
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+  if (fcntl(p->fd, F_SETLK, &fl) == 0) {
+    return SQLITE_OK;
+  }
+  return errno == EAGAIN || errno == EACCES ? SQLITE_BUSY : ioerr;
+}
+
+// Closes the descriptors of `state`'s file that vfs_close() kept open, once the
+// module holds no more locks on the file. Must be called with g_vfs_mutex held.
+void close_deferred_fds(vfs_shared* state) {
+  if (state->level != SQLITE_LOCK_NONE || state->shmRefs > 0) {
+    return;
+  }
+  for (long fd : state->closeFds) {
+    close(fd);
+  }
+  state->closeFds.clear();
+}
+
+// Lock transitions follow unixLock() and unixUnlock(). `level` of the shared
+// state is the strongest lock held by any connection, `readers` is the number of
+// connections holding at least a SHARED lock. The module's fcntl() locks follow
+// `level`.
+int vfs_lock(sqlite3_file* pFile, int eLock) {
+  vfs_file* p = (vfs_file*)pFile;
+  if (p->level >= eLock) {
+    return SQLITE_OK;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* state = p->shared;
+  // Another connection holds a PENDING or stronger lock, or we want more than
+  // SHARED while another connection holds RESERVED or stronger.
+  if (state->level != p->level &&
+      (state->level >= SQLITE_LOCK_PENDING || eLock > SQLITE_LOCK_SHARED)) {
+    return SQLITE_BUSY;
+  }
+  int rc = SQLITE_OK;
+  if (eLock == SQLITE_LOCK_SHARED) {
+    if (state->level == SQLITE_LOCK_NONE) {
+      // The pending byte is read-locked while the shared range is taken, so that
+      // no new reader gets in while another instance holds PENDING.
+      rc = range_lock(p, F_RDLCK, kPendingByte, 1, SQLITE_IOERR_LOCK);
+      if (rc == SQLITE_OK) {
+        rc = range_lock(p, F_RDLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_RDLOCK);
+        int unlockRc = range_lock(p, F_UNLCK, kPendingByte, 1, SQLITE_IOERR_UNLOCK);
+        if (rc == SQLITE_OK && unlockRc != SQLITE_OK) {
+          range_lock(p, F_UNLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_UNLOCK);
+          rc = unlockRc;
+        }
+      }
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+#if PTHREADFS_VFS_MMAP
+      // Another instance may have written the file since the module last held a
+      // lock. As for SQLite's page cache, the file change counter tells.
+      if (state->mirrorSize >= 28 && state->fetchRefs == 0) {
+        char counter[4];
+        if (bridge_read(p->fd, counter, 4, 24) != 4 || memcmp(counter, state->mirror + 24, 4) != 0) {
+          state->mirrorSize = 0;
+        }
+      }
+#endif
+      state->level = SQLITE_LOCK_SHARED;
+    }
+    state->readers++;
+    p->level = SQLITE_LOCK_SHARED;
+    return SQLITE_OK;
+  }
+  if (eLock == SQLITE_LOCK_RESERVED) {
+    rc = range_lock(p, F_WRLCK, kReservedByte, 1, SQLITE_IOERR_LOCK);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    state->level = SQLITE_LOCK_RESERVED;
+    p->level = SQLITE_LOCK_RESERVED;
+    return SQLITE_OK;
+  }
+  // PENDING keeps new readers out until the remaining ones are done.
+  if (p->level < SQLITE_LOCK_PENDING) {
+    rc = range_lock(p, F_WRLCK, kPendingByte, 1, SQLITE_IOERR_LOCK);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    state->level = SQLITE_LOCK_PENDING;
+    p->level = SQLITE_LOCK_PENDING;
+  }
+  if (eLock == SQLITE_LOCK_EXCLUSIVE) {
+    if (state->readers > 1) {
+      return SQLITE_BUSY;
+    }
+    // Fails while readers of other instances hold the shared range.
+    rc = range_lock(p, F_WRLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_LOCK);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    state->level = SQLITE_LOCK_EXCLUSIVE;
+    p->level = SQLITE_LOCK_EXCLUSIVE;
+  }
+  return SQLITE_OK;
+}
+
+int vfs_unlock(sqlite3_file* pFile, int eLock) {
+  vfs_file* p = (vfs_file*)pFile;
+  if (p->level <= eLock) {
+    return SQLITE_OK;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* state = p->shared;
+  int rc = SQLITE_OK;
+  if (p->level > SQLITE_LOCK_SHARED) {
+    if (p->level == SQLITE_LOCK_EXCLUSIVE && eLock == SQLITE_LOCK_SHARED) {
+      rc = range_lock(p, F_RDLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_RDLOCK);
+    }
+    // The pending and reserved bytes.
+    int unlockRc = range_lock(p, F_UNLCK, kPendingByte, 2, SQLITE_IOERR_UNLOCK);
+    if (rc == SQLITE_OK) {
+      rc = unlockRc;
+    }
+    state->level = SQLITE_LOCK_SHARED;
+  }
+  if (eLock == SQLITE_LOCK_NONE) {
+    state->readers--;
+    if (state->readers == 0) {
+      int unlockRc = range_lock(p, F_UNLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_UNLOCK);
+      if (rc == SQLITE_OK) {
+        rc = unlockRc;
+      }
+      state->level = SQLITE_LOCK_NONE;
+      close_deferred_fds(state);
+    }
+  }
+  p->level = eLock;
+  return rc;
+}
+
+int vfs_check_reserved_lock(sqlite3_file* pFile, int* pResOut) {
+  vfs_file* p = (vfs_file*)pFile;
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  if (p->shared->level > SQLITE_LOCK_SHARED) {
+    *pResOut = 1;
+    return SQLITE_OK;
+  }
+  // Only other instances of the module can hold the reserved byte now.
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = kReservedByte;
+  fl.l_len = 1;
+  if (fcntl(p->fd, F_GETLK, &fl) != 0) {
+    return SQLITE_IOERR_CHECKRESERVEDLOCK;
+  }
+  *pResOut = fl.l_type != F_UNLCK;
+  return SQLITE_OK;
+}
+
+#if PTHREADFS_VFS_BATCH
+// Commits the staged writes of `p` in a single bridge call. The records are
+// appended to the log in the -batch file next to the database and flushed
+// before they are applied to the database, so a commit that is interrupted is
+// finished by batch_recover() on the next open.
+int batch_commit(vfs_file* p) {
+  if (p->batchFd < 0) {
+    std::string path = std::string(p->path) + "-batch";
+    p->batchFd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (p->batchFd < 0) {
+      // SQLite falls back to a rollback journal on I/O errors.
+      return SQLITE_IOERR_WRITE;
+    }
+  }
+  const std::vector<char>& records = p->batch->records;
+  long res = bridge_batch_commit(p->fd, p->batchFd, records.data(), (long)records.size());
+  if (res == -ENOSPC) {
+    return SQLITE_FULL;
+  }
+  if (res != 0) {
+    return SQLITE_IOERR_WRITE;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* shared = p->shared;
+  for (const vfs_batch::staged& w : p->batch->writes) {
+    if (w.amount < 0) {
+      shared->mirrorSize = std::min(shared->mirrorSize, w.offset);
+    } else if (w.offset < shared->mirrorSize) {
+      sqlite3_int64 n = std::min<sqlite3_int64>(w.amount, shared->mirrorSize - w.offset);
+      memcpy(shared->mirror + w.offset, &records[w.pos], n);
+    }
+  }
+  return SQLITE_OK;
+}
+
+// Finishes a batch-atomic commit of `p`'s file that was interrupted after its
+// -batch file was flushed. Must be called before any connection of the module
+// uses the file. While another instance of the module holds a lock on the file,
+// the log may belong to a commit in progress and is left alone.
+int batch_recover(vfs_file* p) {
+  // Separately, as long ranges only conflict with the same range elsewhere.
+  if (range_lock(p, F_WRLCK, kPendingByte, 1, SQLITE_IOERR_LOCK) != SQLITE_OK ||
+      range_lock(p, F_WRLCK, kReservedByte, 1, SQLITE_IOERR_LOCK) != SQLITE_OK ||
+      range_lock(p, F_WRLCK, kSharedFirst, kSharedSize, SQLITE_IOERR_LOCK) != SQLITE_OK) {
+    range_lock(p, F_UNLCK, kPendingByte, 2 + kSharedSize, SQLITE_IOERR_UNLOCK);
+    return SQLITE_OK;
+  }
+  std::string path = std::string(p->path) + "-batch";
+  long batchFd = open(path.c_str(), O_RDWR);
+  int rc = SQLITE_OK;
+  if (batchFd < 0) {
+    rc = errno == ENOENT ? SQLITE_OK : SQLITE_CANTOPEN;
+  } else {
+    p->batchFd = batchFd;
+    rc = bridge_batch_recover(p->fd, batchFd) < 0 ? SQLITE_CANTOPEN : SQLITE_OK;
+  }
+  range_lock(p, F_UNLCK, kPendingByte, 2 + kSharedSize, SQLITE_IOERR_UNLOCK);
+  return rc;
+}
+#endif // PTHREADFS_VFS_BATCH
+
+int vfs_file_control(sqlite3_file* pFile, int op, void* pArg) {
+#if PTHREADFS_VFS_BATCH
+  vfs_file* p = (vfs_file*)pFile;
+  switch (op) {
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+      delete p->batch;
+      p->batch = new vfs_batch();
+      return SQLITE_OK;
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE: {
+      int rc = batch_commit(p);
+      if (rc == SQLITE_OK) {
+        delete p->batch;
+        p->batch = nullptr;
+      }
+      return rc;
+    }
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+      delete p->batch;
+      p->batch = nullptr;
+      return SQLITE_OK;
+  }
+#endif
+#if PTHREADFS_VFS_MMAP
+  if (op == SQLITE_FCNTL_MMAP_SIZE) {
+    vfs_file* p = (vfs_file*)pFile;
+    sqlite3_int64 limit = *(sqlite3_int64*)pArg;
+    *(sqlite3_int64*)pArg = p->mmapSizeMax;
+    if (limit >= 0) {
+      p->mmapSizeMax = limit;
+    }
+    return SQLITE_OK;
+  }
+#endif
+  return SQLITE_NOTFOUND;
+}
+
+int vfs_sector_size(sqlite3_file* pFile) { return 4096; }
+
+int vfs_device_characteristics(sqlite3_file* pFile) {
+#if PTHREADFS_VFS_BATCH
+  if (((vfs_file*)pFile)->batchAtomic) {
+    return SQLITE_IOCAP_BATCH_ATOMIC;
+  }
+#endif
+  return 0;
+}
+
+int vfs_shm_map(
+  sqlite3_file* pFile, int iRegion, int szRegion, int bExtend, void volatile** pp) {
+  vfs_file* p = (vfs_file*)pFile;
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* shared = p->shared;
+  if (!p->shmMapped) {
+    if (shared->shmRefs == 0) {
+      // Another instance has its own wal-index of the file. It must not be
+      // used concurrently, unless with locking_mode=EXCLUSIVE, which keeps the
+      // index in heap memory and never gets here.
+      int rc = range_lock(p, F_WRLCK, kShmDmsByte, 1, SQLITE_IOERR_SHMOPEN);
+      if (rc != SQLITE_OK) {
+        return SQLITE_IOERR_SHMOPEN;
+      }
+    }
+    p->shmMapped = 1;
+    shared->shmRefs++;
+  }
+  *pp = nullptr;
+  if ((int)shared->shmRegions.size() <= iRegion) {
+    if (!bExtend) {
+      return SQLITE_OK;
+    }
+    while ((int)shared->shmRegions.size() <= iRegion) {
+      char* region = (char*)calloc(1, szRegion);
+      if (region == nullptr) {
+        return SQLITE_NOMEM;
+      }
+      shared->shmRegions.push_back(region);
+    }
+  }
+  *pp = shared->shmRegions[iRegion];
+  return SQLITE_OK;
+}
+
+int vfs_shm_lock(sqlite3_file* pFile, int ofst, int n, int flags) {
+  vfs_file* p = (vfs_file*)pFile;
+  std::atomic<int>* locks = p->shared->shmLocks;
+  unsigned mask = ((1u << n) - 1) << ofst;
+  if (flags & SQLITE_SHM_UNLOCK) {
+    for (int i = ofst; i < ofst + n; i++) {
+      if (p->shmExclusive & (1u << i)) {
+        locks[i].store(0);
+      } else if (p->shmShared & (1u << i)) {
+        locks[i].fetch_sub(1);
+      }
+    }
+    p->shmShared &= ~mask;
+    p->shmExclusive &= ~mask;
+    return SQLITE_OK;
+  }
+  if (flags & SQLITE_SHM_SHARED) {
+    // SQLite only takes single shared locks.
+    if ((p->shmShared | p->shmExclusive) & mask) {
+      return SQLITE_OK;
+    }
+    int current = locks[ofst].load();
+    do {
+      if (current < 0) {
+        return SQLITE_BUSY;
+      }
+    } while (!locks[ofst].compare_exchange_weak(current, current + 1));
+    p->shmShared |= mask;
+    return SQLITE_OK;
+  }
+  for (int i = ofst; i < ofst + n; i++) {
+    int expected = 0;
+    if (!locks[i].compare_exchange_strong(expected, -1)) {
+      // Release what was taken so far.
+      while (--i >= ofst) {
+        locks[i].store(0);
+      }
+      return SQLITE_BUSY;
+    }
+  }
+  p->shmExclusive |= mask;
+  return SQLITE_OK;
+}
+
+void vfs_shm_barrier(sqlite3_file* pFile) { std::atomic_thread_fence(std::memory_order_seq_cst); }
+
+int vfs_shm_unmap(sqlite3_file* pFile, int deleteFlag) {
+  vfs_file* p = (vfs_file*)pFile;
+  vfs_shm_lock(pFile, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  if (p->shmMapped) {
+    p->shmMapped = 0;
+    if (--p->shared->shmRefs == 0) {
+      shm_free_regions(p->shared);
+      range_lock(p, F_UNLCK, kShmDmsByte, 1, SQLITE_IOERR_UNLOCK);
+      close_deferred_fds(p->shared);
+    }
+  }
+  return SQLITE_OK;
+}
+
+#if PTHREADFS_VFS_MMAP
+// Extends the mirror of `p`'s file to cover at least `end` bytes, reading the
+// missing part with a single bridge call. Must be called with g_vfs_mutex held.
+bool mirror_extend(vfs_file* p, sqlite3_int64 end) {
+  vfs_shared* shared = p->shared;
+  // Reallocating would move pages that SQLite still holds.
+  if (shared->fetchRefs > 0) {
+    return false;
+  }
+  double fileSize = 0;
+  if (bridge_size(p->fd, &fileSize) != 0) {
+    return false;
+  }
+  sqlite3_int64 size = std::min((sqlite3_int64)fileSize, p->mmapSizeMax);
+  if (size < end) {
+    return false;
+  }
+  char* mirror = (char*)realloc(shared->mirror, size);
+  if (mirror == nullptr) {
+    return false;
+  }
+  shared->mirror = mirror;
+  sqlite3_int64 missing = size - shared->mirrorSize;
+  if (bridge_read(p->fd, mirror + shared->mirrorSize, missing, shared->mirrorSize) != missing) {
+    return false;
+  }
+  shared->mirrorSize = size;
+  return true;
+}
+
+// Pages that cannot be served from the mirror are left to xRead by returning a
+// null pointer.
+int vfs_fetch(sqlite3_file* pFile, sqlite3_int64 iOfst, int iAmt, void** pp) {
+  vfs_file* p = (vfs_file*)pFile;
+  *pp = nullptr;
+  if (iOfst + iAmt > p->mmapSizeMax) {
+    return SQLITE_OK;
+  }
+  std::lock_guard<std::mutex> lock(g_vfs_mutex);
+  vfs_shared* shared = p->shared;
+  if (iOfst + iAmt > shared->mirrorSize && !mirror_extend(p, iOfst + iAmt)) {
+    return SQLITE_OK;
+  }
+  shared->fetchRefs++;
+  *pp = shared->mirror + iOfst;
+  return SQLITE_OK;
+}
+
+// A null `pPage` asks to unmap the whole file. The mirror is shared with other
+// connections, so it is kept; it is freed when the last connection closes.
+int vfs_unfetch(sqlite3_file* pFile, sqlite3_int64 iOfst, void* pPage) {
+  vfs_file* p = (vfs_file*)pFile;
+  if (pPage != nullptr) {
+    std::lock_guard<std::mutex> lock(g_vfs_mutex);
+    p->shared->fetchRefs--;
+  }
+  return SQLITE_OK;
+}
+#endif // PTHREADFS_VFS_MMAP
+
+const sqlite3_io_methods g_vfs_io_methods = {
+#if PTHREADFS_VFS_MMAP
+  3,                          // iVersion
+#else
+  2,                          // iVersion
+#endif
+  vfs_close,                  // xClose
+  vfs_read,                   // xRead
+  vfs_write,                  // xWrite
+  vfs_truncate,               // xTruncate
+  vfs_sync,                   // xSync
+  vfs_file_size,              // xFileSize
+  vfs_lock,                   // xLock
+  vfs_unlock,                 // xUnlock
+  vfs_check_reserved_lock,    // xCheckReservedLock
+  vfs_file_control,           // xFileControl
+  vfs_sector_size,            // xSectorSize
+  vfs_device_characteristics, // xDeviceCharacteristics
+  vfs_shm_map,                // xShmMap
+  vfs_shm_lock,               // xShmLock
+  vfs_shm_barrier,            // xShmBarrier
+  vfs_shm_unmap,              // xShmUnmap
+#if PTHREADFS_VFS_MMAP
+  vfs_fetch,                  // xFetch
+  vfs_unfetch,                // xUnfetch
+#endif
+};
+
+// Temporary files are kept in wasm memory, in chunks that are allocated as they
+// are written. A file that would take the total beyond g_temp_budget is spilled
+// to PThreadFS or fails, depending on g_temp_policy.
+constexpr sqlite3_int64 kTempChunkSize = 64 * 1024;
+constexpr int kTempFileTypes =
+  SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_SUBJOURNAL | SQLITE_OPEN_TRANSIENT_DB;
+
+std::atomic<sqlite3_int64> g_temp_budget{64 * 1024 * 1024};
+std::atomic<int> g_temp_policy{PTHREADFS_TEMP_SPILL};
+std::atomic<sqlite3_int64> g_temp_bytes{0};
+std::atomic<sqlite3_int64> g_temp_highwater{0};
+std::atomic<int> g_temp_spilled{0};
+
+struct temp_data {
+  // Null for chunks that were never written, which read as zeros.
+  std::vector<char*> chunks;
+  sqlite3_int64 size = 0;
+  // Once spilled, all calls are forwarded to `spill`, a file at `spillPath`.
+  sqlite3_file* spill = nullptr;
+  std::string spillPath;
+};
+
+struct temp_file {
+  sqlite3_file base;
+  temp_data* data;
+};
+
+// Accounts for `bytes` more of temporary file memory, unless that would exceed
+// the budget.
+bool temp_reserve(sqlite3_int64 bytes) {
+  sqlite3_int64 current = g_temp_bytes.load();
+  do {
+    if (current + bytes > g_temp_budget.load()) {
+      return false;
+    }
+  } while (!g_temp_bytes.compare_exchange_weak(current, current + bytes));
+  sqlite3_int64 highwater = g_temp_highwater.load();
+  while (current + bytes > highwater &&
+         !g_temp_highwater.compare_exchange_weak(highwater, current + bytes)) {
+  }
+  return true;
+}
+
+// Frees the chunks of `d` from index `from` on.
+void temp_free_chunks(temp_data* d, size_t from) {
+  for (size_t i = from; i < d->chunks.size(); i++) {
+    if (d->chunks[i] != nullptr) {
+      free(d->chunks[i]);
+      g_temp_bytes -= kTempChunkSize;
+    }
+  }
+  d->chunks.resize(std::min(from, d->chunks.size()));
+}
+
+int vfs_open(sqlite3_vfs* pVfs, const char* zName, sqlite3_file* pFile, int flags, int* pOutFlags);
+
+// Moves the contents of `d` to a new file in PTHREADFS_FOLDER, which is deleted
+// on close and never synced, and frees its chunks.
+int temp_spill(temp_data* d) {
+  unsigned int random;
+  sqlite3_randomness(sizeof(random), &random);
+  d->spillPath = std::string("/" PTHREADFS_FOLDER_NAME "/.sqlite-temp-") + std::to_string(random);
+  sqlite3_file* spill = (sqlite3_file*)sqlite3_malloc(g_vfs.szOsFile);
+  if (spill == nullptr) {
+    return SQLITE_NOMEM;
+  }
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_EXCLUSIVE |
+              SQLITE_OPEN_DELETEONCLOSE;
+  int rc = vfs_open(&g_vfs, d->spillPath.c_str(), spill, flags, nullptr);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(spill);
+    return rc;
+  }
+  for (size_t i = 0; i < d->chunks.size() && rc == SQLITE_OK; i++) {
+    sqlite3_int64 offset = i * kTempChunkSize;
+    if (d->chunks[i] != nullptr && offset < d->size) {
+      int amount = (int)std::min(kTempChunkSize, d->size - offset);
+      rc = spill->pMethods->xWrite(spill, d->chunks[i], amount, offset);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    // Covers chunks at the end that were never written.
+    rc = spill->pMethods->xTruncate(spill, d->size);
+  }
+  if (rc != SQLITE_OK) {
+    spill->pMethods->xClose(spill);
+    sqlite3_free(spill);
+    return rc;
+  }
+  temp_free_chunks(d, 0);
+  d->spill = spill;
+  g_temp_spilled++;
+  return SQLITE_OK;
+}
+
+int temp_close(sqlite3_file* pFile) {
+  temp_data* d = ((temp_file*)pFile)->data;
+  int rc = SQLITE_OK;
+  if (d->spill != nullptr) {
+    rc = d->spill->pMethods->xClose(d->spill);
+    sqlite3_free(d->spill);
+  }
+  temp_free_chunks(d, 0);
+  delete d;
+  return rc;
+}
+
+int temp_read(sqlite3_file* pFile, void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  temp_data* d = ((temp_file*)pFile)->data;
+  if (d->spill != nullptr) {
+    return d->spill->pMethods->xRead(d->spill, zBuf, iAmt, iOfst);
+  }
+  char* out = (char*)zBuf;
+  int n = (int)std::max<sqlite3_int64>(0, std::min<sqlite3_int64>(iAmt, d->size - iOfst));
+  for (int done = 0; done < n;) {
+    sqlite3_int64 pos = iOfst + done;
+    size_t chunk = (size_t)(pos / kTempChunkSize);
+    int start = (int)(pos % kTempChunkSize);
+    int count = (int)std::min<sqlite3_int64>(kTempChunkSize - start, n - done);
+    if (chunk < d->chunks.size() && d->chunks[chunk] != nullptr) {
+      memcpy(out + done, d->chunks[chunk] + start, count);
+    } else {
+      memset(out + done, 0, count);
+    }
+    done += count;
+  }
+  if (n < iAmt) {
+    memset(out + n, 0, iAmt - n);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+int temp_write(sqlite3_file* pFile, const void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  temp_data* d = ((temp_file*)pFile)->data;
+  if (d->spill != nullptr) {
+    return d->spill->pMethods->xWrite(d->spill, zBuf, iAmt, iOfst);
+  }
+  size_t first = (size_t)(iOfst / kTempChunkSize);
+  size_t last = (size_t)((iOfst + iAmt - 1) / kTempChunkSize);
+  // The chunks a write needs are reserved up front, so that it either fits or
+  // spills as a whole.
+  int missing = 0;
+  for (size_t i = first; i <= last; i++) {
+    if (i >= d->chunks.size() || d->chunks[i] == nullptr) {
+      missing++;
+    }
+  }
+  if (missing > 0 && !temp_reserve(missing * kTempChunkSize)) {
+    if (g_temp_policy.load() == PTHREADFS_TEMP_FULL) {
+      return SQLITE_FULL;
+    }
+    int rc = temp_spill(d);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    return d->spill->pMethods->xWrite(d->spill, zBuf, iAmt, iOfst);
+  }
+  if (d->chunks.size() <= last) {
+    d->chunks.resize(last + 1, nullptr);
+  }
+  const char* in = (const char*)zBuf;
+  for (int done = 0; done < iAmt;) {
+    sqlite3_int64 pos = iOfst + done;
+    char*& chunk = d->chunks[(size_t)(pos / kTempChunkSize)];
+    int start = (int)(pos % kTempChunkSize);
+    int count = (int)std::min<sqlite3_int64>(kTempChunkSize - start, iAmt - done);
+    if (chunk == nullptr) {
+      chunk = (char*)calloc(1, kTempChunkSize);
+      if (chunk == nullptr) {
+        g_temp_bytes -= missing * kTempChunkSize;
+        return SQLITE_IOERR_NOMEM;
+      }
+      missing--;
+    }
+    memcpy(chunk + start, in + done, count);
+    done += count;
+  }
+  d->size = std::max(d->size, iOfst + iAmt);
+  return SQLITE_OK;
+}
+
+int temp_truncate(sqlite3_file* pFile, sqlite3_int64 size) {
+  temp_data* d = ((temp_file*)pFile)->data;
+  if (d->spill != nullptr) {
+    return d->spill->pMethods->xTruncate(d->spill, size);
+  }
+  size_t keep = (size_t)((size + kTempChunkSize - 1) / kTempChunkSize);
+  temp_free_chunks(d, keep);
+  // The rest of the last chunk must read as zeros if the file grows again.
+  int tail = (int)(size % kTempChunkSize);
+  if (tail > 0 && keep > 0 && keep <= d->chunks.size() && d->chunks[keep - 1] != nullptr) {
+    memset(d->chunks[keep - 1] + tail, 0, kTempChunkSize - tail);
+  }
+  d->size = size;
+  return SQLITE_OK;
+}
+
+// Temporary files are never synced, not even once spilled.
+int temp_sync(sqlite3_file* pFile, int flags) { return SQLITE_OK; }
+
+int temp_file_size(sqlite3_file* pFile, sqlite3_int64* pSize) {
+  temp_data* d = ((temp_file*)pFile)->data;
+  if (d->spill != nullptr) {
+    return d->spill->pMethods->xFileSize(d->spill, pSize);
+  }
+  *pSize = d->size;
+  return SQLITE_OK;
+}
+
+// Temporary files are private to their connection, so locks always succeed.
+int temp_lock(sqlite3_file* pFile, int eLock) { return SQLITE_OK; }
+
+int temp_check_reserved_lock(sqlite3_file* pFile, int* pResOut) {
+  *pResOut = 0;
+  return SQLITE_OK;
+}
+
+int temp_file_control(sqlite3_file* pFile, int op, void* pArg) { return SQLITE_NOTFOUND; }
+
+int temp_device_characteristics(sqlite3_file* pFile) { return 0; }
+
+const sqlite3_io_methods g_temp_io_methods = {
+  1,                          // iVersion
+  temp_close,                 // xClose
+  temp_read,                  // xRead
+  temp_write,                 // xWrite
+  temp_truncate,              // xTruncate
+  temp_sync,                  // xSync
+  temp_file_size,             // xFileSize
+  temp_lock,                  // xLock
+  temp_lock,                  // xUnlock
+  temp_check_reserved_lock,   // xCheckReservedLock
+  temp_file_control,          // xFileControl
+  vfs_sector_size,            // xSectorSize
+  temp_device_characteristics, // xDeviceCharacteristics
+};
+
+int vfs_open(sqlite3_vfs* pVfs, const char* zName, sqlite3_file* pFile, int flags, int* pOutFlags) {
+  if ((flags & kTempFileTypes) && (zName == nullptr || (flags & SQLITE_OPEN_DELETEONCLOSE))) {
+    temp_file* p = (temp_file*)pFile;
+    memset(p, 0, sizeof(temp_file));
+    p->data = new temp_data();
+    p->base.pMethods = &g_temp_io_methods;
+    if (pOutFlags) {
+      *pOutFlags = flags;
+    }
+    return SQLITE_OK;
+  }
+  if (zName == nullptr || !emscripten::is_pthreadfs_file(zName)) {
+    return g_base_vfs->xOpen(g_base_vfs, zName, pFile, flags, pOutFlags);
+  }
+  vfs_file* p = (vfs_file*)pFile;
+  memset(p, 0, sizeof(vfs_file));
+
+  int oflags = (flags & SQLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY;
+  if (flags & SQLITE_OPEN_CREATE) {
+    oflags |= O_CREAT;
+  }
+  if (flags & SQLITE_OPEN_EXCLUSIVE) {
+    oflags |= O_EXCL;
+  }
+  long fd = open(zName, oflags, 0644);
+  if (fd < 0) {
+    return SQLITE_CANTOPEN;
+  }
+  p->fd = fd;
+  p->level = SQLITE_LOCK_NONE;
+  p->deleteOnClose = flags & SQLITE_OPEN_DELETEONCLOSE;
+  p->path = zName;
+  p->batchFd = -1;
+  p->batchAtomic = (flags & SQLITE_OPEN_MAIN_DB) && (flags & SQLITE_OPEN_READWRITE);
+  {
+    std::lock_guard<std::mutex> lock(g_vfs_mutex);
+    vfs_shared* shared = &g_vfs_files[zName];
+#if PTHREADFS_VFS_BATCH
+    if (p->batchAtomic && shared->refs == 0) {
+      int rc = batch_recover(p);
+      if (rc != SQLITE_OK) {
+        g_vfs_files.erase(zName);
+        if (p->batchFd >= 0) {
+          close(p->batchFd);
+        }
+        close(fd);
+        return rc;
+      }
+    }
+#endif
+    p->shared = shared;
+    p->shared->refs++;
+  }
+  p->base.pMethods = &g_vfs_io_methods;
+  if (pOutFlags) {
+    *pOutFlags = flags;
+  }
+  return SQLITE_OK;
+}
+
+int vfs_delete(sqlite3_vfs* pVfs, const char* zName, int syncDir) {
+  if (!emscripten::is_pthreadfs_file(zName)) {
+    return g_base_vfs->xDelete(g_base_vfs, zName, syncDir);
+  }
+  // OPFS has no directory entries to sync, so syncDir is ignored.
+  if (unlink(zName) != 0) {
+    if (errno == ENOENT) {
+#ifdef SQLITE_IOERR_DELETE_NOENT
+      return SQLITE_IOERR_DELETE_NOENT;
+#else
+      return SQLITE_OK;
+#endif
+    }
+    return SQLITE_IOERR_DELETE;
+  }
+  return SQLITE_OK;
+}
+
+int vfs_access(sqlite3_vfs* pVfs, const char* zName, int flags, int* pResOut) {
+  if (!emscripten::is_pthreadfs_file(zName)) {
+    return g_base_vfs->xAccess(g_base_vfs, zName, flags, pResOut);
+  }
+  long res = bridge_access(zName, flags);
+  if (res < 0) {
+    return SQLITE_IOERR_ACCESS;
+  }
+  *pResOut = res;
+  return SQLITE_OK;
+}
+
+int vfs_full_pathname(sqlite3_vfs* pVfs, const char* zName, int nOut, char* zOut) {
+  return g_base_vfs->xFullPathname(g_base_vfs, zName, nOut, zOut);
+}
+
+void* vfs_dl_open(sqlite3_vfs* pVfs, const char* zFilename) {
+  return g_base_vfs->xDlOpen(g_base_vfs, zFilename);
+}
+
+void vfs_dl_error(sqlite3_vfs* pVfs, int nByte, char* zErrMsg) {
+  g_base_vfs->xDlError(g_base_vfs, nByte, zErrMsg);
+}
+
+void (*vfs_dl_sym(sqlite3_vfs* pVfs, void* pHandle, const char* zSymbol))(void) {
+  return g_base_vfs->xDlSym(g_base_vfs, pHandle, zSymbol);
+}
+
+void vfs_dl_close(sqlite3_vfs* pVfs, void* pHandle) { g_base_vfs->xDlClose(g_base_vfs, pHandle); }
+
+int vfs_randomness(sqlite3_vfs* pVfs, int nByte, char* zOut) {
+  return g_base_vfs->xRandomness(g_base_vfs, nByte, zOut);
+}
+
+int vfs_sleep(sqlite3_vfs* pVfs, int microseconds) {
+  return g_base_vfs->xSleep(g_base_vfs, microseconds);
+}
+
+int vfs_current_time(sqlite3_vfs* pVfs, double* pTime) {
+  return g_base_vfs->xCurrentTime(g_base_vfs, pTime);
+}
+
+int vfs_current_time_int64(sqlite3_vfs* pVfs, sqlite3_int64* pTime) {
+  if (g_base_vfs->iVersion >= 2 && g_base_vfs->xCurrentTimeInt64) {
+    return g_base_vfs->xCurrentTimeInt64(g_base_vfs, pTime);
+  }
+  double now;
+  int rc = g_base_vfs->xCurrentTime(g_base_vfs, &now);
+  *pTime = (sqlite3_int64)(now * 86400000.0);
+  return rc;
+}
+
+int vfs_get_last_error(sqlite3_vfs* pVfs, int nByte, char* zOut) {
+  return g_base_vfs->xGetLastError ? g_base_vfs->xGetLastError(g_base_vfs, nByte, zOut) : 0;
+}
+
+} // namespace
+
+extern "C" int sqlite3_pthreadfs_vfs_register(int makeDefault) {
+  if (g_base_vfs == nullptr) {
+    g_base_vfs = sqlite3_vfs_find(nullptr);
+    if (g_base_vfs == nullptr) {
+      return SQLITE_ERROR;
+    }
+    // Files outside of PTHREADFS_FOLDER are opened by the base VFS in place.
+    int szOsFile = (int)sizeof(vfs_file);
+    g_vfs.iVersion = 2;
+    g_vfs.szOsFile = szOsFile > g_base_vfs->szOsFile ? szOsFile : g_base_vfs->szOsFile;
+    g_vfs.mxPathname = g_base_vfs->mxPathname;
+    g_vfs.zName = PTHREADFS_VFS_NAME;
+    g_vfs.xOpen = vfs_open;
+    g_vfs.xDelete = vfs_delete;
+    g_vfs.xAccess = vfs_access;
+    g_vfs.xFullPathname = vfs_full_pathname;
+    g_vfs.xDlOpen = vfs_dl_open;
+    g_vfs.xDlError = vfs_dl_error;
+    g_vfs.xDlSym = vfs_dl_sym;
+    g_vfs.xDlClose = vfs_dl_close;
+    g_vfs.xRandomness = vfs_randomness;
+    g_vfs.xSleep = vfs_sleep;
+    g_vfs.xCurrentTime = vfs_current_time;
+    g_vfs.xGetLastError = vfs_get_last_error;
+    g_vfs.xCurrentTimeInt64 = vfs_current_time_int64;
+  }
+  return sqlite3_vfs_register(&g_vfs, makeDefault);
+}
+
+extern "C" void sqlite3_pthreadfs_vfs_temp_config(long long budget, int policy) {
+  g_temp_budget = budget;
+  g_temp_policy = policy;
+}
+
+extern "C" void sqlite3_pthreadfs_vfs_temp_stats(
+  long long* pCurrent, long long* pHighwater, int* pSpilled) {
+  *pCurrent = g_temp_bytes.load();
+  *pHighwater = g_temp_highwater.load();
+  *pSpilled = g_temp_spilled.load();
+}
@@ -0,0 +1,60 @@
+#ifndef PTHREADFS_VFS_H
+#define PTHREADFS_VFS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Name of the SQLite VFS registered by sqlite3_pthreadfs_vfs_register().
+#define PTHREADFS_VFS_NAME "pthreadfs"
+
+// Registers an SQLite VFS that reads and writes database files in
+// PTHREADFS_FOLDER with a single bridge call per operation, instead of going
+// through the unix VFS and the libc syscall overrides. Files outside of
+// PTHREADFS_FOLDER and temporary files are handled by the VFS that was the
+// default when this function was first called. Returns an SQLite result code.
+int sqlite3_pthreadfs_vfs_register(int makeDefault);
+
+// Temporary files (sort spills, temp indices and databases, statement
+// journals) opened through the PThreadFS VFS are kept in wasm memory in 64 KiB
+// chunks and never flushed. Once all temporary files together would exceed
+// `budget` bytes (64 MiB by default), the file that grows is handled according
+// to `policy`:
+// PTHREADFS_TEMP_SPILL moves it to an unflushed file in PTHREADFS_FOLDER,
+// PTHREADFS_TEMP_FULL fails the write with SQLITE_FULL.
+#define PTHREADFS_TEMP_SPILL 0
+#define PTHREADFS_TEMP_FULL 1
+void sqlite3_pthreadfs_vfs_temp_config(long long budget, int policy);
+
+// Reports the bytes held by temporary files in memory, their peak, and how many
+// files were spilled.
+void sqlite3_pthreadfs_vfs_temp_stats(long long* pCurrent, long long* pHighwater, int* pSpilled);
+
+// Name of the page compression VFS registered by sqlite3_pthreadfs_zvfs_register().
+#define PTHREADFS_ZVFS_NAME "pthreadfs-lz4"
+
+// Registers a VFS on top of the PThreadFS VFS that stores the pages of main
+// database files in PTHREADFS_FOLDER compressed with LZ4. Pages take a variable
+// amount of space in the database file, and a "-cmap" file next to it maps each
+// page to its location. Only databases created through this VFS are compressed;
+// other files are passed through. Returns an SQLite result code.
+int sqlite3_pthreadfs_zvfs_register(int makeDefault);
+
+// Counters of the compression VFS since the module started. Doubles, so that
+// JavaScript can read them directly.
+typedef struct pthreadfs_zvfs_stats {
+  double pagesWritten;   // Pages compressed on write.
+  double pagesStoredRaw; // Written pages that did not compress and were stored as is.
+  double bytesIn;        // Uncompressed size of the written pages.
+  double bytesOut;       // Bytes stored for them.
+  double pagesRead;      // Pages decompressed on read.
+  double compressMs;     // Time spent compressing.
+  double decompressMs;   // Time spent decompressing.
+} pthreadfs_zvfs_stats;
+void sqlite3_pthreadfs_zvfs_stats(pthreadfs_zvfs_stats* pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PTHREADFS_VFS_H
@@ -0,0 +1,852 @@
+#include "pthreadfs_vfs.h"
+
+#include "pthreadfs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Built against either libs/sqlite3.h or libs/sqlite_js/sqlite3.h, depending on
+// the include path.
+#include <sqlite3.h>
+
+// LZ4 is not part of the repository. build.js defines PTHREADFS_ZVFS_LZ4 as 0
+// when libs/lz4 is missing, and sqlite3_pthreadfs_zvfs_register() then fails.
+#ifndef PTHREADFS_ZVFS_LZ4
+#define PTHREADFS_ZVFS_LZ4 1
+#endif
+
+#if PTHREADFS_ZVFS_LZ4
+// From the LZ4 release in libs/lz4, see speed_test/README.md.
+#include "lz4.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// The VFS below stores each page of a main database file LZ4-compressed, in a
+// slot of the file that is a multiple of kSlotAlign bytes. The "-cmap" file next
+// to the database holds the page size and the logical size of the file, followed
+// by one entry per page with the location of its slot. Pages that do not save at
+// least one kSlotAlign unit are stored as is.
+//
+// The map is created with its header, and flushed, before the first page is
+// written, so a database is compressed exactly when its map exists. The header
+// is kept in two copies that are written in turn, and header copies and entries
+// carry a check value, so that a write torn by a crash is detected: the other
+// copy of the header is used, and a torn entry reads as a page that was never
+// written. Entries are only written for pages of transactions that SQLite has
+// not committed yet, which its rollback journal or WAL rewrites after the crash.
+//
+// A page that outgrows its slot moves to free space or to the end of the file.
+// The old slot is only reused after the next xSync has made the new location
+// durable, so that after a crash no two pages of the map share a slot and the
+// rollback journal or the WAL can rewrite any page. Free space is rebuilt from
+// the map when the file is opened, and free space at the end of the file is
+// truncated by xSync.
+//
+// The map is shared by all connections of the module that have the file open,
+// like the lock state of the PThreadFS VFS. Locking, the wal-index and syncs are
+// those of the PThreadFS VFS on the database file. Other instances of the module
+// keep maps of their own: a writer writes the header again when it gives up its
+// RESERVED or stronger lock after changing entries, and when the module takes
+// its first SHARED lock, it reloads the map if the header's sequence number is
+// not the one it last read or wrote. There is no xFetch, and
+// batch-atomic writes are not offered, as they would not cover the map.
+
+#if PTHREADFS_ZVFS_LZ4
+
+namespace {
+
+constexpr char kMapSuffix[] = "-cmap";
+constexpr uint32_t kMapMagic = 0x50414d43;
+constexpr uint32_t kMapVersion = 2;
+constexpr sqlite3_int64 kSlotAlign = 256;
+// Used when the first write does not look like a page.
+constexpr int kDefaultPageSize = 4096;
+
+// One of the two copies of the header at the start of the map. The one with the
+// higher `seq` is current.
+struct zvfs_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pageSize;
+  uint32_t seq;
+  sqlite3_int64 size;
+  uint32_t check;
+  uint32_t unused;
+};
+
+struct zvfs_entry {
+  sqlite3_int64 offset;
+  // Bytes stored for the page, pageSize if it is not compressed.
+  uint32_t stored;
+  // Size of the slot, 0 for pages that were never written.
+  uint32_t capacity;
+};
+
+// An entry as stored in the map, with the capacity in kSlotAlign units. All
+// zeros for pages that were never written.
+struct zvfs_map_entry {
+  sqlite3_int64 offset;
+  uint32_t stored;
+  uint16_t slots;
+  uint16_t check;
+};
+
+constexpr sqlite3_int64 kMapHeaderCopySize = sizeof(zvfs_header);
+constexpr sqlite3_int64 kMapHeaderSize = 2 * kMapHeaderCopySize;
+constexpr sqlite3_int64 kMapEntrySize = sizeof(zvfs_map_entry);
+static_assert(kMapHeaderCopySize == 32 && kMapEntrySize == 16, "unexpected -cmap layout");
+
+struct zvfs_shared {
+  int refs = 0;
+  // The key in g_zvfs_files, and the path of the map, which must stay valid
+  // until the last connection has closed it.
+  std::string path;
+  std::string mapPath;
+  // Guards everything below.
+  std::mutex mutex;
+  bool loaded = false;
+  // 0 until the first write.
+  int pageSize = 0;
+  sqlite3_int64 size = 0;
+  // Of the last header written, and of the last one whose state both copies
+  // hold.
+  uint32_t headerSeq = 0;
+  uint32_t syncedHeaderSeq = 0;
+  // Whether entries were written since the last header, and the number of
+  // connections holding a SHARED or stronger lock.
+  bool entriesDirty = false;
+  int lockedConns = 0;
+  std::vector<zvfs_entry> entries;
+  // Free space before dataEnd, by offset and by (length, offset).
+  std::map<sqlite3_int64, sqlite3_int64> freeByOffset;
+  std::set<std::pair<sqlite3_int64, sqlite3_int64>> freeBySize;
+  // Slots given up since the last xSync, as (offset, length).
+  std::vector<std::pair<sqlite3_int64, sqlite3_int64>> pendingFree;
+  sqlite3_int64 dataEnd = 0;
+};
+
+struct zvfs_file {
+  sqlite3_file base;
+  // Both opened through the PThreadFS VFS.
+  sqlite3_file* data;
+  sqlite3_file* map;
+  // Points into g_zvfs_files, whose nodes are stable.
+  zvfs_shared* shared;
+  int level;
+  bool writable;
+};
+
+// Guards g_zvfs_files and the refs of its entries.
+std::mutex g_zvfs_mutex;
+std::map<std::string, zvfs_shared> g_zvfs_files;
+
+sqlite3_vfs* g_pthreadfs_vfs = nullptr;
+sqlite3_vfs g_zvfs;
+
+std::atomic<long long> g_pages_written{0};
+std::atomic<long long> g_pages_raw{0};
+std::atomic<long long> g_bytes_in{0};
+std::atomic<long long> g_bytes_out{0};
+std::atomic<long long> g_pages_read{0};
+std::atomic<long long> g_compress_ns{0};
+std::atomic<long long> g_decompress_ns{0};
+
+long long elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start)
+    .count();
+}
+
+void free_add(zvfs_shared* s, sqlite3_int64 offset, sqlite3_int64 length) {
+  auto next = s->freeByOffset.lower_bound(offset);
+  if (next != s->freeByOffset.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      s->freeBySize.erase({prev->second, prev->first});
+      offset = prev->first;
+      length += prev->second;
+      s->freeByOffset.erase(prev);
+    }
+  }
+  if (next != s->freeByOffset.end() && offset + length == next->first) {
+    s->freeBySize.erase({next->second, next->first});
+    length += next->second;
+    s->freeByOffset.erase(next);
+  }
+  s->freeByOffset[offset] = length;
+  s->freeBySize.insert({length, offset});
+}
+
+// Returns the offset of a new slot of `capacity` bytes, the smallest free space
+// that fits or the end of the file.
+sqlite3_int64 slot_alloc(zvfs_shared* s, sqlite3_int64 capacity) {
+  auto it = s->freeBySize.lower_bound({capacity, 0});
+  if (it == s->freeBySize.end()) {
+    sqlite3_int64 offset = s->dataEnd;
+    s->dataEnd += capacity;
+    return offset;
+  }
+  sqlite3_int64 length = it->first;
+  sqlite3_int64 offset = it->second;
+  s->freeBySize.erase(it);
+  s->freeByOffset.erase(offset);
+  if (length > capacity) {
+    s->freeByOffset[offset + capacity] = length - capacity;
+    s->freeBySize.insert({length - capacity, offset + capacity});
+  }
+  return offset;
+}
+
+// FNV-1a over `n` bytes.
+uint32_t map_hash(const void* data, size_t n) {
+  const unsigned char* a = (const unsigned char*)data;
+  uint32_t hash = 0x811c9dc5;
+  for (size_t i = 0; i < n; i++) {
+    hash = (hash ^ a[i]) * 0x01000193;
+  }
+  return hash;
+}
+
+uint32_t header_check(const zvfs_header& h) {
+  return map_hash(&h, offsetof(zvfs_header, check));
+}
+
+zvfs_map_entry entry_encode(const zvfs_entry& e) {
+  zvfs_map_entry m = {e.offset, e.stored, (uint16_t)(e.capacity / kSlotAlign), 0};
+  // Never 0, so that a written entry cannot look like one that was not.
+  m.check = (uint16_t)(map_hash(&m, offsetof(zvfs_map_entry, check)) | 1);
+  return m;
+}
+
+// Returns false if `m` is torn.
+bool entry_decode(const zvfs_map_entry& m, zvfs_entry* e) {
+  *e = zvfs_entry{0, 0, 0};
+  if (m.check == 0) {
+    return m.offset == 0 && m.stored == 0 && m.slots == 0;
+  }
+  zvfs_entry decoded = {m.offset, m.stored, (uint32_t)(m.slots * kSlotAlign)};
+  if (entry_encode(decoded).check != m.check) {
+    return false;
+  }
+  *e = decoded;
+  return true;
+}
+
+int map_write_header(zvfs_file* p) {
+  zvfs_shared* s = p->shared;
+  zvfs_header header = {kMapMagic, kMapVersion, (uint32_t)s->pageSize, ++s->headerSeq, s->size, 0, 0};
+  header.check = header_check(header);
+  // The other copy stays intact if this write is torn.
+  return p->map->pMethods->xWrite(
+    p->map, &header, sizeof(header), (header.seq & 1) * kMapHeaderCopySize);
+}
+
+int map_write_entry(zvfs_file* p, size_t index) {
+  zvfs_map_entry m = entry_encode(p->shared->entries[index]);
+  p->shared->entriesDirty = true;
+  return p->map->pMethods->xWrite(p->map, &m, (int)kMapEntrySize,
+    kMapHeaderSize + (sqlite3_int64)index * kMapEntrySize);
+}
+
+// Writes both copies of the header of an empty database and flushes them, so
+// that the map exists before any page is written.
+int map_create(zvfs_file* p) {
+  int rc = map_write_header(p);
+  if (rc == SQLITE_OK) {
+    rc = map_write_header(p);
+  }
+  if (rc == SQLITE_OK) {
+    rc = p->map->pMethods->xSync(p->map, SQLITE_SYNC_NORMAL);
+  }
+  p->shared->syncedHeaderSeq = p->shared->headerSeq;
+  return rc;
+}
+
+// The valid copy of the header with the highest sequence number, or null.
+const zvfs_header* header_current(const zvfs_header* headers) {
+  const zvfs_header* current = nullptr;
+  for (int i = 0; i < 2; i++) {
+    const zvfs_header& h = headers[i];
+    if (h.magic == kMapMagic && h.version == kMapVersion && h.check == header_check(h) &&
+        (current == nullptr || (int32_t)(h.seq - current->seq) > 0)) {
+      current = &h;
+    }
+  }
+  return current;
+}
+
+// Loads the map of `p`. A map without a valid header is only accepted next to
+// an empty database file, where the creation of the map was interrupted; it is
+// created again if `writable`.
+int map_load(zvfs_file* p, bool writable) {
+  zvfs_shared* s = p->shared;
+  sqlite3_file* map = p->map;
+  s->pageSize = 0;
+  s->size = 0;
+  s->headerSeq = 0;
+  s->syncedHeaderSeq = 0;
+  s->entriesDirty = false;
+  s->entries.clear();
+  s->freeByOffset.clear();
+  s->freeBySize.clear();
+  s->pendingFree.clear();
+  s->dataEnd = 0;
+  sqlite3_int64 mapSize = 0;
+  int rc = map->pMethods->xFileSize(map, &mapSize);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  const zvfs_header* current = nullptr;
+  zvfs_header headers[2];
+  if (mapSize >= kMapHeaderSize) {
+    rc = map->pMethods->xRead(map, headers, sizeof(headers), 0);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    current = header_current(headers);
+  }
+  if (current == nullptr) {
+    sqlite3_int64 dataSize = 0;
+    rc = p->data->pMethods->xFileSize(p->data, &dataSize);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    if (dataSize > 0) {
+      return SQLITE_CORRUPT;
+    }
+    return writable ? map_create(p) : SQLITE_OK;
+  }
+  s->pageSize = (int)current->pageSize;
+  s->size = current->size;
+  s->headerSeq = current->seq;
+  const zvfs_header& other = headers[current == &headers[0] ? 1 : 0];
+  if (other.check == header_check(other) && other.size == current->size &&
+      other.pageSize == current->pageSize) {
+    s->syncedHeaderSeq = current->seq;
+  }
+  std::vector<zvfs_map_entry> stored((size_t)((mapSize - kMapHeaderSize) / kMapEntrySize));
+  if (!stored.empty()) {
+    rc = map->pMethods->xRead(
+      map, stored.data(), (int)(stored.size() * kMapEntrySize), kMapHeaderSize);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  s->entries.resize(stored.size());
+  for (size_t i = 0; i < stored.size(); i++) {
+    // A torn entry belongs to a page that SQLite rewrites, see above.
+    entry_decode(stored[i], &s->entries[i]);
+  }
+  // Everything between the slots in use is free.
+  std::vector<std::pair<sqlite3_int64, sqlite3_int64>> slots;
+  for (const zvfs_entry& e : s->entries) {
+    if (e.capacity > 0) {
+      slots.push_back({e.offset, e.capacity});
+    }
+  }
+  std::sort(slots.begin(), slots.end());
+  sqlite3_int64 end = 0;
+  for (const auto& slot : slots) {
+    if (slot.first > end) {
+      free_add(s, end, slot.first - end);
+    }
+    end = std::max(end, slot.first + slot.second);
+  }
+  s->dataEnd = end;
+  return SQLITE_OK;
+}
+
+// Loads the map of `p` again if another instance of the module has written it
+// since this one last read or wrote the header. Called when the module takes
+// its first SHARED lock, while no connection of the module uses the map.
+int map_refresh(zvfs_file* p) {
+  sqlite3_int64 mapSize = 0;
+  int rc = p->map->pMethods->xFileSize(p->map, &mapSize);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (mapSize >= kMapHeaderSize) {
+    zvfs_header headers[2];
+    rc = p->map->pMethods->xRead(p->map, headers, sizeof(headers), 0);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    const zvfs_header* current = header_current(headers);
+    if (current != nullptr && current->seq == p->shared->headerSeq) {
+      return SQLITE_OK;
+    }
+  }
+  return map_load(p, p->writable);
+}
+
+// Reads page `index` into `out`, which holds pageSize bytes. Called with the
+// mutex of the shared state held.
+int page_read(zvfs_file* p, size_t index, char* out) {
+  zvfs_shared* s = p->shared;
+  if (index >= s->entries.size() || s->entries[index].capacity == 0) {
+    memset(out, 0, s->pageSize);
+    return SQLITE_OK;
+  }
+  const zvfs_entry& e = s->entries[index];
+  std::vector<char> packed;
+  char* in = out;
+  if (e.stored != (uint32_t)s->pageSize) {
+    packed.resize(e.stored);
+    in = packed.data();
+  }
+  int rc = p->data->pMethods->xRead(p->data, in, (int)e.stored, e.offset);
+  if (rc != SQLITE_OK) {
+    // A slot beyond the end of the file is a damaged map.
+    return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_CORRUPT : rc;
+  }
+  if (in == out) {
+    return SQLITE_OK;
+  }
+  auto start = std::chrono::steady_clock::now();
+  int n = LZ4_decompress_safe(in, out, (int)e.stored, s->pageSize);
+  g_decompress_ns += elapsed_ns(start);
+  g_pages_read++;
+  return n == s->pageSize ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+// Compresses and stores page `index`. Called with the mutex of the shared state
+// held.
+int page_write(zvfs_file* p, size_t index, const char* page) {
+  zvfs_shared* s = p->shared;
+  std::vector<char> packed(LZ4_compressBound(s->pageSize));
+  auto start = std::chrono::steady_clock::now();
+  int stored = LZ4_compress_default(page, packed.data(), s->pageSize, (int)packed.size());
+  g_compress_ns += elapsed_ns(start);
+  const char* out = packed.data();
+  sqlite3_int64 capacity = (stored + kSlotAlign - 1) / kSlotAlign * kSlotAlign;
+  if (stored <= 0 || capacity >= s->pageSize) {
+    out = page;
+    stored = s->pageSize;
+    capacity = s->pageSize;
+    g_pages_raw++;
+  }
+  g_pages_written++;
+  g_bytes_in += s->pageSize;
+  g_bytes_out += stored;
+
+  if (s->entries.size() <= index) {
+    s->entries.resize(index + 1, zvfs_entry{0, 0, 0});
+  }
+  zvfs_entry& e = s->entries[index];
+  if (e.capacity < capacity) {
+    if (e.capacity > 0) {
+      s->pendingFree.push_back({e.offset, e.capacity});
+    }
+    e.offset = slot_alloc(s, capacity);
+    e.capacity = (uint32_t)capacity;
+  }
+  e.stored = (uint32_t)stored;
+  int rc = p->data->pMethods->xWrite(p->data, out, stored, e.offset);
+  if (rc == SQLITE_OK) {
+    rc = map_write_entry(p, index);
+  }
+  return rc;
+}
+
+void zvfs_release(zvfs_file* p) {
+  if (p->data->pMethods != nullptr) {
+    p->data->pMethods->xClose(p->data);
+  }
+  if (p->map->pMethods != nullptr) {
+    p->map->pMethods->xClose(p->map);
+  }
+  sqlite3_free(p->data);
+  sqlite3_free(p->map);
+  std::lock_guard<std::mutex> lock(g_zvfs_mutex);
+  if (--p->shared->refs == 0) {
+    g_zvfs_files.erase(p->shared->path);
+  }
+}
+
+int zvfs_close(sqlite3_file* pFile) {
+  zvfs_release((zvfs_file*)pFile);
+  return SQLITE_OK;
+}
+
+int zvfs_read(sqlite3_file* pFile, void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  zvfs_shared* s = p->shared;
+  std::lock_guard<std::mutex> lock(s->mutex);
+  char* out = (char*)zBuf;
+  int n = (int)std::max<sqlite3_int64>(0, std::min<sqlite3_int64>(iAmt, s->size - iOfst));
+  std::vector<char> page;
+  int rc = SQLITE_OK;
+  for (int done = 0; done < n && rc == SQLITE_OK;) {
+    sqlite3_int64 pos = iOfst + done;
+    size_t index = (size_t)(pos / s->pageSize);
+    int start = (int)(pos % s->pageSize);
+    int count = std::min(s->pageSize - start, n - done);
+    if (count == s->pageSize) {
+      rc = page_read(p, index, out + done);
+    } else {
+      page.resize(s->pageSize);
+      rc = page_read(p, index, page.data());
+      memcpy(out + done, page.data() + start, count);
+    }
+    done += count;
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (n < iAmt) {
+    memset(out + n, 0, iAmt - n);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+int zvfs_write(sqlite3_file* pFile, const void* zBuf, int iAmt, sqlite3_int64 iOfst) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  zvfs_shared* s = p->shared;
+  std::lock_guard<std::mutex> lock(s->mutex);
+  if (s->pageSize == 0) {
+    // SQLite writes whole pages, so the first write gives the page size.
+    bool isPage = iOfst == 0 && iAmt >= 512 && iAmt <= 65536 && (iAmt & (iAmt - 1)) == 0;
+    s->pageSize = isPage ? iAmt : kDefaultPageSize;
+  }
+  const char* in = (const char*)zBuf;
+  std::vector<char> page;
+  int rc = SQLITE_OK;
+  for (int done = 0; done < iAmt && rc == SQLITE_OK;) {
+    sqlite3_int64 pos = iOfst + done;
+    size_t index = (size_t)(pos / s->pageSize);
+    int start = (int)(pos % s->pageSize);
+    int count = std::min(s->pageSize - start, iAmt - done);
+    if (count == s->pageSize) {
+      rc = page_write(p, index, in + done);
+    } else {
+      // Writes of part of a page, for example after VACUUM changed the page
+      // size, update the stored page.
+      page.resize(s->pageSize);
+      rc = page_read(p, index, page.data());
+      if (rc == SQLITE_OK) {
+        memcpy(page.data() + start, in + done, count);
+        rc = page_write(p, index, page.data());
+      }
+    }
+    done += count;
+  }
+  if (rc == SQLITE_OK && iOfst + iAmt > s->size) {
+    s->size = iOfst + iAmt;
+    rc = map_write_header(p);
+  }
+  return rc;
+}
+
+int zvfs_truncate(sqlite3_file* pFile, sqlite3_int64 size) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  zvfs_shared* s = p->shared;
+  std::lock_guard<std::mutex> lock(s->mutex);
+  int rc = SQLITE_OK;
+  if (s->pageSize > 0) {
+    size_t keep = (size_t)((size + s->pageSize - 1) / s->pageSize);
+    if (s->entries.size() > keep) {
+      for (size_t i = keep; i < s->entries.size(); i++) {
+        if (s->entries[i].capacity > 0) {
+          s->pendingFree.push_back({s->entries[i].offset, s->entries[i].capacity});
+        }
+      }
+      s->entries.resize(keep);
+      rc = p->map->pMethods->xTruncate(p->map, kMapHeaderSize + keep * kMapEntrySize);
+    }
+    // The rest of the last page must read as zeros if the file grows again.
+    int tail = (int)(size % s->pageSize);
+    if (rc == SQLITE_OK && tail > 0 && keep <= s->entries.size() &&
+        s->entries[keep - 1].capacity > 0) {
+      std::vector<char> page(s->pageSize);
+      rc = page_read(p, keep - 1, page.data());
+      if (rc == SQLITE_OK) {
+        memset(page.data() + tail, 0, s->pageSize - tail);
+        rc = page_write(p, keep - 1, page.data());
+      }
+    }
+  }
+  if (rc == SQLITE_OK) {
+    s->size = size;
+    rc = map_write_header(p);
+  }
+  return rc == SQLITE_OK ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+}
+
+int zvfs_sync(sqlite3_file* pFile, int flags) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  zvfs_shared* s = p->shared;
+  size_t pending;
+  int rc = SQLITE_OK;
+  {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    pending = s->pendingFree.size();
+    // The other copy of the header, which is used if the next header write is
+    // torn, must not describe a size older than this sync.
+    if (s->headerSeq != s->syncedHeaderSeq) {
+      rc = map_write_header(p);
+      s->syncedHeaderSeq = s->headerSeq;
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = p->map->pMethods->xSync(p->map, flags);
+  }
+  if (rc == SQLITE_OK) {
+    rc = p->data->pMethods->xSync(p->data, flags);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // The slots given up before the sync are no longer referenced on disk.
+  std::lock_guard<std::mutex> lock(s->mutex);
+  for (size_t i = 0; i < pending; i++) {
+    free_add(s, s->pendingFree[i].first, s->pendingFree[i].second);
+  }
+  s->pendingFree.erase(s->pendingFree.begin(), s->pendingFree.begin() + pending);
+  if (!s->freeByOffset.empty()) {
+    auto last = std::prev(s->freeByOffset.end());
+    if (last->first + last->second >= s->dataEnd) {
+      s->dataEnd = last->first;
+      s->freeBySize.erase({last->second, last->first});
+      s->freeByOffset.erase(last);
+      // Not synced: if the truncation is lost, the space is found free again.
+      p->data->pMethods->xTruncate(p->data, s->dataEnd);
+    }
+  }
+  return SQLITE_OK;
+}
+
+int zvfs_file_size(sqlite3_file* pFile, sqlite3_int64* pSize) {
+  zvfs_shared* s = ((zvfs_file*)pFile)->shared;
+  std::lock_guard<std::mutex> lock(s->mutex);
+  *pSize = s->size;
+  return SQLITE_OK;
+}
+
+int zvfs_lock(sqlite3_file* pFile, int eLock) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  int rc = p->data->pMethods->xLock(p->data, eLock);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (p->level == SQLITE_LOCK_NONE) {
+    zvfs_shared* s = p->shared;
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (s->lockedConns == 0) {
+      rc = map_refresh(p);
+      if (rc != SQLITE_OK) {
+        p->data->pMethods->xUnlock(p->data, SQLITE_LOCK_NONE);
+        return rc;
+      }
+    }
+    s->lockedConns++;
+  }
+  p->level = eLock;
+  return SQLITE_OK;
+}
+
+int zvfs_unlock(sqlite3_file* pFile, int eLock) {
+  zvfs_file* p = (zvfs_file*)pFile;
+  zvfs_shared* s = p->shared;
+  int rc = SQLITE_OK;
+  if (p->level > SQLITE_LOCK_SHARED && eLock <= SQLITE_LOCK_SHARED) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (s->entriesDirty) {
+      // Tells other instances that the map changed, see above. Both copies
+      // of the header hold the same state afterwards.
+      rc = map_write_header(p);
+      s->entriesDirty = false;
+      s->syncedHeaderSeq = s->headerSeq;
+    }
+  }
+  int unlockRc = p->data->pMethods->xUnlock(p->data, eLock);
+  if (p->level >= SQLITE_LOCK_SHARED && eLock == SQLITE_LOCK_NONE) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->lockedConns--;
+  }
+  p->level = eLock;
+  return rc == SQLITE_OK ? unlockRc : SQLITE_IOERR_UNLOCK;
+}
+
+int zvfs_check_reserved_lock(sqlite3_file* pFile, int* pResOut) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xCheckReservedLock(data, pResOut);
+}
+
+int zvfs_file_control(sqlite3_file* pFile, int op, void* pArg) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xFileControl(data, op, pArg);
+}
+
+int zvfs_sector_size(sqlite3_file* pFile) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xSectorSize(data);
+}
+
+int zvfs_device_characteristics(sqlite3_file* pFile) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  int flags = data->pMethods->xDeviceCharacteristics(data);
+#ifdef SQLITE_IOCAP_BATCH_ATOMIC
+  flags &= ~SQLITE_IOCAP_BATCH_ATOMIC;
+#endif
+  return flags;
+}
+
+int zvfs_shm_map(sqlite3_file* pFile, int iPg, int pgsz, int bExtend, void volatile** pp) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xShmMap(data, iPg, pgsz, bExtend, pp);
+}
+
+int zvfs_shm_lock(sqlite3_file* pFile, int ofst, int n, int flags) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xShmLock(data, ofst, n, flags);
+}
+
+void zvfs_shm_barrier(sqlite3_file* pFile) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  data->pMethods->xShmBarrier(data);
+}
+
+int zvfs_shm_unmap(sqlite3_file* pFile, int deleteFlag) {
+  sqlite3_file* data = ((zvfs_file*)pFile)->data;
+  return data->pMethods->xShmUnmap(data, deleteFlag);
+}
+
+const sqlite3_io_methods g_zvfs_io_methods = {
+  2,                            // iVersion
+  zvfs_close,                   // xClose
+  zvfs_read,                    // xRead
+  zvfs_write,                   // xWrite
+  zvfs_truncate,                // xTruncate
+  zvfs_sync,                    // xSync
+  zvfs_file_size,               // xFileSize
+  zvfs_lock,                    // xLock
+  zvfs_unlock,                  // xUnlock
+  zvfs_check_reserved_lock,     // xCheckReservedLock
+  zvfs_file_control,            // xFileControl
+  zvfs_sector_size,             // xSectorSize
+  zvfs_device_characteristics,  // xDeviceCharacteristics
+  zvfs_shm_map,                 // xShmMap
+  zvfs_shm_lock,                // xShmLock
+  zvfs_shm_barrier,             // xShmBarrier
+  zvfs_shm_unmap,               // xShmUnmap
+};
+
+int zvfs_open(sqlite3_vfs* pVfs, const char* zName, sqlite3_file* pFile, int flags, int* pOutFlags) {
+  sqlite3_vfs* base = g_pthreadfs_vfs;
+  if (!(flags & SQLITE_OPEN_MAIN_DB) || zName == nullptr || !emscripten::is_pthreadfs_file(zName)) {
+    return base->xOpen(base, zName, pFile, flags, pOutFlags);
+  }
+  std::string mapPath = std::string(zName) + kMapSuffix;
+  // Not xAccess, which takes empty files for missing ones: the map is
+  // created before the first page is written, so its presence alone tells a
+  // compressed database.
+  struct stat st;
+  if (stat(mapPath.c_str(), &st) != 0) {
+    // Only new databases are created compressed, existing ones are left as
+    // they are.
+    if (!(flags & SQLITE_OPEN_READWRITE) || (stat(zName, &st) == 0 && st.st_size > 0)) {
+      return base->xOpen(base, zName, pFile, flags, pOutFlags);
+    }
+  }
+  int rc;
+
+  zvfs_file* p = (zvfs_file*)pFile;
+  memset(p, 0, sizeof(zvfs_file));
+  p->data = (sqlite3_file*)sqlite3_malloc(base->szOsFile);
+  p->map = (sqlite3_file*)sqlite3_malloc(base->szOsFile);
+  if (p->data == nullptr || p->map == nullptr) {
+    sqlite3_free(p->data);
+    sqlite3_free(p->map);
+    return SQLITE_NOMEM;
+  }
+  memset(p->data, 0, base->szOsFile);
+  memset(p->map, 0, base->szOsFile);
+  p->writable = (flags & SQLITE_OPEN_READWRITE) != 0;
+  {
+    std::lock_guard<std::mutex> lock(g_zvfs_mutex);
+    p->shared = &g_zvfs_files[zName];
+    if (p->shared->refs++ == 0) {
+      p->shared->path = zName;
+      p->shared->mapPath = mapPath;
+    }
+  }
+  rc = base->xOpen(base, zName, p->data, flags, pOutFlags);
+  if (rc == SQLITE_OK) {
+    // Any type other than the main database and temporary files will do for
+    // the PThreadFS VFS.
+    int mapFlags =
+      (flags & (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) | SQLITE_OPEN_MAIN_JOURNAL;
+    rc = base->xOpen(base, p->shared->mapPath.c_str(), p->map, mapFlags, nullptr);
+  }
+  if (rc == SQLITE_OK) {
+    std::lock_guard<std::mutex> lock(p->shared->mutex);
+    if (!p->shared->loaded) {
+      rc = map_load(p, p->writable);
+      p->shared->loaded = rc == SQLITE_OK;
+    }
+  }
+  if (rc != SQLITE_OK) {
+    zvfs_release(p);
+    return rc;
+  }
+  p->base.pMethods = &g_zvfs_io_methods;
+  return SQLITE_OK;
+}
+
+} // namespace
+
+extern "C" int sqlite3_pthreadfs_zvfs_register(int makeDefault) {
+  if (g_pthreadfs_vfs == nullptr) {
+    if (sqlite3_vfs_find(PTHREADFS_VFS_NAME) == nullptr) {
+      int rc = sqlite3_pthreadfs_vfs_register(0);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    g_pthreadfs_vfs = sqlite3_vfs_find(PTHREADFS_VFS_NAME);
+    // The PThreadFS VFS does not use its sqlite3_vfs argument, so all methods
+    // other than xOpen are shared with it.
+    int szOsFile = (int)sizeof(zvfs_file);
+    g_zvfs = *g_pthreadfs_vfs;
+    g_zvfs.pNext = nullptr;
+    g_zvfs.szOsFile = szOsFile > g_pthreadfs_vfs->szOsFile ? szOsFile : g_pthreadfs_vfs->szOsFile;
+    g_zvfs.zName = PTHREADFS_ZVFS_NAME;
+    g_zvfs.xOpen = zvfs_open;
+  }
+  return sqlite3_vfs_register(&g_zvfs, makeDefault);
+}
+
+extern "C" void sqlite3_pthreadfs_zvfs_stats(pthreadfs_zvfs_stats* pStats) {
+  pStats->pagesWritten = (double)g_pages_written.load();
+  pStats->pagesStoredRaw = (double)g_pages_raw.load();
+  pStats->bytesIn = (double)g_bytes_in.load();
+  pStats->bytesOut = (double)g_bytes_out.load();
+  pStats->pagesRead = (double)g_pages_read.load();
+  pStats->compressMs = g_compress_ns.load() / 1e6;
+  pStats->decompressMs = g_decompress_ns.load() / 1e6;
+}
+
+#else // PTHREADFS_ZVFS_LZ4
+
+// Built without libs/lz4: the compression VFS is not available.
+extern "C" int sqlite3_pthreadfs_zvfs_register(int) {
+  return SQLITE_ERROR;
+}
+
+extern "C" void sqlite3_pthreadfs_zvfs_stats(pthreadfs_zvfs_stats* pStats) {
+  memset(pStats, 0, sizeof(*pStats));
+}
+
+#endif // PTHREADFS_ZVFS_LZ4
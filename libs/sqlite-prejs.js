@@ -2,6 +2,14 @@ var Module = Module || {};
 Module['arguments'] = Module['arguments'] || [];
 Module['arguments'].push('3');
 Module['arguments'].push(`/persistent/db${Math.random()}`);
+// Further speedtest1 options can be given in the page URL, for example
+// index.html?args=--journal+wal+--stats
+if (typeof location !== 'undefined') {
+  let extraArgs = new URLSearchParams(location.search).get('args');
+  if (extraArgs) {
+    Module['arguments'].push(...extraArgs.split(' ').filter((arg) => arg));
+  }
+}
 
 Module['preRun'] = Module['preRun'] || [];
 Module['preRun'].push(() => {
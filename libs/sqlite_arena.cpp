@@ -0,0 +1,253 @@
+#include "sqlite_arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Built against either libs/sqlite3.h or libs/sqlite_js/sqlite3.h, depending on
+// the include path.
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+// SQLite allocates many small objects and page cache entries of a few sizes,
+// and frees most of them on the pthread that allocated them. Each pthread keeps
+// a list of free blocks per size class and only takes the lock of the shared
+// list of a class to move a batch of blocks in or out. The shared lists are
+// filled from spans of kSpanBytes, which are never freed. Allocations above the
+// largest class go to malloc().
+
+namespace {
+
+// Precedes every block. `size` is only used by allocations above the largest
+// class, which have kLargeClass as their class.
+struct arena_header {
+  uint32_t sizeClass;
+  uint32_t size;
+};
+static_assert(sizeof(arena_header) == 8, "blocks must stay 8-byte aligned");
+
+constexpr uint32_t kLargeClass = UINT32_MAX;
+
+// Four classes per power of two, so that at most a fifth of a block is unused.
+constexpr int kClassSizes[] = {8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224,
+  256, 320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096,
+  5120, 6144, 7168, 8192, 10240, 12288, 14336, 16384, 20480, 24576, 28672, 32768};
+constexpr int kClassCount = sizeof(kClassSizes) / sizeof(kClassSizes[0]);
+constexpr int kMaxClassSize = kClassSizes[kClassCount - 1];
+
+// A pthread caches up to kCacheBytes of free blocks per class, but at least a
+// few blocks, and hands half of them back when it has more.
+constexpr int kCacheBytes = 64 * 1024;
+constexpr int kMinCacheBlocks = 4;
+constexpr size_t kSpanBytes = 256 * 1024;
+
+struct free_block {
+  free_block* next;
+};
+
+struct arena_central {
+  std::mutex mutex;
+  free_block* head = nullptr;
+};
+
+arena_central g_central[kClassCount];
+
+std::atomic<long long> g_mallocs{0};
+std::atomic<long long> g_frees{0};
+std::atomic<long long> g_cache_misses{0};
+std::atomic<long long> g_large_allocs{0};
+std::atomic<long long> g_bytes_reserved{0};
+
+int size_class(int n) {
+  return (int)(std::lower_bound(kClassSizes, kClassSizes + kClassCount, n) - kClassSizes);
+}
+
+int cache_limit(int cls) { return std::max(kMinCacheBlocks, kCacheBytes / kClassSizes[cls]); }
+
+// Adds a new span of blocks of class `cls` to the shared list. Called with the
+// lock of the shared list held.
+bool span_carve(arena_central& central, int cls) {
+  size_t blockSize = sizeof(arena_header) + kClassSizes[cls];
+  size_t count = std::max<size_t>(kMinCacheBlocks * 2, kSpanBytes / blockSize);
+  char* span = (char*)malloc(count * blockSize);
+  if (span == nullptr) {
+    return false;
+  }
+  g_bytes_reserved += count * blockSize;
+  for (size_t i = count; i-- > 0;) {
+    arena_header* header = (arena_header*)(span + i * blockSize);
+    header->sizeClass = (uint32_t)cls;
+    header->size = 0;
+    free_block* block = (free_block*)(header + 1);
+    block->next = central.head;
+    central.head = block;
+  }
+  return true;
+}
+
+struct arena_cache {
+  free_block* heads[kClassCount] = {};
+  int counts[kClassCount] = {};
+  long long mallocs = 0;
+  long long frees = 0;
+
+  void publish() {
+    g_mallocs += mallocs;
+    g_frees += frees;
+    mallocs = 0;
+    frees = 0;
+  }
+
+  // Moves up to half of the limit of blocks of class `cls` from the shared list.
+  bool refill(int cls) {
+    arena_central& central = g_central[cls];
+    std::lock_guard<std::mutex> lock(central.mutex);
+    if (central.head == nullptr && !span_carve(central, cls)) {
+      return false;
+    }
+    for (int n = std::max(1, cache_limit(cls) / 2); n > 0 && central.head != nullptr; n--) {
+      free_block* block = central.head;
+      central.head = block->next;
+      block->next = heads[cls];
+      heads[cls] = block;
+      counts[cls]++;
+    }
+    return true;
+  }
+
+  // Moves `n` blocks of class `cls` to the shared list.
+  void flush(int cls, int n) {
+    if (n <= 0) {
+      return;
+    }
+    free_block* first = heads[cls];
+    free_block* last = first;
+    for (int i = 1; i < n; i++) {
+      last = last->next;
+    }
+    heads[cls] = last->next;
+    counts[cls] -= n;
+    arena_central& central = g_central[cls];
+    std::lock_guard<std::mutex> lock(central.mutex);
+    last->next = central.head;
+    central.head = first;
+  }
+
+  ~arena_cache() {
+    for (int cls = 0; cls < kClassCount; cls++) {
+      flush(cls, counts[cls]);
+    }
+    publish();
+  }
+};
+
+thread_local arena_cache t_cache;
+
+void* arena_malloc(int n) {
+  arena_cache& cache = t_cache;
+  cache.mallocs++;
+  if (n > kMaxClassSize) {
+    arena_header* header = (arena_header*)malloc(sizeof(arena_header) + n);
+    if (header == nullptr) {
+      return nullptr;
+    }
+    header->sizeClass = kLargeClass;
+    header->size = (uint32_t)n;
+    g_large_allocs++;
+    return header + 1;
+  }
+  int cls = size_class(n);
+  if (cache.heads[cls] == nullptr) {
+    g_cache_misses++;
+    cache.publish();
+    if (!cache.refill(cls)) {
+      return nullptr;
+    }
+  }
+  free_block* block = cache.heads[cls];
+  cache.heads[cls] = block->next;
+  cache.counts[cls]--;
+  return block;
+}
+
+void arena_free(void* p) {
+  arena_header* header = (arena_header*)p - 1;
+  arena_cache& cache = t_cache;
+  cache.frees++;
+  if (header->sizeClass == kLargeClass) {
+    free(header);
+    return;
+  }
+  int cls = (int)header->sizeClass;
+  free_block* block = (free_block*)p;
+  block->next = cache.heads[cls];
+  cache.heads[cls] = block;
+  if (++cache.counts[cls] > cache_limit(cls)) {
+    cache.publish();
+    cache.flush(cls, cache.counts[cls] / 2);
+  }
+}
+
+int arena_size(void* p) {
+  arena_header* header = (arena_header*)p - 1;
+  return header->sizeClass == kLargeClass ? (int)header->size : kClassSizes[header->sizeClass];
+}
+
+void* arena_realloc(void* p, int n) {
+  arena_header* header = (arena_header*)p - 1;
+  if (header->sizeClass == kLargeClass && n > kMaxClassSize) {
+    header = (arena_header*)realloc(header, sizeof(arena_header) + n);
+    if (header == nullptr) {
+      return nullptr;
+    }
+    header->size = (uint32_t)n;
+    return header + 1;
+  }
+  if (header->sizeClass != kLargeClass && n <= kMaxClassSize &&
+      size_class(n) == (int)header->sizeClass) {
+    return p;
+  }
+  void* moved = arena_malloc(n);
+  if (moved == nullptr) {
+    return nullptr;
+  }
+  memcpy(moved, p, std::min(n, arena_size(p)));
+  arena_free(p);
+  return moved;
+}
+
+int arena_roundup(int n) {
+  return n > kMaxClassSize ? (n + 7) & ~7 : kClassSizes[size_class(n)];
+}
+
+int arena_init(void* pAppData) { return SQLITE_OK; }
+
+void arena_shutdown(void* pAppData) {}
+
+} // namespace
+
+extern "C" int sqlite3_arena_install(void) {
+  static const sqlite3_mem_methods methods = {
+    arena_malloc,   // xMalloc
+    arena_free,     // xFree
+    arena_realloc,  // xRealloc
+    arena_size,     // xSize
+    arena_roundup,  // xRoundup
+    arena_init,     // xInit
+    arena_shutdown, // xShutdown
+    nullptr,        // pAppData
+  };
+  return sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+}
+
+extern "C" void sqlite3_arena_stats(sqlite_arena_stats* pStats) {
+  t_cache.publish();
+  pStats->mallocs = g_mallocs.load();
+  pStats->frees = g_frees.load();
+  pStats->cacheMisses = g_cache_misses.load();
+  pStats->largeAllocs = g_large_allocs.load();
+  pStats->bytesReserved = g_bytes_reserved.load();
+}
@@ -0,0 +1,32 @@
+#ifndef SQLITE_ARENA_H
+#define SQLITE_ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Installs an allocator for SQLite with sqlite3_config(SQLITE_CONFIG_MALLOC).
+// Allocations of up to 32 KiB are served from size classes, with a cache of
+// free blocks per pthread, so that most calls take no lock and never reach the
+// allocator that all pthreads of the module share. Memory of the size classes
+// is kept for reuse and not returned to the system. Must be called before
+// sqlite3_initialize(). Returns an SQLite result code.
+int sqlite3_arena_install(void);
+
+// Counters of the allocator. Calls are counted per pthread and published when
+// the pthread's cache exchanges blocks with the shared lists, so they may lag
+// slightly behind.
+typedef struct sqlite_arena_stats {
+  long long mallocs;       // xMalloc and xRealloc calls that allocated.
+  long long frees;         // Blocks freed, including by xRealloc.
+  long long cacheMisses;   // Allocations that had to refill a pthread cache.
+  long long largeAllocs;   // Allocations above the largest size class.
+  long long bytesReserved; // Memory taken from the system for size classes.
+} sqlite_arena_stats;
+void sqlite3_arena_stats(sqlite_arena_stats* pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SQLITE_ARENA_H
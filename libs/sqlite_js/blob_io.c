@@ -0,0 +1,26 @@
+/*
+** Incremental BLOB I/O for BlobStream in src/sqlite_wrapper/wrapper.js.
+**
+** sqlite3_blob_open() and sqlite3_blob_reopen() take the rowid as a 64-bit
+** integer, which cwrap() cannot pass. These take it as a double, which holds
+** every rowid JavaScript can represent as a number. The other sqlite3_blob_*
+** functions are called directly.
+*/
+#include "sqlite3.h"
+
+int blob_io_open(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zTable,
+  const char *zColumn,
+  double iRow,
+  int flags,              /* 0 to open read-only, 1 to open for writing */
+  sqlite3_blob **ppBlob
+){
+  return sqlite3_blob_open(db, zDb, zTable, zColumn, (sqlite3_int64)iRow,
+                           flags, ppBlob);
+}
+
+int blob_io_reopen(sqlite3_blob *pBlob, double iRow){
+  return sqlite3_blob_reopen(pBlob, (sqlite3_int64)iRow);
+}
@@ -0,0 +1,138 @@
+/*
+** Bulk inserts for Database.insertMany() in src/sqlite_wrapper/wrapper.js.
+**
+** bulk_insert_run() binds, steps and resets one prepared statement for every
+** row inside a savepoint, so that inserting many rows takes a single call from
+** JavaScript. Parameter i of the statement takes its values from aCol[i], a
+** buffer of nRow values of the kind aKind[i]:
+**
+**     BULK_COLUMN_VALUES  encoded values, each a type byte and its payload:
+**                           SQLITE_INTEGER  8-byte integer
+**                           SQLITE_FLOAT    8-byte double
+**                           SQLITE_TEXT     4-byte length, then UTF-8 bytes
+**                           SQLITE_BLOB     4-byte length, then the bytes
+**                           SQLITE_NULL     nothing
+**     BULK_COLUMN_F64     doubles
+**     BULK_COLUMN_I32     32-bit integers
+**     BULK_COLUMN_I64     64-bit integers
+**
+** Rows are inserted up to the first error. The rows before it are kept, and
+** the error message is returned, so the caller learns both how far it got and
+** why it stopped. Callers that want all or nothing run it in a transaction.
+*/
+#include <string.h>
+
+#include "sqlite3.h"
+
+#define BULK_COLUMN_VALUES 0
+#define BULK_COLUMN_F64    1
+#define BULK_COLUMN_I32    2
+#define BULK_COLUMN_I64    3
+
+/* Binds the next encoded value of *pa to parameter i and advances *pa. */
+static int bulkBindValue(sqlite3_stmt *pStmt, int i, const unsigned char **pa){
+  const unsigned char *a = *pa;
+  int eType = *a++;
+  sqlite3_int64 v;
+  double r;
+  int n, rc;
+  switch( eType ){
+    case SQLITE_INTEGER:
+      memcpy(&v, a, 8);
+      a += 8;
+      rc = sqlite3_bind_int64(pStmt, i, v);
+      break;
+    case SQLITE_FLOAT:
+      memcpy(&r, a, 8);
+      a += 8;
+      rc = sqlite3_bind_double(pStmt, i, r);
+      break;
+    case SQLITE_TEXT:
+      memcpy(&n, a, 4);
+      rc = sqlite3_bind_text(pStmt, i, (const char*)a+4, n, SQLITE_STATIC);
+      a += 4+n;
+      break;
+    case SQLITE_BLOB:
+      memcpy(&n, a, 4);
+      rc = sqlite3_bind_blob(pStmt, i, a+4, n, SQLITE_STATIC);
+      a += 4+n;
+      break;
+    default:
+      rc = sqlite3_bind_null(pStmt, i);
+      break;
+  }
+  *pa = a;
+  return rc;
+}
+
+/*
+** Inserts nRow rows with pStmt, see above. *pnDone is set to the number of
+** rows inserted. On error, *pzErr is set to a message to be released with
+** sqlite3_free(). Returns an SQLite result code.
+*/
+int bulk_insert_run(
+  sqlite3 *db,
+  sqlite3_stmt *pStmt,
+  int nRow,
+  int nCol,
+  const int *aKind,
+  const unsigned char **aCol,   /* Read positions are advanced in place */
+  int *pnDone,
+  char **pzErr
+){
+  int iRow, rc;
+  *pnDone = 0;
+  *pzErr = 0;
+  if( nCol!=sqlite3_bind_parameter_count(pStmt) ){
+    *pzErr = sqlite3_mprintf("%d values per row for %d parameters",
+                             nCol, sqlite3_bind_parameter_count(pStmt));
+    return SQLITE_RANGE;
+  }
+  rc = sqlite3_exec(db, "SAVEPOINT bulk_insert", 0, 0, 0);
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  for(iRow=0; iRow<nRow && rc==SQLITE_OK; iRow++){
+    int i;
+    for(i=0; i<nCol && rc==SQLITE_OK; i++){
+      const unsigned char *a = aCol[i];
+      switch( aKind[i] ){
+        case BULK_COLUMN_F64:
+          rc = sqlite3_bind_double(pStmt, i+1, ((const double*)a)[iRow]);
+          break;
+        case BULK_COLUMN_I32:
+          rc = sqlite3_bind_int(pStmt, i+1, ((const int*)a)[iRow]);
+          break;
+        case BULK_COLUMN_I64:
+          rc = sqlite3_bind_int64(pStmt, i+1, ((const sqlite3_int64*)a)[iRow]);
+          break;
+        default:
+          rc = bulkBindValue(pStmt, i+1, &aCol[i]);
+          break;
+      }
+    }
+    if( rc==SQLITE_OK ){
+      rc = sqlite3_step(pStmt);
+      if( rc==SQLITE_DONE || rc==SQLITE_ROW ){
+        rc = SQLITE_OK;
+        (*pnDone)++;
+      }
+    }
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("row %d: %s", iRow, sqlite3_errmsg(db));
+    }
+    sqlite3_reset(pStmt);
+  }
+  sqlite3_clear_bindings(pStmt);
+  if( sqlite3_exec(db, "RELEASE bulk_insert", 0, 0, 0)!=SQLITE_OK ){
+    int rcRelease = sqlite3_extended_errcode(db);
+    if( *pzErr==0 ){
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      rc = rcRelease;
+    }
+    sqlite3_exec(db, "ROLLBACK TO bulk_insert; RELEASE bulk_insert", 0, 0, 0);
+    *pnDone = 0;
+  }
+  return rc;
+}
@@ -0,0 +1,185 @@
+/*
+** Column-wise result sets for Database.execColumnar() in
+** src/sqlite_wrapper/wrapper.js.
+**
+** columnar_step() steps a statement and appends every value to the buffers of
+** its column, so that JavaScript makes one call per batch of rows instead of
+** one per value. Each column has, per row:
+**
+**     aType    the SQLite type of the value (1 byte)
+**     aNum     an 8-byte slot: the integer for SQLITE_INTEGER, the double for
+**              SQLITE_FLOAT, 0 otherwise
+**     aOffset  the end of the value in aData, for SQLITE_TEXT and SQLITE_BLOB;
+**              aOffset[0] is 0, so value i is aData[aOffset[i]..aOffset[i+1]]
+**
+** columnar_finish() converts the integer slots to doubles where JavaScript
+** will read aNum as a Float64Array: in columns that also hold floats, and in
+** all columns unless BigInt values are requested.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlite3.h"
+
+typedef struct ColumnarColumn ColumnarColumn;
+struct ColumnarColumn {
+  unsigned char *aType;
+  sqlite3_int64 *aNum;
+  int *aOffset;           /* nRowAlloc+1 entries */
+  unsigned char *aData;
+  int nData, nDataAlloc;
+  int mType;              /* Bit (1<<type) is set for every type seen */
+};
+
+typedef struct Columnar Columnar;
+struct Columnar {
+  int nCol;
+  int nRow, nRowAlloc;
+  ColumnarColumn *aCol;
+};
+
+Columnar *columnar_new(sqlite3_stmt *pStmt){
+  Columnar *p = calloc(1, sizeof(Columnar));
+  if( p==0 ) return 0;
+  p->nCol = sqlite3_column_count(pStmt);
+  p->aCol = calloc(p->nCol>0 ? p->nCol : 1, sizeof(ColumnarColumn));
+  if( p->aCol==0 ){
+    free(p);
+    return 0;
+  }
+  return p;
+}
+
+void columnar_free(Columnar *p){
+  int i;
+  if( p==0 ) return;
+  for(i=0; i<p->nCol; i++){
+    free(p->aCol[i].aType);
+    free(p->aCol[i].aNum);
+    free(p->aCol[i].aOffset);
+    free(p->aCol[i].aData);
+  }
+  free(p->aCol);
+  free(p);
+}
+
+/* Makes room for one more row in every column. */
+static int columnarGrowRows(Columnar *p){
+  int nNew = p->nRowAlloc ? p->nRowAlloc*2 : 1024;
+  int i;
+  for(i=0; i<p->nCol; i++){
+    ColumnarColumn *c = &p->aCol[i];
+    unsigned char *aType = realloc(c->aType, nNew);
+    sqlite3_int64 *aNum;
+    int *aOffset;
+    if( aType==0 ) return SQLITE_NOMEM;
+    c->aType = aType;
+    aNum = realloc(c->aNum, nNew*sizeof(sqlite3_int64));
+    if( aNum==0 ) return SQLITE_NOMEM;
+    c->aNum = aNum;
+    aOffset = realloc(c->aOffset, (nNew+1)*sizeof(int));
+    if( aOffset==0 ) return SQLITE_NOMEM;
+    if( c->aOffset==0 ) aOffset[0] = 0;
+    c->aOffset = aOffset;
+  }
+  p->nRowAlloc = nNew;
+  return SQLITE_OK;
+}
+
+static int columnarAppendData(ColumnarColumn *c, const void *pData, int n){
+  if( c->nData+n>c->nDataAlloc ){
+    int nNew = c->nDataAlloc ? c->nDataAlloc*2 : 4096;
+    unsigned char *aNew;
+    while( nNew<c->nData+n ) nNew *= 2;
+    aNew = realloc(c->aData, nNew);
+    if( aNew==0 ) return SQLITE_NOMEM;
+    c->aData = aNew;
+    c->nDataAlloc = nNew;
+  }
+  if( n>0 ) memcpy(c->aData+c->nData, pData, n);
+  c->nData += n;
+  return SQLITE_OK;
+}
+
+/*
+** Steps pStmt for up to nMaxRow rows, or until it is done if nMaxRow<=0, and
+** appends the rows. Returns SQLITE_ROW if more rows may follow, SQLITE_DONE,
+** or an error code.
+*/
+int columnar_step(Columnar *p, sqlite3_stmt *pStmt, int nMaxRow){
+  int nStep = 0;
+  int rc;
+  while( nMaxRow<=0 || nStep<nMaxRow ){
+    int i;
+    rc = sqlite3_step(pStmt);
+    if( rc!=SQLITE_ROW ) return rc;
+    if( p->nRow==p->nRowAlloc && columnarGrowRows(p) ) return SQLITE_NOMEM;
+    for(i=0; i<p->nCol; i++){
+      ColumnarColumn *c = &p->aCol[i];
+      int eType = sqlite3_column_type(pStmt, i);
+      c->aType[p->nRow] = (unsigned char)eType;
+      c->mType |= 1<<eType;
+      c->aNum[p->nRow] = 0;
+      switch( eType ){
+        case SQLITE_INTEGER:
+          c->aNum[p->nRow] = sqlite3_column_int64(pStmt, i);
+          break;
+        case SQLITE_FLOAT: {
+          double r = sqlite3_column_double(pStmt, i);
+          memcpy(&c->aNum[p->nRow], &r, sizeof(r));
+          break;
+        }
+        case SQLITE_TEXT:
+          if( columnarAppendData(c, sqlite3_column_text(pStmt, i),
+                                 sqlite3_column_bytes(pStmt, i)) ){
+            return SQLITE_NOMEM;
+          }
+          break;
+        case SQLITE_BLOB:
+          if( columnarAppendData(c, sqlite3_column_blob(pStmt, i),
+                                 sqlite3_column_bytes(pStmt, i)) ){
+            return SQLITE_NOMEM;
+          }
+          break;
+      }
+      c->aOffset[p->nRow+1] = c->nData;
+    }
+    p->nRow++;
+    nStep++;
+  }
+  return SQLITE_ROW;
+}
+
+/* Converts integer slots to doubles, see the comment at the top. */
+void columnar_finish(Columnar *p, int bBigInt){
+  int i, j;
+  for(i=0; i<p->nCol; i++){
+    ColumnarColumn *c = &p->aCol[i];
+    if( (c->mType & (1<<SQLITE_INTEGER))==0 ) continue;
+    if( bBigInt && (c->mType & (1<<SQLITE_FLOAT))==0 ) continue;
+    for(j=0; j<p->nRow; j++){
+      if( c->aType[j]==SQLITE_INTEGER ){
+        double r = (double)c->aNum[j];
+        memcpy(&c->aNum[j], &r, sizeof(r));
+      }
+    }
+  }
+}
+
+int columnar_row_count(Columnar *p){
+  return p->nRow;
+}
+
+/*
+** Writes the type mask and the buffers of column iCol to aOut: mType, aType,
+** aNum, aOffset, aData and nData.
+*/
+void columnar_column(Columnar *p, int iCol, int *aOut){
+  ColumnarColumn *c = &p->aCol[iCol];
+  aOut[0] = c->mType;
+  aOut[1] = (int)(size_t)c->aType;
+  aOut[2] = (int)(size_t)c->aNum;
+  aOut[3] = (int)(size_t)c->aOffset;
+  aOut[4] = (int)(size_t)c->aData;
+  aOut[5] = c->nData;
+}
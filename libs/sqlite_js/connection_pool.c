@@ -0,0 +1,345 @@
+/*
+** A pool of read-only SQLite connections, each running on its own pthread.
+**
+** Queries are submitted from the thread that owns the module and queued in
+** FIFO order; the first idle reader runs the next query. Results are encoded
+** into a malloc()ed buffer which is handed back to the owning thread with
+** MAIN_THREAD_ASYNC_EM_ASM, so submitting never blocks the caller. The
+** JavaScript side (src/sqlite_wrapper/wrapper.js) decodes and frees it.
+**
+** Parameters and results use the same little-endian encoding. A value is a
+** type byte followed by its payload:
+**
+**     SQLITE_INTEGER, SQLITE_FLOAT   8-byte double
+**     SQLITE_TEXT, SQLITE_BLOB       4-byte length, then the bytes
+**     SQLITE_NULL                    nothing
+**
+** Parameters are a 4-byte count followed by that many values. A result starts
+** with the 4-byte SQLite result code. On error, a length-prefixed message
+** follows. Otherwise a 4-byte number of result sets follows, and each is
+** encoded as: column count, length-prefixed column names, row count, and the
+** values in row order.
+**
+** Requires SQLITE_THREADSAFE=1 or 2: every connection is only used by the
+** thread that opened it.
+*/
+#include <emscripten.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlite3.h"
+
+typedef struct PoolJob PoolJob;
+struct PoolJob {
+  int id;                  /* Passed back to JavaScript with the result */
+  char *zSql;              /* SQL text, owned by the job */
+  unsigned char *aParam;   /* Encoded parameters or NULL, owned by the job */
+  PoolJob *pNext;
+};
+
+typedef struct ConnectionPool ConnectionPool;
+struct ConnectionPool {
+  char *zPath;
+  int nReader;
+  pthread_t *aThread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  PoolJob *pFirst, *pLast;  /* Queued jobs */
+  int nIdle;                /* Readers waiting for a job */
+  int bQuit;
+};
+
+/* A growable output buffer. After an allocation failure, appends are ignored
+** and poolRun() returns no result. */
+typedef struct PoolBuf PoolBuf;
+struct PoolBuf {
+  unsigned char *a;
+  int n, nAlloc;
+  int oom;
+};
+
+static void poolBufAppend(PoolBuf *p, const void *pData, int n){
+  if( p->oom ) return;
+  if( p->n+n>p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 4096;
+    unsigned char *aNew;
+    while( nNew<p->n+n ) nNew *= 2;
+    aNew = realloc(p->a, nNew);
+    if( aNew==0 ){
+      p->oom = 1;
+      return;
+    }
+    p->a = aNew;
+    p->nAlloc = nNew;
+  }
+  memcpy(p->a+p->n, pData, n);
+  p->n += n;
+}
+
+static void poolBufInt(PoolBuf *p, int v){
+  poolBufAppend(p, &v, 4);
+}
+
+static void poolBufString(PoolBuf *p, const char *z){
+  int n = z ? (int)strlen(z) : 0;
+  poolBufInt(p, n);
+  poolBufAppend(p, z, n);
+}
+
+static void poolBufError(PoolBuf *p, int rc, const char *zMsg){
+  p->n = 0;
+  p->oom = 0;
+  poolBufInt(p, rc);
+  poolBufString(p, zMsg);
+}
+
+static int poolBind(sqlite3_stmt *pStmt, const unsigned char *a){
+  int nParam, i, rc = SQLITE_OK;
+  if( a==0 ) return SQLITE_OK;
+  memcpy(&nParam, a, 4);
+  a += 4;
+  for(i=1; i<=nParam && rc==SQLITE_OK; i++){
+    int eType = *a++;
+    double r;
+    int n;
+    switch( eType ){
+      case SQLITE_INTEGER:
+        memcpy(&r, a, 8);
+        a += 8;
+        rc = sqlite3_bind_int64(pStmt, i, (sqlite3_int64)r);
+        break;
+      case SQLITE_FLOAT:
+        memcpy(&r, a, 8);
+        a += 8;
+        rc = sqlite3_bind_double(pStmt, i, r);
+        break;
+      case SQLITE_TEXT:
+        memcpy(&n, a, 4);
+        rc = sqlite3_bind_text(pStmt, i, (const char*)a+4, n, SQLITE_STATIC);
+        a += 4+n;
+        break;
+      case SQLITE_BLOB:
+        memcpy(&n, a, 4);
+        rc = sqlite3_bind_blob(pStmt, i, a+4, n, SQLITE_STATIC);
+        a += 4+n;
+        break;
+      default:
+        rc = sqlite3_bind_null(pStmt, i);
+        break;
+    }
+  }
+  return rc;
+}
+
+/* Appends the rows of pStmt as one result set. */
+static int poolStepAll(sqlite3_stmt *pStmt, PoolBuf *p){
+  int nCol = sqlite3_column_count(pStmt);
+  int iRowCount, nRow = 0;
+  int i, rc;
+  poolBufInt(p, nCol);
+  for(i=0; i<nCol; i++){
+    poolBufString(p, sqlite3_column_name(pStmt, i));
+  }
+  iRowCount = p->n;
+  poolBufInt(p, 0);
+  while( (rc = sqlite3_step(pStmt))==SQLITE_ROW ){
+    for(i=0; i<nCol; i++){
+      unsigned char eType = (unsigned char)sqlite3_column_type(pStmt, i);
+      double r;
+      int n;
+      poolBufAppend(p, &eType, 1);
+      switch( eType ){
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT:
+          r = sqlite3_column_double(pStmt, i);
+          poolBufAppend(p, &r, 8);
+          break;
+        case SQLITE_TEXT:
+          n = sqlite3_column_bytes(pStmt, i);
+          poolBufInt(p, n);
+          poolBufAppend(p, sqlite3_column_text(pStmt, i), n);
+          break;
+        case SQLITE_BLOB:
+          n = sqlite3_column_bytes(pStmt, i);
+          poolBufInt(p, n);
+          poolBufAppend(p, sqlite3_column_blob(pStmt, i), n);
+          break;
+      }
+    }
+    nRow++;
+  }
+  if( !p->oom ) memcpy(p->a+iRowCount, &nRow, 4);
+  return rc==SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* Runs every statement of pJob->zSql and returns the encoded result. */
+static unsigned char *poolRun(sqlite3 *db, PoolJob *pJob){
+  PoolBuf buf = {0, 0, 0, 0};
+  const char *zSql = pJob->zSql;
+  int nSet = 0;
+  int rc = SQLITE_OK;
+  poolBufInt(&buf, SQLITE_OK);
+  poolBufInt(&buf, 0);
+  while( rc==SQLITE_OK && zSql[0] ){
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, &zSql);
+    if( rc!=SQLITE_OK || pStmt==0 ) continue;
+    rc = poolBind(pStmt, pJob->aParam);
+    if( rc==SQLITE_OK ){
+      rc = poolStepAll(pStmt, &buf);
+      nSet++;
+    }
+    sqlite3_finalize(pStmt);
+  }
+  if( rc!=SQLITE_OK ){
+    poolBufError(&buf, rc, sqlite3_errmsg(db));
+  }else if( !buf.oom ){
+    memcpy(buf.a+4, &nSet, 4);
+  }
+  if( buf.oom ){
+    free(buf.a);
+    return 0;
+  }
+  return buf.a;
+}
+
+static void *poolReaderMain(void *pArg){
+  ConnectionPool *pPool = (ConnectionPool*)pArg;
+  sqlite3 *db = 0;
+  int rc = sqlite3_open_v2(pPool->zPath, &db, SQLITE_OPEN_READONLY, 0);
+  if( rc==SQLITE_OK ){
+    /* A rollback-journal writer can hold the database exclusively for a
+    ** moment. In WAL mode readers are not blocked at all. */
+    sqlite3_busy_timeout(db, 2000);
+  }
+  pthread_mutex_lock(&pPool->mutex);
+  while( 1 ){
+    PoolJob *pJob;
+    unsigned char *aResult;
+    pPool->nIdle++;
+    while( pPool->pFirst==0 && !pPool->bQuit ){
+      pthread_cond_wait(&pPool->cond, &pPool->mutex);
+    }
+    pPool->nIdle--;
+    if( pPool->bQuit ) break;
+    pJob = pPool->pFirst;
+    pPool->pFirst = pJob->pNext;
+    if( pPool->pFirst==0 ) pPool->pLast = 0;
+    pthread_mutex_unlock(&pPool->mutex);
+
+    if( rc==SQLITE_OK ){
+      aResult = poolRun(db, pJob);
+    }else{
+      PoolBuf buf = {0, 0, 0, 0};
+      poolBufError(&buf, rc, sqlite3_errstr(rc));
+      aResult = buf.a;
+    }
+    MAIN_THREAD_ASYNC_EM_ASM({
+      Module["connectionPoolDone"]($0, $1);
+    }, pJob->id, aResult);
+    free(pJob->zSql);
+    free(pJob->aParam);
+    free(pJob);
+
+    pthread_mutex_lock(&pPool->mutex);
+  }
+  pthread_mutex_unlock(&pPool->mutex);
+  sqlite3_close(db);
+  return 0;
+}
+
+/*
+** Opens nReader read-only connections on zPath, each on its own pthread.
+** Returns NULL if the pool cannot be allocated.
+*/
+ConnectionPool *connection_pool_open(const char *zPath, int nReader){
+  ConnectionPool *pPool = calloc(1, sizeof(ConnectionPool));
+  int i;
+  if( pPool==0 ) return 0;
+  pPool->zPath = strdup(zPath);
+  pPool->aThread = calloc(nReader, sizeof(pthread_t));
+  if( pPool->zPath==0 || pPool->aThread==0 ){
+    free(pPool->zPath);
+    free(pPool->aThread);
+    free(pPool);
+    return 0;
+  }
+  pthread_mutex_init(&pPool->mutex, 0);
+  pthread_cond_init(&pPool->cond, 0);
+  for(i=0; i<nReader; i++){
+    if( pthread_create(&pPool->aThread[i], 0, poolReaderMain, pPool) ) break;
+  }
+  pPool->nReader = i;
+  return pPool;
+}
+
+/*
+** Queues zSql with the encoded parameters aParam (may be NULL) for the next
+** idle reader. Both are copied. The result is passed to
+** Module.connectionPoolDone(id, result) on the owning thread; a NULL result
+** means that it could not be allocated. Returns an SQLite result code.
+*/
+int connection_pool_submit(ConnectionPool *pPool, int id, const char *zSql,
+                           const unsigned char *aParam, int nParam){
+  PoolJob *pJob = calloc(1, sizeof(PoolJob));
+  if( pJob==0 ) return SQLITE_NOMEM;
+  pJob->id = id;
+  pJob->zSql = strdup(zSql);
+  if( aParam ){
+    pJob->aParam = malloc(nParam);
+    if( pJob->aParam ) memcpy(pJob->aParam, aParam, nParam);
+  }
+  if( pJob->zSql==0 || (aParam && pJob->aParam==0) ){
+    free(pJob->zSql);
+    free(pJob->aParam);
+    free(pJob);
+    return SQLITE_NOMEM;
+  }
+  pthread_mutex_lock(&pPool->mutex);
+  if( pPool->pLast ){
+    pPool->pLast->pNext = pJob;
+  }else{
+    pPool->pFirst = pJob;
+  }
+  pPool->pLast = pJob;
+  pthread_cond_signal(&pPool->cond);
+  pthread_mutex_unlock(&pPool->mutex);
+  return SQLITE_OK;
+}
+
+/* Returns the number of readers that are waiting for a query. */
+int connection_pool_idle(ConnectionPool *pPool){
+  int nIdle;
+  pthread_mutex_lock(&pPool->mutex);
+  nIdle = pPool->nIdle;
+  pthread_mutex_unlock(&pPool->mutex);
+  return nIdle;
+}
+
+/*
+** Stops the readers after their current query and frees the pool. Queries
+** that have not started yet are dropped without a result.
+*/
+void connection_pool_close(ConnectionPool *pPool){
+  PoolJob *pJob, *pNext;
+  int i;
+  pthread_mutex_lock(&pPool->mutex);
+  pPool->bQuit = 1;
+  pthread_cond_broadcast(&pPool->cond);
+  pthread_mutex_unlock(&pPool->mutex);
+  for(i=0; i<pPool->nReader; i++){
+    pthread_join(pPool->aThread[i], 0);
+  }
+  for(pJob=pPool->pFirst; pJob; pJob=pNext){
+    pNext = pJob->pNext;
+    free(pJob->zSql);
+    free(pJob->aParam);
+    free(pJob);
+  }
+  pthread_mutex_destroy(&pPool->mutex);
+  pthread_cond_destroy(&pPool->cond);
+  free(pPool->aThread);
+  free(pPool->zPath);
+  free(pPool);
+}
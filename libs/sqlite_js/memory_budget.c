@@ -0,0 +1,111 @@
+/*
+** Fixed memory arenas for SQLite, carved out by the sqlite-wrapper from the
+** `memoryBudget` option of initSqlJs() before SQLite is initialized.
+**
+** The page cache arena holds pages of one size together with their page cache
+** header (SQLITE_CONFIG_PAGECACHE); pages beyond it overflow to the heap. The
+** heap arena replaces the allocator with SQLite's memsys5 buddy allocator
+** (SQLITE_CONFIG_HEAP), so that SQLite never grows the wasm memory; it needs
+** SQLITE_ENABLE_MEMSYS5. The lookaside setting applies to every connection and
+** is allocated from the heap arena, if there is one.
+**
+** memory_budget_stats() reports usage against each arena as doubles, in the
+** order of the MEMORY_STAT_* constants below.
+*/
+#include <stdlib.h>
+
+#include "sqlite3.h"
+
+#define MEMORY_STAT_PAGECACHE_BYTES      0  /* Size of the page cache arena */
+#define MEMORY_STAT_PAGECACHE_SLOT       1  /* Bytes per page slot */
+#define MEMORY_STAT_PAGECACHE_USED       2  /* Slots in use */
+#define MEMORY_STAT_PAGECACHE_HIGHWATER  3  /* Most slots ever in use */
+#define MEMORY_STAT_PAGECACHE_OVERFLOW   4  /* Page bytes allocated from the heap */
+#define MEMORY_STAT_HEAP_BYTES           5  /* Size of the heap arena, 0 if none */
+#define MEMORY_STAT_HEAP_USED            6  /* Bytes allocated by SQLite */
+#define MEMORY_STAT_HEAP_HIGHWATER       7
+#define MEMORY_STAT_LOOKASIDE_SLOTS      8  /* Slots per connection */
+#define MEMORY_STAT_LOOKASIDE_USED       9  /* Slots in use by the connection */
+#define MEMORY_STAT_LOOKASIDE_HIGHWATER 10
+#define MEMORY_STAT_LOOKASIDE_HITS      11
+#define MEMORY_STAT_LOOKASIDE_MISSES    12  /* Requests too large or with all slots used */
+#define MEMORY_STAT_COUNT               13
+
+/* Smallest allocation of the heap arena. memsys5 rounds every request up to a
+** power of two times this. */
+#define MEMORY_BUDGET_HEAP_MIN 64
+
+static int szPageSlot = 0;
+static int nPageSlot = 0;
+static int nHeap = 0;
+static int nLookasideSlot = 0;
+
+/*
+** Carves the arenas. A size of 0 leaves that part to the default. Must be
+** called before SQLite is initialized. Returns an SQLite result code; the
+** arenas that were set up before an error stay in place.
+*/
+int memory_budget_configure(
+  int pageSize,           /* Page size the page cache arena is made for */
+  int nPageCacheByte,     /* Size of the page cache arena */
+  int szLookaside,        /* Size of a lookaside slot */
+  int nLookaside,         /* Lookaside slots per connection */
+  int nHeapByte           /* Size of the heap arena */
+){
+  int rc = SQLITE_OK;
+  if( nHeapByte>0 ){
+    void *pHeap = malloc(nHeapByte);
+    if( pHeap==0 ) return SQLITE_NOMEM;
+    rc = sqlite3_config(SQLITE_CONFIG_HEAP, pHeap, nHeapByte, MEMORY_BUDGET_HEAP_MIN);
+    if( rc ) return rc;
+    nHeap = nHeapByte;
+  }
+  if( nPageCacheByte>0 && pageSize>0 ){
+    int szHdr = 0;
+    void *pPage;
+    int sz, n;
+    rc = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &szHdr);
+    if( rc ) return rc;
+    sz = (pageSize + szHdr + 7) & ~7;
+    n = nPageCacheByte / sz;
+    pPage = malloc((size_t)sz*n);
+    if( pPage==0 ) return SQLITE_NOMEM;
+    rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pPage, sz, n);
+    if( rc ) return rc;
+    szPageSlot = sz;
+    nPageSlot = n;
+  }
+  if( szLookaside>0 && nLookaside>0 ){
+    rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, szLookaside, nLookaside);
+    if( rc ) return rc;
+    nLookasideSlot = nLookaside;
+  }
+  return rc;
+}
+
+/* Fills aOut[0..MEMORY_STAT_COUNT-1]. Lookaside figures are those of db. */
+void memory_budget_stats(sqlite3 *db, double *aOut){
+  sqlite3_int64 iCur, iHi;
+  int iCurDb, iHiDb;
+  aOut[MEMORY_STAT_PAGECACHE_BYTES] = (double)szPageSlot*nPageSlot;
+  aOut[MEMORY_STAT_PAGECACHE_SLOT] = szPageSlot;
+  sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &iCur, &iHi, 0);
+  aOut[MEMORY_STAT_PAGECACHE_USED] = (double)iCur;
+  aOut[MEMORY_STAT_PAGECACHE_HIGHWATER] = (double)iHi;
+  sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &iCur, &iHi, 0);
+  aOut[MEMORY_STAT_PAGECACHE_OVERFLOW] = (double)iCur;
+  aOut[MEMORY_STAT_HEAP_BYTES] = nHeap;
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &iCur, &iHi, 0);
+  aOut[MEMORY_STAT_HEAP_USED] = (double)iCur;
+  aOut[MEMORY_STAT_HEAP_HIGHWATER] = (double)iHi;
+  aOut[MEMORY_STAT_LOOKASIDE_SLOTS] = nLookasideSlot;
+  sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_USED, &iCurDb, &iHiDb, 0);
+  aOut[MEMORY_STAT_LOOKASIDE_USED] = iCurDb;
+  aOut[MEMORY_STAT_LOOKASIDE_HIGHWATER] = iHiDb;
+  sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_HIT, &iCurDb, &iHiDb, 0);
+  aOut[MEMORY_STAT_LOOKASIDE_HITS] = iHiDb;
+  sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &iCurDb, &iHiDb, 0);
+  aOut[MEMORY_STAT_LOOKASIDE_MISSES] = iHiDb;
+  sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &iCurDb, &iHiDb, 0);
+  aOut[MEMORY_STAT_LOOKASIDE_MISSES] += iHiDb;
+}
@@ -0,0 +1,187 @@
+/*
+** Batches of result rows for Database.exec() and Database.each() in
+** src/sqlite_wrapper/wrapper.js.
+**
+** row_packer_step() steps a statement for a batch of rows and encodes them, so
+** that JavaScript makes one call per batch instead of several per value. The
+** values are encoded in row order, little-endian, as a type byte followed by
+** its payload:
+**
+**     SQLITE_INTEGER   8-byte integer if bBigInt is set, else 8-byte double
+**     SQLITE_FLOAT     8-byte double
+**     SQLITE_TEXT      4-byte length in bytes, 4-byte length in UTF-16 units
+**     SQLITE_BLOB      4-byte length, then the bytes
+**     SQLITE_NULL      nothing
+**
+** The bytes of all text values of a batch go, in order, to a separate buffer,
+** which JavaScript decodes with one TextDecoder call and cuts up by the UTF-16
+** lengths. Each text value is checked to be valid UTF-8 on its own: decoding
+** them together would join a broken sequence to the next value's bytes. If one
+** is not, the batch is flagged and JavaScript decodes value by value from the
+** byte lengths.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlite3.h"
+
+/* A batch ends after the row that takes it past this many bytes. */
+#define ROW_PACKER_BATCH_BYTES (1024*1024)
+
+/* A growable buffer. After an allocation failure, appends are ignored and
+** row_packer_step() returns SQLITE_NOMEM. */
+typedef struct PackBuf PackBuf;
+struct PackBuf {
+  unsigned char *a;
+  int n, nAlloc;
+  int oom;
+};
+
+typedef struct RowPacker RowPacker;
+struct RowPacker {
+  PackBuf values;
+  PackBuf text;
+  int nRow;
+  int bInvalid;      /* Some text value of the batch is not valid UTF-8 */
+};
+
+static void packBufAppend(PackBuf *p, const void *pData, int n){
+  if( p->oom || n<=0 ) return;
+  if( p->n+n>p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 4096;
+    unsigned char *aNew;
+    while( nNew<p->n+n ) nNew *= 2;
+    aNew = realloc(p->a, nNew);
+    if( aNew==0 ){
+      p->oom = 1;
+      return;
+    }
+    p->a = aNew;
+    p->nAlloc = nNew;
+  }
+  memcpy(p->a+p->n, pData, n);
+  p->n += n;
+}
+
+static void packBufInt(PackBuf *p, int v){
+  packBufAppend(p, &v, 4);
+}
+
+/*
+** Number of UTF-16 code units of the UTF-8 text z[0..n-1], or -1 if it is not
+** valid UTF-8 as TextDecoder defines it: no overlong forms, surrogates, code
+** points above U+10FFFF or cut-off sequences.
+*/
+static int utf16Length(const unsigned char *z, int n){
+  int i = 0, len = 0;
+  while( i<n ){
+    unsigned char c = z[i];
+    int nCont;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if( c<0x80 ){
+      i++;
+      len++;
+      continue;
+    }
+    if( c>=0xc2 && c<=0xdf ){
+      nCont = 1;
+    }else if( c>=0xe0 && c<=0xef ){
+      nCont = 2;
+      if( c==0xe0 ) lo = 0xa0;
+      if( c==0xed ) hi = 0x9f;
+    }else if( c>=0xf0 && c<=0xf4 ){
+      nCont = 3;
+      if( c==0xf0 ) lo = 0x90;
+      if( c==0xf4 ) hi = 0x8f;
+    }else{
+      return -1;
+    }
+    if( i+nCont>=n ) return -1;
+    if( z[i+1]<lo || z[i+1]>hi ) return -1;
+    if( nCont>1 && (z[i+2]&0xc0)!=0x80 ) return -1;
+    if( nCont>2 && (z[i+3]&0xc0)!=0x80 ) return -1;
+    i += nCont+1;
+    len += nCont==3 ? 2 : 1;
+  }
+  return len;
+}
+
+RowPacker *row_packer_new(void){
+  return calloc(1, sizeof(RowPacker));
+}
+
+void row_packer_free(RowPacker *p){
+  if( p==0 ) return;
+  free(p->values.a);
+  free(p->text.a);
+  free(p);
+}
+
+/*
+** Replaces the batch with up to nMaxRow rows of pStmt. Returns SQLITE_ROW if
+** more rows may follow, SQLITE_DONE, or an error code; the rows stepped
+** before an error are kept.
+*/
+int row_packer_step(RowPacker *p, sqlite3_stmt *pStmt, int nMaxRow, int bBigInt){
+  int nCol = sqlite3_column_count(pStmt);
+  int rc;
+  p->values.n = p->values.oom = 0;
+  p->text.n = p->text.oom = 0;
+  p->nRow = 0;
+  p->bInvalid = 0;
+  while( p->nRow<nMaxRow ){
+    int i;
+    if( p->values.n+p->text.n>=ROW_PACKER_BATCH_BYTES ) return SQLITE_ROW;
+    rc = sqlite3_step(pStmt);
+    if( rc!=SQLITE_ROW ) return rc;
+    for(i=0; i<nCol; i++){
+      unsigned char eType = (unsigned char)sqlite3_column_type(pStmt, i);
+      const unsigned char *z;
+      sqlite3_int64 v;
+      double r;
+      int n, nUtf16;
+      packBufAppend(&p->values, &eType, 1);
+      switch( eType ){
+        case SQLITE_INTEGER:
+          if( bBigInt ){
+            v = sqlite3_column_int64(pStmt, i);
+            packBufAppend(&p->values, &v, 8);
+            break;
+          }
+          /* fall through */
+        case SQLITE_FLOAT:
+          r = sqlite3_column_double(pStmt, i);
+          packBufAppend(&p->values, &r, 8);
+          break;
+        case SQLITE_TEXT:
+          z = sqlite3_column_text(pStmt, i);
+          n = sqlite3_column_bytes(pStmt, i);
+          nUtf16 = utf16Length(z, n);
+          if( nUtf16<0 ) p->bInvalid = 1;
+          packBufInt(&p->values, n);
+          packBufInt(&p->values, nUtf16);
+          packBufAppend(&p->text, z, n);
+          break;
+        case SQLITE_BLOB:
+          n = sqlite3_column_bytes(pStmt, i);
+          packBufInt(&p->values, n);
+          packBufAppend(&p->values, sqlite3_column_blob(pStmt, i), n);
+          break;
+      }
+    }
+    if( p->values.oom || p->text.oom ) return SQLITE_NOMEM;
+    p->nRow++;
+  }
+  return SQLITE_ROW;
+}
+
+/* Writes the row count, the values buffer and its size, the text buffer and
+** its size, and whether some text is not valid UTF-8 to aOut. */
+void row_packer_batch(RowPacker *p, int *aOut){
+  aOut[0] = p->nRow;
+  aOut[1] = (int)(size_t)p->values.a;
+  aOut[2] = p->values.n;
+  aOut[3] = (int)(size_t)p->text.a;
+  aOut[4] = p->text.n;
+  aOut[5] = p->bInvalid;
+}
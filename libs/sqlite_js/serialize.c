@@ -0,0 +1,76 @@
+/*
+** Database images for Database.export(), Database.exportStream() and
+** Database.fromBytes() in src/sqlite_wrapper/wrapper.js.
+**
+** Export copies the database with the online backup API into a snapshot, an
+** in-memory database whose pages lie in one buffer (the memdb VFS). The
+** connection stays open while the caller steps the backup with
+** sqlite3_backup_step(), and snapshot_bytes() then returns the image without
+** copying it (SQLITE_SERIALIZE_NOCOPY).
+**
+** Import writes the image into memory from image_realloc(), which comes from
+** sqlite3_malloc(), so that sqlite3_deserialize() takes it over as it is.
+*/
+#include "sqlite3.h"
+
+/*
+** Opens a snapshot connection and starts a backup of database zDb of db into
+** it. On success, the caller steps *ppBackup to the end, finishes it, and
+** closes *ppSnapshot when done with the image. Returns an SQLite result code.
+*/
+int snapshot_open(
+  sqlite3 *db,
+  const char *zDb,
+  sqlite3 **ppSnapshot,
+  sqlite3_backup **ppBackup
+){
+  sqlite3 *pSnapshot = 0;
+  int rc = sqlite3_open(":memory:", &pSnapshot);
+  *ppSnapshot = 0;
+  *ppBackup = 0;
+  if( rc==SQLITE_OK ){
+    /* An empty image turns "main" into a growable memdb database */
+    rc = sqlite3_deserialize(pSnapshot, "main", 0, 0, 0,
+        SQLITE_DESERIALIZE_FREEONCLOSE|SQLITE_DESERIALIZE_RESIZEABLE);
+  }
+  if( rc==SQLITE_OK ){
+    *ppBackup = sqlite3_backup_init(pSnapshot, "main", db, zDb);
+    if( *ppBackup==0 ) rc = sqlite3_errcode(pSnapshot);
+  }
+  if( rc!=SQLITE_OK ){
+    sqlite3_close(pSnapshot);
+    return rc;
+  }
+  *ppSnapshot = pSnapshot;
+  return SQLITE_OK;
+}
+
+/* Returns the image of a finished snapshot and writes its size to *pnByte.
+** The image belongs to the snapshot connection. */
+unsigned char *snapshot_bytes(sqlite3 *pSnapshot, int *pnByte){
+  sqlite3_int64 sz = 0;
+  unsigned char *a = sqlite3_serialize(pSnapshot, "main", &sz,
+                                       SQLITE_SERIALIZE_NOCOPY);
+  *pnByte = a ? (int)sz : 0;
+  return a;
+}
+
+/* Resizes an image buffer, allocating it if a is NULL. Returns NULL if
+** there is not enough memory, in which case a is left as it was. */
+unsigned char *image_realloc(unsigned char *a, int nByte){
+  return sqlite3_realloc64(a, (sqlite3_uint64)nByte);
+}
+
+void image_free(unsigned char *a){
+  sqlite3_free(a);
+}
+
+/*
+** Replaces the main database of db with the nByte bytes of image a, of which
+** nAlloc are allocated. db takes over a, also if this fails. Returns an SQLite
+** result code.
+*/
+int image_deserialize(sqlite3 *db, unsigned char *a, int nByte, int nAlloc){
+  return sqlite3_deserialize(db, "main", a, nByte, nAlloc,
+      SQLITE_DESERIALIZE_FREEONCLOSE|SQLITE_DESERIALIZE_RESIZEABLE);
+}
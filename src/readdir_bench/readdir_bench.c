@@ -0,0 +1,108 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emscripten.h>
+
+/*
+** Lists a directory with a large number of entries under /persistent.
+**
+** The directory is populated on the first run and reused afterwards, so the
+** first listing of a later run measures a cold PThreadFS cache. Listings are
+** timed with readdir() only and with an additional stat() per entry, as
+** `ls -l` would do. Entry counts are taken from the arguments and default to
+** 10000 and 100000.
+*/
+
+static int listDir(const char *zDir, int doStat, double *pElapsed){
+  char zPath[300];
+  struct stat st;
+  struct dirent *pEntry;
+  DIR *pDir;
+  int n = 0;
+  double t0 = emscripten_get_now();
+  pDir = opendir(zDir);
+  if( pDir==0 ){
+    printf("opendir(%s) failed: %d\n", zDir, errno);
+    return -1;
+  }
+  while( (pEntry = readdir(pDir))!=0 ){
+    if( strcmp(pEntry->d_name, ".")==0 || strcmp(pEntry->d_name, "..")==0 ){
+      continue;
+    }
+    if( doStat ){
+      snprintf(zPath, sizeof(zPath), "%s/%s", zDir, pEntry->d_name);
+      if( stat(zPath, &st)!=0 ){
+        printf("stat(%s) failed: %d\n", zPath, errno);
+      }
+    }
+    n++;
+  }
+  closedir(pDir);
+  *pElapsed = emscripten_get_now() - t0;
+  return n;
+}
+
+static int populateDir(const char *zDir, int nEntry){
+  char zPath[300];
+  double t0;
+  int i;
+  printf("%s: creating %d entries\n", zDir, nEntry);
+  t0 = emscripten_get_now();
+  for(i=0; i<nEntry; i++){
+    int fd;
+    snprintf(zPath, sizeof(zPath), "%s/f%06d", zDir, i);
+    fd = open(zPath, O_CREAT|O_WRONLY, 0666);
+    if( fd<0 ){
+      printf("open(%s) failed: %d\n", zPath, errno);
+      return 1;
+    }
+    close(fd);
+  }
+  printf("%s: created in %.1f ms, reload for cold numbers\n",
+         zDir, emscripten_get_now() - t0);
+  return 0;
+}
+
+static void report(int nEntry, const char *zWhat, double elapsed, int n){
+  printf("%7d entries, %-18s: %9.1f ms (%d listed)\n", nEntry, zWhat, elapsed, n);
+}
+
+static void runBench(int nEntry){
+  char zDir[100];
+  double elapsed;
+  int n;
+  snprintf(zDir, sizeof(zDir), "/persistent/readdir%d", nEntry);
+  if( mkdir(zDir, 0777)!=0 && errno!=EEXIST ){
+    printf("mkdir(%s) failed: %d\n", zDir, errno);
+    return;
+  }
+  /* The first listing of this run is the only cold one. */
+  n = listDir(zDir, 1, &elapsed);
+  if( n<nEntry ){
+    if( populateDir(zDir, nEntry) ) return;
+  }else{
+    report(nEntry, "readdir+stat cold", elapsed, n);
+  }
+  n = listDir(zDir, 0, &elapsed);
+  report(nEntry, "readdir warm", elapsed, n);
+  n = listDir(zDir, 1, &elapsed);
+  report(nEntry, "readdir+stat warm", elapsed, n);
+}
+
+int main(int argc, char **argv){
+  int i;
+  if( argc<2 ){
+    runBench(10000);
+    runBench(100000);
+  }
+  for(i=1; i<argc; i++){
+    runBench(atoi(argv[i]));
+  }
+  return 0;
+}
@@ -27,16 +27,23 @@ static const char zHelp[] =
   "  --pagesize N        Set the page size to N\n"
   "  --pcache N SZ       Configure N pages of pagecache each of size SZ bytes\n"
   "  --primarykey        Use PRIMARY KEY instead of UNIQUE where appropriate\n"
+  "  --relaxed MS        Flush /persistent in the background every MS ms\n"
   "  --reprepare         Reprepare each statement upon every invocation\n"
   "  --scratch N SZ      Configure scratch memory for N slots of SZ bytes each\n"
   "  --sqlonly           No-op.  Only show the SQL that would have been run.\n"
   "  --size N            Relative test size.  Default=100\n"
   "  --stats             Show statistics at the end\n"
+  "  --sysmalloc         Use the system allocator instead of the arena allocator\n"
+  "  --tempbudget N      Keep up to N bytes of temp files in memory (pthreadfs VFS)\n"
   "  --testset T         Run test-set T\n"
+  "  --threads N         Use up to N sorter worker threads (PRAGMA threads)\n"
   "  --trace             Turn on SQL tracing\n"
   "  --utf16be           Set text encoding to UTF-16BE\n"
   "  --utf16le           Set text encoding to UTF-16LE\n"
+  "  --writers N         Number of threads for --testset multiwriter\n"
   "  --verify            Run additional verification steps.\n"
+  "  --vfs NAME          Use NAME as the default VFS (\"pthreadfs\" for PThreadFS,\n"
+  "                      \"pthreadfs-lz4\" for compressed pages)\n"
   "  --without-rowid     Use WITHOUT ROWID where appropriate\n"
 ;
 
@@ -48,6 +55,18 @@ static const char zHelp[] =
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+
+#ifdef __EMSCRIPTEN__
+/* Provided by libs/pthreadfs.cpp */
+extern void pthreadfs_print_stats(void);
+extern void pthreadfs_set_fsync_gather_window(int microseconds);
+extern void pthreadfs_set_relaxed_durability(const char *zPath, int delayMs);
+extern double pthreadfs_current_epoch(void);
+extern long pthreadfs_wait_durable(double epoch);
+#include "pthreadfs_vfs.h"
+#include "sqlite_arena.h"
+#endif
 
 /* All global state is held in this structure */
 static struct Global {
@@ -1136,6 +1155,100 @@ void testset_debug1(void){
   }
 }
 
+/*
+** State of one thread of the multiwriter testset.
+*/
+#define MULTIWRITER_MAX 16
+typedef struct MultiWriter MultiWriter;
+struct MultiWriter {
+  pthread_t tid;             /* Thread running multiwriterMain() */
+  char *zDbName;             /* Database written by this thread */
+  int nTxn;                  /* Number of transactions to run */
+  int rc;                    /* First error encountered, or SQLITE_OK */
+};
+
+/* Run nTxn autocommit INSERTs against a private database connection */
+static void *multiwriterMain(void *pArg){
+  MultiWriter *p = (MultiWriter*)pArg;
+  sqlite3 *db = 0;
+  sqlite3_stmt *pStmt = 0;
+  int i;
+  p->rc = sqlite3_open(p->zDbName, &db);
+  if( p->rc==SQLITE_OK ){
+    p->rc = sqlite3_exec(db,
+        "CREATE TABLE IF NOT EXISTS t1(a INTEGER, b TEXT)", 0, 0, 0);
+  }
+  if( p->rc==SQLITE_OK ){
+    p->rc = sqlite3_prepare_v2(db,
+        "INSERT INTO t1 VALUES(?1, hex(randomblob(50)))", -1, &pStmt, 0);
+  }
+  for(i=0; i<p->nTxn && p->rc==SQLITE_OK; i++){
+    sqlite3_bind_int(pStmt, 1, i);
+    sqlite3_step(pStmt);
+    p->rc = sqlite3_reset(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+  return 0;
+}
+
+/* Run the writers in aWriter[0..nWriter-1] in parallel and wait for them */
+static void multiwriterRun(MultiWriter *aWriter, int nWriter){
+  int i;
+  for(i=0; i<nWriter; i++){
+    if( pthread_create(&aWriter[i].tid, 0, multiwriterMain, &aWriter[i]) ){
+      fatal_error("cannot start writer thread %d\n", i);
+    }
+  }
+  for(i=0; i<nWriter; i++){
+    pthread_join(aWriter[i].tid, 0);
+    if( aWriter[i].rc!=SQLITE_OK ){
+      fatal_error("writer %d failed with error %d\n", i, aWriter[i].rc);
+    }
+  }
+}
+
+/*
+** A testset where several threads commit small transactions to their own
+** databases at the same time.  Every commit syncs both the rollback journal
+** and the database, so this measures how well concurrent fsyncs are merged.
+*/
+void testset_multiwriter(const char *zDbName, int nWriter){
+  MultiWriter aWriter[MULTIWRITER_MAX];
+  int i, n;
+
+  if( zDbName==0 ) fatal_error("the multiwriter testset requires a DATABASE\n");
+  if( nWriter<1 || nWriter>MULTIWRITER_MAX ){
+    fatal_error("--writers must be between 1 and %d\n", MULTIWRITER_MAX);
+  }
+  n = g.szTest;
+  memset(aWriter, 0, sizeof(aWriter));
+  for(i=0; i<nWriter; i++){
+    aWriter[i].zDbName = sqlite3_mprintf("%s-w%d", zDbName, i);
+    aWriter[i].nTxn = n;
+  }
+
+  speedtest1_begin_test(100, "1 writer, %d autocommit INSERTs", n);
+  multiwriterRun(aWriter, 1);
+  speedtest1_end_test();
+
+  speedtest1_begin_test(110, "%d writers, %d autocommit INSERTs each",
+                        nWriter, n);
+  multiwriterRun(aWriter, nWriter);
+  speedtest1_end_test();
+
+#ifdef __EMSCRIPTEN__
+  pthreadfs_set_fsync_gather_window(200);
+  speedtest1_begin_test(120, "%d writers, %d INSERTs each, 200us fsync window",
+                        nWriter, n);
+  multiwriterRun(aWriter, nWriter);
+  speedtest1_end_test();
+  pthreadfs_set_fsync_gather_window(0);
+#endif
+
+  for(i=0; i<nWriter; i++) sqlite3_free(aWriter[i].zDbName);
+}
+
 int main(int argc, char **argv){
   int doAutovac = 0;            /* True for --autovacuum */
   int cacheSize = 0;            /* Desired cache size.  0 means default */
@@ -1154,6 +1267,12 @@ int main(int argc, char **argv){
   int doTrace = 0;              /* True for --trace */
   const char *zEncoding = 0;    /* --utf16be or --utf16le */
   const char *zDbName = 0;      /* Name of the test database */
+  int nWriter = 4;              /* --writers for the multiwriter testset */
+  const char *zVfs = 0;         /* --vfs NAME */
+  int relaxedMs = -1;           /* --relaxed MS */
+  int nTempBudget = -1;         /* --tempbudget N */
+  int nThread = -1;             /* --threads N */
+  int useArena = 1;             /* False for --sysmalloc */
 
   void *pHeap = 0;              /* Allocated heap space */
   void *pLook = 0;              /* Allocated lookaside space */
@@ -1232,6 +1351,9 @@ int main(int argc, char **argv){
         i += 2;
       }else if( strcmp(z,"primarykey")==0 ){
         g.zPK = "PRIMARY KEY";
+      }else if( strcmp(z,"relaxed")==0 ){
+        if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
+        relaxedMs = integerValue(argv[++i]);
       }else if( strcmp(z,"reprepare")==0 ){
         g.bReprepare = 1;
       }else if( strcmp(z,"scratch")==0 ){
@@ -1246,9 +1368,17 @@ int main(int argc, char **argv){
         g.szTest = integerValue(argv[++i]);
       }else if( strcmp(z,"stats")==0 ){
         showStats = 1;
+      }else if( strcmp(z,"sysmalloc")==0 ){
+        useArena = 0;
+      }else if( strcmp(z,"tempbudget")==0 ){
+        if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
+        nTempBudget = integerValue(argv[++i]);
       }else if( strcmp(z,"testset")==0 ){
         if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
         zTSet = argv[++i];
+      }else if( strcmp(z,"threads")==0 ){
+        if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
+        nThread = integerValue(argv[++i]);
       }else if( strcmp(z,"trace")==0 ){
         doTrace = 1;
       }else if( strcmp(z,"utf16le")==0 ){
@@ -1257,6 +1387,12 @@ int main(int argc, char **argv){
         zEncoding = "utf16be";
       }else if( strcmp(z,"verify")==0 ){
         g.bVerify = 1;
+      }else if( strcmp(z,"vfs")==0 ){
+        if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
+        zVfs = argv[++i];
+      }else if( strcmp(z,"writers")==0 ){
+        if( i>=argc-1 ) fatal_error("missing argument on %s\n", argv[i]);
+        nWriter = integerValue(argv[++i]);
       }else if( strcmp(z,"without-rowid")==0 ){
         g.zWR = "WITHOUT ROWID";
         g.zPK = "PRIMARY KEY";
@@ -1278,6 +1414,15 @@ int main(int argc, char **argv){
   if( zDbName==0 ){
     fatal_error(zHelp, argv[0]);
   }
+#endif
+#ifdef __EMSCRIPTEN__
+  /* --heap replaces the allocator, so the arena is only used without it. */
+  if( useArena && nHeap==0 ){
+    rc = sqlite3_arena_install();
+    if( rc ) fatal_error("arena allocator configuration failed: %d\n", rc);
+  }else{
+    useArena = 0;
+  }
 #endif
   if( nHeap>0 ){
     pHeap = malloc( nHeap );
@@ -1302,6 +1447,38 @@ int main(int argc, char **argv){
   if( nLook>0 ){
     sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 0, 0);
   }
+#ifdef __EMSCRIPTEN__
+  /* The unix VFS cannot map a -shm file on PThreadFS, so WAL needs the
+  ** PThreadFS VFS, which keeps the wal-index in shared wasm memory. */
+  if( zJMode && sqlite3_strnicmp(zJMode, "wal", 4)==0 && zVfs==0 ){
+    zVfs = PTHREADFS_VFS_NAME;
+  }
+#endif
+#ifdef __EMSCRIPTEN__
+  if( relaxedMs>=0 ){
+    pthreadfs_set_relaxed_durability("/persistent", relaxedMs);
+  }
+#endif
+  if( zVfs ){
+    sqlite3_vfs *pVfs;
+#ifdef __EMSCRIPTEN__
+    if( strcmp(zVfs, PTHREADFS_VFS_NAME)==0
+     || strcmp(zVfs, PTHREADFS_ZVFS_NAME)==0 ){
+      if( strcmp(zVfs, PTHREADFS_ZVFS_NAME)==0 ){
+        rc = sqlite3_pthreadfs_zvfs_register(0);
+      }else{
+        rc = sqlite3_pthreadfs_vfs_register(0);
+      }
+      if( rc ) fatal_error("cannot register VFS %s: %d\n", zVfs, rc);
+      if( nTempBudget>=0 ){
+        sqlite3_pthreadfs_vfs_temp_config(nTempBudget, PTHREADFS_TEMP_SPILL);
+      }
+    }
+#endif
+    pVfs = sqlite3_vfs_find(zVfs);
+    if( pVfs==0 ) fatal_error("No such VFS: \"%s\"\n", zVfs);
+    sqlite3_vfs_register(pVfs, 1);
+  }
  
   /* Open the database and the input file */
   if( sqlite3_open(zDbName, &g.db) ){
@@ -1340,6 +1517,13 @@ int main(int argc, char **argv){
   if( zJMode ){
     speedtest1_exec("PRAGMA journal_mode=%s", zJMode);
   }
+  if( nThread>=0 ){
+#if SQLITE_VERSION_NUMBER>=3008007
+    speedtest1_exec("PRAGMA threads=%d", nThread);
+#else
+    fatal_error("--threads needs SQLite 3.8.7 or later (node build.js speedtest-threads)\n");
+#endif
+  }
 
   if( g.bExplain ) printf(".explain\n.echo on\n");
   if( strcmp(zTSet,"main")==0 ){
@@ -1350,10 +1534,22 @@ int main(int argc, char **argv){
     testset_cte();
   }else if( strcmp(zTSet,"rtree")==0 ){
     testset_rtree(6, 147);
+  }else if( strcmp(zTSet,"multiwriter")==0 ){
+    testset_multiwriter(zDbName, nWriter);
   }else{
-    fatal_error("unknown testset: \"%s\"\nChoices: main debug1 cte rtree\n",
-                 zTSet);
+    fatal_error("unknown testset: \"%s\"\n"
+                "Choices: main debug1 cte rtree multiwriter\n", zTSet);
+  }
+#ifdef __EMSCRIPTEN__
+  /* With --relaxed, the run is only complete once all commits are durable. */
+  if( relaxedMs>=0 ){
+    speedtest1_begin_test(999, "Wait for all commits to be durable");
+    if( pthreadfs_wait_durable(pthreadfs_current_epoch()) ){
+      fatal_error("background flush failed\n");
+    }
+    speedtest1_end_test();
   }
+#endif
   speedtest1_final();
 
   /* Database connection statistics printed after both prepared statements
@@ -1406,6 +1602,36 @@ int main(int argc, char **argv){
     printf("-- Largest Pcache Allocation:   %d bytes\n",iHi);
     sqlite3_status(SQLITE_STATUS_SCRATCH_SIZE, &iCur, &iHi, 0);
     printf("-- Largest Scratch Allocation:  %d bytes\n", iHi);
+#ifdef __EMSCRIPTEN__
+    if( useArena ){
+      sqlite_arena_stats as;
+      sqlite3_arena_stats(&as);
+      printf("-- Arena mallocs:               %lld (%lld frees, %lld cache misses, "
+             "%lld large)\n", as.mallocs, as.frees, as.cacheMisses, as.largeAllocs);
+      printf("-- Arena memory reserved:       %lld bytes\n", as.bytesReserved);
+    }
+    pthreadfs_print_stats();
+    if( zVfs && (strcmp(zVfs, PTHREADFS_VFS_NAME)==0
+              || strcmp(zVfs, PTHREADFS_ZVFS_NAME)==0) ){
+      long long nTemp, mxTemp;
+      int nSpill;
+      sqlite3_pthreadfs_vfs_temp_stats(&nTemp, &mxTemp, &nSpill);
+      printf("-- Temp File Memory:            %lld bytes (max %lld, %d spilled)\n",
+             nTemp, mxTemp, nSpill);
+    }
+    if( zVfs && strcmp(zVfs, PTHREADFS_ZVFS_NAME)==0 ){
+      pthreadfs_zvfs_stats zs;
+      sqlite3_pthreadfs_zvfs_stats(&zs);
+      printf("-- Pages compressed:            %.0f (%.0f stored as is), "
+             "ratio %.2f\n", zs.pagesWritten, zs.pagesStoredRaw,
+             zs.bytesOut>0 ? zs.bytesIn/zs.bytesOut : 0.0);
+      printf("-- Compression time:            %.1f ms (%.2f us/page)\n",
+             zs.compressMs,
+             zs.pagesWritten>0 ? zs.compressMs*1000.0/zs.pagesWritten : 0.0);
+      printf("-- Decompression time:          %.1f ms for %.0f pages\n",
+             zs.decompressMs, zs.pagesRead);
+    }
+#endif
   }
 
   /* Release memory */
@@ -0,0 +1,114 @@
+importScripts('/out/sqlite-wrapper/sql-wasm.js')
+
+// Micro-benchmarks of the sqlite-wrapper. Run one with
+// /src/sqlite_wrapper/bench.html?bench=NAME, or all of them without `bench`.
+const params = new URLSearchParams(location.search)
+const iterations = Number(params.get('n') || 20000)
+
+function time(label, fn) {
+  const start = performance.now()
+  const result = fn()
+  console.log(`${label}: ${(performance.now() - start).toFixed(1)} ms`)
+  return result
+}
+
+async function timeAsync(label, fn) {
+  const start = performance.now()
+  const result = await fn()
+  console.log(`${label}: ${(performance.now() - start).toFixed(1)} ms`)
+  return result
+}
+
+const benches = {
+  // The same INSERT and SELECT strings through db.run and db.exec, with the
+  // statement cache disabled and enabled. The difference is the cost of
+  // preparing and freeing a statement on every call.
+  'statement-cache': SQL => {
+    for (const statementCacheSize of [0, 256]) {
+      const db = new SQL.Database(null, { statementCacheSize })
+      db.run('DROP TABLE IF EXISTS bench')
+      db.run('CREATE TABLE bench (id INTEGER PRIMARY KEY, value TEXT)')
+      db.run('BEGIN')
+      time(`run INSERT x${iterations}, cache ${statementCacheSize}`, () => {
+        for (let i = 0; i < iterations; i++) {
+          db.run('INSERT INTO bench VALUES (?, ?)', [i, 'value ' + i])
+        }
+      })
+      db.run('COMMIT')
+      time(`exec SELECT x${iterations}, cache ${statementCacheSize}`, () => {
+        for (let i = 0; i < iterations; i++) {
+          db.exec('SELECT value FROM bench WHERE id = ?', [i])
+        }
+      })
+      console.log('statement cache', db.statementCacheStats())
+      db.run('DROP TABLE bench')
+      db.close()
+    }
+  },
+
+  // The same rows inserted with one db.run per row, and with db.insertMany
+  // from rows and from typed array columns, each in one transaction.
+  'insert-many': SQL => {
+    const db = new SQL.Database()
+    const ids = new Int32Array(iterations).map((_, i) => i)
+    const values = new Float64Array(iterations).map((_, i) => i / 2)
+    const names = Array.from(ids, i => 'name ' + i)
+    const rows = Array.from(ids, i => [i, values[i], names[i]])
+    const insert = 'INSERT INTO bench VALUES (?, ?, ?)'
+    const reset = () => {
+      db.run('DROP TABLE IF EXISTS bench')
+      db.run('CREATE TABLE bench (id INTEGER PRIMARY KEY, value REAL, name TEXT)')
+    }
+    reset()
+    time(`run x${iterations}`, () => {
+      db.run('BEGIN')
+      for (const row of rows) db.run(insert, row)
+      db.run('COMMIT')
+    })
+    reset()
+    console.log(time(`insertMany rows x${iterations}`, () => db.insertMany(insert, rows)))
+    reset()
+    console.log(time(`insertMany columns x${iterations}`, () =>
+      db.insertMany(insert, { columns: [ids, values, names] })))
+    db.run('DROP TABLE bench')
+    db.close()
+  },
+
+  // A database of `n` rows exported whole and as a stream, and opened again
+  // from the bytes and from the stream.
+  'export-import': async SQL => {
+    const db = new SQL.Database()
+    db.run('DROP TABLE IF EXISTS bench')
+    db.run('CREATE TABLE bench (id INTEGER PRIMARY KEY, name TEXT, data BLOB)')
+    const ids = new Int32Array(iterations).map((_, i) => i)
+    db.insertMany('INSERT INTO bench VALUES (?, ?, randomblob(200))',
+      { columns: [ids, Array.from(ids, i => 'name ' + i)] })
+    const bytes = time('export', () => db.export())
+    console.log(`${(bytes.length / 1048576).toFixed(1)} MB`)
+    const chunks = await timeAsync('exportStream', async () => {
+      const chunks = []
+      for await (const chunk of db.exportStream()) chunks.push(chunk)
+      return chunks
+    })
+    console.log(`${chunks.length} chunks`)
+    const fromBytes = time('fromBytes', () => SQL.Database.fromBytes(bytes))
+    console.log(fromBytes.exec('SELECT count(*) FROM bench')[0].values)
+    fromBytes.close()
+    const fromStream = await timeAsync('fromStream', () =>
+      SQL.Database.fromStream(db.exportStream(), { size: bytes.length }))
+    console.log(fromStream.exec('SELECT count(*) FROM bench')[0].values)
+    fromStream.close()
+    db.run('DROP TABLE bench')
+    db.close()
+  },
+}
+
+initSqlJs({ locateFile: filename => `/out/sqlite-wrapper/${filename}` }).then(async SQL => {
+  const selected = params.get('bench')
+  for (const name of Object.keys(benches)) {
+    if (!selected || selected === name) {
+      console.log(`-- ${name}`)
+      await benches[name](SQL)
+    }
+  }
+})
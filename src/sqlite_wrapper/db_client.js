@@ -0,0 +1,187 @@
+// The calling side of the async Database API: a Database that lives in a
+// worker running db_host.js (db_worker.js in the browser), used through
+// promises.
+//
+// Queries passed to exec() in the same tick are sent together in one message,
+// and the client does not wait for a reply before sending the next message,
+// so requests are pipelined while the worker runs earlier ones. batch() sends
+// a list of queries at once, optionally in one transaction. Results come back
+// in transferred ArrayBuffers, which are decoded here with one TextDecoder
+// call per reply; see db_host.js for the format.
+//
+// Works with a browser Worker and with a worker_threads Worker:
+//
+//   const client = new SqliteClient(new Worker('/src/sqlite_wrapper/db_worker.js'))
+//   await client.open()
+//   await client.exec('CREATE TABLE t (a, b)')
+//   await client.batch([
+//     { sql: 'INSERT INTO t VALUES (?, ?)', params: [1, 'one'] },
+//     { sql: 'INSERT INTO t VALUES (?, ?)', params: [2, 'two'] },
+//   ], { transaction: true })
+//   const [{ columns, values }] = await client.exec('SELECT * FROM t')
+(function () {
+  const SQLITE_INTEGER = 1
+  const SQLITE_FLOAT = 2
+  const SQLITE_TEXT = 3
+  const SQLITE_BLOB = 4
+
+  class ReplyReader {
+    constructor(values, text) {
+      this.view = new DataView(values)
+      this.bytes = new Uint8Array(values)
+      this.pos = 0
+      this.text = new TextDecoder().decode(text)
+      this.textPos = 0
+    }
+
+    int32() {
+      const v = this.view.getInt32(this.pos, true)
+      this.pos += 4
+      return v
+    }
+
+    uint8() {
+      return this.bytes[this.pos++]
+    }
+
+    string() {
+      const length = this.int32()
+      const s = this.text.substring(this.textPos, this.textPos + length)
+      this.textPos += length
+      return s
+    }
+
+    value() {
+      const type = this.uint8()
+      if (type === SQLITE_INTEGER || type === SQLITE_FLOAT) {
+        const v = this.view.getFloat64(this.pos, true)
+        this.pos += 8
+        return v
+      }
+      if (type === SQLITE_TEXT) return this.string()
+      if (type === SQLITE_BLOB) {
+        const length = this.int32()
+        const v = this.bytes.slice(this.pos, this.pos + length)
+        this.pos += length
+        return v
+      }
+      return null
+    }
+
+    // Returns [{results, changes} or {error}] per query.
+    batch() {
+      const entries = []
+      for (let count = this.int32(); count > 0; count--) {
+        if (this.uint8() === 0) {
+          entries.push({ error: new Error(this.string()) })
+          continue
+        }
+        const changes = this.int32()
+        const results = []
+        for (let n = this.int32(); n > 0; n--) {
+          const columns = []
+          for (let c = this.int32(); c > 0; c--) columns.push(this.string())
+          const values = []
+          for (let r = this.int32(); r > 0; r--) {
+            const row = []
+            for (let c = 0; c < columns.length; c++) row.push(this.value())
+            values.push(row)
+          }
+          results.push({ columns, values })
+        }
+        entries.push({ results, changes })
+      }
+      return entries
+    }
+  }
+
+  class SqliteClient {
+    constructor(worker) {
+      this.worker = worker
+      this.nextId = 1
+      this.pending = new Map()
+      // exec() calls of the current tick, sent as one batch
+      this.queued = null
+      const onReply = message => this.onReply(message)
+      if (typeof worker.on === 'function') {
+        worker.on('message', onReply)
+      } else {
+        worker.addEventListener('message', event => onReply(event.data))
+      }
+    }
+
+    request(message) {
+      // Queries queued by exec() were issued first, so they go out first
+      this.flush()
+      const id = this.nextId++
+      return new Promise((resolve, reject) => {
+        this.pending.set(id, { resolve, reject })
+        this.worker.postMessage({ id, ...message })
+      })
+    }
+
+    onReply(message) {
+      const request = this.pending.get(message.id)
+      if (!request) return
+      this.pending.delete(message.id)
+      if (message.error !== undefined) {
+        request.reject(new Error(message.error))
+      } else if (message.values) {
+        request.resolve(new ReplyReader(message.values, message.text).batch())
+      } else {
+        request.resolve()
+      }
+    }
+
+    // Opens the database in the worker, with the config of `new Database`.
+    open(config) {
+      return this.request({ type: 'open', config })
+    }
+
+    // Runs `sql` like Database.exec and resolves to its results. Calls made
+    // in the same tick share one message.
+    exec(sql, params) {
+      if (!this.queued) {
+        this.queued = []
+        Promise.resolve().then(() => this.flush())
+      }
+      return new Promise((resolve, reject) => {
+        this.queued.push({ query: { sql, params }, resolve, reject })
+      })
+    }
+
+    // Sends the queries queued by exec(), if any, as one batch.
+    flush() {
+      const queued = this.queued
+      if (!queued) return
+      this.queued = null
+      this.request({ type: 'batch', queries: queued.map(q => q.query) }).then(
+        entries => entries.forEach((entry, i) => {
+          if (entry.error) queued[i].reject(entry.error)
+          else queued[i].resolve(entry.results)
+        }),
+        error => queued.forEach(q => q.reject(error))
+      )
+    }
+
+    // Runs [{sql, params}] in one message and resolves to one entry per
+    // query: {results, changes}, or {error} if that query failed. With
+    // `transaction`, the queries run in one transaction, which is rolled back
+    // and rejects if any of them fails.
+    batch(queries, options) {
+      const transaction = !!(options && options.transaction)
+      return this.request({ type: 'batch', queries, transaction })
+    }
+
+    // Closes the database. Requests sent before are still answered.
+    close() {
+      return this.request({ type: 'close' })
+    }
+  }
+
+  if (typeof module !== 'undefined' && module.exports) {
+    module.exports = { SqliteClient }
+  } else {
+    self.SqliteClient = SqliteClient
+  }
+})()
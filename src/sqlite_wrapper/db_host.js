@@ -0,0 +1,187 @@
+// The worker side of the async Database API, see db_client.js.
+//
+// serveDatabase(SQL, endpoint) answers the messages of an SqliteClient on
+// `endpoint`: `self` in a browser worker, or `parentPort` of worker_threads.
+// SQL is what initSqlJs resolves to, or the promise itself.
+// Messages are handled one after the other in the order they arrive, so a
+// client can send requests while earlier ones still run.
+//
+// Requests are {id, type, ...}:
+//   {type: "open", config}                 opens the database
+//   {type: "batch", queries, transaction}  runs [{sql, params}] with db.exec,
+//                                          in one transaction if requested
+//   {type: "close"}                        closes the database
+// Replies are {id, values, text} with two ArrayBuffers that are transferred,
+// not cloned, or {id, error}. `text` holds the UTF-8 bytes of every string of
+// the reply, in order. `values` is little-endian:
+//   batch:   int32 query count, then per query:
+//              uint8 0 and a string (the error message), or
+//              uint8 1, int32 rows modified, int32 result count, then per
+//              result: int32 column count, the column names as strings,
+//              int32 row count and the values in row order
+//   string:  int32 length in UTF-16 units of its part of `text`
+//   value:   uint8 type (as SQLite's), then for 1 and 2 a float64, for 3 a
+//            string, for 4 an int32 length and the bytes, for 5 nothing
+(function () {
+  const SQLITE_FLOAT = 2
+  const SQLITE_TEXT = 3
+  const SQLITE_BLOB = 4
+  const SQLITE_NULL = 5
+
+  class ReplyWriter {
+    constructor() {
+      this.buffer = new ArrayBuffer(4096)
+      this.view = new DataView(this.buffer)
+      this.bytes = new Uint8Array(this.buffer)
+      this.length = 0
+      this.strings = []
+    }
+
+    reserve(n) {
+      if (this.length + n <= this.buffer.byteLength) return
+      let size = this.buffer.byteLength * 2
+      while (size < this.length + n) size *= 2
+      const bytes = new Uint8Array(size)
+      bytes.set(this.bytes.subarray(0, this.length))
+      this.buffer = bytes.buffer
+      this.view = new DataView(this.buffer)
+      this.bytes = bytes
+    }
+
+    int32(v) {
+      this.reserve(4)
+      this.view.setInt32(this.length, v, true)
+      this.length += 4
+    }
+
+    uint8(v) {
+      this.reserve(1)
+      this.bytes[this.length++] = v
+    }
+
+    string(s) {
+      this.int32(s.length)
+      this.strings.push(s)
+    }
+
+    value(v) {
+      if (v === null || v === undefined) {
+        this.uint8(SQLITE_NULL)
+      } else if (typeof v === 'string') {
+        this.uint8(SQLITE_TEXT)
+        this.string(v)
+      } else if (typeof v === 'object') {
+        this.uint8(SQLITE_BLOB)
+        this.int32(v.length)
+        this.reserve(v.length)
+        this.bytes.set(v, this.length)
+        this.length += v.length
+      } else {
+        this.uint8(SQLITE_FLOAT)
+        this.reserve(8)
+        this.view.setFloat64(this.length, Number(v), true)
+        this.length += 8
+      }
+    }
+
+    // Returns the message and its transfer list.
+    finish(id) {
+      // One encoder call for all strings of the reply
+      const text = new TextEncoder().encode(this.strings.join('')).buffer
+      const values = this.buffer.slice(0, this.length)
+      return [{ id, values, text }, [values, text]]
+    }
+  }
+
+  function runBatch(db, queries, transaction, writer) {
+    writer.int32(queries.length)
+    if (transaction) db.exec('BEGIN')
+    try {
+      for (const query of queries) {
+        let results
+        try {
+          results = db.exec(query.sql, query.params)
+        } catch (error) {
+          // A failed transaction is rolled back and fails as a whole
+          if (transaction) throw error
+          writer.uint8(0)
+          writer.string(String(error && error.message || error))
+          continue
+        }
+        writer.uint8(1)
+        writer.int32(db.getRowsModified())
+        writer.int32(results.length)
+        for (const result of results) {
+          writer.int32(result.columns.length)
+          result.columns.forEach(name => writer.string(name))
+          writer.int32(result.values.length)
+          for (const row of result.values) row.forEach(v => writer.value(v))
+        }
+      }
+      if (transaction) db.exec('COMMIT')
+    } catch (error) {
+      if (transaction) {
+        // Some errors roll the transaction back by themselves
+        try {
+          db.exec('ROLLBACK')
+        } catch (rollbackError) {}
+      }
+      throw error
+    }
+  }
+
+  function serveDatabase(SQL, endpoint) {
+    const nodeStyle = typeof endpoint.on === 'function'
+    let db = null
+    const ready = Promise.resolve(SQL)
+    ready.catch(() => {})
+    // Handles requests in order, also while SQL is still loading
+    let queue = Promise.resolve()
+
+    function reply(message, transfer) {
+      endpoint.postMessage(message, transfer || [])
+    }
+
+    function handle(SQL, request) {
+      try {
+        if (request.type === 'open') {
+          if (db) db.close()
+          db = new SQL.Database(null, request.config)
+          reply({ id: request.id })
+        } else if (request.type === 'batch') {
+          if (!db) throw new Error('Database not open')
+          const writer = new ReplyWriter()
+          runBatch(db, request.queries, request.transaction, writer)
+          reply(...writer.finish(request.id))
+        } else if (request.type === 'close') {
+          if (db) db.close()
+          db = null
+          reply({ id: request.id })
+        } else {
+          throw new Error(`Unknown request ${request.type}`)
+        }
+      } catch (error) {
+        reply({ id: request.id, error: String(error && error.message || error) })
+      }
+    }
+
+    function onRequest(request) {
+      queue = queue.then(() => ready).then(
+        SQL => handle(SQL, request),
+        error => reply({ id: request.id, error: `Could not load SQLite: ${error}` })
+      )
+    }
+
+    if (nodeStyle) {
+      endpoint.on('message', onRequest)
+    } else {
+      endpoint.addEventListener('message', event => onRequest(event.data))
+    }
+  }
+
+  if (typeof module !== 'undefined' && module.exports) {
+    module.exports = { serveDatabase }
+  } else {
+    self.serveDatabase = serveDatabase
+  }
+})()
@@ -0,0 +1,7 @@
+importScripts('/out/sqlite-wrapper/sql-wasm.js', '/src/sqlite_wrapper/db_host.js')
+
+// A worker for SqliteClient (db_client.js). Requests that arrive while the
+// module loads are queued by serveDatabase.
+serveDatabase(initSqlJs({
+  locateFile: filename => `/out/sqlite-wrapper/${filename}`
+}), self)
@@ -1,7 +1,7 @@
 /* global
     ALLOC_NORMAL
     FS
-    HEAP8
+    HEAPU8
     Module
     _malloc
     _free
@@ -11,6 +11,7 @@
     getValue
     intArrayFromString
     removeFunction
+    setImmediate
     setValue
     stackAlloc
     stackRestore
@@ -29,9 +30,16 @@
  */
 
 /**
- * @typedef {{locateFile:function(string):string}} SqlJsConfig
+ * @typedef {{locateFile:function(string):string, memoryBudget:Object}} SqlJsConfig
  * @property {function(string):string} locateFile
  * a function that returns the full path to a resource given its file name
+ * @property {{pageCache:number, pageSize:number, heap:number,
+ * lookasideSlotSize:number, lookasideSlots:number}} [memoryBudget]
+ * fixed arenas that SQLite is given before the first connection opens:
+ * `pageCache` bytes for pages of `pageSize` (4096 by default) bytes, a `heap`
+ * of that many bytes for all other allocations, and `lookasideSlots` slots of
+ * `lookasideSlotSize` bytes per connection, taken from the heap. Parts that
+ * are left out keep their defaults. See {@link Database.memoryStats}
  * @see https://emscripten.org/docs/api_reference/module.html
  */
 
@@ -63,6 +71,7 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
     var NULL = 0;
     // SQLite enum
     var SQLITE_OK = 0;
+    var SQLITE_NOMEM = 7;
     var SQLITE_ROW = 100;
     var SQLITE_DONE = 101;
     var SQLITE_INTEGER = 1;
@@ -230,6 +239,183 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         "number",
         ["number"]
     );
+    var memory_budget_configure = cwrap(
+        "memory_budget_configure",
+        "number",
+        ["number", "number", "number", "number", "number"]
+    );
+    var memory_budget_stats = cwrap(
+        "memory_budget_stats",
+        "",
+        ["number", "number"]
+    );
+    var columnar_new = cwrap("columnar_new", "number", ["number"]);
+    var columnar_step = cwrap(
+        "columnar_step",
+        "number",
+        ["number", "number", "number"]
+    );
+    var columnar_finish = cwrap("columnar_finish", "", ["number", "number"]);
+    var columnar_row_count = cwrap("columnar_row_count", "number", ["number"]);
+    var columnar_column = cwrap(
+        "columnar_column",
+        "",
+        ["number", "number", "number"]
+    );
+    var columnar_free = cwrap("columnar_free", "", ["number"]);
+    var row_packer_new = cwrap("row_packer_new", "number", []);
+    var row_packer_step = cwrap(
+        "row_packer_step",
+        "number",
+        ["number", "number", "number", "number"]
+    );
+    var row_packer_batch = cwrap("row_packer_batch", "", ["number", "number"]);
+    var row_packer_free = cwrap("row_packer_free", "", ["number"]);
+    var blob_io_open = cwrap(
+        "blob_io_open",
+        "number",
+        ["number", "string", "string", "string", "number", "number", "number"]
+    );
+    var blob_io_reopen = cwrap("blob_io_reopen", "number", ["number", "number"]);
+    var sqlite3_blob_bytes = cwrap("sqlite3_blob_bytes", "number", ["number"]);
+    var sqlite3_blob_read = cwrap(
+        "sqlite3_blob_read",
+        "number",
+        ["number", "number", "number", "number"]
+    );
+    var sqlite3_blob_write = cwrap(
+        "sqlite3_blob_write",
+        "number",
+        ["number", "number", "number", "number"]
+    );
+    var sqlite3_blob_close = cwrap("sqlite3_blob_close", "number", ["number"]);
+    var bulk_insert_run = cwrap(
+        "bulk_insert_run",
+        "number",
+        [
+            "number", "number", "number", "number", "number", "number",
+            "number", "number"
+        ]
+    );
+    var sqlite3_free = cwrap("sqlite3_free", "", ["number"]);
+    var snapshot_open = cwrap(
+        "snapshot_open",
+        "number",
+        ["number", "string", "number", "number"]
+    );
+    var snapshot_bytes = cwrap("snapshot_bytes", "number", ["number", "number"]);
+    var sqlite3_backup_step = cwrap(
+        "sqlite3_backup_step",
+        "number",
+        ["number", "number"]
+    );
+    var sqlite3_backup_finish = cwrap(
+        "sqlite3_backup_finish",
+        "number",
+        ["number"]
+    );
+    var image_realloc = cwrap("image_realloc", "number", ["number", "number"]);
+    var image_free = cwrap("image_free", "", ["number"]);
+    var image_deserialize = cwrap(
+        "image_deserialize",
+        "number",
+        ["number", "number", "number", "number"]
+    );
+    var sqlite3_arena_install = cwrap(
+        "sqlite3_arena_install",
+        "number",
+        []
+    );
+    var sqlite3_pthreadfs_vfs_register = cwrap(
+        "sqlite3_pthreadfs_vfs_register",
+        "number",
+        ["number"]
+    );
+    var sqlite3_pthreadfs_zvfs_register = cwrap(
+        "sqlite3_pthreadfs_zvfs_register",
+        "number",
+        ["number"]
+    );
+    var sqlite3_pthreadfs_zvfs_stats = cwrap(
+        "sqlite3_pthreadfs_zvfs_stats",
+        "",
+        ["number"]
+    );
+
+    var connection_pool_open = cwrap(
+        "connection_pool_open",
+        "number",
+        ["string", "number"]
+    );
+    var connection_pool_submit = cwrap(
+        "connection_pool_submit",
+        "number",
+        ["number", "number", "string", "number", "number"]
+    );
+    var connection_pool_idle = cwrap(
+        "connection_pool_idle",
+        "number",
+        ["number"]
+    );
+    var connection_pool_close = cwrap(
+        "connection_pool_close",
+        "",
+        ["number"]
+    );
+    var pthreadfs_set_relaxed_durability = cwrap(
+        "pthreadfs_set_relaxed_durability",
+        "",
+        ["string", "number"]
+    );
+    var pthreadfs_current_epoch = cwrap(
+        "pthreadfs_current_epoch",
+        "number",
+        []
+    );
+    var pthreadfs_durable_epoch = cwrap(
+        "pthreadfs_durable_epoch",
+        "number",
+        []
+    );
+    var SQLITE_NULL = 5;
+    // Default capacity of the statement cache of a Database.
+    var STATEMENT_CACHE_SIZE = 256;
+    // Rows that exec and each step in one call, see Statement.stepRows.
+    var ROW_BATCH_SIZE = 1024;
+    // Shared by all statements; a batch is decoded before the next is packed.
+    // While rowPackerBusy, a user function is stepping another statement
+    // from within row_packer_step, which then packs into a packer of its own.
+    var rowPacker = NULL;
+    var rowPackerBusy = false;
+    // ignoreBOM keeps a byte order mark at the start of the batch's text, which
+    // belongs to the first value.
+    var utf8Decoder = typeof TextDecoder !== "undefined"
+        ? new TextDecoder("utf8", { ignoreBOM: true })
+        : null;
+
+    // The memory budget and the allocator must be configured before SQLite
+    // is initialized, which registering the VFS does. Without a heap arena,
+    // SQLite allocates from size classes with a cache per pthread, see
+    // libs/sqlite_arena.cpp.
+    var memoryBudget = Module["memoryBudget"] || {};
+    var budgetResult = memory_budget_configure(
+        memoryBudget["pageSize"] || 4096,
+        memoryBudget["pageCache"] || 0,
+        memoryBudget["lookasideSlotSize"] || 0,
+        memoryBudget["lookasideSlots"] || 0,
+        memoryBudget["heap"] || 0
+    );
+    if (budgetResult !== SQLITE_OK) {
+        throw new Error("Invalid memoryBudget, SQLite error " + budgetResult);
+    }
+    if (!memoryBudget["heap"]) {
+        sqlite3_arena_install();
+    }
+
+    // Databases in /persistent are accessed through the PThreadFS VFS, which
+    // hands every read and write to PThreadFS in a single call. Other files
+    // are still handled by the default unix VFS.
+    sqlite3_pthreadfs_vfs_register(1);
 
     /**
     * @classdesc
@@ -380,18 +566,18 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         return sqlite3_column_text(this.stmt, pos);
     };
 
-    Statement.prototype.getBlob = function getBlob(pos) {
+    // With `view`, returns the bytes in the wasm memory without copying them;
+    // they are only valid until the statement is stepped, reset or freed.
+    Statement.prototype.getBlob = function getBlob(pos, view) {
         if (pos == null) {
             pos = this.pos;
             this.pos += 1;
         }
         var size = sqlite3_column_bytes(this.stmt, pos);
         var ptr = sqlite3_column_blob(this.stmt, pos);
-        var result = new Uint8Array(size);
-        for (var i = 0; i < size; i += 1) {
-            result[i] = HEAP8[ptr + i];
-        }
-        return result;
+        return view
+            ? HEAPU8.subarray(ptr, ptr + size)
+            : HEAPU8.slice(ptr, ptr + size);
     };
 
     /** Get one row of results of a statement.
@@ -408,6 +594,11 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
     <caption>Enable BigInt support</caption>
     var stmt = db.prepare("SELECT * FROM test");
     while (stmt.step()) console.log(stmt.get(null, {useBigInt: true}));
+
+    <caption>Read blobs without copying them</caption>
+    // Each blob is a view of the wasm memory, only valid until the next step
+    var stmt = db.prepare("SELECT data FROM images");
+    while (stmt.step()) hash.update(stmt.get(null, {blobView: true})[0]);
      */
     Statement.prototype["get"] = function get(params, config) {
         config = config || {};
@@ -431,7 +622,7 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
                     results1.push(this.getString(field));
                     break;
                 case SQLITE_BLOB:
-                    results1.push(this.getBlob(field));
+                    results1.push(this.getBlob(field, config["blobView"]));
                     break;
                 default:
                     results1.push(null);
@@ -440,6 +631,125 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         return results1;
     };
 
+    // Decodes a batch of libs/sqlite_js/row_packer.c into rows in the format
+    // of Statement.get. `text` is the decoded text buffer of the batch, or
+    // null to decode each text value on its own.
+    function decodePackedRows(batch, columnCount, useBigInt, text) {
+        var view = new DataView(HEAPU8.buffer);
+        var pos = batch.valuesPtr;
+        var textBytes = 0;
+        var textChars = 0;
+        var rows = [];
+        for (var row = 0; row < batch.rowCount; row += 1) {
+            var values = [];
+            for (var col = 0; col < columnCount; col += 1) {
+                var type = HEAPU8[pos];
+                pos += 1;
+                if (type === SQLITE_INTEGER && useBigInt) {
+                    if (typeof BigInt !== "function") {
+                        throw new Error("BigInt is not supported");
+                    }
+                    values.push(view.getBigInt64(pos, true));
+                    pos += 8;
+                } else if (type === SQLITE_INTEGER || type === SQLITE_FLOAT) {
+                    values.push(view.getFloat64(pos, true));
+                    pos += 8;
+                } else if (type === SQLITE_TEXT) {
+                    var bytes = view.getInt32(pos, true);
+                    var chars = view.getInt32(pos + 4, true);
+                    pos += 8;
+                    values.push(text !== null
+                        ? text.substring(textChars, textChars + chars)
+                        : UTF8ToString(batch.textPtr + textBytes, bytes));
+                    textBytes += bytes;
+                    textChars += chars;
+                } else if (type === SQLITE_BLOB) {
+                    var length = view.getInt32(pos, true);
+                    values.push(HEAPU8.slice(pos + 4, pos + 4 + length));
+                    pos += 4 + length;
+                } else {
+                    values.push(null);
+                }
+            }
+            rows.push(values);
+        }
+        return rows;
+    }
+
+    /* Steps up to `maxRows` rows in one call to libs/sqlite_js/row_packer.c
+    and returns them in the format of Statement.get, with `done` set once the
+    statement has no more rows. Used by Database.exec and Database.each.
+     */
+    Statement.prototype.stepRows = function stepRows(maxRows, config) {
+        if (!this.stmt) {
+            throw "Statement closed";
+        }
+        var packer = rowPackerBusy ? NULL : rowPacker;
+        if (packer === NULL) {
+            packer = row_packer_new();
+            if (packer === NULL) {
+                throw new Error("Out of memory");
+            }
+            if (!rowPackerBusy) {
+                rowPacker = packer;
+            }
+        }
+        try {
+            return this.packRows(packer, maxRows, config);
+        } finally {
+            if (packer !== rowPacker) {
+                row_packer_free(packer);
+            }
+        }
+    };
+
+    // Packs the next rows of the statement into `packer` and decodes them.
+    Statement.prototype.packRows = function packRows(packer, maxRows, config) {
+        var useBigInt = !!(config && config["useBigInt"]);
+        var busy = rowPackerBusy;
+        var ret;
+        rowPackerBusy = true;
+        try {
+            ret = row_packer_step(packer, this.stmt, maxRows, useBigInt ? 1 : 0);
+        } finally {
+            rowPackerBusy = busy;
+        }
+        if (ret === SQLITE_NOMEM) {
+            // The packer's buffers could not grow, so the connection has no
+            // message for it
+            throw new Error("Out of memory");
+        }
+        if (ret !== SQLITE_ROW && ret !== SQLITE_DONE) {
+            throw this.db.handleError(ret);
+        }
+        var stack = stackSave();
+        var batch;
+        try {
+            var info = stackAlloc(6 * 4);
+            row_packer_batch(packer, info);
+            batch = {
+                rowCount: getValue(info, "i32"),
+                valuesPtr: getValue(info + 4, "i32"),
+                textPtr: getValue(info + 12, "i32"),
+                textSize: getValue(info + 16, "i32"),
+                invalidText: getValue(info + 20, "i32") !== 0
+            };
+        } finally {
+            stackRestore(stack);
+        }
+        var columnCount = sqlite3_column_count(this.stmt);
+        var text = null;
+        // Text that is not valid UTF-8 is decoded value by value, so that a
+        // broken sequence cannot join the bytes of the next value.
+        if (utf8Decoder !== null && batch.textSize > 0 && !batch.invalidText) {
+            text = utf8Decoder.decode(
+                HEAPU8.slice(batch.textPtr, batch.textPtr + batch.textSize)
+            );
+        }
+        var rows = decodePackedRows(batch, columnCount, useBigInt, text);
+        return { rows: rows, done: ret === SQLITE_DONE };
+    };
+
     /** Get the list of column names of a row of result of a statement.
     @return {string[]} The names of the columns
     @example
@@ -545,7 +855,11 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
             pos = this.pos;
             this.pos += 1;
         }
-        var blobptr = allocate(array, ALLOC_NORMAL);
+        var blobptr = _malloc(array.length || 1);
+        if (blobptr === NULL) {
+            throw new Error("Unable to allocate memory for the blob");
+        }
+        HEAPU8.set(array, blobptr);
         this.allocatedmem.push(blobptr);
         this.db.handleError(sqlite3_bind_blob(
             this.stmt,
@@ -766,6 +1080,20 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
             ));
             this.nextSqlPtr = getValue(pzTail, "i32");
             var pStmt = getValue(apiTemp, "i32");
+            // Skip empty statements, such as a lone ";" or a comment
+            while (pStmt === NULL && getValue(this.nextSqlPtr, "i8") !== NULL) {
+                setValue(apiTemp, 0, "i32");
+                setValue(pzTail, 0, "i32");
+                this.db.handleError(sqlite3_prepare_v2_sqlptr(
+                    this.db.db,
+                    this.nextSqlPtr,
+                    -1,
+                    apiTemp,
+                    pzTail
+                ));
+                this.nextSqlPtr = getValue(pzTail, "i32");
+                pStmt = getValue(apiTemp, "i32");
+            }
             if (pStmt === NULL) {
                 this.finalize();
                 return { done: true };
@@ -805,119 +1133,1023 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         };
     }
 
-    /** @classdesc
-    * Represents an SQLite database
-    * @constructs Database
-    * @memberof module:SqlJs
-    * Open a new database either by creating a new one or opening an existing
-    * one stored in the byte array passed in first argument
-    * @param {number[]} data An array of bytes representing
-    * an SQLite database file
-    */
-  function Database(data) {
-    console.log('open db')
-    this.filename = "/persistent/db";
-    this.handleError(sqlite3_open(this.filename, apiTemp));
-    console.log('get db pointer')
-    this.db = getValue(apiTemp, "i32");
-    console.log('registerExtensionFunctions')
-        registerExtensionFunctions(this.db);
-        // A list of all prepared statements of the database
-        this.statements = {};
-        // A list of all user function of the database
-        // (created by create_function call)
-        this.functions = {};
+    /**
+     * @classdesc
+     * A BLOB that is read and written in pieces with sqlite3_blob_read and
+     * sqlite3_blob_write, so that a large value is never held in memory as a
+     * whole, let alone twice. Its size is fixed when the row is written; use
+     * `zeroblob(N)` to make room for a value that is written afterwards.
+     *
+     * You can't instantiate this class directly, you have to use
+     * {@link Database.openBlob}.
+     *
+     * @example
+     * db.run("INSERT INTO files VALUES (1, zeroblob(?))", [file.size]);
+     * var blob = db.openBlob("files", "data", 1, true);
+     * for (var offset = 0; offset < file.size; offset += chunk.length) {
+     *     chunk = readChunk(file, offset);
+     *     blob.write(chunk, offset);
+     * }
+     * blob.close();
+     *
+     * @constructs BlobStream
+     * @memberof module:SqlJs
+     * @param {number} pBlob The sqlite3_blob handle
+     * @param {Database} db The database the BLOB was opened on
+     */
+    function BlobStream(pBlob, db) {
+        this.blob = pBlob;
+        this.db = db;
     }
 
-    /** Execute an SQL query, ignoring the rows it returns.
-    @param {string} sql a string containing some SQL text to execute
-    @param {Statement.BindParams} [params] When the SQL statement contains
-    placeholders, you can pass them in here. They will be bound to the statement
-    before it is executed. If you use the params argument, you **cannot**
-    provide an sql string that contains several statements (separated by `;`)
+    /** @return {number} The size of the BLOB in bytes */
+    BlobStream.prototype["size"] = function size() {
+        if (!this.blob) {
+            throw "Blob closed";
+        }
+        return sqlite3_blob_bytes(this.blob);
+    };
 
-    @example
-    // Insert values in a table
-    db.run(
-        "INSERT INTO test VALUES (:age, :name)",
-        { ':age' : 18, ':name' : 'John' }
-    );
+    /** Read part of the BLOB.
+    @param {number} [offset=0] The first byte to read
+    @param {number} [length] The number of bytes, by default up to the end
+    @return {Uint8Array} The bytes read
+    @throws {String} SQLite error, for example if the row has changed
+     */
+    BlobStream.prototype["read"] = function read(offset, length) {
+        var start = offset || 0;
+        var count = length == null ? this["size"]() - start : length;
+        var ptr = _malloc(count || 1);
+        if (ptr === NULL) {
+            throw new Error("Unable to allocate memory for the blob");
+        }
+        try {
+            this.db.handleError(
+                sqlite3_blob_read(this.blob, ptr, count, start)
+            );
+            return HEAPU8.slice(ptr, ptr + count);
+        } finally {
+            _free(ptr);
+        }
+    };
 
-    @return {Database} The database object (useful for method chaining)
+    /** Write bytes into the BLOB, which must have been opened for writing.
+    Writing cannot change the size of the BLOB.
+    @param {Uint8Array|number[]} data The bytes to write
+    @param {number} [offset=0] Where to write them
+    @return {BlobStream} The blob. Useful for method chaining
      */
-    Database.prototype["run"] = function run(sql, params) {
-        if (!this.db) {
-            throw "Database closed";
+    BlobStream.prototype["write"] = function write(data, offset) {
+        if (!this.blob) {
+            throw "Blob closed";
         }
-        if (params) {
-            var stmt = this["prepare"](sql, params);
-            try {
-                stmt["step"]();
-            } finally {
-                stmt["free"]();
+        var ptr = _malloc(data.length || 1);
+        if (ptr === NULL) {
+            throw new Error("Unable to allocate memory for the blob");
+        }
+        try {
+            HEAPU8.set(data, ptr);
+            this.db.handleError(
+                sqlite3_blob_write(this.blob, ptr, data.length, offset || 0)
+            );
+        } finally {
+            _free(ptr);
+        }
+        return this;
+    };
+
+    /** Iterate over the BLOB in pieces of `chunkSize` bytes.
+    @param {number} [chunkSize=65536]
+    @return {Iterator<Uint8Array>}
+     */
+    BlobStream.prototype["chunks"] = function chunks(chunkSize) {
+        var blob = this;
+        var step = chunkSize || 65536;
+        var offset = 0;
+        var size = this["size"]();
+        var iterator = {
+            "next": function next() {
+                if (offset >= size) {
+                    return { "done": true };
+                }
+                var chunk = blob["read"](offset, Math.min(step, size - offset));
+                offset += chunk.length;
+                return { "value": chunk, "done": false };
             }
-        } else {
-            this.handleError(sqlite3_exec(this.db, sql, 0, 0, apiTemp));
+        };
+        if (typeof Symbol === "function" && typeof Symbol.iterator === "symbol") {
+            iterator[Symbol.iterator] = function self() { return iterator; };
         }
+        return iterator;
+    };
+
+    /** Move to the same column of another row of the same table.
+    @param {number} rowid
+    @return {BlobStream} The blob. Useful for method chaining
+     */
+    BlobStream.prototype["reopen"] = function reopen(rowid) {
+        if (!this.blob) {
+            throw "Blob closed";
+        }
+        this.db.handleError(blob_io_reopen(this.blob, rowid));
         return this;
     };
 
+    /** Close the BLOB handle
+    @return {boolean} true in case of success
+     */
+    BlobStream.prototype["close"] = function close() {
+        if (!this.blob) {
+            return true;
+        }
+        var res = sqlite3_blob_close(this.blob) === SQLITE_OK;
+        delete this.db.blobs[this.blob];
+        this.blob = NULL;
+        return res;
+    };
+
+    // Resolves once other tasks, such as messages to the worker, have had a
+    // chance to run. Unlike setTimeout, not clamped when called in a loop.
+    function yieldTask() {
+        return new Promise(function wait(resolve) {
+            if (typeof setImmediate === "function") {
+                setImmediate(resolve);
+            } else if (typeof MessageChannel === "function") {
+                var channel = new MessageChannel();
+                channel.port1.onmessage = function done() {
+                    channel.port1.close();
+                    resolve();
+                };
+                channel.port2.postMessage(null);
+            } else {
+                setTimeout(resolve, 0);
+            }
+        });
+    }
+
     /**
-     * @typedef {{
-        columns:string[],
-        values:Database.SqlValue[][]
-    }} Database.QueryExecResult
-     * @property {string[]} columns the name of the columns of the result
-     * (as returned by {@link Statement.getColumnNames})
-     * @property {Database.SqlValue[][]} values one array per row, containing
-     * the column values
+     * @classdesc
+     * An async iterator over the rows of a statement, in batches of at most
+     * `batchSize` rows in the format of {@link Statement.get}. Each batch is
+     * stepped when it is asked for, after yielding to the event loop, so only
+     * one batch is held in memory at a time and the worker stays responsive.
+     * The statement is freed when the rows run out, on an error, or when the
+     * consumer stops early, for example with `break` in `for await`.
+     *
+     * You can't instantiate this class directly, you have to use
+     * {@link Database.stream}.
+     *
+     * @constructs RowStream
+     * @memberof module:SqlJs
+     * @param {Statement} stmt The statement, with its parameters bound
+     * @param {number} batchSize The most rows per batch
+     * @param {{useBigInt:boolean}} [config] As for {@link Statement.get}
      */
+    function RowStream(stmt, batchSize, config) {
+        this.stmt = stmt;
+        this.batchSize = batchSize;
+        this.config = config;
+        this.started = false;
+        /** @type {string[]} The names of the columns */
+        this["columns"] = stmt["getColumnNames"]();
+    }
 
-    /** Execute an SQL query, and returns the result.
-    *
-    * This is a wrapper against
-    * {@link Database.prepare},
-    * {@link Statement.bind},
-    * {@link Statement.step},
-    * {@link Statement.get},
-    * and {@link Statement.free}.
-    *
-    * The result is an array of result elements. There are as many result
-    * elements as the number of statements in your sql string (statements are
-    * separated by a semicolon)
-    *
-    * ## Example use
-    * We will create the following table, named *test* and query it with a
-    * multi-line statement using params:
-    *
-    * | id | age |  name  |
-    * |:--:|:---:|:------:|
-    * | 1  |  1  | Ling   |
-    * | 2  |  18 | Paul   |
-    *
-    * We query it like that:
-    * ```javascript
-    * var db = new SQL.Database();
-    * var res = db.exec(
-    *     "DROP TABLE IF EXISTS test;\n"
-    *     + "CREATE TABLE test (id INTEGER, age INTEGER, name TEXT);"
-    *     + "INSERT INTO test VALUES ($id1, :age1, @name1);"
-    *     + "INSERT INTO test VALUES ($id2, :age2, @name2);"
-    *     + "SELECT id FROM test;"
-    *     + "SELECT age,name FROM test WHERE id=$id1",
-    *     {
-    *         "$id1": 1, ":age1": 1, "@name1": "Ling",
-    *         "$id2": 2, ":age2": 18, "@name2": "Paul"
-    *     }
-    * );
-    * ```
-    *
-    * `res` is now :
-    * ```javascript
-    *     [
-    *         {"columns":["id"],"values":[[1],[2]]},
-    *         {"columns":["age","name"],"values":[[1,"Ling"]]}
-    *     ]
+    /** Step the next batch of rows.
+    @return {Promise<{value:Array<Database.SqlValue[]>, done:boolean}>}
+     */
+    RowStream.prototype["next"] = function next() {
+        var stream = this;
+        if (this.stmt === null) {
+            return Promise.resolve({ "done": true });
+        }
+        var wait = this.started ? yieldTask() : Promise.resolve();
+        this.started = true;
+        return wait.then(function step() {
+            if (stream.stmt === null) {
+                return { "done": true };
+            }
+            var batch;
+            try {
+                batch = stream.stmt.stepRows(stream.batchSize, stream.config);
+            } catch (error) {
+                stream["return"]();
+                throw error;
+            }
+            if (batch.done) {
+                stream["return"]();
+            }
+            if (batch.rows.length === 0) {
+                return { "done": true };
+            }
+            return { "value": batch.rows, "done": false };
+        });
+    };
+
+    /** Stop early and free the statement. Called by `for await` when the
+    loop is left before the end.
+    @return {Promise<{done:boolean}>}
+     */
+    RowStream.prototype["return"] = function cancel() {
+        if (this.stmt !== null) {
+            this.stmt["free"]();
+            this.stmt = null;
+        }
+        return Promise.resolve({ "done": true });
+    };
+    RowStream.prototype["cancel"] = RowStream.prototype["return"];
+
+    if (
+        typeof Symbol === "function"
+        && typeof Symbol.asyncIterator === "symbol"
+    ) {
+        RowStream.prototype[Symbol.asyncIterator] = function iterator() {
+            return this;
+        };
+    }
+
+    // An in-memory copy of a database made with the online backup API, see
+    // libs/sqlite_js/serialize.c. Once step() has copied all pages, `ptr`
+    // and `size` are its image in the wasm memory until close().
+    function Snapshot(db) {
+        var stack = stackSave();
+        try {
+            var ptrs = stackAlloc(8);
+            var ret = snapshot_open(db.db, "main", ptrs, ptrs + 4);
+            if (ret !== SQLITE_OK) {
+                throw new Error("Could not start the export, SQLite error " + ret);
+            }
+            this.snapshot = getValue(ptrs, "i32");
+            this.backup = getValue(ptrs + 4, "i32");
+        } finally {
+            stackRestore(stack);
+        }
+        this.ptr = NULL;
+        this.size = 0;
+    }
+
+    // Copies up to `pages` pages, or all if negative. Returns true once the
+    // copy is complete.
+    Snapshot.prototype.step = function step(pages) {
+        var ret = sqlite3_backup_step(this.backup, pages);
+        if (ret === SQLITE_OK) {
+            return false;
+        }
+        var finish = sqlite3_backup_finish(this.backup);
+        this.backup = NULL;
+        if (ret !== SQLITE_DONE || finish !== SQLITE_OK) {
+            throw new Error("Export failed, SQLite error "
+                + (ret !== SQLITE_DONE ? ret : finish));
+        }
+        var stack = stackSave();
+        try {
+            var pSize = stackAlloc(4);
+            this.ptr = snapshot_bytes(this.snapshot, pSize);
+            this.size = getValue(pSize, "i32");
+        } finally {
+            stackRestore(stack);
+        }
+        return true;
+    };
+
+    Snapshot.prototype.close = function close() {
+        if (this.backup !== NULL) {
+            sqlite3_backup_finish(this.backup);
+            this.backup = NULL;
+        }
+        if (this.snapshot !== NULL) {
+            sqlite3_close_v2(this.snapshot);
+            this.snapshot = NULL;
+        }
+        this.ptr = NULL;
+    };
+
+    /**
+     * @classdesc
+     * An async iterator over the bytes of a database, in chunks of at most
+     * `chunkSize` bytes. The first call to next() copies the database, a few
+     * pages at a time; the chunks are then cut from that copy, which is freed
+     * after the last chunk or when the consumer stops early.
+     *
+     * You can't instantiate this class directly, you have to use
+     * {@link Database.exportStream}.
+     *
+     * @constructs ExportStream
+     * @memberof module:SqlJs
+     * @param {Snapshot} snapshot The copy of the database to stream
+     * @param {number} chunkSize The most bytes per chunk
+     * @param {number} pagesPerStep The pages copied between two yields
+     */
+    function ExportStream(snapshot, chunkSize, pagesPerStep) {
+        this.snapshot = snapshot;
+        this.chunkSize = chunkSize;
+        this.pagesPerStep = pagesPerStep;
+        this.copied = false;
+        this.offset = 0;
+    }
+
+    /** Copy the database if needed and return the next chunk.
+    @return {Promise<{value:Uint8Array, done:boolean}>}
+     */
+    ExportStream.prototype["next"] = function next() {
+        var stream = this;
+        if (this.snapshot === null) {
+            return Promise.resolve({ "done": true });
+        }
+        function copy() {
+            if (stream.snapshot === null) {
+                return null;
+            }
+            if (stream.copied) {
+                return stream.snapshot;
+            }
+            try {
+                stream.copied = stream.snapshot.step(stream.pagesPerStep);
+            } catch (error) {
+                stream["return"]();
+                throw error;
+            }
+            return stream.copied ? stream.snapshot : yieldTask().then(copy);
+        }
+        return Promise.resolve().then(copy).then(function chunk(snapshot) {
+            if (snapshot === null || stream.offset >= snapshot.size) {
+                stream["return"]();
+                return { "done": true };
+            }
+            var start = snapshot.ptr + stream.offset;
+            var end = Math.min(start + stream.chunkSize, snapshot.ptr + snapshot.size);
+            stream.offset += end - start;
+            return { "value": HEAPU8.slice(start, end), "done": false };
+        });
+    };
+
+    /** Stop early and free the copy of the database.
+    @return {Promise<{done:boolean}>}
+     */
+    ExportStream.prototype["return"] = function cancel() {
+        if (this.snapshot !== null) {
+            this.snapshot.close();
+            this.snapshot = null;
+        }
+        return Promise.resolve({ "done": true });
+    };
+    ExportStream.prototype["cancel"] = ExportStream.prototype["return"];
+
+    if (
+        typeof Symbol === "function"
+        && typeof Symbol.asyncIterator === "symbol"
+    ) {
+        ExportStream.prototype[Symbol.asyncIterator] = function iterator() {
+            return this;
+        };
+    }
+
+    // Reader pool queries in flight, by job id. Completions are delivered by
+    // libs/sqlite_js/connection_pool.c through Module.connectionPoolDone.
+    var poolJobs = {};
+    var nextPoolJobId = 1;
+
+    // Encodes bind parameters for connection_pool_submit. See
+    // libs/sqlite_js/connection_pool.c for the format.
+    function encodePoolParams(params) {
+        var values = params.map(function encode(value) {
+            if (value === null || value === undefined) {
+                return { type: SQLITE_NULL, size: 1 };
+            }
+            if (typeof value === "number" || typeof value === "boolean") {
+                return {
+                    type: Number.isInteger(+value) ? SQLITE_INTEGER : SQLITE_FLOAT,
+                    number: +value,
+                    size: 9
+                };
+            }
+            if (typeof value === "string") {
+                var text = intArrayFromString(value, true);
+                return { type: SQLITE_TEXT, bytes: text, size: 5 + text.length };
+            }
+            if (value.length != null) {
+                return { type: SQLITE_BLOB, bytes: value, size: 5 + value.length };
+            }
+            throw new Error("Wrong API use : unsupported parameter " + value);
+        });
+        var size = values.reduce(function add(sum, v) { return sum + v.size; }, 4);
+        var ptr = _malloc(size);
+        var view = new DataView(HEAPU8.buffer);
+        var pos = ptr;
+        view.setInt32(pos, values.length, true);
+        pos += 4;
+        values.forEach(function write(v) {
+            HEAPU8[pos] = v.type;
+            pos += 1;
+            if (v.type === SQLITE_INTEGER || v.type === SQLITE_FLOAT) {
+                view.setFloat64(pos, v.number, true);
+                pos += 8;
+            } else if (v.bytes) {
+                view.setInt32(pos, v.bytes.length, true);
+                HEAPU8.set(v.bytes, pos + 4);
+                pos += 4 + v.bytes.length;
+            }
+        });
+        return { ptr: ptr, size: size };
+    }
+
+    // Decodes a result buffer of connection_pool.c into the format of
+    // Database.exec, or throws the error it contains.
+    function decodePoolResult(ptr) {
+        var view = new DataView(HEAPU8.buffer);
+        var pos = ptr;
+        function readInt() {
+            var value = view.getInt32(pos, true);
+            pos += 4;
+            return value;
+        }
+        function readString() {
+            var length = readInt();
+            var value = UTF8ToString(pos, length);
+            pos += length;
+            return value;
+        }
+        if (readInt() !== SQLITE_OK) {
+            throw new Error(readString());
+        }
+        var results = [];
+        var nSet = readInt();
+        for (var set = 0; set < nSet; set += 1) {
+            var nCol = readInt();
+            var columns = [];
+            for (var col = 0; col < nCol; col += 1) {
+                columns.push(readString());
+            }
+            var nRow = readInt();
+            var values = [];
+            for (var row = 0; row < nRow; row += 1) {
+                var rowValues = [];
+                for (col = 0; col < nCol; col += 1) {
+                    var type = HEAPU8[pos];
+                    pos += 1;
+                    if (type === SQLITE_INTEGER || type === SQLITE_FLOAT) {
+                        rowValues.push(view.getFloat64(pos, true));
+                        pos += 8;
+                    } else if (type === SQLITE_TEXT) {
+                        rowValues.push(readString());
+                    } else if (type === SQLITE_BLOB) {
+                        var length = readInt();
+                        rowValues.push(HEAPU8.slice(pos, pos + length));
+                        pos += length;
+                    } else {
+                        rowValues.push(null);
+                    }
+                }
+                values.push(rowValues);
+            }
+            // Like exec, statements that return no rows have no result.
+            if (nRow > 0) {
+                results.push({ columns: columns, values: values });
+            }
+        }
+        return results;
+    }
+
+    Module["connectionPoolDone"] = function connectionPoolDone(id, ptr) {
+        var job = poolJobs[id];
+        delete poolJobs[id];
+        try {
+            if (!job) {
+                // The database was closed in the meantime.
+                return;
+            }
+            if (ptr === NULL) {
+                job.reject(new Error("Out of memory in the reader pool"));
+                return;
+            }
+            job.resolve(decodePoolResult(ptr));
+        } catch (error) {
+            job.reject(error);
+        } finally {
+            _free(ptr);
+        }
+    };
+
+    /** @classdesc
+    * Represents an SQLite database
+    * @constructs Database
+    * @memberof module:SqlJs
+    * Open a new database either by creating a new one or opening an existing
+    * one stored in the byte array passed in first argument
+    * @param {number[]} data An array of bytes representing
+    * an SQLite database file
+    * @param {{readers:number, relaxedDurability:number, threads:number}}
+    * [config] With `readers` > 0, also open a pool of that many read-only
+    * connections, see {@link Database.openReaderPool}. With
+    * `relaxedDurability`, commits are flushed in the background after that
+    * many milliseconds, see {@link Database.setRelaxedDurability}. `threads`
+    * sets the number of sorter worker threads, see {@link Database.setThreads}.
+    * With `compress`, a new database is created with LZ4-compressed pages, see
+    * {@link Database.compressionStats}. `statementCacheSize` bounds the
+    * statements kept prepared by run and exec (256 by default, 0 disables
+    * the cache), see {@link Database.statementCacheStats}.
+    */
+  function Database(data, config) {
+    if (config && config["compress"]) {
+        // Also used by the reader pool and any later database, so that a
+        // compressed file is never opened without the compression VFS.
+        if (sqlite3_pthreadfs_zvfs_register(1) !== SQLITE_OK) {
+            throw new Error("Could not register the compression VFS");
+        }
+    }
+    console.log('open db')
+    this.filename = (config && config["filename"]) || "/persistent/db";
+    this.handleError(sqlite3_open(this.filename, apiTemp));
+    console.log('get db pointer')
+    this.db = getValue(apiTemp, "i32");
+    console.log('registerExtensionFunctions')
+        registerExtensionFunctions(this.db);
+        // A list of all prepared statements of the database
+        this.statements = {};
+        // A list of all user function of the database
+        // (created by create_function call)
+        this.functions = {};
+        // Open BLOB handles, see openBlob
+        this.blobs = {};
+        // Prepared statements of run and exec by SQL text, least recently
+        // used first, see acquireStatement
+        this.statementCache = new Map();
+        this.statementCacheSize = (config && config["statementCacheSize"] != null)
+            ? config["statementCacheSize"]
+            : STATEMENT_CACHE_SIZE;
+        this.statementCacheHits = 0;
+        this.statementCacheMisses = 0;
+        // Reader pool, see openReaderPool
+        this.pool = NULL;
+        this.poolJobIds = [];
+        if (config && config["readers"] > 0) {
+            this["openReaderPool"](config["readers"]);
+        }
+        if (config && config["relaxedDurability"] != null) {
+            this["setRelaxedDurability"](config["relaxedDurability"]);
+        }
+        if (config && config["threads"] != null) {
+            this["setThreads"](config["threads"]);
+        }
+    }
+
+    /** Reports memory use against the arenas of the `memoryBudget` option of
+    initSqlJs. All sizes are in bytes, and a budget of 0 means that part was
+    left to the default allocator. `pageCache.overflow` counts pages that did
+    not fit into the page cache arena and were allocated from the heap.
+    `heap.used` is all memory SQLite has allocated, and lookaside figures are
+    those of this connection.
+    @return {{pageCache:Object, heap:Object, lookaside:Object}}
+    */
+    Database.prototype["memoryStats"] = function memoryStats() {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var count = 13;
+        var ptr = _malloc(count * 8);
+        var v = [];
+        try {
+            memory_budget_stats(this.db, ptr);
+            for (var i = 0; i < count; i += 1) {
+                v.push(getValue(ptr + i * 8, "double"));
+            }
+        } finally {
+            _free(ptr);
+        }
+        return {
+            "pageCache": {
+                "budget": v[0],
+                "slotSize": v[1],
+                "used": v[2] * v[1],
+                "highwater": v[3] * v[1],
+                "overflow": v[4]
+            },
+            "heap": { "budget": v[5], "used": v[6], "highwater": v[7] },
+            "lookaside": {
+                "slots": v[8],
+                "used": v[9],
+                "highwater": v[10],
+                "hits": v[11],
+                "misses": v[12]
+            }
+        };
+    };
+
+    /** Returns the counters of the page compression VFS, for all databases
+    opened with `compress` since the module started. `ratio` is the size of the
+    written pages divided by the bytes stored for them.
+    @return {{pagesWritten:number, pagesStoredRaw:number, bytesIn:number,
+    bytesOut:number, pagesRead:number, compressMs:number,
+    decompressMs:number, ratio:number}}
+    */
+    Database.prototype["compressionStats"] = function compressionStats() {
+        var names = [
+            "pagesWritten", "pagesStoredRaw", "bytesIn", "bytesOut",
+            "pagesRead", "compressMs", "decompressMs"
+        ];
+        var ptr = _malloc(names.length * 8);
+        var stats = {};
+        try {
+            sqlite3_pthreadfs_zvfs_stats(ptr);
+            for (var i = 0; i < names.length; i += 1) {
+                stats[names[i]] = getValue(ptr + i * 8, "double");
+            }
+        } finally {
+            _free(ptr);
+        }
+        stats["ratio"] = stats["bytesOut"] > 0
+            ? stats["bytesIn"] / stats["bytesOut"]
+            : 0;
+        return stats;
+    };
+
+    /** Sets how many worker threads SQLite may start, on top of the calling
+    thread, to sort large `ORDER BY`, `GROUP BY` and `CREATE INDEX` inputs.
+    Sorts that fit in the page cache stay on the calling thread. The default
+    is 2 and the maximum 4, as compiled in.
+    @param {number} threads the number of worker threads, 0 to sort on the
+    calling thread only
+    @return {number} The number of worker threads now in use
+    */
+    Database.prototype["setThreads"] = function setThreads(threads) {
+        var result = this["exec"]("PRAGMA threads=" + (threads | 0));
+        return result[0]["values"][0][0];
+    };
+
+    /** Lets commits return before they are flushed to disk. The database file
+    and its journal are then flushed by a background pass at most `delayMs`
+    milliseconds after a commit. Each pass makes one epoch durable, and
+    {@link Database.waitDurable} waits for a given epoch.
+
+    A crash of the page loses nothing that was committed, but an OS crash or
+    power loss can lose the commits that are not durable yet and, as with
+    `PRAGMA synchronous=OFF`, corrupt a database in rollback journal mode.
+
+    @param {number} delayMs the flush delay, or a negative number to flush on
+    every commit again
+    @return {Database} The database object (useful for method chaining)
+    */
+    Database.prototype["setRelaxedDurability"] = function setRelaxedDurability(
+        delayMs
+    ) {
+        pthreadfs_set_relaxed_durability(this.filename, delayMs);
+        return this;
+    };
+
+    /** Returns the current durability epoch, which covers all commits made so
+    far.
+    @return {number}
+    */
+    Database.prototype["currentEpoch"] = function currentEpoch() {
+        return pthreadfs_current_epoch();
+    };
+
+    /** Waits until the commits of an epoch are durable. The background pass
+    is not hurried, so this resolves within the delay passed to
+    {@link Database.setRelaxedDurability}.
+    @param {number} [epoch] the epoch to wait for, by default the current one
+    @return {Promise<number>} The newest durable epoch
+    */
+    Database.prototype["waitDurable"] = function waitDurable(epoch) {
+        var target = epoch == null ? pthreadfs_current_epoch() : epoch;
+        return new Promise(function poll(resolve) {
+            var durable = pthreadfs_durable_epoch();
+            if (durable >= target) {
+                resolve(durable);
+            } else {
+                setTimeout(function retry() { poll(resolve); }, 20);
+            }
+        });
+    };
+
+    /** Opens a pool of read-only connections to this database, each running
+    on its own pthread. Queries passed to {@link Database.read} are then run by
+    the next idle reader, so that long reports do not hold up other queries.
+    This connection remains the only writer.
+
+    The database is switched to WAL mode, in which readers see the last
+    committed state without waiting for the writer. If WAL is not available,
+    readers wait for writes to finish.
+
+    @param {number} readers the number of read-only connections
+    @return {Database} The database object (useful for method chaining)
+    */
+    Database.prototype["openReaderPool"] = function openReaderPool(readers) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        if (this.pool !== NULL) {
+            throw new Error("The reader pool is already open");
+        }
+        this["exec"]("PRAGMA journal_mode=WAL");
+        this.pool = connection_pool_open(this.filename, readers);
+        if (this.pool === NULL) {
+            throw new Error("Could not open the reader pool");
+        }
+        return this;
+    };
+
+    /** Runs a read-only query on the reader pool.
+
+    Without a pool, the query runs synchronously on this connection.
+    @param {string} sql SQL text, which may contain several statements
+    @param {Array} [params] positional parameters, bound to every statement
+    @return {Promise<Database.QueryExecResult[]>} The results, as returned by
+    {@link Database.exec}
+    */
+    Database.prototype["read"] = function read(sql, params) {
+        if (!this.db) {
+            return Promise.reject(new Error("Database closed"));
+        }
+        if (this.pool === NULL) {
+            try {
+                return Promise.resolve(this["exec"](sql, params));
+            } catch (error) {
+                return Promise.reject(error);
+            }
+        }
+        if (params != null && !Array.isArray(params)) {
+            return Promise.reject(new Error(
+                "Wrong API use : the reader pool only binds parameter arrays"
+            ));
+        }
+        var id = nextPoolJobId;
+        nextPoolJobId += 1;
+        var encoded = params ? encodePoolParams(params) : { ptr: NULL, size: 0 };
+        var db = this;
+        var promise = new Promise(function submit(resolve, reject) {
+            poolJobs[id] = { resolve: resolve, reject: reject };
+        });
+        var rc = connection_pool_submit(this.pool, id, sql, encoded.ptr, encoded.size);
+        _free(encoded.ptr);
+        if (rc !== SQLITE_OK) {
+            delete poolJobs[id];
+            return Promise.reject(new Error("Could not queue the query"));
+        }
+        this.poolJobIds.push(id);
+        return promise.finally(function done() {
+            var index = db.poolJobIds.indexOf(id);
+            if (index >= 0) {
+                db.poolJobIds.splice(index, 1);
+            }
+        });
+    };
+
+    /** Returns the number of readers of the pool that are waiting for a query.
+    @return {number}
+    */
+    Database.prototype["idleReaders"] = function idleReaders() {
+        return this.pool === NULL ? 0 : connection_pool_idle(this.pool);
+    };
+
+    /** Stops the reader pool, waiting for queries that are running. Queries
+    that have not completed are rejected. Called by {@link Database.close}.
+    */
+    Database.prototype["closeReaderPool"] = function closeReaderPool() {
+        if (this.pool === NULL) {
+            return;
+        }
+        connection_pool_close(this.pool);
+        this.pool = NULL;
+        this.poolJobIds.forEach(function reject(id) {
+            if (poolJobs[id]) {
+                poolJobs[id].reject(new Error("Database closed"));
+                delete poolJobs[id];
+            }
+        });
+        this.poolJobIds = [];
+    };
+
+    /** Execute an SQL query, ignoring the rows it returns.
+    @param {string} sql a string containing some SQL text to execute
+    @param {Statement.BindParams} [params] When the SQL statement contains
+    placeholders, you can pass them in here. They will be bound to the statement
+    before it is executed. If you use the params argument, you **cannot**
+    provide an sql string that contains several statements (separated by `;`)
+
+    @example
+    // Insert values in a table
+    db.run(
+        "INSERT INTO test VALUES (:age, :name)",
+        { ':age' : 18, ':name' : 'John' }
+    );
+
+    @return {Database} The database object (useful for method chaining)
+     */
+    Database.prototype["run"] = function run(sql, params) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var cached = this.acquireStatement(sql);
+        if (cached !== null) {
+            try {
+                if (params) {
+                    cached.bind(params);
+                    cached["step"]();
+                } else {
+                    while (cached["step"]());
+                }
+            } finally {
+                this.releaseStatement(cached);
+            }
+        } else if (params) {
+            var stmt = this["prepare"](sql, params);
+            try {
+                stmt["step"]();
+            } finally {
+                stmt["free"]();
+            }
+        } else {
+            this.handleError(sqlite3_exec(this.db, sql, 0, 0, apiTemp));
+        }
+        return this;
+    };
+
+    /* Returns the cached statement for `sql`, preparing it on a miss, or null
+    if `sql` is empty, holds several statements, or its statement is already
+    running further up the stack. Statements are prepared with
+    sqlite3_prepare_v2, so SQLite recompiles them itself after a schema
+    change. Must be paired with releaseStatement.
+     */
+    Database.prototype.acquireStatement = function acquireStatement(sql) {
+        if (this.statementCacheSize <= 0) {
+            return null;
+        }
+        var stmt = this.statementCache.get(sql);
+        if (stmt !== undefined) {
+            if (stmt === null || stmt.cacheInUse) {
+                return null;
+            }
+            this.statementCacheHits += 1;
+            // Move it to the most recently used end
+            this.statementCache.delete(sql);
+            this.statementCache.set(sql, stmt);
+            stmt.cacheInUse = true;
+            return stmt;
+        }
+        this.statementCacheMisses += 1;
+        var stack = stackSave();
+        try {
+            var pzTail = stackAlloc(4);
+            setValue(apiTemp, 0, "i32");
+            setValue(pzTail, 0, "i32");
+            this.handleError(sqlite3_prepare_v2_sqlptr(
+                this.db,
+                allocateUTF8OnStack(sql),
+                -1,
+                apiTemp,
+                pzTail
+            ));
+            var pStmt = getValue(apiTemp, "i32");
+            if (pStmt === NULL) {
+                return null;
+            }
+            stmt = new Statement(pStmt, this);
+            if (!/^[\s;]*$/.test(UTF8ToString(getValue(pzTail, "i32")))) {
+                // Several statements; remember not to try again
+                stmt["free"]();
+                stmt = null;
+            } else {
+                this.statements[pStmt] = stmt;
+                stmt.cacheInUse = true;
+            }
+        } finally {
+            stackRestore(stack);
+        }
+        this.statementCache.set(sql, stmt);
+        this.evictStatements();
+        return stmt;
+    };
+
+    /* Resets a statement of acquireStatement and clears its bindings. */
+    Database.prototype.releaseStatement = function releaseStatement(stmt) {
+        stmt["reset"]();
+        stmt.cacheInUse = false;
+    };
+
+    /* Frees the least recently used statements that are not running until
+    the cache fits statementCacheSize. */
+    Database.prototype.evictStatements = function evictStatements() {
+        var keys = this.statementCache.keys();
+        var excess = this.statementCache.size - this.statementCacheSize;
+        var evicted = [];
+        for (var key = keys.next(); excess > 0 && !key.done; key = keys.next()) {
+            var stmt = this.statementCache.get(key.value);
+            if (stmt === null || !stmt.cacheInUse) {
+                evicted.push(key.value);
+                if (stmt !== null) stmt["free"]();
+                excess -= 1;
+            }
+        }
+        for (var i = 0; i < evicted.length; i += 1) {
+            this.statementCache.delete(evicted[i]);
+        }
+    };
+
+    /** Free the statements kept prepared by run and exec. They are freed
+    when the database is closed anyway.
+    @return {Database} The database object. Useful for method chaining
+     */
+    Database.prototype["clearStatementCache"] = function clearStatementCache() {
+        var size = this.statementCacheSize;
+        this.statementCacheSize = 0;
+        this.evictStatements();
+        this.statementCacheSize = size;
+        return this;
+    };
+
+    /** Report how often run and exec found their statement prepared. A miss
+    prepares the statement; SQL strings with several statements are not cached
+    and count one miss only.
+    @return {{hits:number, misses:number, size:number, capacity:number}}
+     */
+    Database.prototype["statementCacheStats"] = function statementCacheStats() {
+        return {
+            "hits": this.statementCacheHits,
+            "misses": this.statementCacheMisses,
+            "size": this.statementCache.size,
+            "capacity": this.statementCacheSize
+        };
+    };
+
+    // Binds and runs one statement for Database.exec, and appends its rows
+    // to `results` if it returned any.
+    function execStatement(stmt, params, config, results) {
+        var curresult = null;
+        var batch;
+        if (params != null) {
+            stmt.bind(params);
+        }
+        do {
+            batch = stmt.stepRows(ROW_BATCH_SIZE, config);
+            if (curresult === null && batch.rows.length > 0) {
+                curresult = {
+                    columns: stmt["getColumnNames"](),
+                    values: [],
+                };
+                results.push(curresult);
+            }
+            for (var i = 0; i < batch.rows.length; i += 1) {
+                curresult["values"].push(batch.rows[i]);
+            }
+        } while (!batch.done);
+    }
+
+    /**
+     * @typedef {{
+        columns:string[],
+        values:Database.SqlValue[][]
+    }} Database.QueryExecResult
+     * @property {string[]} columns the name of the columns of the result
+     * (as returned by {@link Statement.getColumnNames})
+     * @property {Database.SqlValue[][]} values one array per row, containing
+     * the column values
+     */
+
+    /** Execute an SQL query, and returns the result.
+    *
+    * This is a wrapper against
+    * {@link Database.prepare},
+    * {@link Statement.bind},
+    * {@link Statement.step},
+    * {@link Statement.get},
+    * and {@link Statement.free}.
+    *
+    * The result is an array of result elements. There are as many result
+    * elements as the number of statements in your sql string (statements are
+    * separated by a semicolon)
+    *
+    * ## Example use
+    * We will create the following table, named *test* and query it with a
+    * multi-line statement using params:
+    *
+    * | id | age |  name  |
+    * |:--:|:---:|:------:|
+    * | 1  |  1  | Ling   |
+    * | 2  |  18 | Paul   |
+    *
+    * We query it like that:
+    * ```javascript
+    * var db = new SQL.Database();
+    * var res = db.exec(
+    *     "DROP TABLE IF EXISTS test;\n"
+    *     + "CREATE TABLE test (id INTEGER, age INTEGER, name TEXT);"
+    *     + "INSERT INTO test VALUES ($id1, :age1, @name1);"
+    *     + "INSERT INTO test VALUES ($id2, :age2, @name2);"
+    *     + "SELECT id FROM test;"
+    *     + "SELECT age,name FROM test WHERE id=$id1",
+    *     {
+    *         "$id1": 1, ":age1": 1, "@name1": "Ling",
+    *         "$id2": 2, ":age2": 18, "@name2": "Paul"
+    *     }
+    * );
+    * ```
+    *
+    * `res` is now :
+    * ```javascript
+    *     [
+    *         {"columns":["id"],"values":[[1],[2]]},
+    *         {"columns":["age","name"],"values":[[1,"Ling"]]}
+    *     ]
     * ```
     *
     @param {string} sql a string containing some SQL text to execute
@@ -932,11 +2164,145 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         if (!this.db) {
             throw "Database closed";
         }
+        var results = [];
+        var cached = this.acquireStatement(sql);
+        if (cached !== null) {
+            try {
+                execStatement(cached, params, config, results);
+            } finally {
+                this.releaseStatement(cached);
+            }
+            return results;
+        }
+        var it = new StatementIterator(sql, this);
+        try {
+            var next;
+            while (!(next = it["next"]()).done) {
+                execStatement(next.value, params, config, results);
+            }
+            return results;
+        } catch (errCaught) {
+            if (it.activeStatement !== null) {
+                it.activeStatement["free"]();
+                it.activeStatement = null;
+            }
+            if (it.sqlPtr !== null) it.finalize();
+            throw errCaught;
+        }
+    };
+
+    // Copies column `index` of the result gathered by libs/sqlite_js/columnar.c
+    // out of the wasm memory. `info` points to 6 ints of scratch space.
+    function decodeColumnarColumn(columnar, index, rows, useBigInt, info) {
+        columnar_column(columnar, index, info);
+        var mask = getValue(info, "i32");
+        var typesPtr = getValue(info + 4, "i32");
+        var numPtr = getValue(info + 8, "i32");
+        var offsetsPtr = getValue(info + 12, "i32");
+        var dataPtr = getValue(info + 16, "i32");
+        var dataLength = getValue(info + 20, "i32");
+        var numeric = mask & ((1 << SQLITE_INTEGER) | (1 << SQLITE_FLOAT));
+        var bytes = mask & ((1 << SQLITE_TEXT) | (1 << SQLITE_BLOB));
+        var type = "mixed";
+        if ((mask & ~(1 << SQLITE_NULL)) === 0) {
+            type = "null";
+        } else if (numeric && !bytes) {
+            type = (mask & (1 << SQLITE_FLOAT)) ? "real" : "integer";
+        } else if (!numeric && bytes === (1 << SQLITE_TEXT)) {
+            type = "text";
+        } else if (!numeric && bytes === (1 << SQLITE_BLOB)) {
+            type = "blob";
+        }
+        var column = { "type": type };
+        if (type === "null" || type === "mixed" || (mask & (1 << SQLITE_NULL))) {
+            column["types"] = HEAPU8.slice(typesPtr, typesPtr + rows);
+        }
+        if (numeric) {
+            // columnar_finish keeps integers as int64 in columns without
+            // floats when BigInt values are requested, also in mixed ones.
+            column["values"] = (useBigInt && !(mask & (1 << SQLITE_FLOAT)))
+                ? new BigInt64Array(HEAPU8.buffer, numPtr, rows).slice()
+                : new Float64Array(HEAPU8.buffer, numPtr, rows).slice();
+        }
+        if (bytes) {
+            column["offsets"] = new Int32Array(
+                HEAPU8.buffer,
+                offsetsPtr,
+                rows + 1
+            ).slice();
+            column["data"] = HEAPU8.slice(dataPtr, dataPtr + dataLength);
+        }
+        return column;
+    }
+
+    /**
+     * @typedef {{
+        type:string,
+        types:(Uint8Array|undefined),
+        values:(Float64Array|BigInt64Array|undefined),
+        offsets:(Int32Array|undefined),
+        data:(Uint8Array|undefined)
+    }} Database.ColumnarColumn
+     * @property {string} type `"integer"`, `"real"`, `"text"`, `"blob"`,
+     * `"null"` if the column only holds NULL, or `"mixed"`
+     * @property {Uint8Array} [types] the SQLite type of each row (1 integer,
+     * 2 float, 3 text, 4 blob, 5 null), for columns that are mixed or hold NULL
+     * @property {Float64Array|BigInt64Array} [values] the number in each row, 0
+     * for rows of other types. With `useBigInt`, a BigInt64Array for columns
+     * that hold integers but no floats
+     * @property {Int32Array} [offsets] for columns with text or blobs, row `i`
+     * is `data.subarray(offsets[i], offsets[i + 1])`, UTF-8 encoded for text
+     * @property {Uint8Array} [data] the bytes of the text and blob values
+     */
+
+    /**
+     * @typedef {{
+        columns:string[],
+        rowCount:number,
+        values:Database.ColumnarColumn[]
+    }} Database.ColumnarResult
+     */
+
+    /** Execute an SQL query like {@link Database.exec}, but return the result
+    column by column in typed arrays.
+
+    The rows are stepped and gathered in C, with one call per statement, so
+    that large results are not built up value by value. Text is not decoded;
+    use a TextDecoder on the bytes of the rows that are needed.
+
+    @example
+    var res = db.execColumnar("SELECT id, name FROM test");
+    var ids = res[0].values[0].values; // Float64Array
+    var names = res[0].values[1];
+    var decoder = new TextDecoder();
+    decoder.decode(names.data.subarray(names.offsets[0], names.offsets[1]));
+
+    @param {string} sql a string containing some SQL text to execute
+    @param {Statement.BindParams} [params] as for {@link Database.exec}
+    @param {{useBigInt:boolean}} [config] return the numbers of columns
+    without floats as BigInt64Array
+    @return {Database.ColumnarResult[]} The results of each statement that
+    returned rows
+    */
+    Database.prototype["execColumnar"] = function execColumnar(
+        sql,
+        params,
+        config
+    ) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var useBigInt = !!(config && config["useBigInt"]);
+        if (useBigInt && typeof BigInt64Array !== "function") {
+            throw new Error("BigInt is not supported");
+        }
         var stack = stackSave();
         var stmt = null;
+        var columnar = NULL;
         try {
             var nextSqlPtr = allocateUTF8OnStack(sql);
             var pzTail = stackAlloc(4);
+            var info = stackAlloc(6 * 4);
             var results = [];
             while (getValue(nextSqlPtr, "i8") !== NULL) {
                 setValue(apiTemp, 0, "i32");
@@ -948,31 +2314,55 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
                     apiTemp,
                     pzTail
                 ));
-                // pointer to a statement, or null
                 var pStmt = getValue(apiTemp, "i32");
                 nextSqlPtr = getValue(pzTail, "i32");
-                // Empty statement
                 if (pStmt !== NULL) {
-                    var curresult = null;
                     stmt = new Statement(pStmt, this);
                     if (params != null) {
                         stmt.bind(params);
                     }
-                    while (stmt["step"]()) {
-                        if (curresult === null) {
-                            curresult = {
-                                columns: stmt["getColumnNames"](),
-                                values: [],
-                            };
-                            results.push(curresult);
+                    columnar = columnar_new(pStmt);
+                    if (columnar === NULL) {
+                        throw new Error("Out of memory");
+                    }
+                    var ret = columnar_step(columnar, pStmt, 0);
+                    if (ret === SQLITE_NOMEM) {
+                        // The helper's own allocation failed, so the
+                        // connection has no message for it
+                        throw new Error("Out of memory");
+                    }
+                    if (ret !== SQLITE_DONE) {
+                        this.handleError(ret);
+                    }
+                    var rows = columnar_row_count(columnar);
+                    if (rows > 0) {
+                        columnar_finish(columnar, useBigInt ? 1 : 0);
+                        var columns = [];
+                        var count = sqlite3_column_count(pStmt);
+                        for (var i = 0; i < count; i += 1) {
+                            columns.push(decodeColumnarColumn(
+                                columnar,
+                                i,
+                                rows,
+                                useBigInt,
+                                info
+                            ));
                         }
-                        curresult["values"].push(stmt["get"](null, config));
+                        results.push({
+                            "columns": stmt["getColumnNames"](),
+                            "rowCount": rows,
+                            "values": columns
+                        });
                     }
+                    columnar_free(columnar);
+                    columnar = NULL;
                     stmt["free"]();
+                    stmt = null;
                 }
             }
             return results;
         } catch (errCaught) {
+            if (columnar !== NULL) columnar_free(columnar);
             if (stmt) stmt["free"]();
             throw errCaught;
         } finally {
@@ -1011,9 +2401,18 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         }
         stmt = this["prepare"](sql, params);
         try {
-            while (stmt["step"]()) {
-                callback(stmt["getAsObject"](null, config));
-            }
+            var names = stmt["getColumnNames"]();
+            var batch;
+            do {
+                batch = stmt.stepRows(ROW_BATCH_SIZE, config);
+                for (var row = 0; row < batch.rows.length; row += 1) {
+                    var rowObject = {};
+                    for (var i = 0; i < names.length; i += 1) {
+                        rowObject[names[i]] = batch.rows[row][i];
+                    }
+                    callback(rowObject);
+                }
+            } while (!batch.done);
         } finally {
             stmt["free"]();
         }
@@ -1046,6 +2445,32 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         return stmt;
     };
 
+    /** Stream the rows of an SQL statement in batches, see {@link RowStream}.
+    Only the first statement of `sql` is run.
+
+    @example
+    const rows = db.stream("SELECT * FROM log", [], {batchSize: 500});
+    for await (const batch of rows) {
+        for (const row of batch) write(row);
+        if (enough()) break; // frees the statement
+    }
+
+    @param {string} sql a string of SQL, that can contain placeholders
+    @param {Statement.BindParams} [params] values to bind to placeholders
+    @param {{batchSize:number, useBigInt:boolean}} [options] `batchSize` is
+    the most rows per batch, 1024 by default
+    @return {RowStream} An async iterator over batches of rows
+    @throws {String} SQLite error
+     */
+    Database.prototype["stream"] = function stream(sql, params, options) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var stmt = this["prepare"](sql, params);
+        var batchSize = (options && options["batchSize"]) || ROW_BATCH_SIZE;
+        return new RowStream(stmt, batchSize, options);
+    };
+
     /** Iterate over multiple SQL statements in a SQL string.
      * This function returns an iterator over {@link Statement} objects.
      * You can use a for..of loop to execute the returned statements one by one.
@@ -1066,20 +2491,304 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         return new StatementIterator(sql, this);
     };
 
-    /** Exports the contents of the database to a binary array
+    // Column kinds of libs/sqlite_js/bulk_insert.c
+    var BULK_COLUMN_VALUES = 0;
+    var BULK_COLUMN_F64 = 1;
+    var BULK_COLUMN_I32 = 2;
+    var BULK_COLUMN_I64 = 3;
+
+    // Writes a number with no fractional part as a little-endian 64-bit
+    // integer, without needing BigInt.
+    function setInt64(view, pos, value) {
+        var lo = value % 4294967296;
+        var hi = (value - lo) / 4294967296;
+        if (lo < 0) {
+            lo += 4294967296;
+            hi -= 1;
+        }
+        view.setUint32(pos, lo, true);
+        view.setInt32(pos + 4, hi, true);
+    }
+
+    // Encodes the values `get(0)` .. `get(count - 1)` of one column for
+    // bulk_insert_run into a _malloc()ed buffer, which the caller frees.
+    // Values are checked while sizing, so that nothing is written past the
+    // buffer: blobs must have a length, as in Statement.bindValue.
+    function encodeBulkValues(count, get) {
+        var size = 1;
+        var row;
+        var value;
+        for (row = 0; row < count; row += 1) {
+            value = get(row);
+            if (value == null) {
+                size += 1;
+            } else if (typeof value === "string") {
+                size += 5 + lengthBytesUTF8(value);
+            } else if (typeof value === "object"
+                && Number.isInteger(value.length) && value.length >= 0) {
+                size += 5 + value.length;
+            } else if (typeof value === "number"
+                || typeof value === "bigint"
+                || typeof value === "boolean") {
+                size += 9;
+            } else {
+                throw (
+                    "Wrong API use : tried to bind a value of an unknown type ("
+                    + value + ")."
+                );
+            }
+        }
+        var ptr = _malloc(size);
+        if (ptr === NULL) {
+            throw new Error("Unable to allocate memory for the rows");
+        }
+        var view = new DataView(HEAPU8.buffer);
+        var pos = ptr;
+        for (row = 0; row < count; row += 1) {
+            value = get(row);
+            if (value == null) {
+                HEAPU8[pos] = SQLITE_NULL;
+                pos += 1;
+            } else if (typeof value === "string") {
+                var length = lengthBytesUTF8(value);
+                HEAPU8[pos] = SQLITE_TEXT;
+                view.setInt32(pos + 1, length, true);
+                // Also writes a terminator, into the next value or the
+                // spare byte at the end
+                stringToUTF8(value, pos + 5, length + 1);
+                pos += 5 + length;
+            } else if (typeof value === "object") {
+                HEAPU8[pos] = SQLITE_BLOB;
+                view.setInt32(pos + 1, value.length, true);
+                HEAPU8.set(value, pos + 5);
+                pos += 5 + value.length;
+            } else if (typeof value === "bigint") {
+                HEAPU8[pos] = SQLITE_INTEGER;
+                view.setBigInt64(pos + 1, value, true);
+                pos += 9;
+            } else if (Number.isInteger(+value)
+                && Math.abs(+value) <= Number.MAX_SAFE_INTEGER) {
+                HEAPU8[pos] = SQLITE_INTEGER;
+                setInt64(view, pos + 1, +value);
+                pos += 9;
+            } else {
+                HEAPU8[pos] = SQLITE_FLOAT;
+                view.setFloat64(pos + 1, +value, true);
+                pos += 9;
+            }
+        }
+        return ptr;
+    }
+
+    // Copies a typed array column into a _malloc()ed buffer, which the caller
+    // frees, and returns its BULK_COLUMN_* kind.
+    function copyBulkColumn(column, ptrs) {
+        var ptr = _malloc(column.byteLength || 1);
+        if (ptr === NULL) {
+            throw new Error("Unable to allocate memory for the rows");
+        }
+        ptrs.push(ptr);
+        HEAPU8.set(
+            new Uint8Array(column.buffer, column.byteOffset, column.byteLength),
+            ptr
+        );
+        return ptr;
+    }
+
+    /** Insert many rows with one statement, in a single call into the module.
+    The rows are copied into the wasm memory once, and a C loop binds, steps
+    and resets the statement for each of them inside a savepoint
+    (libs/sqlite_js/bulk_insert.c).
+
+    Rows are inserted up to the first error, which is returned rather than
+    thrown; the rows before it are kept. Run it inside a transaction to roll
+    back all of them instead.
+
+    @example
+    db.insertMany("INSERT INTO points VALUES (?, ?, ?)", [[1, 0.5, "a"], [2, 1.5, "b"]]);
+    db.insertMany("INSERT INTO points VALUES (?, ?, ?)", {columns: [
+        new Int32Array([1, 2]), new Float64Array([0.5, 1.5]), ["a", "b"]
+    ]});
+
+    @param {string} sql An SQL statement with one placeholder per value
+    @param {Array<Array<Database.SqlValue>>|{columns:Array}} rowsOrColumns
+    Either an array of rows, or `{columns: [...]}` with one array per
+    placeholder. A column that is a Float64Array, Int32Array or BigInt64Array
+    is copied into the module as it is.
+    @return {{count:number, error:?string}} The number of rows inserted and
+    the message of the error that stopped it, with its row index, or null
+     */
+    Database.prototype["insertMany"] = function insertMany(sql, rowsOrColumns) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var columns = rowsOrColumns["columns"];
+        var rows = columns ? null : rowsOrColumns;
+        var rowCount;
+        var columnCount;
+        if (rows) {
+            rowCount = rows.length;
+            columnCount = rowCount > 0 ? rows[0].length : 0;
+        } else {
+            columnCount = columns.length;
+            rowCount = columnCount > 0 ? columns[0].length : 0;
+        }
+        if (rowCount === 0) {
+            return { "count": 0, "error": null };
+        }
+        var stmt = this.acquireStatement(sql);
+        var cached = stmt !== null;
+        if (!cached) {
+            stmt = this["prepare"](sql);
+        }
+        var ptrs = [];
+        var stack = stackSave();
+        try {
+            var kinds = stackAlloc(4 * columnCount);
+            var cols = stackAlloc(4 * columnCount);
+            var pnDone = stackAlloc(4);
+            var pzErr = stackAlloc(4);
+            for (var i = 0; i < columnCount; i += 1) {
+                var kind = BULK_COLUMN_VALUES;
+                var ptr;
+                var column = rows ? null : columns[i];
+                if (column instanceof Float64Array) {
+                    kind = BULK_COLUMN_F64;
+                } else if (column instanceof Int32Array) {
+                    kind = BULK_COLUMN_I32;
+                } else if (typeof BigInt64Array === "function"
+                    && column instanceof BigInt64Array) {
+                    kind = BULK_COLUMN_I64;
+                }
+                if (kind !== BULK_COLUMN_VALUES) {
+                    if (column.length !== rowCount) {
+                        throw new Error("Columns of different lengths");
+                    }
+                    ptr = copyBulkColumn(column, ptrs);
+                } else if (rows) {
+                    ptr = encodeBulkValues(rowCount, function cell(row) {
+                        return rows[row][i];
+                    });
+                    ptrs.push(ptr);
+                } else {
+                    if (column.length !== rowCount) {
+                        throw new Error("Columns of different lengths");
+                    }
+                    ptr = encodeBulkValues(rowCount, function cell(row) {
+                        return column[row];
+                    });
+                    ptrs.push(ptr);
+                }
+                setValue(kinds + 4 * i, kind, "i32");
+                setValue(cols + 4 * i, ptr, "i32");
+            }
+            bulk_insert_run(
+                this.db,
+                stmt.stmt,
+                rowCount,
+                columnCount,
+                kinds,
+                cols,
+                pnDone,
+                pzErr
+            );
+            var error = null;
+            var errPtr = getValue(pzErr, "i32");
+            if (errPtr !== NULL) {
+                error = UTF8ToString(errPtr);
+                sqlite3_free(errPtr);
+            }
+            return { "count": getValue(pnDone, "i32"), "error": error };
+        } finally {
+            stackRestore(stack);
+            ptrs.forEach(function free(p) { _free(p); });
+            if (cached) {
+                this.releaseStatement(stmt);
+            } else {
+                stmt["free"]();
+            }
+        }
+    };
+
+    /** Open a BLOB for incremental I/O, see {@link BlobStream}.
+    @param {string} table The table of the BLOB
+    @param {string} column Its column
+    @param {number} rowid The rowid of its row
+    @param {boolean} [writable=false] Open it for writing
+    @param {string} [dbName="main"] The attached database of the table
+    @return {BlobStream} The open BLOB, to be closed with close()
+    @throws {String} SQLite error, for example if the value is not a BLOB
+     */
+    Database.prototype["openBlob"] = function openBlob(
+        table,
+        column,
+        rowid,
+        writable,
+        dbName
+    ) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        setValue(apiTemp, 0, "i32");
+        this.handleError(blob_io_open(
+            this.db,
+            dbName || "main",
+            table,
+            column,
+            rowid,
+            writable ? 1 : 0,
+            apiTemp
+        ));
+        var pBlob = getValue(apiTemp, "i32");
+        var blob = new BlobStream(pBlob, this);
+        this.blobs[pBlob] = blob;
+        return blob;
+    };
+
+    /** Exports the contents of the database to a binary array. The database
+    is copied with the online backup API, so it stays open, and its statements
+    and functions stay usable. See {@link Database.exportStream} to export a
+    large database in pieces.
     @return {Uint8Array} An array of bytes of the SQLite3 database file
      */
     Database.prototype["export"] = function exportDatabase() {
-        Object.values(this.statements).forEach(function each(stmt) {
-            stmt["free"]();
-        });
-        Object.values(this.functions).forEach(removeFunction);
-        this.functions = {};
-        this.handleError(sqlite3_close_v2(this.db));
-        var binaryDb = FS.readFile(this.filename, { encoding: "binary" });
-        this.handleError(sqlite3_open(this.filename, apiTemp));
-        this.db = getValue(apiTemp, "i32");
-        return binaryDb;
+        if (!this.db) {
+            throw "Database closed";
+        }
+        var snapshot = new Snapshot(this);
+        try {
+            snapshot.step(-1);
+            return HEAPU8.slice(snapshot.ptr, snapshot.ptr + snapshot.size);
+        } finally {
+            snapshot.close();
+        }
+    };
+
+    /** Exports the contents of the database as an async iterator of chunks,
+    for example to write them to a file or a network stream. The database is
+    copied `pagesPerStep` pages at a time with the online backup API, yielding
+    to the event loop in between; changes made meanwhile are included.
+
+    @example
+    const chunks = [];
+    for await (const chunk of db.exportStream({chunkSize: 1 << 20})) {
+        chunks.push(chunk);
+    }
+
+    @param {{chunkSize:number, pagesPerStep:number}} [options] `chunkSize`
+    is the most bytes per chunk (1 MiB by default), and `pagesPerStep` the
+    pages copied between two yields (256 by default)
+    @return {ExportStream} An async iterator over Uint8Array chunks
+     */
+    Database.prototype["exportStream"] = function exportStream(options) {
+        if (!this.db) {
+            throw "Database closed";
+        }
+        return new ExportStream(
+            new Snapshot(this),
+            (options && options["chunkSize"]) || 1048576,
+            (options && options["pagesPerStep"]) || 256
+        );
     };
 
     /** Close the database, and all associated prepared statements.
@@ -1097,13 +2806,20 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         if (this.db === null) {
             return;
         }
+        this["closeReaderPool"]();
+        Object.values(this.blobs).forEach(function each(blob) {
+            blob["close"]();
+        });
         Object.values(this.statements).forEach(function each(stmt) {
             stmt["free"]();
         });
+        this.statementCache.clear();
         Object.values(this.functions).forEach(removeFunction);
         this.functions = {};
         this.handleError(sqlite3_close_v2(this.db));
-        FS.unlink("/" + this.filename);
+        if (this.filename !== ":memory:") {
+            FS.unlink("/" + this.filename);
+        }
         this.db = null;
     };
 
@@ -1150,11 +2866,7 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
             function extract_blob(ptr) {
                 var size = sqlite3_value_bytes(ptr);
                 var blob_ptr = sqlite3_value_blob(ptr);
-                var blob_arg = new Uint8Array(size);
-                for (var j = 0; j < size; j += 1) {
-                    blob_arg[j] = HEAP8[blob_ptr + j];
-                }
-                return blob_arg;
+                return HEAPU8.slice(blob_ptr, blob_ptr + size);
             }
             var args = [];
             for (var i = 0; i < argc; i += 1) {
@@ -1193,7 +2905,8 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
                     if (result === null) {
                         sqlite3_result_null(cx);
                     } else if (result.length != null) {
-                        var blobptr = allocate(result, ALLOC_NORMAL);
+                        var blobptr = _malloc(result.length || 1);
+                        HEAPU8.set(result, blobptr);
                         sqlite3_result_blob(cx, blobptr, result.length, -1);
                         _free(blobptr);
                     } else {
@@ -1229,6 +2942,103 @@ Module["onRuntimeInitialized"] = function onRuntimeInitialized() {
         return this;
     };
 
+    // Opens an in-memory Database on an image from image_realloc, which it
+    // takes over; the image is freed if that fails.
+    function openImage(image, size, allocated, config) {
+        var db;
+        try {
+            db = new Database(
+                null,
+                Object.assign({}, config, { "filename": ":memory:" })
+            );
+        } catch (error) {
+            image_free(image);
+            throw error;
+        }
+        try {
+            db.handleError(image_deserialize(db.db, image, size, allocated));
+        } catch (error) {
+            db["close"]();
+            throw error;
+        }
+        return db;
+    }
+
+    /** Open an in-memory database on the bytes of a database file, such as
+    those of {@link Database.export}. The bytes are copied once, into memory
+    that SQLite then uses as the database (sqlite3_deserialize).
+    @param {Uint8Array} bytes The database file
+    @param {Object} [config] As for `new Database`
+    @return {Database}
+     */
+    Database["fromBytes"] = function fromBytes(bytes, config) {
+        var image = image_realloc(NULL, bytes.length || 1);
+        if (image === NULL) {
+            throw new Error("Unable to allocate memory for the database");
+        }
+        HEAPU8.set(bytes, image);
+        return openImage(image, bytes.length, bytes.length || 1, config);
+    };
+
+    /** Like {@link Database.fromBytes}, but reads the database file from an
+    async iterable of Uint8Array chunks, such as {@link Database.exportStream}
+    or a ReadableStream. Each chunk is written straight into the memory that
+    becomes the database.
+    @param {AsyncIterable<Uint8Array>|ReadableStream} chunks The database file
+    @param {Object} [config] As for `new Database`, and `size`, the expected
+    size in bytes, to allocate the memory at once
+    @return {Promise<Database>}
+     */
+    Database["fromStream"] = function fromStream(chunks, config) {
+        var reader;
+        if (typeof chunks.getReader === "function") {
+            reader = chunks.getReader();
+        } else if (
+            typeof Symbol === "function"
+            && typeof chunks[Symbol.asyncIterator] === "function"
+        ) {
+            reader = chunks[Symbol.asyncIterator]();
+        } else {
+            reader = chunks[Symbol.iterator]();
+        }
+        var read = typeof reader.read === "function"
+            ? function readChunk() { return reader.read(); }
+            : function nextChunk() { return reader.next(); };
+        var allocated = Math.max((config && config["size"]) || 0, 65536);
+        var image = image_realloc(NULL, allocated);
+        var size = 0;
+        if (image === NULL) {
+            return Promise.reject(
+                new Error("Unable to allocate memory for the database")
+            );
+        }
+        function pump(result) {
+            if (result.done) {
+                // openImage takes the image over, also if it fails
+                var done = image;
+                image = NULL;
+                return openImage(done, size, allocated, config);
+            }
+            var chunk = result.value;
+            if (size + chunk.length > allocated) {
+                var grown = Math.max(allocated * 2, size + chunk.length);
+                var moved = image_realloc(image, grown);
+                if (moved === NULL) {
+                    throw new Error("Unable to allocate memory for the database");
+                }
+                image = moved;
+                allocated = grown;
+            }
+            HEAPU8.set(chunk, image + size);
+            size += chunk.length;
+            return Promise.resolve(read()).then(pump);
+        }
+        return Promise.resolve(read()).then(pump).catch(function fail(error) {
+            if (image !== NULL) image_free(image);
+            throw error;
+        });
+    };
+
     // export Database to Module
     Module.Database = Database;
 };
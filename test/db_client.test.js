@@ -0,0 +1,193 @@
+// Tests of src/sqlite_wrapper/db_client.js and db_host.js under Node: the host
+// runs in a worker_threads Worker, with a stand-in for SQL.Database that
+// understands a few statements. Run with `node --test test/`.
+'use strict'
+
+const assert = require('assert')
+const path = require('path')
+const test = require('node:test')
+const { Worker } = require('worker_threads')
+
+const { SqliteClient } = require('../src/sqlite_wrapper/db_client.js')
+
+// The worker. Its Database keeps a list of rows:
+//   INSERT            appends the params as a row
+//   SELECT            returns the rows, with columns a and b
+//   FAIL              throws
+//   BEGIN, COMMIT and ROLLBACK keep and restore a copy of the rows
+//   STATS             returns what the host did so far: the requests it
+//                     received by type, its replies whose ArrayBuffers were
+//                     detached by postMessage (so transferred), and the
+//                     statements run and databases opened and closed
+const WORKER = `
+const { parentPort, workerData } = require('worker_threads')
+const { serveDatabase } = require(workerData.host)
+
+const stats = { requests: {}, replies: 0, transferred: 0, log: [] }
+
+class Database {
+  constructor(file, config) {
+    this.rows = []
+    this.saved = null
+    this.changes = 0
+    this.name = config && config.name
+    stats.log.push('open ' + this.name)
+  }
+
+  exec(sql, params) {
+    if (this.closed) throw new Error('Database closed')
+    stats.log.push(sql + ' ' + this.name)
+    this.changes = 0
+    const verb = sql.split(' ')[0]
+    if (verb === 'INSERT') {
+      this.rows.push(params)
+      this.changes = 1
+      return []
+    }
+    if (verb === 'SELECT') return [{ columns: ['a', 'b'], values: this.rows.map(row => row.slice()) }]
+    if (verb === 'FAIL') throw new Error('no such table: nope')
+    if (verb === 'BEGIN') this.saved = this.rows.slice()
+    if (verb === 'COMMIT') this.saved = null
+    if (verb === 'ROLLBACK') this.rows = this.saved
+    if (verb === 'STATS') {
+      return [{ columns: ['stats'], values: [[JSON.stringify(stats)]] }]
+    }
+    return []
+  }
+
+  getRowsModified() {
+    return this.changes
+  }
+
+  close() {
+    this.closed = true
+    stats.log.push('close ' + this.name)
+  }
+}
+
+// Delays the stand-in's module, as initSqlJs does.
+const SQL = new Promise(resolve => setTimeout(() => resolve({ Database }), 20))
+
+serveDatabase(SQL, {
+  on(type, listener) {
+    parentPort.on(type, request => {
+      stats.requests[request.type] = (stats.requests[request.type] || 0) + 1
+      listener(request)
+    })
+  },
+  postMessage(message, transfer) {
+    parentPort.postMessage(message, transfer)
+    if (message.values) {
+      stats.replies++
+      if (message.values.byteLength === 0 && message.text.byteLength === 0) stats.transferred++
+    }
+  },
+})
+`
+
+function start() {
+  const worker = new Worker(WORKER, {
+    eval: true,
+    workerData: { host: path.join(__dirname, '../src/sqlite_wrapper/db_host.js') },
+  })
+  const client = new SqliteClient(worker)
+  return { worker, client }
+}
+
+async function stats(client) {
+  const [entry] = await client.batch([{ sql: 'STATS' }])
+  return JSON.parse(entry.results[0].values[0][0])
+}
+
+test('exec calls of one tick are sent as one batch and resolve in order', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  await client.open({ name: 'db' })
+  const inserts = [
+    client.exec('INSERT', [1, 'one']),
+    client.exec('INSERT', [2.5, 'ü€😀']),
+    client.exec('INSERT', [null, new Uint8Array([1, 2, 3])]),
+  ]
+  const select = client.exec('SELECT')
+  assert.deepStrictEqual(await Promise.all(inserts), [[], [], []])
+  assert.deepStrictEqual(await select, [{
+    columns: ['a', 'b'],
+    values: [[1, 'one'], [2.5, 'ü€😀'], [null, new Uint8Array([1, 2, 3])]],
+  }])
+  const { requests } = await stats(client)
+  assert.deepStrictEqual(requests, { open: 1, batch: 2 }, 'four exec calls, one batch')
+})
+
+test('queued exec calls run before a later open or close', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  // Sent before the module has loaded: the host queues them in order
+  const opened = client.open({ name: 'first' })
+  const insert = client.exec('INSERT', [1, 'a'])
+  const closed = client.close()
+  const reopened = client.open({ name: 'second' })
+  const select = client.exec('SELECT')
+  await Promise.all([opened, closed, reopened])
+  assert.deepStrictEqual(await insert, [])
+  assert.deepStrictEqual((await select)[0].values, [], 'the second database is empty')
+  const { log } = await stats(client)
+  assert.deepStrictEqual(log, [
+    'open first', 'INSERT first', 'close first', 'open second', 'SELECT second', 'STATS second',
+  ])
+})
+
+test('a failing query rolls back a transaction batch and rejects it', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  await client.open({ name: 'db' })
+  await client.exec('INSERT', [1, 'kept'])
+  await assert.rejects(client.batch([
+    { sql: 'INSERT', params: [2, 'lost'] },
+    { sql: 'FAIL' },
+    { sql: 'INSERT', params: [3, 'never run'] },
+  ], { transaction: true }), /no such table: nope/)
+  assert.deepStrictEqual((await client.exec('SELECT'))[0].values, [[1, 'kept']])
+  const { log } = await stats(client)
+  assert.deepStrictEqual(log, [
+    'open db', 'INSERT db', 'BEGIN db', 'INSERT db', 'FAIL db', 'ROLLBACK db', 'SELECT db', 'STATS db',
+  ], 'the query after the failure did not run')
+})
+
+test('without a transaction, errors are reported per query', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  await client.open({ name: 'db' })
+  const entries = await client.batch([
+    { sql: 'INSERT', params: [1, 'a'] },
+    { sql: 'FAIL' },
+    { sql: 'INSERT', params: [2, 'b'] },
+  ])
+  assert.deepStrictEqual(entries[0], { results: [], changes: 1 })
+  assert(entries[1].error instanceof Error)
+  assert.strictEqual(entries[1].error.message, 'no such table: nope')
+  assert.deepStrictEqual(entries[2], { results: [], changes: 1 })
+  // exec calls of one batch fail on their own as well
+  const failing = client.exec('FAIL')
+  const select = client.exec('SELECT')
+  await assert.rejects(failing, /no such table: nope/)
+  assert.deepStrictEqual((await select)[0].values, [[1, 'a'], [2, 'b']])
+})
+
+test('requests fail once the database is closed', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  await client.open({ name: 'db' })
+  await client.close()
+  await assert.rejects(client.exec('SELECT'), /Database not open/)
+})
+
+test('reply buffers are transferred to the client', async t => {
+  const { worker, client } = start()
+  t.after(() => worker.terminate())
+  await client.open({ name: 'db' })
+  await client.batch([{ sql: 'INSERT', params: [1, 'x'.repeat(10000)] }, { sql: 'SELECT' }])
+  await client.exec('SELECT')
+  const { replies, transferred } = await stats(client)
+  assert.strictEqual(replies, 2)
+  assert.strictEqual(transferred, 2)
+})
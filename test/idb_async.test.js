@@ -0,0 +1,549 @@
+// Tests of the IDB_ASYNC backend of libs/library_pthreadfs.js under Node, with
+// in-process stand-ins for IndexedDB and the parts of PThreadFS it uses.
+// Run with `node --test test/`.
+'use strict'
+
+const assert = require('assert')
+const fs = require('fs')
+const path = require('path')
+const test = require('node:test')
+
+// Values of the emscripten defines that IDB_ASYNC uses.
+const DEFINES = {
+  EINVAL: 28,
+  EIO: 29,
+  ENOENT: 44,
+  ENOTEMPTY: 55,
+  EXDEV: 75,
+  SEEK_CUR: 1,
+  SEEK_END: 2,
+  S_IFDIR: 0o40000,
+}
+const S_IFREG = 0o100000
+
+/* IndexedDB stand-in */
+
+// Orders keys as IndexedDB does for the keys IDB_ASYNC uses: strings, and
+// arrays of numbers.
+function compareKeys(a, b) {
+  if (Array.isArray(a)) {
+    for (let i = 0; i < Math.min(a.length, b.length); i++) {
+      const c = compareKeys(a[i], b[i])
+      if (c !== 0) return c
+    }
+    return a.length - b.length
+  }
+  return a < b ? -1 : a > b ? 1 : 0
+}
+
+class FakeKeyRange {
+  constructor(lower, upper) {
+    this.lower = lower
+    this.upper = upper
+  }
+
+  static bound(lower, upper) {
+    return new FakeKeyRange(lower, upper)
+  }
+
+  includes(key) {
+    return compareKeys(this.lower, key) <= 0 && compareKeys(key, this.upper) <= 0
+  }
+}
+
+// Object stores map JSON-encoded keys to {key, value}. Transactions run one at
+// a time in the order they were created, each in a later task, as IndexedDB
+// does for transactions whose scopes overlap. A readwrite transaction works on
+// copies of its stores and commits them together once all its requests ran,
+// so a crash, taken with snapshot(), never sees part of one.
+class FakeIndexedDB {
+  constructor(databases) {
+    this.databases = databases || new Map()
+    this.transactions = { readonly: 0, readwrite: 0 }
+    this.queue = Promise.resolve()
+  }
+
+  open(name) {
+    const req = {}
+    setImmediate(() => {
+      req.result = new FakeDatabase(this, name)
+      if (!this.databases.has(name)) {
+        this.databases.set(name, new Map())
+        if (req.onupgradeneeded) req.onupgradeneeded()
+      }
+      req.onsuccess()
+    })
+    return req
+  }
+
+  // The committed state, as it would be found after a crash. Stores are
+  // replaced rather than changed on commit, so they can be shared.
+  snapshot() {
+    return new Map(Array.from(this.databases, ([name, stores]) => [name, new Map(stores)]))
+  }
+}
+
+class FakeDatabase {
+  constructor(idb, name) {
+    this.idb = idb
+    this.name = name
+  }
+
+  get objectStoreNames() {
+    const stores = this.idb.databases.get(this.name)
+    return { contains: name => stores.has(name) }
+  }
+
+  createObjectStore(name) {
+    this.idb.databases.get(this.name).set(name, new Map())
+  }
+
+  transaction(names, mode) {
+    return new FakeTransaction(this, [].concat(names), mode || 'readonly')
+  }
+}
+
+class FakeTransaction {
+  constructor(db, names, mode) {
+    this.db = db
+    this.names = names
+    this.mode = mode
+    this.requests = []
+    db.idb.transactions[mode]++
+    db.idb.queue = db.idb.queue
+      .then(() => new Promise(resolve => setImmediate(resolve)))
+      .then(() => this.run())
+  }
+
+  objectStore(name) {
+    assert(this.names.includes(name), `${name} is not in the scope of the transaction`)
+    return new FakeStore(this, name)
+  }
+
+  request(store, fn) {
+    const req = {}
+    this.requests.push({ store, fn, req })
+    return req
+  }
+
+  run() {
+    const stores = this.db.idb.databases.get(this.db.name)
+    const work = new Map(this.names.map(name => [
+      name, this.mode === 'readwrite' ? new Map(stores.get(name)) : stores.get(name),
+    ]))
+    for (const { store, fn, req } of this.requests) {
+      req.result = fn(work.get(store))
+      if (req.onsuccess) req.onsuccess()
+    }
+    if (this.mode === 'readwrite') {
+      work.forEach((records, name) => stores.set(name, records))
+    }
+    if (this.oncomplete) this.oncomplete()
+  }
+}
+
+class FakeStore {
+  constructor(tx, name) {
+    this.tx = tx
+    this.name = name
+  }
+
+  matching(records, range) {
+    return Array.from(records.values())
+      .filter(record => !range || range.includes(record.key))
+      .sort((a, b) => compareKeys(a.key, b.key))
+  }
+
+  get(key) {
+    return this.tx.request(this.name, records => {
+      const record = records.get(JSON.stringify(key))
+      return record ? structuredClone(record.value) : undefined
+    })
+  }
+
+  put(value, key) {
+    assert.strictEqual(this.tx.mode, 'readwrite')
+    // Values are cloned when they are put, not when the transaction commits.
+    const copy = structuredClone(value)
+    return this.tx.request(this.name, records => {
+      records.set(JSON.stringify(key), { key, value: copy })
+      return key
+    })
+  }
+
+  delete(query) {
+    assert.strictEqual(this.tx.mode, 'readwrite')
+    return this.tx.request(this.name, records => {
+      if (query instanceof FakeKeyRange) {
+        this.matching(records, query).forEach(record => records.delete(JSON.stringify(record.key)))
+      } else {
+        records.delete(JSON.stringify(query))
+      }
+    })
+  }
+
+  getAll(range) {
+    return this.tx.request(this.name, records =>
+      this.matching(records, range).map(record => structuredClone(record.value)))
+  }
+
+  getAllKeys(range) {
+    return this.tx.request(this.name, records =>
+      this.matching(records, range).map(record => record.key))
+  }
+
+  count(range) {
+    return this.tx.request(this.name, records => this.matching(records, range).length)
+  }
+}
+
+/* PThreadFS stand-in */
+
+class ErrnoError extends Error {
+  constructor(errno) {
+    super(`errno ${errno}`)
+    this.errno = errno
+  }
+}
+
+let mounting = null
+let nextNodeId = 1
+
+const PThreadFS = {
+  ErrnoError,
+  genericErrors: { [DEFINES.ENOENT]: new ErrnoError(DEFINES.ENOENT) },
+  stats: null,
+  isDir: mode => (mode & 0o170000) === DEFINES.S_IFDIR,
+  isFile: mode => (mode & 0o170000) === S_IFREG,
+  createNode(parent, name, mode) {
+    const node = { id: nextNodeId++, name, mode, rdev: 0, children: new Map() }
+    node.parent = parent || node
+    node.mount = parent ? parent.mount : mounting
+    if (parent) parent.children.set(name, node)
+    return node
+  },
+  async lookupNode(parent, name) {
+    return parent.children.get(name) || parent.node_ops.lookup(parent, name)
+  },
+  hashRemoveNode(node) {
+    node.parent.children.delete(node.name)
+  },
+  resetStats() {
+    PThreadFS.stats = {
+      idbTransactions: 0,
+      idbBlockReads: 0,
+      idbBlockWrites: 0,
+      idbCacheHits: 0,
+    }
+  },
+}
+
+function loadIdbAsync() {
+  let source = fs.readFileSync(path.join(__dirname, '../libs/library_pthreadfs.js'), 'utf8')
+  source = source.substring(source.lastIndexOf('mergeInto(LibraryManager.library, {'))
+  assert(source.includes('$IDB_ASYNC:'))
+  source = source.replace(/\{\{\{ cDefine\('(\w+)'\) \}\}\}/g, (match, name) => {
+    assert(name in DEFINES, `no value for ${name}`)
+    return String(DEFINES[name])
+  })
+  return new Function('PThreadFS', 'IDBKeyRange', `
+    const LibraryManager = { library: {} };
+    function mergeInto(library, entries) { Object.assign(library, entries); }
+    ${source}
+    const IDB_ASYNC = LibraryManager.library.$IDB_ASYNC;
+    return IDB_ASYNC;
+  `)(PThreadFS, FakeKeyRange)
+}
+
+const IDB_ASYNC = loadIdbAsync()
+const DEFAULTS = {
+  cacheBlocks: IDB_ASYNC.cacheBlocks,
+  maxDirtyBlocks: IDB_ASYNC.maxDirtyBlocks,
+}
+const BS = IDB_ASYNC.blockSize
+const DB_NAME = 'PThreadFS-test'
+
+/* Helpers */
+
+// Mounts a fresh instance of the backend on `idb`, as after a page reload.
+async function mount(idb) {
+  global.indexedDB = idb
+  IDB_ASYNC.cache = null
+  PThreadFS.resetStats()
+  const m = { opts: { name: 'test' } }
+  mounting = m
+  const root = await IDB_ASYNC.mount(m)
+  mounting = null
+  m.root = root
+  root.mount = m
+  return root
+}
+
+// Mounts the state a crash of `idb` would leave behind.
+function remount(idb) {
+  return mount(new FakeIndexedDB(idb.snapshot()))
+}
+
+async function lookup(root, filePath) {
+  let node = root
+  for (const name of filePath.split('/')) {
+    node = await PThreadFS.lookupNode(node, name)
+  }
+  return node
+}
+
+async function create(root, filePath, mode) {
+  const names = filePath.split('/')
+  const parent = await lookup(root, names.slice(0, -1).join('/') || '.').catch(() => root)
+  return parent.node_ops.mknod(parent, names[names.length - 1], mode || (S_IFREG | 0o644), 0)
+}
+
+async function open(node) {
+  const stream = { node }
+  await node.stream_ops.open(stream)
+  return stream
+}
+
+function write(stream, data, position) {
+  return stream.node.stream_ops.write(stream, data, 0, data.length, position)
+}
+
+async function read(stream, position, length) {
+  const buffer = new Uint8Array(length)
+  const n = await stream.node.stream_ops.read(stream, buffer, 0, length, position)
+  return buffer.subarray(0, n)
+}
+
+async function readAll(stream) {
+  return read(stream, 0, stream.node.usedBytes)
+}
+
+function fsync(stream) {
+  return stream.node.stream_ops.fsync(stream)
+}
+
+async function rename(node, newDir, newName) {
+  PThreadFS.hashRemoveNode(node)
+  await node.node_ops.rename(node, newDir, newName)
+  newDir.children.set(newName, node)
+}
+
+function bytes(length, fill) {
+  return new Uint8Array(length).fill(fill)
+}
+
+// The contents of the file at `filePath` as committed in `idb`, or null.
+function storedFile(idb, filePath) {
+  const stores = idb.databases.get(DB_NAME)
+  const entry = stores.get(IDB_ASYNC.ENTRY_STORE).get(JSON.stringify('/' + filePath))
+  if (!entry) return null
+  const { id, size } = entry.value
+  const data = new Uint8Array(size)
+  for (const { key, value } of stores.get(IDB_ASYNC.BLOCK_STORE).values()) {
+    if (key[0] === id && key[1] * BS < size) {
+      data.set(value.subarray(0, Math.min(BS, size - key[1] * BS)), key[1] * BS)
+    }
+  }
+  return data
+}
+
+function storedBlockCount(idb, id) {
+  const blocks = idb.databases.get(DB_NAME).get(IDB_ASYNC.BLOCK_STORE)
+  return Array.from(blocks.values()).filter(record => record.key[0] === id).length
+}
+
+test.beforeEach(() => {
+  Object.assign(IDB_ASYNC, DEFAULTS)
+})
+
+/* Tests */
+
+test('blocks are written on fsync and read back after a remount', async () => {
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const stream = await open(await create(root, 'data'))
+  const data = Uint8Array.from({ length: 10000 }, (_, i) => i % 251)
+  await write(stream, data, 100)
+  assert.deepStrictEqual(storedFile(idb, 'data'), new Uint8Array(0), 'writes wait for fsync')
+  assert.deepStrictEqual(await read(stream, 100, 10000), data)
+
+  await fsync(stream)
+  const stored = storedFile(idb, 'data')
+  assert.strictEqual(stored.length, 10100)
+  assert.deepStrictEqual(stored.subarray(100), data)
+  assert.strictEqual(storedBlockCount(idb, stream.node.fileId), 3)
+
+  const after = await open(await lookup(await remount(idb), 'data'))
+  const contents = await readAll(after)
+  assert.deepStrictEqual(contents.subarray(0, 100), new Uint8Array(100))
+  assert.deepStrictEqual(contents.subarray(100), data)
+})
+
+test('fsync writes all dirty blocks and the entry in one transaction', async () => {
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const stream = await open(await create(root, 'many'))
+  for (let i = 0; i < 100; i++) {
+    await write(stream, bytes(100, i), (i % 20) * BS + i)
+  }
+  const before = idb.transactions.readwrite
+  PThreadFS.resetStats()
+  await fsync(stream)
+  assert.strictEqual(idb.transactions.readwrite - before, 1)
+  assert.strictEqual(PThreadFS.stats.idbBlockWrites, 20)
+
+  // Nothing left to write
+  await fsync(stream)
+  assert.strictEqual(idb.transactions.readwrite - before, 1)
+})
+
+test('truncation drops blocks and reads as zeros when the file grows again', async () => {
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const node = await create(root, 'trunc')
+  const stream = await open(node)
+  await write(stream, bytes(3 * BS, 0xaa), 0)
+  await fsync(stream)
+
+  await node.node_ops.setattr(node, { size: 5000 })
+  await write(stream, bytes(1, 0xbb), 3 * BS + 10)
+  const expected = new Uint8Array(3 * BS + 11)
+  expected.fill(0xaa, 0, 5000)
+  expected[3 * BS + 10] = 0xbb
+  assert.deepStrictEqual(await readAll(stream), expected)
+  assert.strictEqual(storedFile(idb, 'trunc').length, 3 * BS, 'truncation waits for fsync')
+
+  await fsync(stream)
+  assert.deepStrictEqual(storedFile(idb, 'trunc'), expected)
+  // Blocks 0 and 1 and the new block 3; block 2 was dropped
+  assert.strictEqual(storedBlockCount(idb, node.fileId), 3)
+
+  // Closed files are written at once
+  await node.stream_ops.close(stream)
+  await node.node_ops.setattr(node, { size: 0 })
+  assert.strictEqual(storedBlockCount(idb, node.fileId), 0)
+  const after = await lookup(await remount(idb), 'trunc')
+  assert.strictEqual(after.usedBytes, 0)
+})
+
+test('rename moves entries and keeps the blocks of the file', async () => {
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const dir = await create(root, 'd', DEFINES.S_IFDIR | 0o755)
+  const a = await create(root, 'd/a')
+  let stream = await open(a)
+  await write(stream, bytes(2 * BS, 1), 0)
+  await a.stream_ops.close(stream)
+  const transactions = idb.transactions.readwrite
+
+  await rename(a, root, 'b')
+  assert.strictEqual(idb.transactions.readwrite - transactions, 1)
+  assert.strictEqual(storedFile(idb, 'd/a'), null)
+  assert.deepStrictEqual(storedFile(idb, 'b'), bytes(2 * BS, 1))
+  assert.strictEqual(storedBlockCount(idb, a.fileId), 2)
+
+  // Over an existing file, whose blocks are deleted
+  const c = await create(root, 'c')
+  stream = await open(c)
+  await write(stream, bytes(BS, 2), 0)
+  await c.stream_ops.close(stream)
+  await rename(a, root, 'c')
+  assert.strictEqual(storedBlockCount(idb, c.fileId), 0)
+  assert.deepStrictEqual(storedFile(idb, 'c'), bytes(2 * BS, 1))
+
+  // Directories move with everything below them
+  await create(root, 'd/x')
+  await rename(dir, root, 'e')
+  const after = await remount(idb)
+  await assert.rejects(lookup(after, 'd/x'), { errno: DEFINES.ENOENT })
+  await assert.rejects(lookup(after, 'b'), { errno: DEFINES.ENOENT })
+  assert.ok(PThreadFS.isFile((await lookup(after, 'e/x')).mode))
+  assert.deepStrictEqual(await readAll(await open(await lookup(after, 'c'))), bytes(2 * BS, 1))
+})
+
+test('reads are served from the block cache', async () => {
+  const idb = new FakeIndexedDB()
+  let root = await mount(idb)
+  let stream = await open(await create(root, 'cached'))
+  const data = Uint8Array.from({ length: 4 * BS }, (_, i) => i % 13)
+  await write(stream, data, 0)
+  await stream.node.stream_ops.close(stream)
+
+  root = await remount(idb)
+  stream = await open(await lookup(root, 'cached'))
+  const idbAfter = global.indexedDB
+  assert.deepStrictEqual(await readAll(stream), data)
+  assert.strictEqual(PThreadFS.stats.idbBlockReads, 4)
+  const reads = idbAfter.transactions.readonly
+
+  assert.deepStrictEqual(await readAll(stream), data)
+  assert.strictEqual(idbAfter.transactions.readonly, reads, 'no transaction for cached blocks')
+  assert.strictEqual(PThreadFS.stats.idbBlockReads, 4)
+  assert.strictEqual(PThreadFS.stats.idbCacheHits, 4)
+
+  // Least recently used blocks are evicted
+  IDB_ASYNC.cacheBlocks = 2
+  stream = await open(await lookup(await remount(idb), 'cached'))
+  assert.deepStrictEqual(await readAll(stream), data)
+  assert.strictEqual(IDB_ASYNC.cache.size, 2)
+  assert.deepStrictEqual(await read(stream, 3 * BS, BS), data.subarray(3 * BS))
+  assert.strictEqual(PThreadFS.stats.idbBlockReads, 4)
+  assert.deepStrictEqual(await read(stream, 0, BS), data.subarray(0, BS))
+  assert.strictEqual(PThreadFS.stats.idbBlockReads, 5)
+})
+
+test('early flushes of dirty blocks leave a state a crash may expose', async () => {
+  IDB_ASYNC.maxDirtyBlocks = 4
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const stream = await open(await create(root, 'early'))
+  await write(stream, bytes(8 * BS, 1), 0)
+  await fsync(stream)
+
+  // Every block is rewritten and the file grows, one block per write. After
+  // a crash, the file must hold the result of some prefix of these writes
+  // that is at least as long as the one made durable by the last flush.
+  const writes = []
+  for (let i = 0; i < 10; i++) {
+    writes.push({ data: bytes(BS, 10 + i), position: ((i * 3) % 10) * BS })
+  }
+  const states = [bytes(8 * BS, 1)]
+  for (const w of writes) {
+    const prev = states[states.length - 1]
+    const next = new Uint8Array(Math.max(prev.length, w.position + BS))
+    next.set(prev)
+    next.set(w.data, w.position)
+    states.push(next)
+  }
+  const matchingState = stored => states.findIndex(state =>
+    state.length === stored.length && Buffer.compare(state, stored) === 0)
+
+  const before = idb.transactions.readwrite
+  let durable = 0
+  for (let i = 0; i < writes.length; i++) {
+    await write(stream, writes[i].data, writes[i].position)
+    const k = matchingState(storedFile(idb, 'early'))
+    assert.ok(k >= durable && k <= i + 1, `state after write ${i} is a prefix of the writes`)
+    durable = k
+  }
+  assert.ok(idb.transactions.readwrite - before >= 2, 'dirty blocks were flushed before fsync')
+  assert.ok(durable > 0)
+
+  const crashed = await open(await lookup(await remount(idb), 'early'))
+  assert.strictEqual(matchingState(await readAll(crashed)), durable)
+})
+
+test('writes made while a flush is running are kept', async () => {
+  const idb = new FakeIndexedDB()
+  const root = await mount(idb)
+  const stream = await open(await create(root, 'race'))
+  await write(stream, bytes(BS, 1), 0)
+  // A background flush pass, as with relaxed durability
+  const flushing = fsync(stream)
+  await write(stream, bytes(BS, 2), 0)
+  await write(stream, bytes(BS, 3), BS)
+  await flushing
+  await fsync(stream)
+  const expected = new Uint8Array(2 * BS).fill(2, 0, BS).fill(3, BS)
+  assert.deepStrictEqual(storedFile(idb, 'race'), expected)
+})
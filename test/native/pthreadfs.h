@@ -0,0 +1,12 @@
+// Stand-in for libs/pthreadfs.h in native builds of the tests, where every file
+// is taken to be a PThreadFS file.
+#ifndef PTHREADFS_H
+#define PTHREADFS_H
+
+#include <string>
+
+namespace emscripten {
+inline bool is_pthreadfs_file(const std::string&) { return true; }
+} // namespace emscripten
+
+#endif // PTHREADFS_H
@@ -0,0 +1,159 @@
+// Two processes, standing in for two instances of the module, share a
+// database compressed by libs/pthreadfs_zvfs.cpp and take turns writing it.
+// The base VFS is SQLite's unix VFS, whose fcntl() locks are what PThreadFS
+// serves through Web Locks. Built and run by test/zvfs_shared.test.js.
+#include "pthreadfs_vfs.h"
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+static sqlite3_vfs g_base;
+
+extern "C" int sqlite3_pthreadfs_vfs_register(int makeDefault) {
+  g_base = *sqlite3_vfs_find(nullptr);
+  g_base.zName = PTHREADFS_VFS_NAME;
+  g_base.pNext = nullptr;
+  return sqlite3_vfs_register(&g_base, makeDefault);
+}
+
+static void fail(const char* who, const std::string& what) {
+  fprintf(stderr, "%s: %s\n", who, what.c_str());
+  exit(1);
+}
+
+static sqlite3* open_db(const char* who, const char* path) {
+  sqlite3* db = nullptr;
+  if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+        PTHREADFS_ZVFS_NAME) != SQLITE_OK) {
+    fail(who, sqlite3_errmsg(db));
+  }
+  sqlite3_busy_timeout(db, 5000);
+  return db;
+}
+
+static void exec(const char* who, sqlite3* db, const char* sql) {
+  char* err = nullptr;
+  if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+    fail(who, std::string(sql) + ": " + (err ? err : "?"));
+  }
+}
+
+static std::string query(const char* who, sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    fail(who, std::string(sql) + ": " + sqlite3_errmsg(db));
+  }
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    fail(who, std::string(sql) + ": " + sqlite3_errmsg(db));
+  }
+  std::string result = (const char*)sqlite3_column_text(stmt, 0);
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+// Summarizes the contents of t, and checks the database.
+static std::string digest(const char* who, sqlite3* db) {
+  std::string check = query(who, db, "PRAGMA integrity_check");
+  if (check != "ok") {
+    fail(who, "integrity_check: " + check);
+  }
+  return query(who, db,
+    "SELECT count(*) || ' ' || sum(length(b)) || ' ' || "
+    "group_concat(substr(b, 1 + a % 50, 8), '') FROM (SELECT * FROM t ORDER BY a)");
+}
+
+static void send(int fd, const std::string& message) {
+  std::string line = message + "\n";
+  if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+    exit(1);
+  }
+}
+
+static std::string receive(int fd) {
+  std::string line;
+  char c;
+  while (read(fd, &c, 1) == 1 && c != '\n') {
+    line += c;
+  }
+  return line;
+}
+
+// Waits for the digest of the other process's last change, and checks that
+// this process sees the same contents.
+static void expect(const char* who, sqlite3* db, int fd) {
+  std::string theirs = receive(fd);
+  std::string ours = digest(who, db);
+  if (ours != theirs) {
+    fail(who, "sees different contents than the writer");
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s DIRECTORY\n", argv[0]);
+    return 2;
+  }
+  std::string path = std::string(argv[1]) + "/shared.db";
+  if (sqlite3_pthreadfs_zvfs_register(0) != SQLITE_OK) {
+    fail("setup", "cannot register the compression VFS");
+  }
+  {
+    sqlite3* db = open_db("setup", path.c_str());
+    exec("setup", db,
+      "CREATE TABLE t(a INTEGER PRIMARY KEY, b);"
+      "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM c WHERE i < 300) "
+      "INSERT INTO t SELECT i, printf('%0400d', i) FROM c");
+    sqlite3_close(db);
+  }
+  int toChild[2], toParent[2];
+  if (pipe(toChild) != 0 || pipe(toParent) != 0) {
+    return 1;
+  }
+  pid_t child = fork();
+  if (child == 0) {
+    // So that reads see the end of the pipe if the other process fails.
+    close(toChild[1]);
+    close(toParent[0]);
+    const char* who = "second instance";
+    sqlite3* db = open_db(who, path.c_str());
+    send(toParent[1], digest(who, db));
+    // Pages that moved and pages that were added.
+    expect(who, db, toChild[0]);
+    exec(who, db,
+      "DELETE FROM t WHERE a % 3 = 0;"
+      "UPDATE t SET b = printf('%0100d', a) WHERE a % 3 = 1");
+    send(toParent[1], digest(who, db));
+    expect(who, db, toChild[0]);
+    sqlite3_close(db);
+    return 0;
+  }
+  close(toChild[0]);
+  close(toParent[1]);
+  const char* who = "first instance";
+  sqlite3* db = open_db(who, path.c_str());
+  expect(who, db, toParent[0]);
+  exec(who, db,
+    "UPDATE t SET b = hex(randomblob(400)) WHERE a % 2 = 0;"
+    "WITH RECURSIVE c(i) AS (SELECT 301 UNION ALL SELECT i + 1 FROM c WHERE i < 500) "
+    "INSERT INTO t SELECT i, hex(randomblob(300)) FROM c");
+  send(toChild[1], digest(who, db));
+  // Writing after the other instance moved and freed slots must not reuse
+  // slots it took.
+  expect(who, db, toParent[0]);
+  exec(who, db, "UPDATE t SET b = hex(randomblob(500)) WHERE a % 5 = 0");
+  send(toChild[1], digest(who, db));
+  sqlite3_close(db);
+  int status = 0;
+  waitpid(child, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
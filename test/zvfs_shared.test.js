@@ -0,0 +1,55 @@
+// Builds test/native/zvfs_shared.cpp against libs/pthreadfs_zvfs.cpp with the
+// host compiler and runs it: two processes share a compressed database and
+// take turns writing it. Needs a C/C++ compiler, SQLite's headers and library,
+// and LZ4 in libs/lz4 (see speed_test/README.md); skipped otherwise.
+// Run with `node --test test/`.
+'use strict'
+
+const assert = require('assert')
+const { execFileSync } = require('child_process')
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const test = require('node:test')
+
+const ROOT = path.join(__dirname, '..')
+const CC = process.env.CC || 'cc'
+const CXX = process.env.CXX || 'c++'
+
+function run(cmd, args, options) {
+  return execFileSync(cmd, args, Object.assign({ encoding: 'utf8', stdio: 'pipe' }, options))
+}
+
+// Why the test cannot run here, or null.
+function missing(dir) {
+  if (!fs.existsSync(path.join(ROOT, 'libs/lz4/lz4.c'))) return 'libs/lz4 not found'
+  const probe = path.join(dir, 'probe.c')
+  fs.writeFileSync(probe, '#include <sqlite3.h>\nint main(void) { return sqlite3_libversion_number() > 0 ? 0 : 1; }\n')
+  try {
+    run(CC, [probe, '-lsqlite3', '-o', path.join(dir, 'probe')])
+  } catch (e) {
+    return `cannot build against SQLite with ${CC}`
+  }
+  return null
+}
+
+const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'zvfs-'))
+const reason = missing(dir)
+
+test('instances reload the page map that another instance changed', { skip: reason || false }, () => {
+  // pthreadfs_zvfs.cpp includes "pthreadfs.h", which is looked up next to it
+  // first, so it is built from a copy next to the stand-in.
+  for (const file of ['libs/pthreadfs_zvfs.cpp', 'libs/pthreadfs_vfs.h', 'test/native/pthreadfs.h']) {
+    fs.copyFileSync(path.join(ROOT, file), path.join(dir, path.basename(file)))
+  }
+  const lz4 = path.join(ROOT, 'libs/lz4')
+  run(CC, ['-O2', '-c', path.join(lz4, 'lz4.c'), '-o', path.join(dir, 'lz4.o')])
+  const binary = path.join(dir, 'zvfs_shared')
+  run(CXX, ['-std=c++17', '-O1', '-Wall', '-I' + dir, '-I' + lz4,
+    path.join(ROOT, 'test/native/zvfs_shared.cpp'), path.join(dir, 'pthreadfs_zvfs.cpp'),
+    path.join(dir, 'lz4.o'), '-lsqlite3', '-lpthread', '-o', binary])
+  const data = fs.mkdtempSync(path.join(dir, 'db-'))
+  assert.strictEqual(run(binary, [data], { timeout: 60000 }).trim(), 'ok')
+})
+
+test.after(() => fs.rmSync(dir, { recursive: true, force: true }))